@@ -15,6 +15,7 @@
 #include <atomic>
 #include <time.h>
 
+#include "sharded_statistics.h"
 #include "statrecorder.h"
 #include "zmq_lvc.h"
 
@@ -57,16 +58,17 @@ public:
 private:
   /// Set of current statistics being accumulated.
   struct {
-    // We use a set of atomics here. This isn't perfect, as reads are not
-    // synchronized (e.g. we could read a value of _n that is more recent than
-    // the value we read of _sigma). However, given that _n is likely to be
-    // quite large and only out by 1 or 2, it's not expected to matter.
+    // We use a set of sharded atomics here, so that threads accumulating
+    // samples don't contend with each other. This isn't perfect, as reads are
+    // not synchronized (e.g. we could read a value of _n that is more recent
+    // than the value we read of _sigma). However, given that _n is likely to
+    // be quite large and only out by 1 or 2, it's not expected to matter.
     std::atomic_uint_fast64_t _timestamp_us;
-    std::atomic_uint_fast64_t _n;
-    std::atomic_uint_fast64_t _sigma;
-    std::atomic_uint_fast64_t _sigma_squared;
-    std::atomic_uint_fast64_t _lwm;
-    std::atomic_uint_fast64_t _hwm;
+    ShardedCounter _n;
+    ShardedCounter _sigma;
+    ShardedCounter _sigma_squared;
+    ShardedLowWaterMark _lwm;
+    ShardedHighWaterMark _hwm;
   } _current;
 
   /// Set of statistics accumulated over the previous period.
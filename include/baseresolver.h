@@ -146,7 +146,7 @@ protected:
 
   /// The NAPTR cache holds a cache of the results of performing a NAPTR
   /// lookup on a particular target.
-  typedef TTLCache<std::string, NAPTRReplacement*> NAPTRCache;
+  typedef ShardedTTLCache<std::string, NAPTRReplacement*> NAPTRCache;
   NAPTRCache* _naptr_cache;
 
   /// The SRVPriorityList holds the result of an SRV lookup sorted into
@@ -185,7 +185,7 @@ protected:
 
   /// The SRV cache holds a cache of SRVPriorityLists indexed on the SRV domain
   /// name (that is, a domain of the form _<service>._<transport>.<target>).
-  typedef TTLCache<std::string, SRVPriorityList*> SRVCache;
+  typedef ShardedTTLCache<std::string, SRVPriorityList*> SRVCache;
   SRVCache* _srv_cache;
 
   /// The global hosts map holds a list of IP/transport/port combinations which
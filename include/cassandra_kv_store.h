@@ -0,0 +1,75 @@
+/**
+ * @file cassandra_kv_store.h Adapter exposing a cassandra store through the
+ * generic Store interface.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CASSANDRA_KV_STORE_H_
+#define CASSANDRA_KV_STORE_H_
+
+#include "store.h"
+#include "cassandra_store.h"
+
+namespace CassandraStore {
+
+/// Adapter that allows a CassandraStore::Store to be used through the generic
+/// key/value Store interface.
+///
+/// Each table is a column family and each key is a row, with the data held in
+/// a single column.  Batched reads use a single multiget_slice and batched
+/// writes a single batch_mutate.
+///
+/// The CAS returned by a read is the timestamp of the data column.  A write
+/// first reads the current timestamp and fails with DATA_CONTENTION if it
+/// doesn't match the CAS supplied (or if the row exists and the CAS is zero).
+/// Cassandra's thrift interface has no check-and-set, so the check and the
+/// write are not atomic: two writers that both read the same version and
+/// write at the same moment can both succeed, and the later timestamp wins.
+/// This catches writers working from stale data, but not a true race.
+class KeyValueStore : public ::Store
+{
+public:
+  /// Constructor.
+  ///
+  /// @param store - The cassandra store to use.  This must already have
+  ///                been configured and started.
+  KeyValueStore(CassandraStore::Store* store);
+  virtual ~KeyValueStore();
+
+  ::Store::Status get_data(const std::string& table,
+                           const std::string& key,
+                           std::string& data,
+                           uint64_t& cas,
+                           SAS::TrailId trail = 0);
+  ::Store::Status set_data(const std::string& table,
+                           const std::string& key,
+                           const std::string& data,
+                           uint64_t cas,
+                           int expiry,
+                           SAS::TrailId trail = 0);
+  ::Store::Status delete_data(const std::string& table,
+                              const std::string& key,
+                              SAS::TrailId trail = 0);
+  void get_data_multi(const std::string& table,
+                      std::vector< ::Store::GetRequest>& requests,
+                      SAS::TrailId trail = 0);
+  void set_data_multi(const std::string& table,
+                      std::vector< ::Store::SetRequest>& requests,
+                      SAS::TrailId trail = 0);
+
+  /// The name of the column that holds the data.
+  static const std::string DATA_COLUMN;
+
+private:
+  CassandraStore::Store* _store;
+};
+
+}; // namespace CassandraStore
+
+#endif
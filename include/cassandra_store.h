@@ -49,6 +49,7 @@
 #include "communicationmonitor.h"
 #include "a_record_resolver.h"
 #include "cassandra_connection_pool.h"
+#include "snmp_counter_table.h"
 
 // Shortcut for the apache cassandra namespace.
 namespace cass = org::apache::cassandra;
@@ -176,6 +177,15 @@ public:
                                std::vector<cass::ColumnOrSuperColumn>& columns,
                                cass::ConsistencyLevel::type consistency_level);
 
+  /// Get specific columns in multiple rows (non-HA).
+  ///
+  /// @param consistency_level cassandra consistency level.
+  void multiget_columns(const std::string& column_family,
+                        const std::vector<std::string>& keys,
+                        const std::vector<std::string>& names,
+                        std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& columns,
+                        cass::ConsistencyLevel::type consistency_level);
+
   /// Get all columns in multiple rows that have a particular prefix to their
   /// name.
   ///
@@ -417,6 +427,47 @@ public:
                                  unsigned int num_threads,
                                  unsigned int max_queue = 0);
 
+  /// Configure write batching.
+  ///
+  /// When write batching is enabled, asynchronous operations that only write
+  /// to cassandra (see Operation::is_batchable()) don't each occupy a worker
+  /// thread for a whole request.  Instead their writes are collected and sent
+  /// to cassandra together, in one batch_mutate per consistency level, at
+  /// least once per flush interval.  Each operation's transaction is then
+  /// called back with the result of the batch.  Batches are retried in the
+  /// same way as individual operations, and SAS events about the batch are
+  /// logged to the trail of each operation in it.  If cassandra rejects a
+  /// batch as invalid, the writes of each operation are retried on their
+  /// own, so that only the operation at fault fails.
+  ///
+  /// This must be called before the store is started, and only has an
+  /// effect if there are worker threads.
+  ///
+  /// @param flush_interval_ms - The maximum time to hold on to a write
+  ///                            before sending it.  0 => no batching.
+  /// @param max_batch_ops     - The maximum number of operations in a
+  ///                            batch.  A full batch is sent immediately.
+  virtual void configure_write_batching(unsigned int flush_interval_ms,
+                                        unsigned int max_batch_ops = 100);
+
+  /// Configure read coalescing.
+  ///
+  /// When read coalescing is enabled, a read (get_slice or multiget_slice)
+  /// that is identical to one that is already in flight - the same column
+  /// family, keys, columns and consistency level - doesn't make its own
+  /// request to cassandra.  It waits for the in-flight read to complete and
+  /// gets a copy of its result (or the exception it hit).
+  ///
+  /// Only reads that have already been sent are shared, so a read that
+  /// starts after a write completes may see the data from before the write.
+  /// Users that need to read their own writes shouldn't enable this.
+  ///
+  /// @param enabled             - Whether to coalesce reads.
+  /// @param coalesced_reads_tbl - Counter that is incremented for each read
+  ///                              that is saved by coalescing.  May be NULL.
+  virtual void configure_read_coalescing(bool enabled,
+                                         SNMP::CounterTable* coalesced_reads_tbl = NULL);
+
   /// Start the store.
   ///
   /// Start any necessary worker threads.
@@ -483,6 +534,38 @@ private:
                   ResultCode& cass_result,
                   std::string& cass_error_text);
 
+  // Classes used for write batching.  A batchable operation is run against a
+  // RecordingClient, which captures the writes it makes.  These are added to
+  // a BatchOperation, which makes all the writes in the batch when it's
+  // performed, and the operation and transaction are added to a
+  // BatchTransaction, which calls back all the transactions in the batch.
+  class RecordingClient;
+  class BatchOperation;
+  class BatchTransaction;
+
+  // Get the SAS trails to log the events for an operation to.  This is the
+  // trail of every operation in a batch, or just the given trail otherwise.
+  static std::vector<SAS::TrailId> sas_trails(Operation* op, SAS::TrailId trail);
+
+  // Add an asynchronous operation to the pending batch.  Returns false if
+  // the operation can't be batched, in which case it should be run as
+  // normal.
+  bool add_to_batch(Operation* op, Transaction* trx);
+
+  // Pass the pending batch (if there is one) to the thread pool.
+  void flush_batch();
+
+  static void* batch_thread_func(void* store);
+  void batch_thread_loop();
+
+  // Classes used for read coalescing.  Operations are run against a
+  // CoalescingClient, which passes reads to the real client unless an
+  // identical read is already in flight, in which case it waits for the
+  // result of that read.  An InFlightRead holds the state of a read that
+  // other threads may be waiting on.
+  class CoalescingClient;
+  struct InFlightRead;
+
   // DNS resolver
   CassandraResolver* _resolver;
 
@@ -514,6 +597,33 @@ private:
   // requests a connection from the pool when it is needed, and returns it
   // when it is finished.
   CassandraConnectionPool* _conn_pool;
+
+  // Write batching.
+  //
+  // _batch_interval_ms and _max_batch_ops are set up by the call to
+  // configure_write_batching().  The batch thread flushes the pending batch
+  // every _batch_interval_ms.  The pending batch (_batch_op and _batch_trx)
+  // and _batch_terminated must only be accessed with _batch_lock held.
+  unsigned int _batch_interval_ms;
+  unsigned int _max_batch_ops;
+  bool _batch_thread_running;
+  pthread_t _batch_thread;
+  pthread_mutex_t _batch_lock;
+  pthread_cond_t _batch_cond;
+  bool _batch_terminated;
+  BatchOperation* _batch_op;
+  BatchTransaction* _batch_trx;
+
+  // Read coalescing.
+  //
+  // _in_flight_reads maps a description of each read that is in flight to its
+  // state, and must only be accessed with _in_flight_lock held.
+  // _in_flight_cond is signalled whenever a read completes.
+  bool _read_coalescing;
+  SNMP::CounterTable* _coalesced_reads_tbl;
+  std::map<std::string, InFlightRead*> _in_flight_reads;
+  pthread_mutex_t _in_flight_lock;
+  pthread_cond_t _in_flight_cond;
 };
 
 /// Base class for transactions used to perform asynchronous operations.
@@ -587,6 +697,18 @@ public:
   ///                 or an empty string if the operation succeeded.
   virtual std::string get_error_text();
 
+  /// Whether this operation can be combined with others when the store has
+  /// write batching enabled.  Operations that return true must only write
+  /// to cassandra in perform() (for example using put_columns() or
+  /// delete_columns()), and must not rely on the writes having completed
+  /// when perform() returns.  perform() is called once to capture the
+  /// writes, and the result of writing the batch is reported through the
+  /// operation's transaction as usual.
+  ///
+  /// @return       - Whether the operation can be batched.  The default is
+  ///                 false.
+  virtual bool is_batchable() { return false; }
+
 protected:
   friend class Store;
 
@@ -671,6 +793,22 @@ public:
                       std::vector<cass::ColumnOrSuperColumn>& columns,
                       SAS::TrailId trail);
 
+  /// HA get specific columns in multiple rows.
+  ///
+  /// @param client         - The Client with which to perform the get.
+  /// @param column_family  - The column family to operate on.
+  /// @param keys           - Row keys
+  /// @param names          - The names of the columns to retrieve
+  /// @param columns        - (out) The retrieved columns.  Returned as a map
+  ///                         where the keys are the requested row keys and
+  ///                         each value is a vector of columns.
+  void ha_multiget_columns(Client* client,
+                           const std::string& column_family,
+                           const std::vector<std::string>& keys,
+                           const std::vector<std::string>& names,
+                           std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& columns,
+                           SAS::TrailId trail);
+
   /// HA get all columns in a row
   /// This is useful when working with dynamic columns.
   ///
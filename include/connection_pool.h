@@ -15,6 +15,9 @@
 
 #include <map>
 #include <deque>
+#include <vector>
+#include <atomic>
+#include <unordered_map>
 #include <pthread.h>
 #include <time.h>
 
@@ -41,11 +44,46 @@ struct ConnectionInfo
   // The time in seconds that the connection was last used
   time_t last_used_time_s;
 
+  // Links in the pool's list of idle connections, which is ordered by last
+  // used time.  These are only valid while the connection is idle in the
+  // pool's slots.
+  ConnectionInfo<T>* newer;
+  ConnectionInfo<T>* older;
+
   ConnectionInfo(T conn, AddrInfo target) :
     conn(conn),
     target(target),
-    last_used_time_s(0)
+    last_used_time_s(0),
+    newer(NULL),
+    older(NULL)
+  {
+  }
+};
+
+/// Hash function so that AddrInfo can be used as the key of an unordered
+/// container.  This is consistent with AddrInfo::operator==, so only hashes
+/// the address, port and transport.
+struct AddrInfoHash
+{
+  size_t operator()(const AddrInfo& ai) const
   {
+    // This is on the pool's default path, so combine whole words rather than
+    // hashing byte by byte.
+    size_t hash;
+
+    if (ai.address.af == AF_INET6)
+    {
+      const uint32_t* words = (const uint32_t*)&ai.address.addr.ipv6;
+      hash = ((size_t)words[0] * 31 + words[1]) * 31 + words[2];
+      hash = hash * 31 + words[3];
+    }
+    else
+    {
+      hash = ai.address.addr.ipv4.s_addr;
+    }
+
+    hash = hash * 31 + ((size_t)ai.port << 8) + ai.transport;
+    return hash * 0x9e3779b97f4a7c15ULL;
   }
 };
 
@@ -55,7 +93,13 @@ struct ConnectionInfo
 ///
 /// Connections can be retrieved from and replaced in the pool, at the front of
 /// the slot. Connections that have gone unused for a while are removed
-/// periodically from the back of the slots.
+/// periodically from the back of the slots. All the idle connections in the
+/// slots are also kept on a list ordered by when they were last used, so the
+/// oldest connection can be found without searching the slots.
+///
+/// The pool can optionally keep a small cache of idle connections for each
+/// thread that uses it (see enable_thread_caches). A thread that repeatedly
+/// uses the same targets then doesn't need the pool's lock.
 ///
 /// Retrieved connections are wrapped in ConnectionHandle objects, which, when
 /// destroyed, handle returning the connection to the pool.
@@ -71,7 +115,7 @@ class ConnectionPool
   friend class ConnectionHandle<T>;
 
   using Slot = std::deque<ConnectionInfo<T>*>;
-  using Pool = std::map<AddrInfo, Slot>;
+  using Pool = std::unordered_map<AddrInfo, Slot, AddrInfoHash>;
 
 public:
   ConnectionPool(time_t max_idle_time_s, bool free_on_error = false);
@@ -89,6 +133,18 @@ public:
   /// (virtual to allow for testing)
   virtual ConnectionHandle<T> get_connection(AddrInfo target);
 
+  /// Caches up to the given number of idle connections for each thread that
+  /// uses the pool.  Connections are returned to the calling thread's cache
+  /// if there is space (falling back to the shared slots), and taken from it
+  /// in preference to the slots.
+  ///
+  /// In this mode idle connections are removed in a single pass at most once
+  /// a second, rather than one at a time whenever a connection is released.
+  /// Any connections still cached by a thread when it exits are destroyed.
+  ///
+  /// This must be called before any connections are retrieved.
+  void enable_thread_caches(size_t connections_per_thread);
+
 protected:
   /// Creates a type T connection for the given target
   virtual T create_connection(AddrInfo target) = 0;
@@ -106,9 +162,46 @@ protected:
                                   bool return_to_pool);
 
 private:
+  /// The idle connections cached for a single thread, most recently used
+  /// last.  The lock is only contended when the pool is removing idle
+  /// connections or being destroyed.
+  ///
+  /// A cache is owned by both its thread and the pool, as the thread can exit
+  /// while the pool is being destroyed, and whichever releases it last frees
+  /// it.  Whichever releases it first destroys the cached connections, under
+  /// the cache lock, so the thread never uses the pool after it has been
+  /// destroyed.
+  struct ThreadCache
+  {
+    ConnectionPool<T>* pool;
+    pthread_mutex_t lock;
+    std::vector<ConnectionInfo<T>*> conns;
+    std::atomic<int> owners;
+  };
+
   /// Removes one connection that has gone unused for more than the max idle
-  /// time, if any such connections exist
-  void free_old_connection();
+  /// time, if any such connections exist.  Must be called with the pool lock
+  /// held.
+  void free_old_connection(time_t current_time);
+
+  /// Removes all the connections (including those in the thread caches) that
+  /// have gone unused for more than the max idle time.
+  void free_old_connections(time_t current_time);
+
+  /// Destroys an idle connection.  Must be called with the pool lock held.
+  void free_connection(ConnectionInfo<T>* conn_info_ptr);
+
+  /// Adds and removes connections from the list of idle connections.  Must
+  /// be called with the pool lock held.
+  void add_idle(ConnectionInfo<T>* conn_info_ptr);
+  void remove_idle(ConnectionInfo<T>* conn_info_ptr);
+
+  /// Gets the calling thread's connection cache, creating it if necessary.
+  ThreadCache* get_thread_cache();
+
+  /// Destroys the connections in a thread's cache, and drops one owner of
+  /// the cache, freeing it if that was the last.
+  static void release_thread_cache(void* cache);
 
   Pool _conn_pool;
   pthread_mutex_t _conn_pool_lock;
@@ -117,6 +210,20 @@ private:
   // Whether one dead connection should trigger cleanup of any others to the
   // same target
   bool _free_on_error;
+
+  // The list of idle connections in the slots, from the most recently used
+  // (_newest_idle) to the least recently used (_oldest_idle).  Must access
+  // under _conn_pool_lock.
+  ConnectionInfo<T>* _newest_idle;
+  ConnectionInfo<T>* _oldest_idle;
+
+  // Thread cache configuration and state.  _thread_cache_size is zero if
+  // thread caches are disabled.  _thread_caches must be accessed under
+  // _conn_pool_lock.
+  size_t _thread_cache_size;
+  pthread_key_t _thread_cache_key;
+  std::vector<ThreadCache*> _thread_caches;
+  std::atomic<time_t> _next_free_time_s;
 };
 
 /// Template class storing a connection in a ConnectionInfo object. On
@@ -166,11 +273,26 @@ private:
 template<typename T>
 ConnectionPool<T>::ConnectionPool(time_t max_idle_time_s, bool free_on_error) :
   _max_idle_time_s(max_idle_time_s),
-  _free_on_error(free_on_error)
+  _free_on_error(free_on_error),
+  _newest_idle(NULL),
+  _oldest_idle(NULL),
+  _thread_cache_size(0),
+  _thread_caches(),
+  _next_free_time_s(0)
 {
   pthread_mutex_init(&_conn_pool_lock, NULL);
 }
 
+template<typename T>
+void ConnectionPool<T>::enable_thread_caches(size_t connections_per_thread)
+{
+  if ((_thread_cache_size == 0) && (connections_per_thread > 0))
+  {
+    pthread_key_create(&_thread_cache_key, release_thread_cache);
+    _thread_cache_size = connections_per_thread;
+  }
+}
+
 template<typename T>
 void ConnectionPool<T>::destroy_connection_pool()
 {
@@ -195,6 +317,26 @@ void ConnectionPool<T>::destroy_connection_pool()
     }
   }
   _conn_pool.clear();
+  _newest_idle = NULL;
+  _oldest_idle = NULL;
+
+  // Destroy the connections in the thread caches, and drop the pool's
+  // ownership of them.  A thread that is exiting at the same time frees its
+  // cache when it has finished with it.  Once the key is deleted below, the
+  // caches of threads that are still running are never freed, but they are
+  // empty.
+  for (ThreadCache* cache : _thread_caches)
+  {
+    release_thread_cache(cache);
+  }
+  _thread_caches.clear();
+
+  if (_thread_cache_size > 0)
+  {
+    pthread_key_delete(_thread_cache_key);
+    _thread_cache_size = 0;
+  }
+
   pthread_mutex_unlock(&_conn_pool_lock);
 }
 
@@ -205,7 +347,34 @@ ConnectionHandle<T> ConnectionPool<T>::get_connection(AddrInfo target)
             target.address.to_string().c_str(),
             target.port);
 
-  ConnectionInfo<T>* conn_info_ptr;
+  ConnectionInfo<T>* conn_info_ptr = NULL;
+
+  if (_thread_cache_size > 0)
+  {
+    // Look for a connection to the target in this thread's cache, starting
+    // with the most recently used.
+    ThreadCache* cache = get_thread_cache();
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (size_t ii = cache->conns.size(); ii > 0; --ii)
+    {
+      if (cache->conns[ii - 1]->target == target)
+      {
+        conn_info_ptr = cache->conns[ii - 1];
+        cache->conns.erase(cache->conns.begin() + (ii - 1));
+        break;
+      }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    if (conn_info_ptr != NULL)
+    {
+      TRC_DEBUG("Found existing connection %p in thread cache", conn_info_ptr);
+      return ConnectionHandle<T>(conn_info_ptr, this);
+    }
+  }
 
   pthread_mutex_lock(&_conn_pool_lock);
 
@@ -216,6 +385,7 @@ ConnectionHandle<T> ConnectionPool<T>::get_connection(AddrInfo target)
     // If there is a connection in the pool for the given AddrInfo, retrieve it
     conn_info_ptr = slot_it->second.front();
     slot_it->second.pop_front();
+    remove_idle(conn_info_ptr);
     TRC_DEBUG("Found existing connection %p in pool", conn_info_ptr);
   }
   else
@@ -241,17 +411,48 @@ void ConnectionPool<T>::release_connection(ConnectionInfo<T>* conn_info_ptr,
             conn_info_ptr->target.port,
             return_to_pool ? "to pool" : "and destroy");
 
+  time_t current_time = time(NULL);
+
   if (return_to_pool)
   {
     // Update the last used time of the connection
-    conn_info_ptr->last_used_time_s = time(NULL);
+    conn_info_ptr->last_used_time_s = current_time;
 
-    pthread_mutex_lock(&_conn_pool_lock);
+    bool cached = false;
 
-    // Put the connection back into the pool.
-    _conn_pool[conn_info_ptr->target].push_front(conn_info_ptr);
+    if (_thread_cache_size > 0)
+    {
+      // Keep the connection in this thread's cache if there's space.
+      ThreadCache* cache = get_thread_cache();
 
-    pthread_mutex_unlock(&_conn_pool_lock);
+      pthread_mutex_lock(&cache->lock);
+
+      if (cache->conns.size() < _thread_cache_size)
+      {
+        cache->conns.push_back(conn_info_ptr);
+        cached = true;
+      }
+
+      pthread_mutex_unlock(&cache->lock);
+    }
+
+    if (!cached)
+    {
+      pthread_mutex_lock(&_conn_pool_lock);
+
+      // Put the connection back into the pool.
+      _conn_pool[conn_info_ptr->target].push_front(conn_info_ptr);
+      add_idle(conn_info_ptr);
+
+      // Remove an idle connection while we have the lock, rather than taking
+      // it again below.
+      if (_thread_cache_size == 0)
+      {
+        free_old_connection(current_time);
+      }
+
+      pthread_mutex_unlock(&_conn_pool_lock);
+    }
   }
   else
   {
@@ -269,11 +470,33 @@ void ConnectionPool<T>::release_connection(ConnectionInfo<T>* conn_info_ptr,
         {
           ConnectionInfo<T>* conn_info = slot_it->second.front();
           slot_it->second.pop_front();
-          destroy_connection(conn_info->target, conn_info->conn);
-          delete conn_info; conn_info = NULL;
+          free_connection(conn_info);
         }
       }
 
+      // Including any in the thread caches.
+      for (ThreadCache* cache : _thread_caches)
+      {
+        pthread_mutex_lock(&cache->lock);
+
+        typename std::vector<ConnectionInfo<T>*>::iterator it = cache->conns.begin();
+        while (it != cache->conns.end())
+        {
+          if ((*it)->target == conn_info_ptr->target)
+          {
+            destroy_connection((*it)->target, (*it)->conn);
+            delete *it;
+            it = cache->conns.erase(it);
+          }
+          else
+          {
+            ++it;
+          }
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+      }
+
       pthread_mutex_unlock(&_conn_pool_lock);
     }
 
@@ -281,64 +504,232 @@ void ConnectionPool<T>::release_connection(ConnectionInfo<T>* conn_info_ptr,
     // (which isn't in the pool, and hence wasn't destroyed above)
     destroy_connection(conn_info_ptr->target, conn_info_ptr->conn);
     delete conn_info_ptr; conn_info_ptr = NULL;
+
+    if (_thread_cache_size == 0)
+    {
+      pthread_mutex_lock(&_conn_pool_lock);
+      free_old_connection(current_time);
+      pthread_mutex_unlock(&_conn_pool_lock);
+    }
   }
 
-  free_old_connection();
+  if (_thread_cache_size > 0)
+  {
+    // Only one thread needs to look for idle connections each second.
+    time_t next_free_time_s = _next_free_time_s.load();
+
+    if ((current_time >= next_free_time_s) &&
+        (_next_free_time_s.compare_exchange_strong(next_free_time_s,
+                                                   current_time + 1)))
+    {
+      free_old_connections(current_time);
+    }
+  }
 }
 
 template<typename T>
-void ConnectionPool<T>::free_old_connection()
+void ConnectionPool<T>::free_old_connection(time_t current_time)
 {
-  time_t current_time = time(NULL);
+  // The least recently used connection is the only one that can have been
+  // idle for longest.
+  ConnectionInfo<T>* oldest_conn_info_ptr = _oldest_idle;
 
+  if ((oldest_conn_info_ptr != NULL) &&
+      (current_time > oldest_conn_info_ptr->last_used_time_s + _max_idle_time_s))
+  {
+    if (Log::enabled(Log::DEBUG_LEVEL))
+    {
+      /// Create strings required for debug logging
+      std::string addr_info_str = oldest_conn_info_ptr->target.address_and_port_to_string();
+      std::string current_time_str = ctime(&current_time);
+      std::string last_used_time_s_str = ctime(&(oldest_conn_info_ptr->last_used_time_s));
+
+      TRC_DEBUG("Free idle connection to target: %s (time now is %s, last used %s)",
+                addr_info_str.c_str(),
+                current_time_str.c_str(),
+                last_used_time_s_str.c_str());
+    }
+
+    // Connections are always checked in/out at the front of the slot, so the
+    // oldest one is at the back.  Delete the entire slot if it is now empty.
+    typename Pool::iterator slot_it = _conn_pool.find(oldest_conn_info_ptr->target);
+    slot_it->second.pop_back();
+    if (slot_it->second.empty())
+    {
+      _conn_pool.erase(slot_it);
+    }
+
+    // Delete the connection as it is too old
+    free_connection(oldest_conn_info_ptr);
+  }
+}
+
+template<typename T>
+void ConnectionPool<T>::free_old_connections(time_t current_time)
+{
   pthread_mutex_lock(&_conn_pool_lock);
 
-  // Iterate over the slots
-  for (typename Pool::iterator slot_it = _conn_pool.begin();
-       slot_it != _conn_pool.end();
-       ++slot_it)
+  // Remove connections from the end of the idle list until we reach one that
+  // hasn't been idle for too long.
+  while ((_oldest_idle != NULL) &&
+         (current_time > _oldest_idle->last_used_time_s + _max_idle_time_s))
   {
-    if (!slot_it->second.empty())
+    ConnectionInfo<T>* oldest_conn_info_ptr = _oldest_idle;
+    TRC_DEBUG("Free idle connection to target: %s",
+              oldest_conn_info_ptr->target.address_and_port_to_string().c_str());
+
+    typename Pool::iterator slot_it = _conn_pool.find(oldest_conn_info_ptr->target);
+    slot_it->second.pop_back();
+    if (slot_it->second.empty())
     {
-      // Connections are always checked in/out at the front of the slot, so the
-      // oldest one is at the back
-      ConnectionInfo<T>* oldest_conn_info_ptr = slot_it->second.back();
+      _conn_pool.erase(slot_it);
+    }
 
-      if (current_time > oldest_conn_info_ptr->last_used_time_s + _max_idle_time_s)
-      {
-        if (Log::enabled(Log::DEBUG_LEVEL))
-        {
-          /// Create strings required for debug logging
-          std::string addr_info_str = oldest_conn_info_ptr->target.address_and_port_to_string();
-          std::string current_time_str = ctime(&current_time);
-          std::string last_used_time_s_str = ctime(&(oldest_conn_info_ptr->last_used_time_s));
-
-          TRC_DEBUG("Free idle connection to target: %s (time now is %s, last used %s)",
-                    addr_info_str.c_str(),
-                    current_time_str.c_str(),
-                    last_used_time_s_str.c_str());
-        }
+    free_connection(oldest_conn_info_ptr);
+  }
 
-        // Delete the connection as it is too old
-        slot_it->second.pop_back();
-        destroy_connection(oldest_conn_info_ptr->target, oldest_conn_info_ptr->conn);
-        delete oldest_conn_info_ptr; oldest_conn_info_ptr = NULL;
+  // The thread caches are small, so just check every connection in them.
+  // Free the caches of any threads that have exited on the way.
+  typename std::vector<ThreadCache*>::iterator cache_it = _thread_caches.begin();
+  while (cache_it != _thread_caches.end())
+  {
+    ThreadCache* cache = *cache_it;
 
-        // Delete the entire slot if it is now empty
-        if (slot_it->second.empty())
-        {
-          _conn_pool.erase(slot_it);
-        }
+    if (cache->owners.load() == 1)
+    {
+      cache_it = _thread_caches.erase(cache_it);
+      release_thread_cache(cache);
+      continue;
+    }
 
-        // We have deleted one old connection, so we stop here
-        break;
+    ++cache_it;
+
+    pthread_mutex_lock(&cache->lock);
+
+    typename std::vector<ConnectionInfo<T>*>::iterator it = cache->conns.begin();
+    while (it != cache->conns.end())
+    {
+      if (current_time > (*it)->last_used_time_s + _max_idle_time_s)
+      {
+        TRC_DEBUG("Free idle cached connection to target: %s",
+                  (*it)->target.address_and_port_to_string().c_str());
+        destroy_connection((*it)->target, (*it)->conn);
+        delete *it;
+        it = cache->conns.erase(it);
+      }
+      else
+      {
+        ++it;
       }
     }
+
+    pthread_mutex_unlock(&cache->lock);
   }
 
   pthread_mutex_unlock(&_conn_pool_lock);
 }
 
+template<typename T>
+void ConnectionPool<T>::free_connection(ConnectionInfo<T>* conn_info_ptr)
+{
+  remove_idle(conn_info_ptr);
+  destroy_connection(conn_info_ptr->target, conn_info_ptr->conn);
+  delete conn_info_ptr; conn_info_ptr = NULL;
+}
+
+template<typename T>
+void ConnectionPool<T>::add_idle(ConnectionInfo<T>* conn_info_ptr)
+{
+  // The connection has just been used, so goes at the front of the list.
+  conn_info_ptr->newer = NULL;
+  conn_info_ptr->older = _newest_idle;
+
+  if (_newest_idle != NULL)
+  {
+    _newest_idle->newer = conn_info_ptr;
+  }
+  else
+  {
+    _oldest_idle = conn_info_ptr;
+  }
+
+  _newest_idle = conn_info_ptr;
+}
+
+template<typename T>
+void ConnectionPool<T>::remove_idle(ConnectionInfo<T>* conn_info_ptr)
+{
+  if (conn_info_ptr->newer != NULL)
+  {
+    conn_info_ptr->newer->older = conn_info_ptr->older;
+  }
+  else
+  {
+    _newest_idle = conn_info_ptr->older;
+  }
+
+  if (conn_info_ptr->older != NULL)
+  {
+    conn_info_ptr->older->newer = conn_info_ptr->newer;
+  }
+  else
+  {
+    _oldest_idle = conn_info_ptr->newer;
+  }
+
+  conn_info_ptr->newer = NULL;
+  conn_info_ptr->older = NULL;
+}
+
+template<typename T>
+typename ConnectionPool<T>::ThreadCache* ConnectionPool<T>::get_thread_cache()
+{
+  ThreadCache* cache = (ThreadCache*)pthread_getspecific(_thread_cache_key);
+
+  if (cache == NULL)
+  {
+    cache = new ThreadCache();
+    cache->pool = this;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->conns.reserve(_thread_cache_size);
+    cache->owners = 2;
+    pthread_setspecific(_thread_cache_key, cache);
+
+    pthread_mutex_lock(&_conn_pool_lock);
+    _thread_caches.push_back(cache);
+    pthread_mutex_unlock(&_conn_pool_lock);
+  }
+
+  return cache;
+}
+
+template<typename T>
+void ConnectionPool<T>::release_thread_cache(void* cache_ptr)
+{
+  ThreadCache* cache = (ThreadCache*)cache_ptr;
+
+  // The cached connections are older than those in the pool's slots, so
+  // can't be added to the idle list in order.  Just destroy them.  If the
+  // pool has already released the cache it is empty, so the pool (which may
+  // no longer exist) isn't used.
+  pthread_mutex_lock(&cache->lock);
+
+  for (ConnectionInfo<T>* conn_info_ptr : cache->conns)
+  {
+    cache->pool->destroy_connection(conn_info_ptr->target, conn_info_ptr->conn);
+    delete conn_info_ptr; conn_info_ptr = NULL;
+  }
+  cache->conns.clear();
+
+  pthread_mutex_unlock(&cache->lock);
+
+  if (cache->owners.fetch_sub(1) == 1)
+  {
+    pthread_mutex_destroy(&cache->lock);
+    delete cache; cache = NULL;
+  }
+}
+
 template <typename T>
 ConnectionHandle<T>::ConnectionHandle(ConnectionInfo<T>* conn_info_ptr,
                                       ConnectionPool<T>* conn_pool_ptr) :
@@ -363,7 +754,8 @@ ConnectionHandle<T>::~ConnectionHandle()
 template <typename T>
 ConnectionHandle<T>::ConnectionHandle(ConnectionHandle<T>&& conn_handle) :
   _conn_info_ptr(conn_handle._conn_info_ptr),
-  _conn_pool_ptr(conn_handle._conn_pool_ptr)
+  _conn_pool_ptr(conn_handle._conn_pool_ptr),
+  _return_to_pool(conn_handle._return_to_pool)
 {
   conn_handle._conn_info_ptr = NULL;
   conn_handle._conn_pool_ptr = NULL;
@@ -374,6 +766,7 @@ ConnectionHandle<T>& ConnectionHandle<T>::operator=(ConnectionHandle<T>&& conn_h
 {
   _conn_info_ptr = conn_handle._conn_info_ptr; conn_handle._conn_info_ptr = NULL;
   _conn_pool_ptr = conn_handle._conn_pool_ptr; conn_handle._conn_pool_ptr = NULL;
+  _return_to_pool = conn_handle._return_to_pool;
   return *this;
 }
 
@@ -15,6 +15,7 @@
 #include <atomic>
 #include <time.h>
 
+#include "sharded_statistics.h"
 #include "statrecorder.h"
 #include "zmq_lvc.h"
 
@@ -49,7 +50,7 @@ private:
   /// Current accumulated count.
   struct {
     std::atomic_uint_fast64_t _timestamp_us;
-    std::atomic_uint_fast64_t _count;
+    ShardedCounter _count;
   } _current;
 
   /// Count accumulated over the previous period.
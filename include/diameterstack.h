@@ -28,6 +28,7 @@
 #include "exception_handler.h"
 #include "counter.h"
 #include "snmp_counter_table.h"
+#include "snmp_event_histogram_table.h"
 
 namespace Diameter
 {
@@ -628,7 +629,8 @@ public:
                          ExceptionHandler* exception_handler,
                          BaseCommunicationMonitor* comm_monitor = NULL,
                          SNMP::CounterTable* realm_counter = NULL,
-                         SNMP::CounterTable* host_counter = NULL);
+                         SNMP::CounterTable* host_counter = NULL,
+                         SNMP::EventHistogramTable* latency_histogram = NULL);
   virtual void advertize_application(const Dictionary::Application::Type type,
                                      const Dictionary::Application& app);
   virtual void advertize_application(const Dictionary::Application::Type type,
@@ -655,6 +657,7 @@ public:
 
   virtual void report_tsx_result(int32_t rc);
   virtual void report_tsx_timeout();
+  virtual void report_tsx_latency(Transaction* tsx);
 
   virtual bool add(Peer* peer);
   virtual void remove(Peer* peer);
@@ -732,6 +735,7 @@ private:
   BaseCommunicationMonitor* _comm_monitor;
   SNMP::CounterTable* _realm_counter;
   SNMP::CounterTable* _host_counter;
+  SNMP::EventHistogramTable* _latency_histogram;
 
   // Number of peers we're currently either connected to or trying to connect
   // to, or have recently tried to connect to, and the number of peers we're
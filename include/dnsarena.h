@@ -0,0 +1,217 @@
+/**
+ * @file dnsarena.h Compact, arena-backed store of DNS resource records.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DNSARENA_H__
+#define DNSARENA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <netinet/in.h>
+
+#include "dnsrrecords.h"
+
+/// A set of DNS resource records (typically all the records from one DNS
+/// response) held in a single block of memory.
+///
+/// The records are fixed size and stored in a flat array, in the order they
+/// appeared in the response (answers, then authorities, then additional
+/// records).  Domain names and character strings are stored as
+/// null-terminated text after the records, and each distinct domain name is
+/// only stored once, so records refer to names by index into the name table.
+///
+/// An arena is filled in once (by DnsParser::parse_to_arena or from_records)
+/// and is then immutable, so it is shared between the cache entries (and
+/// cache snapshots) that hold its records using a shared_ptr.  Its memory is
+/// only freed as a whole, so a single record that is still in use keeps every
+/// record from the same response in memory.  This is the cost of doing one
+/// allocation per response rather than one per record.
+class DnsArena
+{
+public:
+  /// Reference to a character string in the arena.
+  struct Text
+  {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  /// A single resource record.  Which member of rdata is valid depends on
+  /// rrtype - records of types other than A, AAAA, SRV, NAPTR and CNAME have
+  /// no rdata.
+  struct Record
+  {
+    uint16_t rrtype;
+    uint16_t rrclass;
+    int32_t ttl;
+    int32_t expires;
+    uint32_t name;
+
+    union
+    {
+      struct in_addr a;
+      struct in6_addr aaaa;
+      struct
+      {
+        uint16_t priority;
+        uint16_t weight;
+        uint16_t port;
+        uint32_t target;
+      } srv;
+      struct
+      {
+        uint16_t order;
+        uint16_t preference;
+        Text flags;
+        Text service;
+        Text regexp;
+        uint32_t replacement;
+      } naptr;
+      struct
+      {
+        uint32_t target;
+      } cname;
+    } rdata;
+  };
+
+  /// Creates an empty arena with room for the specified number of records,
+  /// names and bytes of text (including null terminators).  This is the only
+  /// allocation made while filling in the arena.
+  DnsArena(size_t max_records, size_t max_names, size_t max_text);
+  ~DnsArena();
+
+  DnsArena(const DnsArena&) = delete;
+  DnsArena& operator=(const DnsArena&) = delete;
+
+  /// The records in the arena.
+  size_t num_records() const { return _num_records; }
+  const Record& record(size_t index) const { return _records[index]; }
+
+  /// The records are stored in the order of the sections of the response,
+  /// so the answers are the first num_answers() records, followed by the
+  /// authority records, then the additional records.
+  size_t num_answers() const { return _num_answers; }
+  size_t num_authorities() const { return _num_authorities; }
+  size_t num_additional() const
+  {
+    return _num_records - _num_answers - _num_authorities;
+  }
+
+  /// Returns the specified domain name as a null-terminated string.
+  const char* name(uint32_t name) const { return _text + _names[name].offset; }
+  size_t name_length(uint32_t name) const { return _names[name].length; }
+
+  /// Returns a character string as a null-terminated string.
+  const char* text(const Text& text) const { return _text + text.offset; }
+
+  /// Creates a DnsRRecord object equivalent to the specified record.  The
+  /// caller owns the returned object.
+  DnsRRecord* to_rrecord(const Record& record) const;
+
+  /// Appends DnsRRecord objects equivalent to the specified records (which
+  /// must all be in this arena) to a vector.  The caller owns the objects.
+  void to_rrecords(const std::vector<const Record*>& records,
+                   std::vector<DnsRRecord*>& rrecords) const;
+
+  /// Renders a record to a displayable string.
+  std::string to_string(const Record& record) const;
+
+  /// Builds an arena holding copies of the specified records.
+  static std::shared_ptr<DnsArena> from_records(const std::vector<DnsRRecord*>& records);
+
+  /// Methods used to fill in the arena.  The caller is responsible for
+  /// staying within the sizes passed to the constructor.
+  ///
+  /// Names added with a non-zero wire offset can be found again with
+  /// find_name, and must be added in increasing order of wire offset.
+  Record& add_record();
+  uint32_t add_name(const char* name, size_t length, uint32_t wire_offset);
+  uint32_t find_name(uint32_t wire_offset) const;
+  char* add_text(size_t length, Text& text);
+  void set_sections(size_t num_answers, size_t num_authorities)
+  {
+    _num_answers = num_answers;
+    _num_authorities = num_authorities;
+  }
+
+  size_t names_used() const { return _num_names; }
+  size_t text_used() const { return _text_used; }
+
+  /// Methods to save the arena as a flat image (used to persist the DNS
+  /// cache).  The image is a small header followed by the arena's block, so
+  /// loading it is a single allocation and copy.  Images are padded to a
+  /// multiple of 8 bytes, so a sequence of them can be read from a mapped
+  /// file without copying the header.
+  size_t image_size() const;
+  void write_image(char* buf) const;
+
+  /// Loads an arena from an image written by write_image.  Every name and
+  /// text reference in the image is checked, so a corrupt image is rejected
+  /// rather than producing an arena that reads out of bounds.
+  ///
+  /// @param buf    - The image.
+  /// @param length - The number of bytes available at buf.
+  /// @param used   - Filled in with the length of the image.
+  /// @returns the arena, or NULL if the image is invalid.
+  static std::shared_ptr<DnsArena> read_image(const char* buf,
+                                              size_t length,
+                                              size_t& used);
+
+private:
+  /// Entry in the name table.
+  struct Name
+  {
+    uint32_t offset;
+    uint32_t length;
+
+    /// The offset in the DNS message at which the name was decoded, or zero
+    /// if it didn't come from a DNS message.  This is used to share the name
+    /// with other names that are compressed to a pointer to it.
+    uint32_t wire_offset;
+  };
+
+  /// Header of an image of the arena.
+  struct ImageHeader
+  {
+    uint32_t num_records;
+    uint32_t num_names;
+    uint32_t text_size;
+    uint32_t num_answers;
+    uint32_t num_authorities;
+    uint32_t reserved;
+  };
+
+  size_t block_size() const
+  {
+    return _num_records * sizeof(Record) + _num_names * sizeof(Name) + _text_used;
+  }
+
+  bool valid_name(uint32_t name) const;
+  bool valid_text(const Text& text) const;
+
+  void* _block;
+  Record* _records;
+  Name* _names;
+  char* _text;
+
+  size_t _num_records;
+  size_t _num_names;
+  size_t _text_used;
+  size_t _num_answers;
+  size_t _num_authorities;
+};
+
+typedef std::shared_ptr<const DnsArena> DnsArenaPtr;
+
+#endif
@@ -13,11 +13,16 @@
 #define DNSCACHEDRESOLVER_H__
 
 #include <string.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdint.h>
 
+#include <atomic>
+#include <deque>
 #include <map>
 #include <list>
+#include <set>
 #include <vector>
 #include <memory>
 
@@ -26,6 +31,7 @@
 
 #include "utils.h"
 #include "dnsrrecords.h"
+#include "dnsarena.h"
 #include "sas.h"
 
 class DnsResult
@@ -83,6 +89,57 @@ public:
   // Reads DNS records from _dns_config_file and stores them in _static_records
   void reload_static_records();
 
+  /// Enables stale-while-revalidate mode.  In this mode, an entry that has
+  /// expired less than grace_period seconds ago is returned (with a TTL of
+  /// STALE_TTL) rather than blocking the caller on a new query, and the entry is
+  /// refreshed on a background thread.  Entries that are hit frequently in
+  /// the last prefetch_time seconds before they expire are also refreshed
+  /// in the background.  The grace period is capped at EXTRA_INVALID_TIME.
+  ///
+  /// This must be called before the resolver is used for queries.
+  void enable_stale_while_revalidate(int grace_period, int prefetch_time);
+
+  struct Stats
+  {
+    // The number of times an expired entry has been returned.
+    uint64_t stale_serves;
+
+    // The number of background refreshes issued, and how many of these were
+    // prefetches of entries that hadn't yet expired.
+    uint64_t refreshes;
+    uint64_t prefetches;
+  };
+
+  /// Returns the stale-while-revalidate statistics.
+  Stats stats() const;
+
+  /// Saves the contents of the cache to a file, in a compact binary format
+  /// that can be read back by load_cache.  Entries that can no longer be
+  /// served are left out.  The file is written to a temporary file which is
+  /// then renamed, so a reader never sees a partially written file.
+  ///
+  /// @returns whether the file was written.
+  bool save_cache(const std::string& filename);
+
+  /// Loads the entries from a file written by save_cache into the cache.
+  /// Entries keep their original expiry times, so are served with their
+  /// remaining TTLs.  Entries that can no longer be served, or are already
+  /// in the cache, are skipped.
+  ///
+  /// @returns whether the file was read.
+  bool load_cache(const std::string& filename);
+
+  /// Enables persistence of the cache, so a restarted process can serve
+  /// from a warm cache rather than querying the DNS server for every name.
+  /// The cache is loaded from the file (if it exists), then saved to it
+  /// every interval seconds and when the resolver is destroyed.  An interval
+  /// of less than MIN_PERSIST_INTERVAL seconds is raised to that.
+  ///
+  /// This must be called before the resolver is used for queries, and after
+  /// enable_stale_while_revalidate if that is used (so entries that have
+  /// expired but can be served stale are loaded).
+  void enable_cache_persistence(const std::string& filename, int interval);
+
   // Default timeout for DNS requests over the wire (in milliseconds)
   static const int DEFAULT_TIMEOUT = 200;
 
@@ -116,19 +173,65 @@ private:
     SAS::TrailId _trail;
   };
 
+  /// An immutable copy of a cache entry, which can be read without holding
+  /// the cache lock.
+  struct DnsCacheSnapshotEntry
+  {
+    DnsCacheSnapshotEntry(const std::string& domain_param,
+                          int dnstype_param,
+                          int expires_param,
+                          const DnsArenaPtr& arena_param,
+                          const std::vector<const DnsArena::Record*>& records_param);
+
+    std::string domain;
+    int dnstype;
+    int expires;
+
+    /// The records are shared with the cache entry, rather than copied.
+    DnsArenaPtr arena;
+    std::vector<const DnsArena::Record*> records;
+
+    /// The number of hits on this entry in the prefetch window before it
+    /// expires.
+    mutable std::atomic<int> prefetch_hits;
+  };
+
+  typedef std::shared_ptr<const DnsCacheSnapshotEntry> DnsCacheSnapshotEntryPtr;
+
   struct DnsCacheEntry
   {
     bool pending_query;
+
+    /// Set if a background refresh of the entry was skipped because a query
+    /// was already pending, so the prefetch trigger is re-armed when that
+    /// query completes.
+    bool refresh_skipped;
+
     std::string domain;
     int dnstype;
     int expires;
-    std::vector<DnsRRecord*> records;
+
+    /// The records for the entry, which are held in the arena they were
+    /// parsed into.  The arena may also hold records for other cache entries
+    /// (from the same DNS response), so is shared between them.  All the
+    /// records are in this one arena.
+    ///
+    /// The whole arena is kept until every entry (and snapshot) using it has
+    /// gone, so an entry with a long TTL keeps the records of the rest of its
+    /// response alive after their own entries have expired.  This is bounded
+    /// by the size of one response per live entry.
+    DnsArenaPtr arena;
+    std::vector<const DnsArena::Record*> records;
+
+    /// The snapshot of this entry in the published snapshot of the cache, or
+    /// NULL if the entry has changed since the last snapshot was published.
+    DnsCacheSnapshotEntryPtr snapshot;
   };
 
   class DnsCacheKeyCompare
   {
   public:
-    bool operator()(const std::pair<int, std::string> lhs, const std::pair<int, std::string> rhs)
+    bool operator()(const std::pair<int, std::string>& lhs, const std::pair<int, std::string>& rhs) const
     {
       if (lhs.first > rhs.first)
       {
@@ -153,6 +256,43 @@ private:
                    DnsCacheEntryPtr,
                    DnsCacheKeyCompare> DnsCache;
 
+  typedef std::map<DnsCacheKey,
+                   DnsCacheSnapshotEntryPtr,
+                   DnsCacheKeyCompare> DnsCacheSnapshotBucket;
+  typedef std::vector<std::shared_ptr<const DnsCacheSnapshotBucket>>
+                                                      DnsCacheSnapshotBucketGroup;
+
+  /// A snapshot of the whole cache (and the static CNAME records), published
+  /// each time the cache changes.  Cache hits are served from the snapshot
+  /// without taking the cache lock.
+  ///
+  /// The entries are split into a fixed number of buckets by hashing their
+  /// keys (see snapshot_bucket), and the buckets into groups.  Publishing a
+  /// snapshot only copies the groups and buckets that hold changed entries,
+  /// and shares the rest with the previous snapshot, so the cost doesn't grow
+  /// with the size of the cache until the buckets get large.
+  struct DnsCacheSnapshot
+  {
+    std::vector<std::shared_ptr<const DnsCacheSnapshotBucketGroup>> groups;
+    std::shared_ptr<const std::map<std::string, std::string>> static_cnames;
+  };
+
+  typedef std::shared_ptr<const DnsCacheSnapshot> DnsCacheSnapshotPtr;
+
+  /// Each thread holds a reference to the snapshot it last used, so it only
+  /// needs to fetch the published snapshot when the version changes.
+  ///
+  /// A reference is owned by both its thread and the resolver (see
+  /// _snapshot_refs), so that it can be released by whichever is destroyed
+  /// first.  Each drops the snapshot and then decrements owners, and the
+  /// last one frees the reference.
+  struct DnsCacheSnapshotRef
+  {
+    DnsCacheSnapshotPtr snapshot;
+    uint64_t version;
+    std::atomic<int> owners;
+  };
+
   /// Performs the actual DNS query.
   void inner_dns_query(const std::vector<std::string>& domains,
                        int dnstype,
@@ -168,12 +308,36 @@ private:
 
   bool caching_enabled(int rrtype);
 
+  bool query_snapshot(const std::vector<std::string>& domains,
+                      int dnstype,
+                      std::vector<DnsResult>& results);
+  DnsCacheSnapshotPtr get_snapshot();
+  void publish_snapshot();
+  void snapshot_entry_changed(const DnsCacheKey& key);
+  static size_t snapshot_bucket(const DnsCacheKey& key);
+  static void destroy_snapshot_ref(DnsCacheSnapshotRef* ref);
+
+  bool can_serve_stale(int expires, bool has_records, time_t now);
+  void request_refresh(const std::string& domain, int dnstype);
+  void refresh(const DnsCacheKey& key);
+  void stop_refresh_thread();
+  static void* refresh_thread_func(void* resolver);
+  void refresh_thread_loop();
+
+  bool load_cache_file(const char* buf, size_t length);
+  void stop_persist_thread();
+  static void* persist_thread_func(void* resolver);
+  void persist_thread_loop();
+
   DnsCacheEntryPtr get_cache_entry(const std::string& domain, int dnstype);
   DnsCacheEntryPtr create_cache_entry(const std::string& domain, int dnstype);
   void add_to_expiry_list(DnsCacheEntryPtr ce);
   void expire_cache();
-  void add_record_to_cache(DnsCacheEntryPtr ce, DnsRRecord* rr);
+  void add_record_to_cache(DnsCacheEntryPtr ce,
+                           const DnsArenaPtr& arena,
+                           const DnsArena::Record* record);
   void clear_cache_entry(DnsCacheEntryPtr ce);
+  void cache_entry_changed(DnsCacheEntryPtr ce);
 
 
   DnsChannel* get_dns_channel();
@@ -199,6 +363,109 @@ private:
   std::string _dns_config_file;
   std::map<std::string, std::vector<DnsRRecord*>> _static_records;
 
+  /// The static CNAME records, as a map from domain to target.
+  std::shared_ptr<const std::map<std::string, std::string>> _static_cnames;
+
+  /// The published snapshot of the cache.  This must only be accessed using
+  /// the std::atomic_load/atomic_store functions, and is only updated under
+  /// the cache lock.  _snapshot_dirty and _snapshot_changed (which must be
+  /// accessed under the cache lock) record whether the cache has changed
+  /// since it was last published, and the keys of the entries that changed.
+  DnsCacheSnapshotPtr _snapshot;
+  std::atomic<uint64_t> _snapshot_version;
+  bool _snapshot_dirty;
+  std::set<DnsCacheKey, DnsCacheKeyCompare> _snapshot_changed;
+
+  // The thread-local store for DnsCacheSnapshotRefs, and every reference that
+  // the resolver still owns (which must be accessed under _snapshot_refs_lock).
+  pthread_key_t _snapshot_key;
+  pthread_mutex_t _snapshot_refs_lock;
+  std::vector<DnsCacheSnapshotRef*> _snapshot_refs;
+
+  /// Stale-while-revalidate configuration.  Both are zero if the mode is
+  /// disabled.
+  int _stale_grace_period;
+  int _prefetch_time;
+
+  /// Background refreshes are queued to a dedicated thread.  Keys stay in
+  /// _refresh_keys until the refresh completes, so each entry is only
+  /// refreshed once at a time.  These must be accessed under _refresh_lock,
+  /// which may be taken while holding _cache_lock but not the other way
+  /// round.
+  pthread_t _refresh_thread;
+  bool _refresh_thread_running;
+  pthread_mutex_t _refresh_lock;
+  pthread_cond_t _refresh_cond;
+  bool _refresh_terminated;
+  std::deque<DnsCacheKey> _refresh_queue;
+  std::set<DnsCacheKey, DnsCacheKeyCompare> _refresh_keys;
+
+  std::atomic<uint64_t> _stale_serves;
+  std::atomic<uint64_t> _refreshes;
+  std::atomic<uint64_t> _prefetches;
+
+  /// Cache persistence configuration.  _persist_file is empty if
+  /// persistence is disabled.  The persist thread saves the cache every
+  /// _persist_interval seconds, until _persist_terminated is set (under
+  /// _persist_lock).
+  std::string _persist_file;
+  int _persist_interval;
+  pthread_t _persist_thread;
+  bool _persist_thread_running;
+  pthread_mutex_t _persist_lock;
+  pthread_cond_t _persist_cond;
+  bool _persist_terminated;
+
+  /// Layout of a cache file written by save_cache.  The header is followed
+  /// by num_arenas arena images (see DnsArena::write_image), then by
+  /// num_entries entries, each of which is a CacheFileEntry followed by the
+  /// indexes of its records in its arena, then its domain name.  Every part
+  /// is padded to a multiple of 8 bytes, so the file can be read in place
+  /// from a mapping.
+  ///
+  /// The records are stored in their in-memory layout, so the file is only
+  /// loaded if the byte order and record size match.
+  struct CacheFileHeader
+  {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t num_arenas;
+    uint32_t num_entries;
+    uint32_t reserved;
+    int64_t saved_at;
+  };
+
+  struct CacheFileEntry
+  {
+    int32_t dnstype;
+    int32_t expires;
+    uint32_t arena;
+    uint32_t num_records;
+    uint32_t domain_length;
+    uint32_t reserved;
+  };
+
+  static const char CACHE_FILE_MAGIC[8];
+  static const uint32_t CACHE_FILE_BYTE_ORDER = 0x01020304;
+  static const uint32_t CACHE_FILE_VERSION = 1;
+
+  // The records are written in their in-memory layout, so the layout is part
+  // of the file format.  If this fails, DnsArena::Record has changed, so
+  // increment CACHE_FILE_VERSION and update the expected layout.
+  static_assert((CACHE_FILE_VERSION == 1) &&
+                (sizeof(DnsArena::Record) == 48) &&
+                (offsetof(DnsArena::Record, ttl) == 4) &&
+                (offsetof(DnsArena::Record, expires) == 8) &&
+                (offsetof(DnsArena::Record, name) == 12) &&
+                (offsetof(DnsArena::Record, rdata) == 16) &&
+                (sizeof(DnsArena::Record::rdata) == 32),
+                "DnsArena::Record layout doesn't match CACHE_FILE_VERSION");
+
+  /// Arena index used for entries with no records.
+  static const uint32_t CACHE_FILE_NO_ARENA = 0xffffffff;
+
   // Expiry is done efficiently by storing pointers to cache entries in a
   // multimap indexed on expiry time.
   DnsCacheExpiryList _cache_expiry_list;
@@ -212,6 +479,25 @@ private:
   /// This provides a grace period if a DNS server becomes temporarily
   /// unresponsive, but doesn't risk leaking memory.
   static const int EXTRA_INVALID_TIME = 300;
+
+  /// The number of hits an entry must get in the prefetch window before it
+  /// is prefetched.
+  static const int PREFETCH_MIN_HITS = 10;
+
+  /// The TTL returned with an expired entry that is served while it is
+  /// refreshed.  This is positive so callers don't treat the records as
+  /// unusable, and short so they don't hold on to them for long (30 seconds
+  /// is the value recommended by RFC 8767).
+  static const int STALE_TTL = 30;
+
+  /// The shortest interval at which the cache is saved, as each save writes
+  /// the whole cache.
+  static const int MIN_PERSIST_INTERVAL = 1;
+
+  /// The number of groups of buckets in a snapshot, and the number of
+  /// buckets in each group.
+  static const size_t SNAPSHOT_GROUPS = 64;
+  static const size_t SNAPSHOT_GROUP_BUCKETS = 64;
 };
 
 #endif
@@ -14,8 +14,11 @@
 
 #include <string>
 #include <list>
+#include <memory>
+#include <stdint.h>
 
 #include "dnsrrecords.h"
+#include "dnsarena.h"
 
 class DnsParser
 {
@@ -33,7 +36,31 @@ public:
 
   static std::string display_records(const std::list<DnsRRecord*>& records);
 
+  /// Parses the message into a DnsArena, instead of into the lists of
+  /// DnsRRecord objects returned by the accessors above.  The arena is
+  /// sized exactly by a first pass over the message, so parsing allocates
+  /// nothing other than the arena (and the shared_ptr holding it).  Every
+  /// read is bounds checked against the message length, and compression
+  /// pointers must point strictly backwards from the last one followed, so
+  /// malformed or hostile messages are rejected rather than causing out of
+  /// bounds reads or loops.
+  ///
+  /// @returns the arena, or NULL if the message is malformed.
+  std::shared_ptr<DnsArena> parse_to_arena();
+
+  static std::string display_records(const DnsArena& arena);
+
 private:
+  struct ArenaPass;
+  void arena_pass(ArenaPass& pass);
+  uint32_t arena_domain_name(ArenaPass& pass, size_t& offset);
+  void arena_character_string(ArenaPass& pass,
+                              size_t& offset,
+                              size_t end,
+                              DnsArena::Text& text);
+  void arena_rr(ArenaPass& pass, size_t& offset);
+  void check_bounds(size_t offset, size_t length);
+
   int parse_header(unsigned char* hptr);
   int parse_domain_name(unsigned char* nptr, std::string& name);
   int parse_character_string(unsigned char* sptr, std::string& cstring);
@@ -59,6 +86,11 @@ private:
   std::list<DnsRRecord*> _authorities;
   std::list<DnsRRecord*> _additional;
 
+  // The maximum length of a DNS message (limited by the length field in
+  // DNS over TCP) and of a decoded domain name.
+  static const int MAX_MESSAGE_LENGTH      = 65535;
+  static const int MAX_NAME_LENGTH         = 255;
+
   // Constants defining sizes and offsets in message header.
   static const int HDR_SIZE                = 12;
   static const int QDCOUNT_OFFSET          = 4;
@@ -70,6 +70,10 @@ public:
   int expires() const { return _expires; };
   bool expired() const { return _expires > time(NULL); }
 
+  /// Overrides the expiry time calculated from the TTL, for records that are
+  /// recreated from a cached copy.
+  void set_expires(int expires) { _expires = expires; }
+
   virtual DnsRRecord* clone()
   {
     return new DnsRRecord(*this);
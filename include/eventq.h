@@ -17,6 +17,7 @@
 #include <time.h>
 
 #include <queue>
+#include <vector>
 
 #include "log.h"
 
@@ -242,6 +243,67 @@ public:
     return rc;
   }
 
+  /// Push a range of items on to the event queue under a single lock.
+  ///
+  /// This may block if the queue is full (in which case the items that fit
+  /// are made available to readers before waiting for space), and will fail
+  /// if the queue is closed.
+  template<class InputIterator>
+  bool push_bulk(InputIterator begin, InputIterator end)
+  {
+    bool rc = false;
+
+    pthread_mutex_lock(&_m);
+
+    if (_open)
+    {
+      if ((_deadlock_threshold > 0) &&
+          (_q.empty()) &&
+          (begin != end))
+      {
+        // As for push, reset the service time when the queue goes from empty
+        // to non-empty.
+        clock_gettime(CLOCK_MONOTONIC, &_service_time);
+      }
+
+      while (begin != end)
+      {
+        if (_max_queue != 0)
+        {
+          while (_q.size() >= _max_queue)
+          {
+            // Queue is full.  Wake the readers so they can drain what we've
+            // pushed so far, then block.
+            if (_readers > 0)
+            {
+              pthread_cond_broadcast(&_r_cond);
+            }
+
+            ++_writers;
+            pthread_cond_wait(&_w_cond, &_m);
+            --_writers;
+          }
+        }
+
+        _q.push(*begin);
+        ++begin;
+      }
+
+      // Are there any readers waiting?  Wake them all, as there may be enough
+      // work for several.
+      if (_readers > 0)
+      {
+        pthread_cond_broadcast(&_r_cond);
+      }
+
+      rc = true;
+    }
+
+    pthread_mutex_unlock(&_m);
+
+    return rc;
+  }
+
   /// Pop an item from the event queue, waiting indefinitely if it is empty.
   bool pop(T& item)
   {
@@ -354,6 +416,51 @@ public:
     return !_terminated;
   }
 
+  /// Pop up to max_items items from the event queue under a single lock,
+  /// waiting indefinitely if it is empty.  The items are appended to the
+  /// supplied vector.
+  bool pop_batch(std::vector<T>& items, unsigned int max_items)
+  {
+    pthread_mutex_lock(&_m);
+
+    while ((_q.empty()) && (!_terminated))
+    {
+      // The queue is empty, so wait for something to arrive.
+      ++_readers;
+      pthread_cond_wait(&_r_cond, &_m);
+      --_readers;
+    }
+
+    unsigned int popped = 0;
+    while ((!_q.empty()) && (popped < max_items))
+    {
+      items.push_back(_q.front());
+      _q.pop();
+      ++popped;
+    }
+
+    // Are there blocked writers?  Several slots may have been freed, so wake
+    // all of them.
+    if ((popped > 0) &&
+        (_max_queue != 0) &&
+        (_q.size() < _max_queue) &&
+        (_writers > 0))
+    {
+      pthread_cond_broadcast(&_w_cond);
+    }
+
+    if (_deadlock_threshold > 0)
+    {
+      // Deadlock detection is enabled, so record the time we popped items
+      // off the queue.
+      clock_gettime(CLOCK_MONOTONIC, &_service_time);
+    }
+
+    pthread_mutex_unlock(&_m);
+
+    return !_terminated;
+  }
+
   /// Peek at the item at the front of the event queue.
   T peek()
   {
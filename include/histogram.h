@@ -0,0 +1,120 @@
+/**
+ * @file histogram.h Lock-free log-linear histogram.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HISTOGRAM_H__
+#define HISTOGRAM_H__
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/// @class Histogram
+///
+/// A fixed-size histogram of 32-bit values (larger values are clamped), used
+/// to calculate percentiles of latency samples.
+///
+/// The buckets are log-linear, in the style of an HDR histogram: values
+/// below 2^SUB_BUCKET_BITS each have their own bucket, and above that each
+/// power of two is split into 2^(SUB_BUCKET_BITS - 1) equally sized buckets.
+/// This means the value reported for a percentile is within 1 part in
+/// 2^(SUB_BUCKET_BITS - 1) (about 3%) of the true value, whatever the
+/// magnitude.
+///
+/// Recording a sample is a single relaxed atomic increment, so can be done
+/// from any number of threads without locking.  Reads aren't synchronized
+/// with recording, so a read that races with recording may miss some
+/// samples.
+///
+/// The histogram can be used as the data type of a CurrentAndPrevious.
+class Histogram
+{
+public:
+  /// The number of bits of precision kept for each value.
+  static const unsigned int SUB_BUCKET_BITS = 6;
+
+  /// The number of buckets needed to cover all 32-bit values.
+  static const unsigned int NUM_BUCKETS =
+                       (32 - SUB_BUCKET_BITS + 2) << (SUB_BUCKET_BITS - 1);
+
+  Histogram() { reset(); }
+
+  /// Record a sample.
+  inline void record(uint_fast64_t value)
+  {
+    _buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// The total number of samples recorded.
+  uint_fast64_t count() const;
+
+  /// Calculate the value at each of the specified percentiles.
+  ///
+  /// @param percentiles - The percentiles to calculate (each between 0 and
+  ///                      100), in ascending order.
+  /// @param values      - Filled in with the value at each percentile.  This
+  ///                      is the highest value in the bucket containing the
+  ///                      percentile, or 0 if there are no samples.
+  /// @return            - The total number of samples.
+  uint_fast64_t percentiles(const std::vector<double>& percentiles,
+                            std::vector<uint_fast64_t>& values) const;
+
+  /// Calculate the value at a single percentile.
+  uint_fast64_t percentile(double percentile) const;
+
+  /// Clear all the samples.
+  void reset();
+
+  /// Reset method used by CurrentAndPrevious at the start of each period.
+  /// Unlike accumulated statistics, nothing carries across from the
+  /// previous period, so the period start time and previous histogram are
+  /// ignored.
+  void reset(uint64_t, Histogram* = NULL) { reset(); }
+
+  /// Get the bucket index for a value.
+  static inline unsigned int bucket_index(uint_fast64_t value)
+  {
+    if (value > UINT32_MAX)
+    {
+      value = UINT32_MAX;
+    }
+
+    if (value < (1u << SUB_BUCKET_BITS))
+    {
+      return value;
+    }
+
+    // Shift the value down so that it has SUB_BUCKET_BITS significant bits.
+    // Its top bit is then always set, so only the remaining bits select the
+    // bucket within this power of two.
+    unsigned int shift = (31 - __builtin_clz((uint32_t)value)) -
+                         (SUB_BUCKET_BITS - 1);
+    return (shift << (SUB_BUCKET_BITS - 1)) + (value >> shift);
+  }
+
+  /// Get the highest value that is counted in a bucket.
+  static inline uint_fast64_t bucket_max_value(unsigned int index)
+  {
+    if (index < (1u << SUB_BUCKET_BITS))
+    {
+      return index;
+    }
+
+    unsigned int shift = (index >> (SUB_BUCKET_BITS - 1)) - 1;
+    uint_fast64_t sub_bucket = index - (shift << (SUB_BUCKET_BITS - 1));
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+
+private:
+  std::atomic_uint_fast64_t _buckets[NUM_BUCKETS];
+};
+
+#endif
@@ -14,6 +14,10 @@
 #define HTTP_CONNECTION_POOL_H__
 
 #include <curl/curl.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
 
 #include "load_monitor.h"
 #include "snmp_ip_count_table.h"
@@ -56,8 +60,19 @@ public:
   {
     // This call is important to properly destroy the connection pool
     destroy_connection_pool();
+    pthread_mutex_destroy(&_stat_lock);
   }
 
+  /// Use HTTP/2 with prior knowledge (h2c) on connections created from now
+  /// on.  Transfers on these connections that are driven by the same curl
+  /// multi handle share a single multiplexed connection to each target.
+  ///
+  /// The per-target statistic then counts the TCP connections that curl
+  /// opens, rather than the pooled curl handles.  Must be called before
+  /// any connections are created.
+  void enable_http2() { _http2 = true; }
+  bool http2_enabled() const { return _http2; }
+
 protected:
   CURL* create_connection(AddrInfo target) override;
 
@@ -69,6 +84,16 @@ protected:
   // connections to a target
   void decrement_statistic(AddrInfo target, CURL* conn);
 
+  // Adds delta to the statistic for the given IP address
+  void update_statistic(const std::string& ip_address, int delta);
+
+  // curl callbacks used to count the connections to each target in HTTP/2
+  // mode
+  static curl_socket_t open_socket(void* pool_ptr,
+                                   curlsocktype purpose,
+                                   struct curl_sockaddr* address);
+  static int close_socket(void* pool_ptr, curl_socket_t fd);
+
   void destroy_connection(AddrInfo target, CURL* conn) override;
 
   // Reset the CURL handle to the default state, then release it into the pool
@@ -77,6 +102,10 @@ protected:
 
   long _timeout_ms;
   SNMP::IPCountTable* _stat_table;
+  bool _http2;
+
+  pthread_mutex_t _stat_lock;
+  std::map<curl_socket_t, std::string> _sockets;  // must access under _stat_lock
 
   // Determines an appropriate absolute HTTP request timeout in ms given the
   // target latency for requests that the downstream components will be using
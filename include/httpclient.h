@@ -11,7 +11,10 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <map>
+#include <vector>
 
 #include <curl/curl.h>
 #include <sas.h>
@@ -27,6 +30,8 @@
 #include "communicationmonitor.h"
 #include "snmp_ip_count_table.h"
 #include "http_connection_pool.h"
+#include "histogram.h"
+#include "current_and_previous.h"
 
 typedef long HTTPCode;
 static const long HTTP_OK = 200;
@@ -73,6 +78,89 @@ public:
 
   virtual ~HttpClient();
 
+  /// Callback invoked when an asynchronous request completes.
+  ///
+  /// @param http_code HTTP code representing outcome of request
+  /// @param response  The retrieved data
+  /// @param headers   The header part of the retrieved data
+  typedef std::function<void(HTTPCode http_code,
+                             const std::string& response,
+                             const std::map<std::string, std::string>& headers)>
+    ResponseCallback;
+
+  /// Starts the event loop threads that drive asynchronous requests.  Each
+  /// thread can have any number of requests in flight at once.  If this isn't
+  /// called, the send_*_async methods send the request synchronously (see
+  /// below).
+  ///
+  /// @param num_threads Number of event loop threads to start
+  ///
+  /// @returns           Whether the threads started successfully
+  bool start_async(int num_threads = 1);
+
+  /// Stops the event loop threads.  Any requests still in flight complete
+  /// with a 503, and their callbacks are invoked before this returns.  This
+  /// is also called by the destructor, in which case the callbacks must not
+  /// use the HttpClient.
+  void stop_async();
+
+  /// Enables HTTP/2 with prior knowledge (h2c) for new connections.  Must be
+  /// called before any requests are sent, and the server must support h2c.
+  ///
+  /// If the event loops are running (see start_async), the synchronous send_*
+  /// methods then also send their requests via the loops and wait for the
+  /// response.  Each loop multiplexes all its requests to a target onto a
+  /// single connection, so there is one connection to each target per loop
+  /// rather than one per concurrent request.  Hedging (see enable_hedging)
+  /// doesn't apply to these requests.
+  void enable_http2();
+
+  /// Enables hedging of GET requests sent with the synchronous send_get
+  /// methods.  If an attempt hasn't completed within the given percentile of
+  /// recent response times, the request is also sent to the next target, and
+  /// whichever target answers first is used.  The other attempt is cancelled.
+  ///
+  /// @param percentile   Percentile of recent successful GET response times
+  ///                     (between 0 and 100) to use as the hedge delay
+  /// @param min_delay_ms Minimum hedge delay.  This is also used until enough
+  ///                     responses have been seen to calculate the percentile
+  void enable_hedging(double percentile, long min_delay_ms);
+
+  /// Asynchronous equivalents of the send_* methods.  These return
+  /// immediately, and the callback is invoked on one of the event loop
+  /// threads when the request completes (after any retries to other
+  /// targets).  Callbacks should not block, as that would delay every other
+  /// request on the same loop.
+  ///
+  /// In the following cases the callback is instead invoked on the calling
+  /// thread, before the method returns, so callers must not hold any locks
+  /// that the callback takes.
+  /// -   The event loops aren't running (start_async hasn't been called, or
+  ///     stop_async has), in which case the request is sent synchronously.
+  /// -   The URL can't be parsed, in which case the callback gets a 400.
+  /// -   The event loops are being stopped, in which case the callback gets
+  ///     a 503.
+  virtual void send_get_async(const std::string& url,
+                              const std::vector<std::string>& headers_to_add,
+                              const std::string& username,
+                              SAS::TrailId trail,
+                              ResponseCallback callback);
+  virtual void send_delete_async(const std::string& url,
+                                 const std::string& body,
+                                 SAS::TrailId trail,
+                                 ResponseCallback callback);
+  virtual void send_put_async(const std::string& url,
+                              const std::string& body,
+                              const std::vector<std::string>& extra_req_headers,
+                              SAS::TrailId trail,
+                              ResponseCallback callback,
+                              const std::string& username = "");
+  virtual void send_post_async(const std::string& url,
+                               const std::string& body,
+                               SAS::TrailId trail,
+                               ResponseCallback callback,
+                               const std::string& username = "");
+
   /// Sends a HTTP GET request to _host with the specified parameters
   ///
   /// @param url            Full URL to request - includes http(s)?://
@@ -256,6 +344,71 @@ private:
                             std::vector<std::string> headers_to_add,
                             std::map<std::string, std::string>* response_headers);
 
+  /// State for a request as it is tried against each target in turn.
+  struct RequestContext;
+
+  /// Event loop used to drive asynchronous requests.
+  class AsyncLoop;
+
+  /// Steps of send_request, shared between the synchronous and asynchronous
+  /// paths.
+  ///
+  /// - init_request parses the URL and resolves the host, returning false if
+  ///   the URL is invalid.
+  /// - start_attempt sets up a pooled curl handle for the next target,
+  ///   returning false if there are no more targets to try.
+  /// - complete_attempt logs the result of an attempt, updates the resolver's
+  ///   blacklist and releases the curl handle, returning whether to try the
+  ///   next target.
+  /// - finish_request updates the load and communication monitors and
+  ///   returns the HTTP code for the request.
+  bool init_request(RequestContext& ctx);
+  bool start_attempt(RequestContext& ctx);
+  bool complete_attempt(RequestContext& ctx, CURLcode rc);
+  HTTPCode finish_request(RequestContext& ctx);
+
+  /// Releases the curl handle for an attempt that won't be completed (because
+  /// the event loop is shutting down, or another attempt has won a hedged
+  /// request).
+  void abort_attempt(RequestContext& ctx);
+
+  /// Runs the attempts for a request (in place of the loop in send_request),
+  /// sending it to the next target as well if an attempt takes longer than
+  /// the hedge delay.
+  void perform_hedged_request(RequestContext& ctx);
+
+  /// Returns the current hedge delay.
+  long hedge_delay_ms();
+
+  /// Gets a curl multi handle to drive a hedged request, and returns it to
+  /// the client afterwards.  The multi handles are kept for the lifetime of
+  /// the client, so that the connections in their connection caches are
+  /// reused by later requests.
+  CURLM* get_hedge_multi();
+  void release_hedge_multi(CURLM* multi);
+
+  /// Sends an asynchronous request via one of the event loops
+  void send_request_async(RequestType request_type,
+                          const std::string& url,
+                          const std::string& body,
+                          const std::string& username,
+                          SAS::TrailId trail,
+                          const std::vector<std::string>& headers_to_add,
+                          ResponseCallback callback);
+
+  /// Finishes an asynchronous request, invokes its callback and frees it
+  void complete_async_request(RequestContext* ctx);
+
+  /// Sends a request via one of the event loops and waits for the response
+  HTTPCode send_request_multiplexed(RequestType request_type,
+                                    const std::string& url,
+                                    const std::string& body,
+                                    std::string& doc,
+                                    const std::string& username,
+                                    SAS::TrailId trail,
+                                    const std::vector<std::string>& headers_to_add,
+                                    std::map<std::string, std::string>* response_headers);
+
   /// Helper function that builds the curl header in the set_curl_options
   /// method.
   struct curl_slist* build_headers(std::vector<std::string> headers_to_add,
@@ -362,4 +515,20 @@ private:
   SNMP::IPCountTable* _stat_table;
   HttpConnectionPool _conn_pool;
   bool _should_omit_body;
+
+  pthread_rwlock_t _async_loops_lock;
+  std::vector<AsyncLoop*> _async_loops;  // must access under _async_loops_lock
+  std::atomic<unsigned int> _next_async_loop;
+
+  // Hedging configuration.  _hedge_percentile is zero if hedging is
+  // disabled.
+  double _hedge_percentile;
+  long _min_hedge_delay_ms;
+
+  // Response times (in microseconds) of successful GET requests, used to
+  // calculate the hedge delay.
+  CurrentAndPrevious<Histogram> _hedge_latencies;
+
+  // Multi handles for hedged requests that aren't currently in use.
+  std::vector<CURLM*> _hedge_multis;  // must access under _lock
 };
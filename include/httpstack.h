@@ -15,6 +15,7 @@
 #include <pthread.h>
 #include <string>
 #include <set>
+#include <vector>
 
 #include <evhtp.h>
 
@@ -38,6 +39,31 @@ public:
     const int _rc;
   };
 
+  /// A read-only view of a contiguous range of bytes, used to access message
+  /// bodies without copying them.  The view doesn't own the bytes, so is only
+  /// valid for as long as the request it came from (and must not be used once
+  /// the request has been replied to).
+  class BodyView
+  {
+  public:
+    BodyView() : _data(NULL), _size(0) {}
+    BodyView(const char* data, size_t size) : _data(data), _size(size) {}
+
+    inline const char* data() const { return _data; }
+    inline size_t size() const { return _size; }
+    inline bool empty() const { return (_size == 0); }
+
+    /// @return    - A string containing a copy of the viewed bytes.
+    inline std::string to_string() const
+    {
+      return (_data != NULL) ? std::string(_data, _size) : std::string();
+    }
+
+  private:
+    const char* _data;
+    size_t _size;
+  };
+
   class Request
   {
   public:
@@ -86,6 +112,25 @@ public:
       evbuffer_add(_req->buffer_out, content.c_str(), content.length());
     }
 
+    /// Add content to the response, taking ownership of the string rather
+    /// than copying it (for large bodies).  The string is freed once the
+    /// response has been sent.
+    void add_content(std::string&& content);
+
+    /// Add content to the response without copying it.  The caller must
+    /// keep the data valid until cleanup is called, which happens once the
+    /// response has been sent.
+    ///
+    /// @param data    - The data to add.
+    /// @param len     - The length of the data.
+    /// @param cleanup - Function called when the data is no longer needed.
+    ///                  May be NULL if the data is static.
+    /// @param arg     - Argument passed to cleanup.
+    void add_content_reference(const char* data,
+                               size_t len,
+                               evbuffer_ref_cleanup_cb cleanup,
+                               void* arg);
+
     void add_header(const std::string& name, const std::string& value)
     {
       evhtp_header_t* new_header = evhtp_header_new(name.c_str(),
@@ -143,10 +188,24 @@ public:
     std::string get_rx_header();
     std::string get_rx_body();
 
+    /// Get the request body without copying it.  The body is made contiguous
+    /// in the request's buffer if it isn't already.
+    BodyView get_rx_body_view();
+
+    /// Get the request body as the segments it was received in, without
+    /// copying or rearranging it.
+    std::vector<BodyView> get_rx_body_segments();
+
+    /// @return    - The length of the request body.
+    size_t get_rx_body_length();
+
     std::string get_tx_message(int rc);
     std::string get_tx_header(int rc);
     std::string get_tx_body();
 
+    /// @return    - The length of the response body added so far.
+    size_t get_tx_body_length();
+
     bool get_remote_ip_port(std::string& ip, unsigned short& port);
     bool get_local_ip_port(std::string& ip, unsigned short& port);
     bool get_x_real_ip_port(std::string& ip, unsigned short& port);
@@ -413,6 +472,19 @@ public:
             StatsInterface* stats = NULL);
   virtual ~HttpStack();
 
+  /// Use a separate listening socket for each thread, rather than a single
+  /// listening socket whose connections are passed to the worker threads.
+  ///
+  /// In this mode each thread has its own event base and evhtp instance, and
+  /// bind_tcp_socket() opens an SO_REUSEPORT socket for each of them, so the
+  /// kernel spreads incoming connections across the threads.  This avoids
+  /// the single accepting thread becoming a bottleneck when there are lots of
+  /// new connections.  Unix sockets are only served by the first thread.
+  ///
+  /// This must be called before initialize().  In this mode the init_cb
+  /// passed to start() is called on each thread with a NULL evthr_t.
+  virtual void use_reuseport_listeners();
+
   virtual void initialize();
   virtual void bind_tcp_socket(const std::string& bind_address,
                                unsigned short port);
@@ -445,6 +517,33 @@ private:
   void handler_callback(evhtp_request_t* req, HandlerInterface* handler);
   void event_base_thread_fn();
 
+  // State for each thread when using SO_REUSEPORT listeners.
+  struct Listener
+  {
+    HttpStack* stack;
+    evbase_t* evbase;
+    evhtp_t* evhtp;
+    pthread_t thread;
+  };
+
+  static void* listener_thread_fn(void* listener_ptr);
+
+  // Returns all the evhtp instances that handlers must be registered with.
+  std::vector<evhtp_t*> evhtp_instances();
+
+  // Binds an evhtp instance to an address using an SO_REUSEPORT socket.
+  // The address is in the format passed to evhtp_bind_socket.  Returns 0 on
+  // success.
+  int bind_reuseport_socket(evhtp_t* evhtp,
+                            const std::string& address,
+                            unsigned short port);
+
+  // Binds all the evhtp instances to an address, throwing an exception on
+  // failure.
+  void bind_all(const std::string& address,
+                unsigned short port,
+                const char* description);
+
   // Don't implement the following, to avoid copies of this instance.
   HttpStack(HttpStack const&);
   void operator=(HttpStack const&);
@@ -460,6 +559,12 @@ private:
   evhtp_t* _evhtp;
   pthread_t _event_base_thread;
 
+  // When using SO_REUSEPORT listeners, there is a Listener for each thread.
+  // The first uses _evbase and _evhtp.
+  bool _reuseport;
+  std::vector<Listener> _listeners;
+  evhtp_thread_init_cb _init_cb;
+
   static bool _ev_using_pthreads;
 
   // Helper structure used to register handlers with libevhtp, while also
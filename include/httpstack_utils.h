@@ -17,6 +17,7 @@
 #include "zmq_lvc.h"
 #include "accumulator.h"
 #include "counter.h"
+#include "snmp_event_histogram_table.h"
 
 namespace HttpStackUtils
 {
@@ -270,7 +271,8 @@ namespace HttpStackUtils
   ///
   /// Implementation of StatsInterface to trivially map through to 3 statistics.
   /// Statistics names can be specified as parameters on the constructor, or just
-  /// default.
+  /// default.  Latencies can also be fed to an SNMP histogram table, to report
+  /// latency percentiles.
   class SimpleStatsManager : public HttpStack::StatsInterface
   {
   public:
@@ -280,13 +282,26 @@ namespace HttpStackUtils
                        const std::string rejected_overload = "http_rejected_overload") :
       _stat_latency_us(latency_us, stats_aggregator),
       _stat_incoming_requests(incoming_requests, stats_aggregator),
-      _stat_rejected_overload(rejected_overload, stats_aggregator)
+      _stat_rejected_overload(rejected_overload, stats_aggregator),
+      _latency_histogram(NULL)
     {}
 
+    /// Also record latencies in the specified histogram table.  The table is
+    /// not owned by the stats manager.
+    void set_latency_histogram(SNMP::EventHistogramTable* latency_histogram)
+    {
+      _latency_histogram = latency_histogram;
+    }
+
   private:
     virtual void update_http_latency_us(unsigned long latency_us)
     {
       _stat_latency_us.accumulate(latency_us);
+
+      if (_latency_histogram != NULL)
+      {
+        _latency_histogram->accumulate(latency_us);
+      }
     }
     virtual void incr_http_incoming_requests()
     {
@@ -300,6 +315,7 @@ namespace HttpStackUtils
     StatisticAccumulator _stat_latency_us;
     StatisticCounter _stat_incoming_requests;
     StatisticCounter _stat_rejected_overload;
+    SNMP::EventHistogramTable* _latency_histogram;
   };
 
 } // namespace HttpStackUtils
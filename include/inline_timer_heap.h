@@ -0,0 +1,275 @@
+/**
+ * @file inline_timer_heap.h d-ary timer heap with the pop times stored inline.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef INLINE_TIMER_HEAP_H
+#define INLINE_TIMER_HEAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#include "timer_heap.h"
+
+/// Interface for a timer which can be used in an InlineTimerHeap.  This is
+/// also a HeapableTimer, so the same timer class can be used with either an
+/// InlineTimerHeap or a TimerHeap.
+class InlineHeapableTimer : public HeapableTimer
+{
+public:
+  virtual ~InlineHeapableTimer() = default;
+
+  /// InlineTimerHeap which this timer is in, or NULL if it isn't currently
+  /// in one.
+  ///
+  /// InlineTimerHeap::insert is responsible for updating this field.
+  const void* _inline_heap = nullptr;
+
+  // The position of this timer in the heap's array.  The InlineTimerHeap is
+  // responsible for keeping this up-to-date.
+  size_t _inline_heap_index = 0;
+};
+
+/// Alternative to TimerHeap with the same insert/remove/rebalance/
+/// get_next_timer contract, optimized for large numbers of timers.
+///
+/// The heap is an array of (pop time, timer) pairs, so comparisons never
+/// need to call get_pop_time() on (and so load) the timers themselves.  Each
+/// node has ARITY children, which makes the heap shallower than a binary
+/// heap, and the array is laid out so that each node's children share a
+/// cache line (or with an ARITY of 8, a pair of cache lines).
+///
+/// Because the pop time is copied into the heap, rebalance() must be called
+/// whenever a timer's pop time changes.
+template <unsigned int ARITY = 4>
+class InlineTimerHeap
+{
+public:
+  InlineTimerHeap() :
+    _entries(nullptr),
+    _capacity(0),
+    _size(0)
+  {}
+
+  ~InlineTimerHeap()
+  {
+    free(_entries); _entries = nullptr;
+  }
+
+  InlineTimerHeap(const InlineTimerHeap&) = delete;
+  InlineTimerHeap& operator=(const InlineTimerHeap&) = delete;
+
+  /// Adds a timer to the heap.  This doesn't take ownership of the timer's
+  /// memory.
+  ///
+  /// Does nothing if this timer is already in the heap.
+  ///
+  /// @param t Timer to insert
+  void insert(InlineHeapableTimer* t)
+  {
+    if (t->_inline_heap != this)
+    {
+      if (_size == _capacity)
+      {
+        grow();
+      }
+
+      size_t index = _size++;
+      entry(index).pop_time = t->get_pop_time();
+      entry(index).timer = t;
+      t->_inline_heap = this;
+      sift_up(index);
+    }
+  }
+
+  /// Removes a timer from the heap.  This does not free the timer's memory.
+  ///
+  /// @param t Timer to remove.
+  ///
+  /// @returns True if the timer was removed, False if the timer was not in
+  /// the heap.
+  bool remove(InlineHeapableTimer* t)
+  {
+    if (t->_inline_heap == this)
+    {
+      size_t index = t->_inline_heap_index;
+      t->_inline_heap = nullptr;
+      --_size;
+
+      if (index != _size)
+      {
+        // Fill the hole with the last entry, and move that to the right place.
+        entry(index) = entry(_size);
+        entry(index).timer->_inline_heap_index = index;
+        restore(index);
+      }
+
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  /// Moves the timer to the right place in the heap.  Must be called after
+  /// changing a timer's pop time.
+  ///
+  /// @param t The timer to move to the right place in the heap.
+  void rebalance(InlineHeapableTimer* t)
+  {
+    if (t->_inline_heap == this)
+    {
+      size_t index = t->_inline_heap_index;
+      entry(index).pop_time = t->get_pop_time();
+      restore(index);
+    }
+  }
+
+  /// Returns the timer which will pop next, or NULL if the heap is empty.
+  /// This does not remove the timer from the heap.
+  InlineHeapableTimer* get_next_timer() const
+  {
+    return (_size == 0) ? nullptr : entry(0).timer;
+  }
+
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+private:
+  struct Entry
+  {
+    uint64_t pop_time;
+    InlineHeapableTimer* timer;
+  };
+
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  // The root is stored at array position ARITY - 1, so that the children of
+  // every node start at a multiple of ARITY (and so at the start of a cache
+  // line).
+  static const size_t OFFSET = ARITY - 1;
+
+  inline Entry& entry(size_t index) { return _entries[index + OFFSET]; }
+  inline const Entry& entry(size_t index) const { return _entries[index + OFFSET]; }
+
+  /// Whether pop time a is before pop time b, allowing for overflow in the
+  /// same way as TimerHeap.
+  static inline bool pops_before(uint64_t a, uint64_t b)
+  {
+    return ((a - b) > ((uint64_t)(1) << 63));
+  }
+
+  /// Moves the entry at the given index up or down to the right place.
+  void restore(size_t index)
+  {
+    if ((index > 0) &&
+        (pops_before(entry(index).pop_time, entry((index - 1) / ARITY).pop_time)))
+    {
+      sift_up(index);
+    }
+    else
+    {
+      sift_down(index);
+    }
+  }
+
+  void sift_up(size_t index)
+  {
+    Entry moving = entry(index);
+
+    while (index > 0)
+    {
+      size_t parent = (index - 1) / ARITY;
+
+      if (!pops_before(moving.pop_time, entry(parent).pop_time))
+      {
+        break;
+      }
+
+      entry(index) = entry(parent);
+      entry(index).timer->_inline_heap_index = index;
+      index = parent;
+    }
+
+    entry(index) = moving;
+    moving.timer->_inline_heap_index = index;
+  }
+
+  void sift_down(size_t index)
+  {
+    Entry moving = entry(index);
+
+    while (true)
+    {
+      size_t first_child = index * ARITY + 1;
+
+      if (first_child >= _size)
+      {
+        break;
+      }
+
+      // Find the child that pops first.
+      size_t last_child = first_child + ARITY;
+      last_child = (last_child < _size) ? last_child : _size;
+      size_t best = first_child;
+
+      for (size_t child = first_child + 1; child < last_child; ++child)
+      {
+        if (pops_before(entry(child).pop_time, entry(best).pop_time))
+        {
+          best = child;
+        }
+      }
+
+      if (!pops_before(entry(best).pop_time, moving.pop_time))
+      {
+        break;
+      }
+
+      entry(index) = entry(best);
+      entry(index).timer->_inline_heap_index = index;
+      index = best;
+    }
+
+    entry(index) = moving;
+    moving.timer->_inline_heap_index = index;
+  }
+
+  void grow()
+  {
+    size_t capacity = (_capacity == 0) ? 64 : (_capacity * 2);
+    void* entries = nullptr;
+
+    if (posix_memalign(&entries,
+                       CACHE_LINE_SIZE,
+                       (capacity + OFFSET) * sizeof(Entry)) != 0)
+    {
+      throw std::bad_alloc(); // LCOV_EXCL_LINE
+    }
+
+    if (_entries != nullptr)
+    {
+      memcpy(entries, _entries, (_size + OFFSET) * sizeof(Entry));
+      free(_entries);
+    }
+
+    _entries = (Entry*)entries;
+    _capacity = capacity;
+  }
+
+  Entry* _entries;
+  size_t _capacity;
+  size_t _size;
+};
+
+#endif
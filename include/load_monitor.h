@@ -14,25 +14,42 @@
 
 #include <time.h>
 #include <pthread.h>
+#include <atomic>
 #include "snmp_continuous_accumulator_table.h"
 #include "snmp_abstract_scalar.h"
+#include "sharded_statistics.h"
 #include "sas.h"
 
+/// A token bucket that tokens can be taken from without locking.
+///
+/// This is implemented as a generic cell rate algorithm (GCRA).  Rather than
+/// storing a token count that must be replenished, the bucket stores the time
+/// at which it was (or will be) empty.  The number of tokens in the bucket is
+/// then the time since that point multiplied by the rate, up to the maximum
+/// size, and taking a token moves that time forward by one token's worth.
+/// Both operations are a single atomic compare-and-swap.
 class TokenBucket
 {
   public:
     TokenBucket(int s, float r);
-    float rate;
-    int max_size;
-    bool get_token();
+    const int max_size;
+    bool get_token(float* tokens_remaining = NULL);
     void update_rate(float new_rate);
-    inline float token_count() { return tokens; }
+    float token_count();
+    inline float get_rate() { return _rate.load(); }
   private:
-    timespec replenish_time;
-    float tokens;
-    void replenish_bucket();
+    static int64_t get_time_ns();
+    static int64_t get_token_interval_ns(float rate);
+    std::atomic<float> _rate;
+    std::atomic<int64_t> _empty_time_ns;
 };
 
+/// Admission control based on the latency of requests.
+///
+/// Admitting a request and recording its latency don't take any locks.  The
+/// latencies are accumulated in sharded counters, and the smoothed latency
+/// and token rate are recalculated periodically by whichever thread first
+/// notices that an adjustment is due.
 class LoadMonitor
 {
   public:
@@ -52,11 +69,19 @@ class LoadMonitor
 
     int get_target_latency() { return target_latency; }
     int get_current_latency() { return smoothed_latency; }
-    float get_rate_limit() { return bucket.rate; }
+    float get_rate_limit() { return bucket.get_rate(); }
 
   private:
-    // This must be held when accessing any of this object's member variables.
-     pthread_mutex_t _lock;
+    // Recalculate the smoothed latency and the token rate.  Must be called
+    // with _adjust_lock held.
+    void adjust_rate(unsigned long current_time_ms);
+
+    static unsigned long get_time_ms();
+
+    // This must be held when adjusting the token rate, and protects the
+    // non-atomic member variables below.  It is only ever taken with a
+    // trylock, so threads never block on it.
+    pthread_mutex_t _adjust_lock;
 
      // Number of requests processed before each adjustment of token bucket rate
      int REQUESTS_BEFORE_ADJUSTMENT;
@@ -69,15 +94,20 @@ class LoadMonitor
     float INCREASE_THRESHOLD;
     float INCREASE_FACTOR;
 
-    int accepted;
-    int rejected;
-    int penalties;
-    int pending_count;
-    int max_pending_count;
+    // Counts since the last adjustment.  These are updated on every request,
+    // so are sharded.
+    ShardedCounter accepted;
+    ShardedCounter rejected;
+    ShardedCounter penalties;
+    ShardedCounter latency_count;
+    ShardedCounter latency_sum;
+
+    // The number of penalties in the last adjustment period, for statistics.
+    int last_penalties;
+
     int target_latency;
-    int smoothed_latency;
-    int adjust_count;
-    unsigned long last_adjustment_time_ms;
+    std::atomic_int smoothed_latency;
+    std::atomic_ulong last_adjustment_time_ms;
     float min_token_rate;
     TokenBucket bucket;
     SNMP::AbstractContinuousAccumulatorTable* _token_rate_table;
@@ -13,6 +13,7 @@
 #define LOCALSTORE_H__
 
 #include <map>
+#include <vector>
 #include <pthread.h>
 
 #include "store.h"
@@ -43,6 +44,14 @@ public:
   Store::Status delete_data(const std::string& table,
                             const std::string& key,
                             SAS::TrailId trail = 0);
+
+  /// Reads/writes all the keys under a single acquisition of the lock.
+  void get_data_multi(const std::string& table,
+                      std::vector<Store::GetRequest>& requests,
+                      SAS::TrailId trail = 0);
+  void set_data_multi(const std::string& table,
+                      std::vector<Store::SetRequest>& requests,
+                      SAS::TrailId trail = 0);
 private:
   typedef struct record
   {
@@ -50,6 +59,19 @@ private:
     uint32_t expiry;
     uint64_t cas;
   } Record;
+
+  // Helpers that read and write a single record.  These must be called with
+  // _db_lock held.
+  Store::Status get_record(std::map<std::string, Record>& db,
+                           const std::string& fqkey,
+                           std::string& data,
+                           uint64_t& cas,
+                           uint32_t now);
+  Store::Status set_record(const std::string& fqkey,
+                           const std::string& data,
+                           uint64_t cas,
+                           int expiry,
+                           uint32_t now);
   bool _data_contention_flag;
   pthread_mutex_t _db_lock;
   std::map<std::string, Record> _db;
@@ -0,0 +1,544 @@
+/**
+ * @file lockfree_eventq.h Template definition for a lock-free event queue
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef LOCKFREE_EVENTQ__
+#define LOCKFREE_EVENTQ__
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <atomic>
+#include <vector>
+
+#include "log.h"
+
+/// A bounded multi-producer/multi-consumer event queue built on a ring buffer
+/// of sequenced slots.
+///
+/// This offers the same interface and semantics as eventq (open/close,
+/// terminate, blocking and non-blocking push, timed pop and deadlock
+/// detection), but the fast path of push and pop is a single compare-and-swap
+/// on the head or tail index, so producers and consumers never serialize on a
+/// mutex.  Threads only sleep (on a futex) when the queue is empty (readers)
+/// or full (writers), and are only woken if they are actually waiting.
+///
+/// Because the ring is a fixed size, a max_queue of zero (which means
+/// "unlimited" for eventq) selects DEFAULT_CAPACITY rather than an unbounded
+/// queue.  There is no peek() as an item cannot be safely copied out of the
+/// ring without claiming it.
+template<class T>
+class lockfree_eventq
+{
+public:
+  static const unsigned int DEFAULT_CAPACITY = 65536;
+
+  /// Create an event queue.
+  ///
+  /// @param max_queue maximum size of event queue, zero selects
+  ///                  DEFAULT_CAPACITY.
+  lockfree_eventq(unsigned int max_queue=0, bool open=true) :
+    _capacity((max_queue != 0) ? max_queue : (unsigned int)DEFAULT_CAPACITY),
+    _slots(new Slot[_capacity]),
+    _enqueue_pos(0),
+    _dequeue_pos(0),
+    _open(open),
+    _terminated(false),
+    _writers(0),
+    _readers(0),
+    _w_seq(0),
+    _r_seq(0),
+    _deadlock_threshold(0),
+    _service_time_ms(0)
+  {
+    for (size_t ii = 0; ii < _capacity; ++ii)
+    {
+      _slots[ii].seq.store(ii, std::memory_order_relaxed);
+    }
+  }
+
+  ~lockfree_eventq()
+  {
+    delete[] _slots;
+  }
+
+  /// Open the queue for new inputs.
+  void open()
+  {
+    _open.store(true);
+  }
+
+  /// Close the queue to new inputs.
+  void close()
+  {
+    _open.store(false);
+  }
+
+  /// Send a termination signal via the queue.
+  void terminate()
+  {
+    _terminated.store(true);
+
+    // Wake all waiting readers so they see the termination.  Writers are
+    // woken too, so they don't sit on a full queue that nobody will drain.
+    _r_seq.fetch_add(1);
+    futex_wake(&_r_seq, INT32_MAX);
+    _w_seq.fetch_add(1);
+    futex_wake(&_w_seq, INT32_MAX);
+  }
+
+  /// Indicates whether the queue has been terminated.
+  bool is_terminated()
+  {
+    return _terminated.load();
+  }
+
+  /// Enables deadlock detection on the queue with the specified threshold
+  /// (in milliseconds).
+  void set_deadlock_threshold(unsigned long threshold_ms)
+  {
+    // Set the service time to the current time as we don't update it while
+    // detection is disabled.
+    _service_time_ms.store(now_ms());
+    _deadlock_threshold.store(threshold_ms);
+  }
+
+  /// Returns the deadlocked state of the queue.
+  bool is_deadlocked()
+  {
+    bool deadlocked = false;
+    unsigned long threshold = _deadlock_threshold.load();
+
+    if ((threshold > 0) && (size() > 0))
+    {
+      // Deadlock detection is enabled, and the queue is not empty, so check
+      // how long it has been since the queue was last serviced.
+      uint64_t service_time = _service_time_ms.load();
+      uint64_t now_time = now_ms();
+
+      // Check that the current time is greater than the last serviced time -
+      // if it's not then we can't be deadlocked.
+      if ((now_time > service_time) &&
+          ((now_time - service_time) > threshold))
+      {
+        TRC_ERROR("Queue is deadlocked - service delay %ld > threshold %ld",
+                  now_time - service_time, threshold);
+        deadlocked = true;
+      }
+    }
+
+    return deadlocked;
+  }
+
+  /// Purges all the events currently in the queue.
+  void purge()
+  {
+    T item;
+    while (try_dequeue(item))
+    {
+    }
+  }
+
+  /// Push an item on to the event queue.
+  ///
+  /// This may block if the queue is full, and will fail if the queue is closed.
+  bool push(T item)
+  {
+    if (!_open.load())
+    {
+      return false;
+    }
+
+    while (!try_enqueue(item))
+    {
+      if (_terminated.load())
+      {
+        // Nobody is going to drain the queue, so don't block forever.
+        return false;
+      }
+
+      // Queue is full, so writer must block until a reader frees a slot.
+      _writers.fetch_add(1);
+      int seq = _w_seq.load();
+      if (full() && !_terminated.load())
+      {
+        futex_wait(&_w_seq, seq, NULL);
+      }
+      _writers.fetch_sub(1);
+    }
+
+    return true;
+  }
+
+  /// Push an item on to the event queue.
+  ///
+  /// This will not block, but may discard the event if the queue is full.
+  bool push_noblock(T item)
+  {
+    return (_open.load() && try_enqueue(item));
+  }
+
+  /// Push a range of items on to the event queue.
+  ///
+  /// This may block if the queue is full, and will fail if the queue is
+  /// closed.  As with push, each item is claimed with a single
+  /// compare-and-swap so there is no lock to amortize.
+  template<class InputIterator>
+  bool push_bulk(InputIterator begin, InputIterator end)
+  {
+    bool rc = _open.load();
+
+    while ((rc) && (begin != end))
+    {
+      rc = push(*begin);
+      ++begin;
+    }
+
+    return rc;
+  }
+
+  /// Pop an item from the event queue, waiting indefinitely if it is empty.
+  bool pop(T& item)
+  {
+    dequeue_wait(item);
+    return !_terminated.load();
+  }
+
+  /// Pop an item from the event queue, waiting for the specified timeout if
+  /// the queue is empty.
+  ///
+  /// @param timeout Maximum time to wait in milliseconds.
+  bool pop(T& item, int timeout)
+  {
+    if ((!try_dequeue(item)) && (timeout != 0))
+    {
+      // The queue is empty and the timeout is non-zero, so wait for
+      // something to arrive.
+      struct timespec attime;
+      if (timeout != -1)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &attime);
+        attime.tv_sec += timeout / 1000;
+        attime.tv_nsec += ((timeout % 1000) * 1000000);
+        if (attime.tv_nsec >= 1000000000)
+        {
+          attime.tv_nsec -= 1000000000;
+          attime.tv_sec += 1;
+        }
+      }
+
+      while (!_terminated.load())
+      {
+        struct timespec reltime;
+        struct timespec* reltime_p = NULL;
+
+        if (timeout != -1)
+        {
+          // Futex timeouts are relative, so work out how long is left.
+          struct timespec now;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          reltime.tv_sec = attime.tv_sec - now.tv_sec;
+          reltime.tv_nsec = attime.tv_nsec - now.tv_nsec;
+          if (reltime.tv_nsec < 0)
+          {
+            reltime.tv_nsec += 1000000000;
+            reltime.tv_sec -= 1;
+          }
+          if (reltime.tv_sec < 0)
+          {
+            break;
+          }
+          reltime_p = &reltime;
+        }
+
+        _readers.fetch_add(1);
+        int seq = _r_seq.load();
+        if (empty() && !_terminated.load())
+        {
+          futex_wait(&_r_seq, seq, reltime_p);
+        }
+        _readers.fetch_sub(1);
+
+        if (try_dequeue(item))
+        {
+          break;
+        }
+      }
+    }
+
+    return !_terminated.load();
+  }
+
+  /// Pop up to max_items items from the event queue, waiting indefinitely if
+  /// it is empty.  The items are appended to the supplied vector.
+  bool pop_batch(std::vector<T>& items, unsigned int max_items)
+  {
+    T item;
+
+    if (dequeue_wait(item))
+    {
+      items.push_back(item);
+
+      for (unsigned int popped = 1;
+           (popped < max_items) && (try_dequeue(item));
+           ++popped)
+      {
+        items.push_back(item);
+      }
+    }
+
+    return !_terminated.load();
+  }
+
+  int size() const
+  {
+    size_t enqueue_pos = _enqueue_pos.load(std::memory_order_relaxed);
+    size_t dequeue_pos = _dequeue_pos.load(std::memory_order_relaxed);
+    return (enqueue_pos > dequeue_pos) ? (int)(enqueue_pos - dequeue_pos) : 0;
+  }
+
+private:
+
+  // Each slot carries a sequence number which tells producers and consumers
+  // whether the slot is free for the lap of the ring they are on.  A slot at
+  // index i is free for the producer at position pos when seq == pos, and
+  // holds an item for the consumer at position pos when seq == pos + 1.
+  struct Slot
+  {
+    std::atomic<size_t> seq;
+    T item;
+  };
+
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  // Dequeue an item, waiting indefinitely if the queue is empty.
+  //
+  // @return whether an item was dequeued (false if the queue was terminated
+  //         while empty).
+  bool dequeue_wait(T& item)
+  {
+    bool got_item;
+
+    while ((!(got_item = try_dequeue(item))) && (!_terminated.load()))
+    {
+      // The queue is empty, so wait for something to arrive.
+      _readers.fetch_add(1);
+      int seq = _r_seq.load();
+      if (empty() && !_terminated.load())
+      {
+        futex_wait(&_r_seq, seq, NULL);
+      }
+      _readers.fetch_sub(1);
+    }
+
+    return got_item;
+  }
+
+  bool try_enqueue(T& item)
+  {
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    while (true)
+    {
+      slot = &_slots[pos % _capacity];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+      if (diff == 0)
+      {
+        // The slot is free - try to claim it.
+        if (_enqueue_pos.compare_exchange_weak(pos,
+                                               pos + 1,
+                                               std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        // The slot still holds an item from the previous lap, so the queue
+        // is full.
+        return false;
+      }
+      else
+      {
+        // Another producer got here first.
+        pos = _enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    if ((_deadlock_threshold.load(std::memory_order_relaxed) > 0) &&
+        (pos == _dequeue_pos.load(std::memory_order_relaxed)))
+    {
+      // Deadlock detection is enabled, and we're about to push an item on
+      // to an empty queue, so update the service time to the current time.
+      // This is done to avoid false positives when the system has been idle
+      // for a while.
+      _service_time_ms.store(now_ms(), std::memory_order_relaxed);
+    }
+
+    slot->item = item;
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    // Are there any readers waiting?  The fence pairs with the increment of
+    // _readers in pop, so either we see the reader or it sees our item.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_readers.load(std::memory_order_relaxed) > 0)
+    {
+      _r_seq.fetch_add(1);
+      futex_wake(&_r_seq, 1);
+    }
+
+    return true;
+  }
+
+  bool try_dequeue(T& item)
+  {
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    while (true)
+    {
+      slot = &_slots[pos % _capacity];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+      if (diff == 0)
+      {
+        // The slot holds an item - try to claim it.
+        if (_dequeue_pos.compare_exchange_weak(pos,
+                                               pos + 1,
+                                               std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        // The queue is empty.
+        return false;
+      }
+      else
+      {
+        // Another consumer got here first.
+        pos = _dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    item = slot->item;
+    slot->item = T();
+
+    // Mark the slot free for the producer on the next lap of the ring.
+    slot->seq.store(pos + _capacity, std::memory_order_release);
+
+    if (_deadlock_threshold.load(std::memory_order_relaxed) > 0)
+    {
+      // Deadlock detection is enabled, so record the time we popped an
+      // item off the queue.
+      _service_time_ms.store(now_ms(), std::memory_order_relaxed);
+    }
+
+    // Are there blocked writers?
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_writers.load(std::memory_order_relaxed) > 0)
+    {
+      _w_seq.fetch_add(1);
+      futex_wake(&_w_seq, 1);
+    }
+
+    return true;
+  }
+
+  bool empty() const
+  {
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    size_t seq = _slots[pos % _capacity].seq.load(std::memory_order_acquire);
+    return ((intptr_t)seq - (intptr_t)(pos + 1) < 0);
+  }
+
+  bool full() const
+  {
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    size_t seq = _slots[pos % _capacity].seq.load(std::memory_order_acquire);
+    return ((intptr_t)seq - (intptr_t)pos < 0);
+  }
+
+  static uint64_t now_ms()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+  }
+
+  // Sleep on the futex word as long as it still holds the expected value.
+  static void futex_wait(std::atomic<int>* word,
+                         int expected,
+                         const struct timespec* reltime)
+  {
+    static_assert(sizeof(std::atomic<int>) == sizeof(int),
+                  "std::atomic<int> must be usable as a futex word");
+    syscall(SYS_futex,
+            reinterpret_cast<int*>(word),
+            FUTEX_WAIT_PRIVATE,
+            expected,
+            reltime,
+            NULL,
+            0);
+  }
+
+  static void futex_wake(std::atomic<int>* word, int count)
+  {
+    syscall(SYS_futex,
+            reinterpret_cast<int*>(word),
+            FUTEX_WAKE_PRIVATE,
+            count,
+            NULL,
+            NULL,
+            0);
+  }
+
+  const size_t _capacity;
+  Slot* _slots;
+
+  // The producer and consumer indices live on separate cache lines so that
+  // producers and consumers don't false-share.
+  char _pad0[CACHE_LINE_SIZE];
+  std::atomic<size_t> _enqueue_pos;
+  char _pad1[CACHE_LINE_SIZE];
+  std::atomic<size_t> _dequeue_pos;
+  char _pad2[CACHE_LINE_SIZE];
+
+  std::atomic<bool> _open;
+  std::atomic<bool> _terminated;
+
+  // Number of writers/readers currently waiting, and the futex words they
+  // wait on.  The words are bumped before every wake so that a waiter which
+  // read the old value never sleeps through a wake-up.
+  std::atomic<int> _writers;
+  std::atomic<int> _readers;
+  std::atomic<int> _w_seq;
+  std::atomic<int> _r_seq;
+
+  // Deadlock detection threshold (in milliseconds).  Zero means deadlock
+  // detection is disabled.
+  std::atomic<unsigned long> _deadlock_threshold;
+
+  // The last time the queue was serviced, in milliseconds on the monotonic
+  // clock.  As for eventq, this is reset whenever an item is placed on to an
+  // empty queue, and is only maintained when deadlock detection is enabled.
+  std::atomic<uint64_t> _service_time_ms;
+};
+
+#endif
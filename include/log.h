@@ -15,6 +15,8 @@
 
 #include "logger.h"
 #include <cstdarg>
+#include <cstddef>
+#include <stdint.h>
 
 #define TRC_ERROR(...) if (Log::enabled(Log::ERROR_LEVEL)) Log::write(Log::ERROR_LEVEL, __FILE__, __LINE__, __VA_ARGS__)
 #define TRC_WARNING(...) if (Log::enabled(Log::WARNING_LEVEL)) Log::write(Log::WARNING_LEVEL, __FILE__, __LINE__, __VA_ARGS__)
@@ -51,6 +53,19 @@ namespace Log
   void _write(int level, const char *module, int line_number, const char *fmt, va_list args);
   void backtrace(const char *fmt, ...);
   void commit();
+
+  // Asynchronous logging.  When enabled, each thread formats its log lines
+  // into its own lock-free buffer (of the specified size in bytes) and a
+  // background thread batches them into large writes to the Logger.  Lines
+  // are dropped (and counted) if a thread's buffer is full.
+  //
+  // Each thread's lines are written in order, but lines from different
+  // threads that are logged within a few milliseconds of each other may be
+  // written out of order.  The timestamp on each line is the time it was
+  // logged.
+  void startAsyncLogging(size_t buffer_size = 1024 * 1024);
+  void stopAsyncLogging();
+  uint64_t asyncLogDrops();
 }
 
 #endif
@@ -17,6 +17,7 @@
 
 #include <string>
 #include <pthread.h>
+#include <time.h>
 
 class Logger
 {
@@ -34,6 +35,24 @@ public:
   virtual void flush();
   virtual void commit();
 
+  // Writes a block of complete log lines (which already include any
+  // timestamps) to the log file with a single write, cycling or opening the
+  // log file when necessary.  Used by asynchronous logging to batch lines.
+  virtual void write_batch(const char* data, size_t length);
+
+  // Writes a block of complete log lines without taking the lock or cycling
+  // the log file.  Like backtrace, this is not thread-safe and should only be
+  // used on the crash path.
+  virtual void write_batch_unlocked(const char* data, size_t length);
+
+  // Formats the specified (real) time as the timestamp prefix that is added to
+  // each log line when ADD_TIMESTAMPS is set.  buf must be at least
+  // MAX_TIMESTAMP_LENGTH bytes long.
+  //
+  // @returns the length of the timestamp prefix.
+  static const int MAX_TIMESTAMP_LENGTH = 100;
+  static int format_timestamp(const struct timespec& time, char* buf);
+
   // Dumps a backtrace.  Note that this is not thread-safe and should only be
   // called when no other threads are running - generally from a signal
   // handler.
@@ -58,7 +77,11 @@ private:
   } timestamp_t;
 
   void get_timestamp(timestamp_t& ts);
+  static void timespec_to_timestamp(const struct timespec& time, timestamp_t& ts);
+  static int format_timestamp(const timestamp_t& ts, char* buf);
+  bool check_log_file(const timestamp_t& ts);
   void write_log_file(const char* data, const timestamp_t& ts);
+  void write_log_file(const char* data, size_t length);
   void cycle_log_file(const timestamp_t& ts);
 
   // Two methods to use with pthread_cleanup_push to release the lock if the logging thread is
@@ -15,6 +15,7 @@
 
 #include <pthread.h>
 
+#include <map>
 #include <sstream>
 #include <vector>
 
@@ -32,6 +33,7 @@ extern "C" {
 #include "communicationmonitor.h"
 #include "astaire_resolver.h"
 #include "memcached_connection_pool.h"
+#include "threadpool.h"
 
 class BaseMemcachedStore : public Store
 {
@@ -87,6 +89,14 @@ protected:
                                       std::string& data,
                                       uint64_t& cas);
 
+  // Perform a get request for several keys to a single replica.  The keys are
+  // all requested in a single pipelined mget (which uses quiet get operations
+  // when the binary protocol is in use).  Records that are found are returned
+  // in `found` as (data, CAS) pairs indexed on key.
+  memcached_return_t get_multi_from_replica(memcached_st* replica,
+                                            const std::vector<std::string>& keys,
+                                            std::map<std::string, std::pair<std::string, uint64_t> >& found);
+
   // Add a record to memcached. This overwrites any tombstone record already
   // stored, but fails if any real data is stored.
   memcached_return_t add_overwriting_tombstone(memcached_st* replica,
@@ -127,7 +137,35 @@ public:
                                 bool remote_store,
                                 BaseCommunicationMonitor* comm_monitor = NULL);
 
-  ~TopologyNeutralMemcachedStore() {}
+  ~TopologyNeutralMemcachedStore();
+
+  /// Configure hedged reads and parallel writes.
+  ///
+  /// By default a read is sent to one target at a time, only moving on to
+  /// the next target if the previous one fails, so a slow target delays the
+  /// whole read.  Once hedging is configured, reads are also sent to the next
+  /// target if the earlier ones haven't answered within the hedge delay, and
+  /// the first definitive answer is used.  The latency of a read then tracks
+  /// the fastest target rather than the sum of the attempts.
+  ///
+  /// Writes are never hedged (as the ADD/CAS semantics don't allow a write
+  /// to be made to two targets at once), but the keys in a set_data_multi
+  /// are written in parallel.
+  ///
+  /// The attempts are made on a pool of worker threads.  This must be called
+  /// before the store is used, and only once.
+  ///
+  /// @param exception_handler - Exception handler for the worker threads.
+  /// @param num_threads       - The number of worker threads.
+  /// @param hedge_delay_ms    - How long to wait for a target before sending
+  ///                            the read to the next one.  0 => send the read
+  ///                            to max_parallel targets immediately.
+  /// @param max_parallel      - The maximum number of targets that a read is
+  ///                            outstanding on at once.
+  void configure_hedging(ExceptionHandler* exception_handler,
+                         unsigned int num_threads,
+                         unsigned int hedge_delay_ms,
+                         unsigned int max_parallel = 2);
 
   /// Gets the data for the specified table and key.
   Store::Status get_data(const std::string& table,
@@ -149,6 +187,18 @@ public:
                             const std::string& key,
                             SAS::TrailId trail = 0);
 
+  /// Gets the data for several keys in one round trip to the proxy.
+  void get_data_multi(const std::string& table,
+                      std::vector<Store::GetRequest>& requests,
+                      SAS::TrailId trail = 0);
+
+  /// Sets the data for several keys.  The targets are resolved once for the
+  /// whole batch, but each key is written with its own ADD/CAS so that
+  /// contention is reported per key.
+  void set_data_multi(const std::string& table,
+                      std::vector<Store::SetRequest>& requests,
+                      SAS::TrailId trail = 0);
+
 protected:
   // The domain name for the memcached proxies.
   std::string _target_domain;
@@ -168,6 +218,27 @@ protected:
   // Get the targets for the configured domain.
   bool get_targets(std::vector<AddrInfo>& targets, SAS::TrailId trail);
 
+  // Traces and logs the start of a write to SAS.  This is done before the
+  // targets are looked up, so that any failure to find them is logged after
+  // the start of the write.
+  void log_set_start(const std::string& table,
+                     const std::string& key,
+                     const std::string& data,
+                     uint64_t cas,
+                     int expiry,
+                     SAS::TrailId trail);
+
+  // Sets the data for the specified table and key using the supplied
+  // targets.  The start of the write must already have been logged by
+  // log_set_start.
+  Store::Status set_data_to_targets(std::vector<AddrInfo>& targets,
+                                    const std::string& table,
+                                    const std::string& key,
+                                    const std::string& data,
+                                    uint64_t cas,
+                                    int expiry,
+                                    SAS::TrailId trail);
+
   // Call a particular subroutine on each target, stopping if any request gives
   // a definitive result (i.e. a result which means it is not worth trying to a
   // different target).
@@ -202,6 +273,32 @@ protected:
     std::vector<AddrInfo>& targets,
     SAS::TrailId trail,
     std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> fn);
+
+  // Equivalent of iterate_through_targets for reads when hedging is
+  // configured.  The read is made on the hedging threads, and sent to
+  // further targets if it hasn't completed within the hedge delay.
+  //
+  // As an attempt may still be running when this returns, each attempt
+  // writes to its own result object (rather than to variables captured by
+  // reference), and the result of the attempt that is used is copied to
+  // `result`.  `fn` must capture anything it needs by value.
+  //
+  // @param targets - The vector of targets to try.
+  // @param trail   - SAS trail ID.
+  // @param fn      - The read to make on each target.
+  // @param result  - (out) The result of the read.
+  template <class R>
+  memcached_return_t hedge_through_targets(
+    std::vector<AddrInfo>& targets,
+    SAS::TrailId trail,
+    std::function<memcached_return_t(memcached_st*, R&)> fn,
+    R& result);
+
+  // Worker threads for hedged reads and parallel writes.  NULL if hedging
+  // isn't configured.
+  FunctorThreadPool* _hedge_pool;
+  unsigned int _hedge_delay_ms;
+  unsigned int _max_parallel_reads;
 };
 
 #endif
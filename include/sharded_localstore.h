@@ -0,0 +1,129 @@
+/**
+ * @file sharded_localstore.h Definitions for the ShardedLocalStore class
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_LOCALSTORE_H__
+#define SHARDED_LOCALSTORE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "store.h"
+
+/// An in-memory Store with the same CAS and expiry semantics as LocalStore,
+/// intended for use as an in-process cache from many threads at once.
+///
+/// Keys are hashed across a number of shards, each with its own lock and
+/// open-addressing hash table, so operations on different keys rarely
+/// contend.  Expired records are removed lazily when they are next accessed,
+/// and (optionally) by a background thread that periodically sweeps each
+/// shard in turn.
+class ShardedLocalStore : public Store
+{
+public:
+  /// Constructor.
+  ///
+  /// @param num_shards       - The number of shards.
+  /// @param expiry_interval  - How often (in seconds) the background thread
+  ///                           sweeps the shards for expired records.  Zero
+  ///                           means there is no background thread, and
+  ///                           records are only expired lazily.
+  ShardedLocalStore(unsigned int num_shards = DEFAULT_SHARDS,
+                    unsigned int expiry_interval = 0);
+  virtual ~ShardedLocalStore();
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail = 0);
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail = 0);
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail = 0);
+
+  /// Removes all records from the store.
+  void flush_all();
+
+  /// Removes all expired records from the store.  This is called
+  /// periodically by the background thread if there is one.
+  void expire_all();
+
+  /// Returns the number of records in the store (including any that have
+  /// expired but not yet been removed).
+  size_t size();
+
+  static const unsigned int DEFAULT_SHARDS = 64;
+
+private:
+  enum SlotState {EMPTY, FULL, DELETED};
+
+  struct Slot
+  {
+    Slot() : state(EMPTY), hash(0), key(), data(), expiry(0), cas(0) {}
+
+    SlotState state;
+    size_t hash;
+    std::string key;
+    std::string data;
+    uint32_t expiry;
+    uint64_t cas;
+  };
+
+  /// Each shard is an open-addressing hash table using linear probing.
+  /// Removed records leave a DELETED slot so that probe sequences stay
+  /// intact - these are reclaimed when the table is rebuilt.
+  struct Shard
+  {
+    Shard();
+    ~Shard();
+
+    pthread_mutex_t lock;
+    std::vector<Slot> slots;
+    size_t full;
+    size_t deleted;
+  };
+
+  Shard& shard_for(size_t hash);
+
+  // Helpers that operate on a single shard.  These must be called with the
+  // shard lock held.
+  size_t find_slot(Shard& shard, size_t hash, const std::string& key);
+  Slot& insert_slot(Shard& shard, size_t hash, const std::string& key);
+  void remove_slot(Shard& shard, size_t index);
+  void expire_shard(Shard& shard, uint32_t now);
+  void rebuild_shard(Shard& shard, size_t capacity);
+
+  static void* expiry_thread_func(void* store);
+  void expiry_thread_loop();
+
+  std::vector<Shard*> _shards;
+
+  // Background expiry thread.
+  unsigned int _expiry_interval;
+  pthread_t _expiry_thread;
+  bool _expiry_thread_running;
+  pthread_mutex_t _expiry_lock;
+  pthread_cond_t _expiry_cond;
+  bool _terminated;
+
+  static const size_t INITIAL_CAPACITY = 16;
+  static const size_t NOT_FOUND_INDEX = (size_t)-1;
+};
+
+#endif
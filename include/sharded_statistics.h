@@ -0,0 +1,276 @@
+/**
+ * @file sharded_statistics.h Per-thread sharded counters and water marks.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_STATISTICS_H__
+#define SHARDED_STATISTICS_H__
+
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Statistics are updated from every worker thread but only read when they
+// are reported (by the SNMP agent or at the end of a statistics period).  The
+// classes in this file spread updates across a set of shards, each on its own
+// cache line, so that threads updating the same statistic don't contend on a
+// single cache line.  Each thread always uses the same shard, and there is
+// one shard per CPU (up to MAX_SHARDS), so only threads that would compete
+// for a CPU anyway share a shard.  Readers merge the shards when they need
+// the value.
+//
+// All the operations are atomic, but reads aren't synchronized with updates
+// (or with each other) so a read that races with updates may miss some of
+// them.  That matches the existing statistics, which use independent atomics
+// for each field.
+namespace ShardedStatistics
+{
+  /// The maximum number of shards for each statistic.
+  static const unsigned int MAX_SHARDS = 64;
+
+  /// The size of a cache line.  Each shard is padded to this size.
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  /// Returns the number of shards for each statistic, which is the number of
+  /// CPUs (capped at MAX_SHARDS).
+  inline unsigned int num_shards()
+  {
+    static const unsigned int shards = []
+    {
+      long cpus = sysconf(_SC_NPROCESSORS_CONF);
+      return (cpus < 1) ? 1u :
+             (cpus > MAX_SHARDS) ? MAX_SHARDS : (unsigned int)cpus;
+    }();
+    return shards;
+  }
+
+  /// Returns the shard index for the calling thread.  Threads are assigned
+  /// shards round-robin the first time they update a statistic.
+  inline unsigned int thread_shard()
+  {
+    static std::atomic_uint next_shard(0);
+    static thread_local unsigned int shard = next_shard++ % num_shards();
+    return shard;
+  }
+
+  /// A single value padded to fill a cache line.
+  struct Slot
+  {
+    std::atomic_uint_fast64_t value;
+    char padding[CACHE_LINE_SIZE - sizeof(std::atomic_uint_fast64_t)];
+  };
+
+  /// The cache-line-aligned shards of one statistic.
+  class Slots
+  {
+  public:
+    Slots() :
+      _slots(NULL)
+    {
+      void* mem = NULL;
+      if (posix_memalign(&mem, CACHE_LINE_SIZE, num_shards() * sizeof(Slot)) != 0)
+      {
+        throw std::bad_alloc(); // LCOV_EXCL_LINE
+      }
+
+      _slots = (Slot*)mem;
+      for (unsigned int ii = 0; ii < num_shards(); ++ii)
+      {
+        new (&_slots[ii]) Slot();
+      }
+    }
+
+    ~Slots()
+    {
+      free(_slots); _slots = NULL;
+    }
+
+    inline Slot& operator[](unsigned int index) { return _slots[index]; }
+    inline const Slot& operator[](unsigned int index) const { return _slots[index]; }
+    inline unsigned int size() const { return num_shards(); }
+
+  private:
+    Slots(const Slots&) = delete;
+    Slots& operator=(const Slots&) = delete;
+
+    Slot* _slots;
+  };
+}
+
+/// @class ShardedCounter
+///
+/// A counter whose value is the sum of its shards.
+class ShardedCounter
+{
+public:
+  ShardedCounter() { store(0); }
+
+  /// Add to the counter.
+  inline void increment(uint_fast64_t delta = 1)
+  {
+    _slots[ShardedStatistics::thread_shard()].value.fetch_add(
+                                                    delta,
+                                                    std::memory_order_relaxed);
+  }
+
+  /// Get the current value of the counter.
+  inline uint_fast64_t load() const
+  {
+    uint_fast64_t total = 0;
+    for (unsigned int ii = 0; ii < _slots.size(); ++ii)
+    {
+      total += _slots[ii].value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  /// Set the value of the counter.  This should not be called concurrently
+  /// with increment(), as increments to other shards may be lost.
+  inline void store(uint_fast64_t value)
+  {
+    _slots[0].value.store(value, std::memory_order_relaxed);
+    for (unsigned int ii = 1; ii < _slots.size(); ++ii)
+    {
+      _slots[ii].value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /// Reset the counter to zero.  Each shard is reset with an atomic
+  /// exchange, so this is safe to call concurrently with increment() - each
+  /// increment either happens before the reset or is kept.
+  inline void reset()
+  {
+    for (unsigned int ii = 0; ii < _slots.size(); ++ii)
+    {
+      _slots[ii].value.exchange(0, std::memory_order_relaxed);
+    }
+  }
+
+  /// Get the current value of the counter and reset it to zero.  Unlike
+  /// store(), this is safe to call concurrently with increment() - each
+  /// increment is either included in the returned value or kept for the
+  /// next read.
+  inline uint_fast64_t read_and_reset()
+  {
+    uint_fast64_t total = 0;
+    for (unsigned int ii = 0; ii < _slots.size(); ++ii)
+    {
+      total += _slots[ii].value.exchange(0, std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+private:
+  ShardedStatistics::Slots _slots;
+};
+
+/// @class ShardedWaterMark
+///
+/// A high- or low-water mark whose value is the highest (or lowest) of its
+/// shards.  Shards that haven't seen a sample hold EMPTY_VALUE (0 for a
+/// high-water mark, and the maximum value for a low-water mark), so an empty
+/// water mark reads as EMPTY_VALUE.
+template <bool HIGH>
+class ShardedWaterMark
+{
+public:
+  static const uint_fast64_t EMPTY_VALUE = HIGH ? 0 : ~((uint_fast64_t)0);
+
+  ShardedWaterMark() { store(EMPTY_VALUE); }
+
+  /// Update the water mark with a new sample.  This only writes to the
+  /// shard if the sample is a new high (or low) for that shard.
+  inline void update(uint_fast64_t sample)
+  {
+    std::atomic_uint_fast64_t& slot =
+                      _slots[ShardedStatistics::thread_shard()].value;
+
+    // Note that compare_exchange_weak loads the current value into the
+    // expected value parameter if the compare fails.
+    uint_fast64_t mark = slot.load(std::memory_order_relaxed);
+    while (better(sample, mark) &&
+           (!slot.compare_exchange_weak(mark,
+                                        sample,
+                                        std::memory_order_relaxed)))
+    {
+      // Do nothing.
+    }
+  }
+
+  /// Get the current value of the water mark.
+  inline uint_fast64_t load() const
+  {
+    uint_fast64_t mark = EMPTY_VALUE;
+    for (unsigned int ii = 0; ii < _slots.size(); ++ii)
+    {
+      uint_fast64_t value = _slots[ii].value.load(std::memory_order_relaxed);
+      if (better(value, mark))
+      {
+        mark = value;
+      }
+    }
+    return mark;
+  }
+
+  /// Set the value of the water mark.  This should not be called
+  /// concurrently with update(), as updates to other shards may be lost.
+  inline void store(uint_fast64_t value)
+  {
+    _slots[0].value.store(value, std::memory_order_relaxed);
+    for (unsigned int ii = 1; ii < _slots.size(); ++ii)
+    {
+      _slots[ii].value.store(EMPTY_VALUE, std::memory_order_relaxed);
+    }
+  }
+
+  /// Reset the water mark to EMPTY_VALUE.  Each shard is reset with an
+  /// atomic exchange, so this is safe to call concurrently with update().
+  inline void reset()
+  {
+    for (unsigned int ii = 0; ii < _slots.size(); ++ii)
+    {
+      _slots[ii].value.exchange(EMPTY_VALUE, std::memory_order_relaxed);
+    }
+  }
+
+  /// Get the current value of the water mark and reset it to EMPTY_VALUE.
+  /// This is safe to call concurrently with update().
+  inline uint_fast64_t read_and_reset()
+  {
+    uint_fast64_t mark = EMPTY_VALUE;
+    for (unsigned int ii = 0; ii < _slots.size(); ++ii)
+    {
+      uint_fast64_t value = _slots[ii].value.exchange(EMPTY_VALUE,
+                                                      std::memory_order_relaxed);
+      if (better(value, mark))
+      {
+        mark = value;
+      }
+    }
+    return mark;
+  }
+
+private:
+  static inline bool better(uint_fast64_t value, uint_fast64_t mark)
+  {
+    return HIGH ? (value > mark) : (value < mark);
+  }
+
+  ShardedStatistics::Slots _slots;
+};
+
+template <bool HIGH>
+const uint_fast64_t ShardedWaterMark<HIGH>::EMPTY_VALUE;
+
+typedef ShardedWaterMark<true> ShardedHighWaterMark;
+typedef ShardedWaterMark<false> ShardedLowWaterMark;
+
+#endif
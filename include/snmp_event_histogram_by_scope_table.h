@@ -0,0 +1,71 @@
+/**
+ * @file snmp_event_histogram_by_scope_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <vector>
+#include <map>
+#include <string>
+#include <atomic>
+
+#include "logger.h"
+#include "snmp_event_histogram_table.h"
+
+#ifndef SNMP_EVENT_HISTOGRAM_BY_SCOPE_TABLE_H
+#define SNMP_EVENT_HISTOGRAM_BY_SCOPE_TABLE_H
+
+// This file contains the interface for tables which:
+//   - are indexed by time period and scope (node type)
+//   - accumulate data samples over time into a histogram
+//   - report a count of samples and the sample value at each of a configured
+//     set of percentiles
+//   - reset completely at the end of the period
+//
+// The thing sampled should be event related, i.e. latency values.  The
+// reported percentiles are accurate to within about 3%.
+//
+// The table has columns:
+//   1     - the time period index
+//   2     - the scope index
+//   3     - the count of samples
+//   4...  - the value at each of the configured percentiles, in ascending
+//           order of percentile
+//
+// To create an event histogram by scope table, simply create one, and call
+// `accumulate` on it as data comes in, e.g.:
+//
+// EventHistogramByScopeTable* sprout_latency_table =
+//   EventHistogramByScopeTable::create("sprout_latency_percentiles", ".1.2.3", {50, 99, 99.9});
+// sprout_latency_table->accumulate(2000);
+
+namespace SNMP
+{
+
+class EventHistogramByScopeTable
+{
+public:
+  virtual ~EventHistogramByScopeTable() {};
+
+  static EventHistogramByScopeTable* create(
+                     std::string name,
+                     std::string oid,
+                     const std::vector<double>& percentiles =
+                                     EventHistogramTable::DEFAULT_PERCENTILES);
+
+  // Accumulate a sample into the underlying statistics.
+  virtual void accumulate(uint32_t sample) = 0;
+
+protected:
+  EventHistogramByScopeTable() {};
+
+};
+
+}
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * @file snmp_event_histogram_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <vector>
+#include <map>
+#include <string>
+#include <atomic>
+
+#include "logger.h"
+
+#ifndef SNMP_EVENT_HISTOGRAM_TABLE_H
+#define SNMP_EVENT_HISTOGRAM_TABLE_H
+
+// This file contains the interface for tables which:
+//   - are indexed by time period
+//   - accumulate data samples over time into a histogram
+//   - report a count of samples and the sample value at each of a configured
+//     set of percentiles
+//   - reset completely at the end of the period
+//
+// The thing sampled should be event related, i.e. latency values.  The
+// reported percentiles are accurate to within about 3%.
+//
+// The table has columns:
+//   1     - the time period index
+//   2     - the count of samples
+//   3...  - the value at each of the configured percentiles, in ascending
+//           order of percentile
+//
+// To create an event histogram table, simply create one, and call
+// `accumulate` on it as data comes in, e.g.:
+//
+// EventHistogramTable* bono_latency_table =
+//   EventHistogramTable::create("bono_latency_percentiles", ".1.2.3", {50, 99, 99.9});
+// bono_latency_table->accumulate(2000);
+
+namespace SNMP
+{
+
+class EventHistogramTable
+{
+public:
+  virtual ~EventHistogramTable() {};
+
+  /// The percentiles reported if none are specified.
+  static const std::vector<double> DEFAULT_PERCENTILES;
+
+  static EventHistogramTable* create(std::string name,
+                                     std::string oid,
+                                     const std::vector<double>& percentiles =
+                                                          DEFAULT_PERCENTILES);
+
+  // Accumulate a sample into the underlying statistics.
+  virtual void accumulate(uint32_t sample) = 0;
+
+protected:
+  EventHistogramTable() {};
+
+};
+
+}
+
+#endif
@@ -14,6 +14,7 @@
 #include <string>
 #include <atomic>
 #include "limits.h"
+#include "sharded_statistics.h"
 
 #ifndef SNMP_STATISTICS_STRUCTURES_H
 #define SNMP_STATISTICS_STRUCTURES_H
@@ -37,44 +38,48 @@ struct SingleCount
   void reset(uint64_t time_periodstart, SingleCount* previous = NULL) { count = 0; };
 };
 
-// Contains a count for attempts, successes and failures
+// Contains a count for attempts, successes and failures.  These are updated
+// for every transaction, so are sharded to avoid contention between threads.
 struct SuccessFailCount
 {
-  std::atomic_uint_fast64_t attempts;
-  std::atomic_uint_fast64_t successes;
-  std::atomic_uint_fast64_t failures;
+  ShardedCounter attempts;
+  ShardedCounter successes;
+  ShardedCounter failures;
 
   void reset(uint64_t time_periodstart, SuccessFailCount* previous = NULL)
   {
-    attempts = 0;
-    successes = 0;
-    failures = 0;
+    attempts.reset();
+    successes.reset();
+    failures.reset();
   }
 };
 
 // Contains values to calculate statistics to persist across periods, and has
-// fields that support continuous data (i.e. defined over the entire period)
+// fields that support continuous data (i.e. defined over the entire period).
+// The count and water marks are sharded, as they don't depend on the order of
+// updates.  The sums are weighted by how long each value was current, so must
+// be updated in order.
 struct ContinuousStatistics
 {
-  std::atomic_uint_fast64_t count;
+  ShardedCounter count;
   std::atomic_uint_fast64_t current_value;
   std::atomic_uint_fast64_t time_last_update_ms;
   std::atomic_uint_fast64_t time_period_start_ms;
   std::atomic_uint_fast64_t sum;
   std::atomic_uint_fast64_t sqsum;
-  std::atomic_uint_fast64_t hwm;
-  std::atomic_uint_fast64_t lwm;
+  ShardedHighWaterMark hwm;
+  ShardedLowWaterMark lwm;
 
   ContinuousStatistics()
   {
-    count = 0;
+    count.store(0);
     current_value = 0;
     time_last_update_ms = 0;
     time_period_start_ms = 0;
     sum = 0;
     sqsum = 0;
-    hwm = 0;
-    lwm = 0;
+    hwm.store(0);
+    lwm.store(0);
   }
 
   ContinuousStatistics(const ContinuousStatistics &other)
@@ -108,7 +113,7 @@ struct ContinuousStatistics
     clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
     // At time 0, all incrementing values should be 0
-    count.store(0);
+    count.reset();
     sum.store(0);
     sqsum.store(0);
 
@@ -11,6 +11,10 @@
 
 #ifndef STORE_H_
 #define STORE_H_
+
+#include <string>
+#include <vector>
+
 #include "sas.h"
 
 /// @class Store
@@ -70,6 +74,90 @@ public:
                              const std::string& key,
                              SAS::TrailId trail = 0) = 0;
 
+  /// A single key read by get_data_multi.
+  struct GetRequest
+  {
+    GetRequest(const std::string& key_param) :
+      key(key_param), data(), cas(0), status(ERROR)
+    {}
+
+    /// Key of the data record to retrieve.
+    std::string key;
+
+    /// (out) The data, CAS value and result of the read, as returned by
+    /// get_data.
+    std::string data;
+    uint64_t cas;
+    Status status;
+  };
+
+  /// A single key written by set_data_multi.
+  struct SetRequest
+  {
+    SetRequest(const std::string& key_param,
+               const std::string& data_param,
+               uint64_t cas_param,
+               int expiry_param) :
+      key(key_param), data(data_param), cas(cas_param), expiry(expiry_param),
+      status(ERROR)
+    {}
+
+    /// The key, data, CAS and expiry, as passed to set_data.
+    std::string key;
+    std::string data;
+    uint64_t cas;
+    int expiry;
+
+    /// (out) The result of the write, as returned by set_data.
+    Status status;
+  };
+
+  /// Gets the data for several keys in the specified namespace.  The result
+  /// of each read is returned in the corresponding request.
+  ///
+  /// Stores that can read several keys in one round trip should override
+  /// this.  The default implementation calls get_data for each key in turn.
+  ///
+  /// @param table    Name of the table to retrive the data.
+  /// @param requests The keys to read.
+  virtual void get_data_multi(const std::string& table,
+                              std::vector<GetRequest>& requests,
+                              SAS::TrailId trail = 0)
+  {
+    for (GetRequest& request : requests)
+    {
+      request.status = get_data(table,
+                                request.key,
+                                request.data,
+                                request.cas,
+                                trail);
+    }
+  }
+
+  /// Sets the data for several keys in the specified namespace.  The result
+  /// of each write is returned in the corresponding request.  Each write
+  /// succeeds or fails independently.
+  ///
+  /// Stores that can write several keys in one round trip should override
+  /// this.  The default implementation calls set_data for each key in turn.
+  ///
+  /// @param table    Name of the table to store the data.
+  /// @param requests The keys and data to write.
+  virtual void set_data_multi(const std::string& table,
+                              std::vector<SetRequest>& requests,
+                              SAS::TrailId trail = 0)
+  {
+    for (SetRequest& request : requests)
+    {
+      request.status = set_data(table,
+                                request.key,
+                                request.data,
+                                request.cas,
+                                request.expiry,
+                                trail);
+    }
+  }
+
   virtual bool has_servers() { return true; }
 };
 
@@ -12,6 +12,7 @@
 #include <functional>
 
 #include <eventq.h>
+#include <lockfree_eventq.h>
 #include "exception_handler.h"
 #include <log.h>
 
@@ -33,7 +34,17 @@
 //
 // The start(), stop(), and join() methods are not threadsafe and should not be
 // called simultaneously.
-template <class T>
+//
+// The work queue defaults to eventq.  Heavily loaded pools can instead use
+// lockfree_eventq (by passing it as the second template parameter) so that
+// add_work and the worker threads don't contend on a single queue mutex.
+//
+// By default each worker takes one work item at a time and passes it to
+// process_work.  If max_batch is greater than one, each worker instead drains
+// up to max_batch items every time it takes from the queue and passes them all
+// to process_batch, which amortizes the queue lock and wake-up across bursts
+// of work.
+template <class T, class Q = eventq<T> >
 class ThreadPool
 {
 public:
@@ -42,14 +53,18 @@ public:
   // @param num_threads the number of threads in the pool.
   // @param max_queue the number of work items that can be queued waiting for a
   //   free thread (0 => no limit).
+  // @param max_batch the maximum number of work items a worker takes from the
+  //   queue at once (1 => items are processed one at a time).
   ThreadPool(unsigned int num_threads,
              ExceptionHandler* exception_handler,
              void (*callback)(T),
-             unsigned int max_queue = 0) :
+             unsigned int max_queue = 0,
+             unsigned int max_batch = 1) :
     _num_threads(num_threads),
     _exception_handler(exception_handler),
     _threads(0),
     _queue(max_queue),
+    _max_batch((max_batch > 0) ? max_batch : 1),
     _callback(callback)
   {}
 
@@ -126,11 +141,22 @@ public:
     _queue.push(work);
   }
 
+  // Add a range of work items to the thread pool in one go.
+  //
+  // @param begin the first work item to add.
+  // @param end one past the last work item to add.
+  template<class InputIterator>
+  void add_work_bulk(InputIterator begin, InputIterator end)
+  {
+    _queue.push_bulk(begin, end);
+  }
+
 private:
   unsigned int _num_threads;
   ExceptionHandler* _exception_handler;
   std::vector<pthread_t> _threads;
-  eventq<T> _queue;
+  Q _queue;
+  unsigned int _max_batch;
 
   // Recovery function provided by the callers
   void (*_callback)(T);
@@ -144,7 +170,7 @@ private:
   // @return NULL (required by the pthreads API).
   static void *static_worker_thread_func(void *pool)
   {
-    ((ThreadPool<T> *)pool)->worker_thread_func();
+    ((ThreadPool<T, Q> *)pool)->worker_thread_func();
     return NULL;
   }
 
@@ -155,6 +181,11 @@ private:
   // This can also be used in UTs to control execution of the thread pool.
   bool run_once()
   {
+    if (_max_batch > 1)
+    {
+      return run_batch_once();
+    }
+
     T work;
     bool got_work = _queue.pop(work);
 
@@ -174,6 +205,38 @@ private:
     return got_work;
   }
 
+  // Take up to _max_batch work items off the queue and process them together.
+  // If an exception is hit, the recovery function is called for the item that
+  // hit it and for all the items that hadn't yet been processed.
+  bool run_batch_once()
+  {
+    std::vector<T> batch;
+    batch.reserve(_max_batch);
+    bool got_work = _queue.pop_batch(batch, _max_batch);
+
+    if ((got_work) && (!batch.empty()))
+    {
+      // This is updated inside CW_TRY and read in CW_EXCEPT (after a
+      // longjmp), so must be volatile to avoid being cached in a register.
+      volatile size_t processed = 0;
+
+      CW_TRY
+      {
+        process_batch(batch, processed);
+      }
+      CW_EXCEPT(_exception_handler)
+      {
+        for (size_t ii = processed; ii < batch.size(); ++ii)
+        {
+          _callback(batch[ii]);
+        }
+      }
+      CW_END
+    }
+
+    return got_work;
+  }
+
   // Function executed by a single worker thread. This loops pulling work off
   // the queue and processing it.
   void worker_thread_func()
@@ -209,6 +272,24 @@ private:
 
   // Process a work item. This method must be overridden by the subclass.
   virtual void process_work(T& work) = 0;
+
+  // (Optional) Process a batch of work items.  This is only called if the
+  // pool was created with a max_batch greater than one.
+  //
+  // Implementations must process the items in order and increment processed
+  // as each item completes, so that if an exception is hit the recovery
+  // function is only called for the items that haven't been processed.
+  // processed is volatile because it is read after the exception handler's
+  // longjmp.
+  //
+  // The default implementation calls process_work on each item in turn.
+  virtual void process_batch(std::vector<T>& batch, volatile size_t& processed)
+  {
+    for (; processed < batch.size(); ++processed)
+    {
+      process_work(batch[processed]);
+    }
+  }
 };
 
 
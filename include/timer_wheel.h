@@ -0,0 +1,158 @@
+/**
+ * @file timer_wheel.h Hierarchical timing wheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "timer_heap.h"
+
+class TimerWheel;
+
+/// Interface for a timer which can be used in a TimerWheel.  This is also a
+/// HeapableTimer, so the same timer class can be used with either a
+/// TimerWheel or a TimerHeap.
+class WheelableTimer : public HeapableTimer
+{
+public:
+  virtual ~WheelableTimer() = default;
+
+  /// Wheel which this timer is in, or NULL if it isn't currently in a wheel.
+  ///
+  /// TimerWheel::insert is responsible for updating this field.
+  TimerWheel* _wheel = nullptr;
+
+  // The slot this timer is in, and its neighbours in that slot's list.  The
+  // TimerWheel is responsible for keeping these up-to-date.
+  uint32_t _wheel_slot = 0;
+  WheelableTimer* _wheel_prev = nullptr;
+  WheelableTimer* _wheel_next = nullptr;
+};
+
+/// Hierarchical timing wheel for storing large numbers of timers.  This has
+/// the same insert/remove/rebalance/get_next_timer contract as TimerHeap, but
+/// inserting, removing and rebalancing a timer are O(1), and expiring timers
+/// is O(1) amortized per timer.
+///
+/// The wheel has NUM_LEVELS levels of SLOTS_PER_LEVEL slots.  Each level
+/// covers SLOT_BITS bits of the pop time, so a timer is in the level of the
+/// most significant bit in which its pop time differs from the wheel's
+/// current time, and the slot given by its pop time's bits at that level.
+/// As the current time advances past the start of a slot, the timers in that
+/// slot are moved down to lower levels, until they reach level 0 (where
+/// every timer in a slot has the same pop time) and expire.
+///
+/// The current time only advances when pop_expired is called, and timers
+/// that are inserted with a pop time at or before the current time are kept
+/// on a separate list until the next call.
+///
+/// Unlike TimerHeap, pop times are compared as plain integers, so must not
+/// wrap.
+class TimerWheel
+{
+public:
+  static const unsigned int SLOT_BITS = 8;
+  static const unsigned int SLOTS_PER_LEVEL = 1 << SLOT_BITS;
+  static const unsigned int NUM_LEVELS = 64 / SLOT_BITS;
+
+  /// @param current_time The time to start the wheel at.  Timers that pop at
+  ///                     or before this time expire on the first call to
+  ///                     pop_expired.
+  TimerWheel(uint64_t current_time = 0);
+
+  /// Adds a timer to the wheel.  This doesn't take ownership of the timer's
+  /// memory.
+  ///
+  /// Does nothing if this timer is already in the wheel.
+  ///
+  /// @param t Timer to insert
+  void insert(WheelableTimer* t);
+
+  /// Removes a timer from the wheel.  This does not free the timer's memory.
+  ///
+  /// @param t Timer to remove.
+  ///
+  /// @returns True if the timer was removed, False if the timer was not in
+  /// the wheel.
+  bool remove(WheelableTimer* t);
+
+  /// Moves the timer to the right slot in the wheel.  Should be called after
+  /// changing a timer's pop time.
+  ///
+  /// @param t The timer to move.
+  void rebalance(WheelableTimer* t);
+
+  /// Returns the timer which will pop next, or NULL if the wheel is empty.
+  /// This does not remove the timer from the wheel.
+  ///
+  /// The result is cached until the timer is removed or a timer that pops
+  /// sooner is inserted, but finding it can involve searching all the timers
+  /// in a slot of one of the higher levels, so callers that are about to
+  /// expire timers should use pop_expired instead.
+  WheelableTimer* get_next_timer();
+
+  /// Advances the wheel's current time, and removes all the timers that pop
+  /// at or before that time.
+  ///
+  /// @param now     The new current time.  If this is before the wheel's
+  ///                current time, only the timers that were inserted with a
+  ///                pop time at or before the current time are removed.
+  /// @param expired Filled in with the removed timers, in the order they pop.
+  void pop_expired(uint64_t now, std::vector<WheelableTimer*>& expired);
+
+  /// The number of timers in the wheel.
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+private:
+  /// The slot used for timers that pop at or before the current time.
+  static const uint32_t OVERDUE_SLOT = NUM_LEVELS * SLOTS_PER_LEVEL;
+
+  /// The number of 64-bit words in each level's occupancy bitmap.
+  static const unsigned int BITMAP_WORDS = SLOTS_PER_LEVEL / 64;
+
+  /// Puts a timer in the right slot for its pop time.
+  void link(WheelableTimer* t);
+
+  /// Takes a timer out of its slot.
+  void unlink(WheelableTimer* t);
+
+  /// Finds the earliest occupied slot (other than the overdue slot), or
+  /// returns false if there are none.
+  bool find_next_slot(unsigned int& level, unsigned int& index) const;
+
+  /// The time at which the given slot starts.
+  uint64_t slot_start_time(unsigned int level, unsigned int index) const;
+
+  /// The digit of the given time at a level.
+  static inline unsigned int digit(uint64_t time, unsigned int level)
+  {
+    return (time >> (level * SLOT_BITS)) & (SLOTS_PER_LEVEL - 1);
+  }
+
+  uint64_t _current_time;
+  size_t _size;
+
+  // The head of each slot's list of timers.  The levels' slots are stored
+  // one after another, followed by the overdue slot.
+  WheelableTimer* _slots[NUM_LEVELS * SLOTS_PER_LEVEL + 1];
+
+  // Which slots in each level are occupied.
+  uint64_t _occupied[NUM_LEVELS][BITMAP_WORDS];
+
+  // Cached result of get_next_timer, or NULL if it needs recalculating.
+  WheelableTimer* _next_timer;
+};
+
+#endif
@@ -13,8 +13,14 @@
 #define TTLCACHE_H__
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
+#include <atomic>
+#include <functional>
 #include <map>
+#include <unordered_map>
+#include <vector>
 
 #include "log.h"
 
@@ -340,4 +346,458 @@ private:
 
   KeyMap _cache;
 };
+
+/// Hit, miss and load statistics for a ShardedTTLCache.
+struct TTLCacheStats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t loads;
+  uint64_t load_time_us;
+};
+
+/// Sharded variant of TTLCache, intended for caches on hot paths that are
+/// accessed from many threads at once.
+///
+/// Keys are hashed across a number of shards, each with its own lock, hash
+/// table and expiry timer wheel, so operations on different keys rarely
+/// contend.  Expired entries are swept at most once a second per shard (as
+/// the wheel advances) rather than on every operation.
+///
+/// The API and semantics match TTLCache - in particular, concurrent calls to
+/// get for the same key result in a single call to the factory, with the
+/// other callers blocking until it completes, and every get must be matched
+/// by a call to dec_ref.
+template <class K, class V, class H = std::hash<K> >
+class ShardedTTLCache
+{
+  /// Each cache entry holds the data plus ...
+  /// -   the state of the entry, so that concurrent gets wait for the single
+  ///     load in progress
+  /// -   a reference count, which includes a reference from the expiry wheel
+  ///     while the entry has not expired
+  /// -   the expiry time of the entry (zero if it is not on the expiry wheel).
+  struct Entry
+  {
+    enum {PENDING, COMPLETE} state;
+    int refs;
+    time_t expiry;
+    V data;
+  };
+
+  typedef std::unordered_map<K, Entry, H> KeyMap;
+  typedef typename KeyMap::iterator KeyMapIterator;
+
+  /// The expiry wheel has a slot per second.  Entries are placed in the slot
+  /// for their expiry time (modulo the size of the wheel), and slots are
+  /// swept as the wheel advances.  Entries that expire further ahead than
+  /// the size of the wheel are left in their slot until a later revolution.
+  ///
+  /// Wheel records are not removed when an entry's TTL is updated - instead
+  /// a record is ignored if it doesn't match the entry's current expiry.
+  struct ExpiryRecord
+  {
+    time_t expiry;
+    K key;
+  };
+
+  typedef std::vector<ExpiryRecord> ExpirySlot;
+
+  struct Shard
+  {
+    Shard(unsigned int wheel_size) :
+      cache(),
+      wheel(wheel_size),
+      last_sweep(time(NULL))
+    {
+      pthread_mutex_init(&lock, NULL);
+      pthread_cond_init(&loaded, NULL);
+    }
+
+    ~Shard()
+    {
+      pthread_cond_destroy(&loaded);
+      pthread_mutex_destroy(&lock);
+    }
+
+    /// Lock protecting all the other fields.  It must not be held when
+    /// calling a factory get() method, but can be held when calling an
+    /// evict() method as these are assumed not to block.
+    pthread_mutex_t lock;
+
+    /// Signalled when a pending entry in this shard completes.
+    pthread_cond_t loaded;
+
+    KeyMap cache;
+    std::vector<ExpirySlot> wheel;
+    time_t last_sweep;
+  };
+
+public:
+  static const unsigned int DEFAULT_SHARDS = 16;
+  static const unsigned int DEFAULT_WHEEL_SIZE = 512;
+
+  ShardedTTLCache(CacheFactory<K, V>* factory,
+                  unsigned int num_shards = DEFAULT_SHARDS,
+                  unsigned int wheel_size = DEFAULT_WHEEL_SIZE) :
+    _factory(factory),
+    _shards(),
+    _hash(),
+    _hits(0),
+    _misses(0),
+    _loads(0),
+    _load_time_us(0)
+  {
+    num_shards = (num_shards > 0) ? num_shards : 1;
+    wheel_size = (wheel_size > 0) ? wheel_size : 1;
+
+    for (unsigned int ii = 0; ii < num_shards; ++ii)
+    {
+      _shards.push_back(new Shard(wheel_size));
+    }
+  }
+
+  ~ShardedTTLCache()
+  {
+    for (typename std::vector<Shard*>::iterator s = _shards.begin();
+         s != _shards.end();
+         ++s)
+    {
+      if (_factory != NULL)
+      {
+        // Call evict for every entry in the shard.
+        for (KeyMapIterator i = (*s)->cache.begin();
+             i != (*s)->cache.end();
+             ++i)
+        {
+          _factory->evict(i->first, i->second.data);
+        }
+      }
+
+      delete *s;
+    }
+  }
+
+  /// Get or create an entry in the cache.
+  V get(K key, int& ttl, SAS::TrailId trail)
+  {
+    Shard& shard = shard_for(key);
+    pthread_mutex_lock(&shard.lock);
+
+    // Evict any old entries.
+    sweep(shard);
+
+    KeyMapIterator i = shard.cache.find(key);
+
+    if (i == shard.cache.end())
+    {
+      _misses.fetch_add(1, std::memory_order_relaxed);
+
+      if (_factory != NULL)
+      {
+        // The entry is not in the cache, so create a placeholder.  Elements
+        // of an unordered_map don't move when it rehashes, so the reference
+        // stays valid while the shard lock is released.
+        TRC_DEBUG("Entry not in cache, so create new entry");
+        Entry& entry = shard.cache[key];
+        entry.state = Entry::PENDING;
+        entry.refs = 0;
+        entry.expiry = 0;
+
+        // Release the shard lock and invoke the factory to populate the
+        // cache data.
+        pthread_mutex_unlock(&shard.lock);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        V data = _factory->get(key, ttl, trail);
+        record_load(start);
+
+        // Get the shard lock again, store the data and mark the entry as
+        // complete.
+        pthread_mutex_lock(&shard.lock);
+        entry.data = data;
+        entry.state = Entry::COMPLETE;
+
+        // Add the entry to the expiry wheel, and add one to the reference
+        // count for this reference.
+        TRC_DEBUG("Adding entry to expiry wheel, TTL=%d, expiry time = %d", ttl, ttl + time(NULL));
+        set_expiry(shard, key, entry, ttl + time(NULL));
+
+        // Increment the reference count on the entry as we are about to
+        // return it to an user, then wake any other threads waiting for it.
+        ++entry.refs;
+        pthread_cond_broadcast(&shard.loaded);
+
+        pthread_mutex_unlock(&shard.lock);
+
+        return data;
+      }
+      else
+      {
+        // No entry in the cache, and no factory, so just return an empty value.
+        pthread_mutex_unlock(&shard.lock);
+        return V();
+      }
+    }
+    else
+    {
+      TRC_DEBUG("Found the entry in the cache");
+      _hits.fetch_add(1, std::memory_order_relaxed);
+      Entry& entry = i->second;
+
+      // Add a reference to the entry so it doesn't get evicted and destroyed
+      // from under our feet.
+      ++entry.refs;
+
+      while (entry.state == Entry::PENDING)
+      {
+        // This cache entry is still being populated, so wait for the factory
+        // to complete.
+        TRC_DEBUG("Cache entry is pending, so wait for the factory to complete");
+        pthread_cond_wait(&shard.loaded, &shard.lock);
+      }
+
+      V data = entry.data;
+      pthread_mutex_unlock(&shard.lock);
+
+      return data;
+    }
+  }
+
+  /// Check whether an item exists in the cache.
+  bool exists(K key)
+  {
+    Shard& shard = shard_for(key);
+    pthread_mutex_lock(&shard.lock);
+
+    // Evict any old entries.
+    sweep(shard);
+
+    bool rc = (shard.cache.find(key) != shard.cache.end());
+
+    pthread_mutex_unlock(&shard.lock);
+
+    return rc;
+  }
+
+  /// Add an item to the cache with the specified time to live.
+  void add(K key, V value, int ttl)
+  {
+    Shard& shard = shard_for(key);
+    pthread_mutex_lock(&shard.lock);
+
+    // Evict any old entries.
+    sweep(shard);
+
+    KeyMapIterator i = shard.cache.find(key);
+
+    if (i == shard.cache.end())
+    {
+      // Add the entry to the cache.
+      Entry& entry = shard.cache[key];
+      entry.data = value;
+      entry.state = Entry::COMPLETE;
+      entry.refs = 0;
+      entry.expiry = 0;
+      set_expiry(shard, key, entry, ttl + time(NULL));
+    }
+    else
+    {
+      // Update the cache entry.
+      Entry& entry = i->second;
+      if (_factory != NULL)
+      {
+        _factory->evict(key, entry.data);
+      }
+      entry.data = value;
+      set_expiry(shard, key, entry, ttl + time(NULL));
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /// Returns the TTL of an item in the cache.  Returns zero if the item isn't
+  /// in the cache at all.
+  int ttl(K key)
+  {
+    int ttl = 0;
+    Shard& shard = shard_for(key);
+    pthread_mutex_lock(&shard.lock);
+
+    // Evict any old entries.
+    sweep(shard);
+
+    KeyMapIterator i = shard.cache.find(key);
+
+    if ((i != shard.cache.end()) && (i->second.expiry != 0))
+    {
+      ttl = i->second.expiry - time(NULL);
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+
+    return ttl;
+  }
+
+  void dec_ref(K key)
+  {
+    // Remove a reference on the specified entry and evict it if it has
+    // timed out and there are no more references.
+    Shard& shard = shard_for(key);
+    pthread_mutex_lock(&shard.lock);
+    KeyMapIterator j = shard.cache.find(key);
+
+    if (j != shard.cache.end())
+    {
+      if (--(j->second.refs) <= 0)
+      {
+        remove(shard, j);
+      }
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /// Returns the hit, miss and load statistics for the cache.
+  TTLCacheStats stats() const
+  {
+    TTLCacheStats stats;
+    stats.hits = _hits.load(std::memory_order_relaxed);
+    stats.misses = _misses.load(std::memory_order_relaxed);
+    stats.loads = _loads.load(std::memory_order_relaxed);
+    stats.load_time_us = _load_time_us.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+private:
+
+  Shard& shard_for(const K& key)
+  {
+    return *_shards[_hash(key) % _shards.size()];
+  }
+
+  void record_load(const struct timespec& start)
+  {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t time_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                       (end.tv_nsec - start.tv_nsec) / 1000;
+    _loads.fetch_add(1, std::memory_order_relaxed);
+    _load_time_us.fetch_add(time_us, std::memory_order_relaxed);
+  }
+
+  /// Sets the expiry time of an entry, taking the expiry wheel's reference on
+  /// the entry if it doesn't already hold one.  Must be called with the shard
+  /// lock held.
+  void set_expiry(Shard& shard, const K& key, Entry& entry, time_t expiry)
+  {
+    if (entry.expiry == 0)
+    {
+      ++entry.refs;
+    }
+
+    entry.expiry = expiry;
+
+    // An entry that has already expired (for example one added with a TTL of
+    // zero) would belong in a slot the wheel has already passed, and so
+    // wouldn't be swept until the wheel came round again.  Put it in the next
+    // slot to be swept instead.
+    time_t tick = (expiry > shard.last_sweep) ? expiry : (shard.last_sweep + 1);
+
+    ExpiryRecord record = {expiry, key};
+    shard.wheel[tick % shard.wheel.size()].push_back(record);
+  }
+
+  /// Removes an entry from the cache.  Must be called with the shard lock
+  /// held.
+  void remove(Shard& shard, KeyMapIterator i)
+  {
+    // Don't release the shard lock around eviction - assumption is it
+    // isn't a blocking operation.
+    if (_factory != NULL)
+    {
+      _factory->evict(i->first, i->second.data);
+    }
+    shard.cache.erase(i);
+  }
+
+  /// Advances the shard's expiry wheel to the current time, expiring any
+  /// entries in the slots it passes.  Must be called with the shard lock
+  /// held.
+  void sweep(Shard& shard)
+  {
+    time_t now = time(NULL);
+
+    if (now <= shard.last_sweep)
+    {
+      return;
+    }
+
+    // Sweep each slot between the last sweep and now, but no more than once.
+    size_t wheel_size = shard.wheel.size();
+    time_t first = shard.last_sweep + 1;
+    if (now - first >= (time_t)wheel_size)
+    {
+      first = now - wheel_size + 1;
+    }
+
+    for (time_t tick = first; tick <= now; ++tick)
+    {
+      sweep_slot(shard, shard.wheel[tick % wheel_size], now);
+    }
+
+    shard.last_sweep = now;
+  }
+
+  void sweep_slot(Shard& shard, ExpirySlot& slot, time_t now)
+  {
+    size_t kept = 0;
+
+    for (size_t ii = 0; ii < slot.size(); ++ii)
+    {
+      ExpiryRecord& record = slot[ii];
+
+      if (record.expiry > now)
+      {
+        // Not due until a later revolution of the wheel, so keep it.
+        if (kept != ii)
+        {
+          slot[kept] = record;
+        }
+        ++kept;
+        continue;
+      }
+
+      KeyMapIterator j = shard.cache.find(record.key);
+
+      if ((j != shard.cache.end()) && (j->second.expiry == record.expiry))
+      {
+        // Decrement the reference count as the entry is no longer referenced
+        // from the expiry wheel.  If the reference count is now zero we can
+        // evict immediately, otherwise wait for other references to end.
+        TRC_DEBUG("Time now is %d, expiring entry with expiry time %d",
+                  now, record.expiry);
+        j->second.expiry = 0;
+        if (--(j->second.refs) <= 0)
+        {
+          remove(shard, j);
+        }
+      }
+    }
+
+    slot.erase(slot.begin() + kept, slot.end());
+  }
+
+  /// Factory object used to get and evict cache data.
+  CacheFactory<K, V>* _factory;
+
+  std::vector<Shard*> _shards;
+  H _hash;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+  std::atomic<uint64_t> _loads;
+  std::atomic<uint64_t> _load_time_us;
+};
 #endif
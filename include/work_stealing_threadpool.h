@@ -0,0 +1,585 @@
+/**
+ * @file work_stealing_threadpool.h implementation of a work-stealing thread
+ * pool.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "exception_handler.h"
+#include <log.h>
+
+#ifndef WORK_STEALING_THREADPOOL_H__
+#define WORK_STEALING_THREADPOOL_H__
+
+// A thread pool with the same contract as ThreadPool (see threadpool.h), but
+// where each worker thread has its own deque of work items rather than all
+// workers sharing a single eventq.
+//
+// - Work added from one of the pool's own worker threads goes on to that
+//   worker's deque (so follow-on work stays on the same core and its cache).
+// - Work added from any other thread goes to the worker given by the
+//   affinity hint, or is spread round-robin across the workers.
+// - A worker processes its own deque newest-first, and when it runs dry it
+//   steals the oldest item from a randomly chosen other worker.
+// - Idle workers sleep on a condition variable, which producers only signal
+//   if there are sleeping workers.
+//
+// Each deque has its own lock, so the only contention is between a worker
+// and a thread adding to or stealing from that particular worker.
+//
+// As for ThreadPool, start, stop and join are not threadsafe, and the pool
+// cannot be restarted once it has been stopped.
+template <class T>
+class WorkStealingThreadPool
+{
+public:
+  // Passed as the affinity hint to let the pool choose the worker.
+  static const int NO_AFFINITY = -1;
+
+  // Create the thread pool.
+  //
+  // @param num_threads the number of threads in the pool.
+  // @param max_queue the number of work items that can be queued waiting for a
+  //   free thread across all workers (0 => no limit).
+  WorkStealingThreadPool(unsigned int num_threads,
+                         ExceptionHandler* exception_handler,
+                         void (*callback)(T),
+                         unsigned int max_queue = 0) :
+    _num_threads((num_threads > 0) ? num_threads : 1),
+    _exception_handler(exception_handler),
+    _threads(0),
+    _workers(),
+    _max_queue(max_queue),
+    _pending(0),
+    _sleepers(0),
+    _blocked_writers(0),
+    _next_worker(0),
+    _terminated(false),
+    _callback(callback)
+  {
+    for (unsigned int ii = 0; ii < _num_threads; ++ii)
+    {
+      Worker* worker = new Worker(ii);
+      worker->pool = this;
+      _workers.push_back(worker);
+    }
+
+    pthread_mutex_init(&_sleep_lock, NULL);
+    pthread_cond_init(&_sleep_cond, NULL);
+    pthread_cond_init(&_writer_cond, NULL);
+  }
+
+  // Destroy the thread pool.
+  virtual ~WorkStealingThreadPool()
+  {
+    for (unsigned int ii = 0; ii < _workers.size(); ++ii)
+    {
+      delete _workers[ii]; _workers[ii] = NULL;
+    }
+
+    pthread_cond_destroy(&_writer_cond);
+    pthread_cond_destroy(&_sleep_cond);
+    pthread_mutex_destroy(&_sleep_lock);
+  }
+
+  // Start the thread pool by creating the required number of worker threads.
+  //
+  // @return whether the thread pool started successfully.
+  bool start()
+  {
+    bool success = true;
+    pthread_t thread_handle;
+
+    for (unsigned int ii = 0; ii < _num_threads; ++ii)
+    {
+      int rc = pthread_create(&thread_handle,
+                              NULL,
+                              static_worker_thread_func,
+                              _workers[ii]);
+      if (rc == 0)
+      {
+        _threads.push_back(thread_handle);
+      }
+      else
+      {
+        TRC_ERROR("Failed to create thread in work-stealing thread pool");
+
+        // Terminate the pool so that all existing threads will exit.
+        terminate();
+        _threads.clear();
+
+        success = false;
+        break;
+      }
+    }
+
+    return success;
+  }
+
+  // Stop the thread pool and shutdown the worker threads.  Work items on the
+  // queues are not guaranteed to be processed.
+  void stop()
+  {
+    purge();
+    terminate();
+  }
+
+  // Wait for the threadpool to shutdown.
+  void join()
+  {
+    for (unsigned int ii = 0; ii < _threads.size(); ++ii)
+    {
+      pthread_join(_threads[ii], NULL);
+    }
+  }
+
+  // Add a work item to the thread pool.
+  //
+  // @param work the work item to add.
+  // @param affinity the index of the worker that should preferably process
+  //   the item, or NO_AFFINITY to let the pool decide.
+  void add_work(T& work, int affinity = NO_AFFINITY)
+  {
+    push_work(work, affinity);
+  }
+
+  // Add a work item to the thread pool by moving it into the pool.
+  //
+  // @param work the work item to add.
+  // @param affinity the index of the worker that should preferably process
+  //   the item, or NO_AFFINITY to let the pool decide.
+  void add_work(T&& work, int affinity = NO_AFFINITY)
+  {
+    push_work(std::move(work), affinity);
+  }
+
+  // Returns the index of the pool's worker that the calling thread is, or
+  // NO_AFFINITY if the calling thread isn't one of this pool's workers.  This
+  // can be passed to add_work on another pool's thread to keep related work
+  // together.
+  int current_worker() const
+  {
+    int index = NO_AFFINITY;
+
+    if (_current_pool == this)
+    {
+      index = _current_index;
+    }
+
+    return index;
+  }
+
+private:
+  // The per-worker state.  Padded so that adjacent workers' locks don't share
+  // a cache line.
+  struct Worker
+  {
+    Worker(unsigned int index_param) :
+      index(index_param),
+      items(),
+      pool(NULL),
+      rand_state(index_param * 2654435761u + 1)
+    {
+      pthread_mutex_init(&lock, NULL);
+    }
+
+    ~Worker()
+    {
+      pthread_mutex_destroy(&lock);
+    }
+
+    unsigned int index;
+    pthread_mutex_t lock;
+    std::deque<T> items;
+    WorkStealingThreadPool<T>* pool;
+    uint32_t rand_state;
+    char _pad[64];
+  };
+
+  // The pool and worker index of the calling thread, if it is a worker.
+  static thread_local WorkStealingThreadPool<T>* _current_pool;
+  static thread_local int _current_index;
+
+  unsigned int _num_threads;
+  ExceptionHandler* _exception_handler;
+  std::vector<pthread_t> _threads;
+  std::vector<Worker*> _workers;
+  unsigned int _max_queue;
+
+  // Number of items on (or being added to) all the deques, number of idle
+  // workers waiting for work and number of writers waiting for space.
+  std::atomic<int> _pending;
+  std::atomic<int> _sleepers;
+  std::atomic<int> _blocked_writers;
+
+  // Used to spread work added from non-worker threads across the workers.
+  std::atomic<unsigned int> _next_worker;
+
+  std::atomic<bool> _terminated;
+
+  pthread_mutex_t _sleep_lock;
+  pthread_cond_t _sleep_cond;
+  pthread_cond_t _writer_cond;
+
+  // Recovery function provided by the callers
+  void (*_callback)(T);
+
+  // Static worker thread function that is passed into pthread_create.
+  //
+  // @param worker pointer to the worker's state.
+  // @return NULL (required by the pthreads API).
+  static void *static_worker_thread_func(void *worker)
+  {
+    Worker* w = (Worker*)worker;
+    w->pool->worker_thread_func(w);
+    return NULL;
+  }
+
+  // Count a work item and then put it on a worker's deque, copying or moving
+  // it as the caller requested.
+  template <class U>
+  void push_work(U&& work, int affinity)
+  {
+    reserve_space();
+
+    Worker* worker = choose_worker(affinity);
+
+    pthread_mutex_lock(&worker->lock);
+    worker->items.push_back(std::forward<U>(work));
+    pthread_mutex_unlock(&worker->lock);
+
+    // Wake a sleeping worker if there is one.  The sequentially-consistent
+    // increment of _pending in reserve_space pairs with the increment of
+    // _sleepers in wait_for_work, so either we see the sleeper or it sees
+    // the item.
+    if (_sleepers.load() > 0)
+    {
+      pthread_mutex_lock(&_sleep_lock);
+      pthread_cond_signal(&_sleep_cond);
+      pthread_mutex_unlock(&_sleep_lock);
+    }
+  }
+
+  Worker* choose_worker(int affinity)
+  {
+    if (affinity >= 0)
+    {
+      return _workers[affinity % _num_threads];
+    }
+    else if (_current_pool == this)
+    {
+      // Work spawned from one of our own workers stays on that worker.
+      return _workers[_current_index];
+    }
+    else
+    {
+      return _workers[_next_worker.fetch_add(1) % _num_threads];
+    }
+  }
+
+  // Take a work item for the specified worker, first from its own deque and
+  // then by stealing from the other workers.
+  //
+  // @return whether an item was found.
+  bool take_work(Worker* worker, T& work)
+  {
+    bool got_work = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if (!worker->items.empty())
+    {
+      // Process our own work newest first, as it is most likely to still be
+      // in cache.
+      work = std::move(worker->items.back());
+      worker->items.pop_back();
+      got_work = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    if ((!got_work) && (_num_threads > 1))
+    {
+      // Pick a random victim to start from, so that thieves don't all pile on
+      // to the same worker.
+      uint32_t r = worker->rand_state;
+      r ^= r << 13;
+      r ^= r >> 17;
+      r ^= r << 5;
+      worker->rand_state = r;
+
+      // Avoid blocking behind the victims' owners on the first pass - if a
+      // deque is busy, move on to the next one.  If that finds nothing but
+      // some deques were busy, make a second pass that waits for their locks
+      // rather than spinning round again.
+      bool contended = false;
+
+      for (int pass = 0; (pass < 2) && (!got_work); ++pass)
+      {
+        for (unsigned int ii = 0; (ii < _num_threads) && (!got_work); ++ii)
+        {
+          Worker* victim = _workers[(r + ii) % _num_threads];
+          if (victim == worker)
+          {
+            continue;
+          }
+
+          if (pass == 0)
+          {
+            if (pthread_mutex_trylock(&victim->lock) != 0)
+            {
+              contended = true;
+              continue;
+            }
+          }
+          else
+          {
+            pthread_mutex_lock(&victim->lock);
+          }
+
+          if (!victim->items.empty())
+          {
+            // Steal the oldest item.
+            work = std::move(victim->items.front());
+            victim->items.pop_front();
+            got_work = true;
+          }
+          pthread_mutex_unlock(&victim->lock);
+        }
+
+        if (!contended)
+        {
+          break;
+        }
+      }
+    }
+
+    if (got_work)
+    {
+      _pending.fetch_sub(1);
+
+      // Are there blocked writers?
+      if ((_max_queue != 0) && (_blocked_writers.load() > 0))
+      {
+        pthread_mutex_lock(&_sleep_lock);
+        pthread_cond_signal(&_writer_cond);
+        pthread_mutex_unlock(&_sleep_lock);
+      }
+    }
+
+    return got_work;
+  }
+
+  // Sleep until there may be work available or the pool is terminated.
+  void wait_for_work()
+  {
+    if (_pending.load() != 0)
+    {
+      // There is work, but we couldn't take it - it is still being put on a
+      // deque, or another thread got to it first.  Yield rather than spin so
+      // the thread holding it can make progress.
+      sched_yield();
+      return;
+    }
+
+    pthread_mutex_lock(&_sleep_lock);
+    _sleepers.fetch_add(1);
+
+    while ((_pending.load() == 0) && (!_terminated.load()))
+    {
+      pthread_cond_wait(&_sleep_cond, &_sleep_lock);
+    }
+
+    _sleepers.fetch_sub(1);
+    pthread_mutex_unlock(&_sleep_lock);
+  }
+
+  // Count a new work item, first waiting until the number of queued items is
+  // below max_queue (if there is one).  The space is claimed with a
+  // compare-and-swap, so concurrent writers can't overshoot max_queue, and
+  // the item is counted before it is published on a deque, so a thief can't
+  // take it (and decrement _pending) before it is counted.
+  void reserve_space()
+  {
+    if (_max_queue == 0)
+    {
+      _pending.fetch_add(1);
+      return;
+    }
+
+    int pending = _pending.load();
+
+    while (true)
+    {
+      if (((unsigned int)pending < _max_queue) || (_terminated.load()))
+      {
+        if (_pending.compare_exchange_weak(pending, pending + 1))
+        {
+          break;
+        }
+      }
+      else
+      {
+        wait_for_space();
+        pending = _pending.load();
+      }
+    }
+  }
+
+  // Block until the number of queued items is below max_queue.
+  void wait_for_space()
+  {
+    if ((unsigned int)_pending.load() >= _max_queue)
+    {
+      pthread_mutex_lock(&_sleep_lock);
+      _blocked_writers.fetch_add(1);
+
+      while (((unsigned int)_pending.load() >= _max_queue) &&
+             (!_terminated.load()))
+      {
+        pthread_cond_wait(&_writer_cond, &_sleep_lock);
+      }
+
+      _blocked_writers.fetch_sub(1);
+      pthread_mutex_unlock(&_sleep_lock);
+    }
+  }
+
+  // Discard all work items on all the deques.
+  void purge()
+  {
+    for (unsigned int ii = 0; ii < _num_threads; ++ii)
+    {
+      Worker* worker = _workers[ii];
+      pthread_mutex_lock(&worker->lock);
+      _pending.fetch_sub(worker->items.size());
+      worker->items.clear();
+      pthread_mutex_unlock(&worker->lock);
+    }
+  }
+
+  // Wake all the workers and writers and tell them to exit.
+  void terminate()
+  {
+    pthread_mutex_lock(&_sleep_lock);
+    _terminated.store(true);
+    pthread_cond_broadcast(&_sleep_cond);
+    pthread_cond_broadcast(&_writer_cond);
+    pthread_mutex_unlock(&_sleep_lock);
+  }
+
+  // Take one work item and process it.  This is called repeatedly by the
+  // worker threads until it returns false (meaning the pool has been
+  // terminated).
+  bool run_once(Worker* worker)
+  {
+    T work;
+    bool got_work = false;
+
+    while ((!got_work) && (!_terminated.load()))
+    {
+      got_work = take_work(worker, work);
+
+      if (!got_work)
+      {
+        wait_for_work();
+      }
+    }
+
+    if (got_work)
+    {
+      CW_TRY
+      {
+        process_work(work);
+      }
+      CW_EXCEPT(_exception_handler)
+      {
+        _callback(work);
+      }
+      CW_END
+    }
+
+    return got_work;
+  }
+
+  // Function executed by a single worker thread. This loops pulling work off
+  // the deques and processing it.
+  void worker_thread_func(Worker* worker)
+  {
+    bool got_work;
+
+    _current_pool = this;
+    _current_index = worker->index;
+
+    // Startup hook.
+    on_thread_startup();
+
+    do
+    {
+      got_work = run_once(worker);
+
+      // If we haven't got any work then the pool must have been terminated.
+      // Exit the loop.
+    } while (got_work);
+
+    // Shutdown hook.
+    on_thread_shutdown();
+
+    _current_pool = NULL;
+    _current_index = NO_AFFINITY;
+  }
+
+  // (Optional) thread startup hook.  This is called by each worker thread just
+  // after it starts up.
+  //
+  // The default implementation of this hook is a no-op.
+  virtual void on_thread_startup() {};
+
+  // (Optional) thread shutdown hook.  This is called by each worker thread just
+  // before it exits.
+  //
+  // The default implementation of this hook is a no-op.
+  virtual void on_thread_shutdown() {};
+
+  // Process a work item. This method must be overridden by the subclass.
+  virtual void process_work(T& work) = 0;
+};
+
+template <class T>
+thread_local WorkStealingThreadPool<T>* WorkStealingThreadPool<T>::_current_pool = NULL;
+
+template <class T>
+thread_local int WorkStealingThreadPool<T>::_current_index = WorkStealingThreadPool<T>::NO_AFFINITY;
+
+/// A work-stealing equivalent of FunctorThreadPool.  Functors added from a
+/// worker thread (for example follow-on work scheduled by a lambda) are run
+/// on the same worker unless another worker is idle and steals them.
+class FunctorWorkStealingThreadPool :
+  public WorkStealingThreadPool<std::function<void()>>
+{
+public:
+  /// Just use the `WorkStealingThreadPool` constructor.
+  using WorkStealingThreadPool<std::function<void()>>::WorkStealingThreadPool;
+
+  virtual ~FunctorWorkStealingThreadPool() {};
+
+  void process_work(std::function<void()>& callable)
+  {
+    callable();
+  }
+};
+
+#endif
@@ -17,27 +17,13 @@
 void Accumulator::accumulate(unsigned long sample)
 {
   // Update the basic counters and samples.
-  _current._n++;
-  _current._sigma += sample;
-  _current._sigma_squared += sample * sample;
+  _current._n.increment();
+  _current._sigma.increment(sample);
+  _current._sigma_squared.increment(sample * sample);
 
-  // Update the low- and high-water marks.  In each case, we get the current
-  // value, decide whether a change is required and then atomically swap it
-  // if so, repeating if it was changed in the meantime.  Note that
-  // compare_exchange_weak loads the current value into the expected value
-  // parameter (lwm or hwm below) if the compare fails.
-  uint_fast64_t lwm = _current._lwm.load();
-  while ((sample < lwm) &&
-	 (!_current._lwm.compare_exchange_weak(lwm, sample)))
-  {
-    // Do nothing.
-  }
-  uint_fast64_t hwm = _current._hwm.load();
-  while ((sample > hwm) &&
-	 (!_current._hwm.compare_exchange_weak(hwm, sample)))
-  {
-    // Do nothing.
-  }
+  // Update the low- and high-water marks.
+  _current._lwm.update(sample);
+  _current._hwm.update(sample);
 
   // Refresh the statistics, if required.
   refresh();
@@ -69,11 +55,11 @@ void Accumulator::reset()
   // Get the timestamp now.
   _current._timestamp_us.store(get_timestamp_us());
   // Reset everything else to 0.
-  _current._n.store(0);
-  _current._sigma.store(0);
-  _current._sigma_squared.store(0);
-  _current._lwm.store(MAX_UINT_FAST64);
-  _current._hwm.store(0);
+  _current._n.reset();
+  _current._sigma.reset();
+  _current._sigma_squared.reset();
+  _current._lwm.reset();
+  _current._hwm.reset();
   _last._n = 0;
   _last._mean = 0;
   _last._variance = 0;
@@ -86,9 +72,9 @@ void Accumulator::reset()
 void Accumulator::read(uint_fast64_t period_us)
 {
   // Read the basic statistics, and replace them with 0.
-  uint_fast64_t n = _current._n.exchange(0);
-  uint_fast64_t sigma = _current._sigma.exchange(0);
-  uint_fast64_t sigma_squared = _current._sigma_squared.exchange(0);
+  uint_fast64_t n = _current._n.read_and_reset();
+  uint_fast64_t sigma = _current._sigma.read_and_reset();
+  uint_fast64_t sigma_squared = _current._sigma_squared.read_and_reset();
   // Scale n by the period.
   _last._n = n * period_us / _target_period_us;
   // Calculate the mean in the obvious way (avoiding division by 0.
@@ -98,9 +84,9 @@ void Accumulator::read(uint_fast64_t period_us)
   _last._variance = (n > 0) ? ((sigma_squared / n) - (mean * mean)) : 0;
   // Read low- and high-water marks, fixing low-water mark to 0 if there were
   // no samples in the period.
-  uint_fast64_t lwm = _current._lwm.exchange(MAX_UINT_FAST64);
+  uint_fast64_t lwm = _current._lwm.read_and_reset();
   _last._lwm = (n > 0) ? lwm : 0;
-  _last._hwm = _current._hwm.exchange(0);
+  _last._hwm = _current._hwm.read_and_reset();
 }
 
 /// Callback whenever the accumulated statistics are refreshed.  Passes
@@ -0,0 +1,345 @@
+/**
+ * @file cassandra_kv_store.cpp Adapter exposing a cassandra store through the
+ * generic Store interface.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "cassandra_kv_store.h"
+#include "log.h"
+
+using namespace org::apache::cassandra;
+
+namespace CassandraStore
+{
+
+const std::string KeyValueStore::DATA_COLUMN = "data";
+
+/// Operation that reads the data column from several rows of a column family
+/// in a single request.
+class MultiGetDataOperation : public HAOperation
+{
+public:
+  MultiGetDataOperation(const std::string& table,
+                        const std::vector<std::string>& keys) :
+    HAOperation(),
+    _table(table),
+    _keys(keys),
+    _columns()
+  {
+  }
+
+  /// Gets the data and CAS (the column timestamp) for a key.
+  ///
+  /// @return - Whether the key was found.
+  bool get_data(const std::string& key, std::string& data, uint64_t& cas)
+  {
+    std::map<std::string, std::vector<ColumnOrSuperColumn> >::const_iterator row =
+      _columns.find(key);
+
+    if (row != _columns.end())
+    {
+      for (const ColumnOrSuperColumn& column : row->second)
+      {
+        if (column.column.name == KeyValueStore::DATA_COLUMN)
+        {
+          data = column.column.value;
+          cas = column.column.timestamp;
+          return true;
+        }
+      }
+    }
+
+    return false;
+  }
+
+protected:
+  bool perform(Client* client, SAS::TrailId trail)
+  {
+    _columns.clear();
+
+    try
+    {
+      ha_multiget_columns(client,
+                          _table,
+                          _keys,
+                          std::vector<std::string>(1, KeyValueStore::DATA_COLUMN),
+                          _columns,
+                          trail);
+    }
+    catch (RowNotFoundException& rnfe)
+    {
+      // None of the rows exist.  This isn't an error for a multi-key read.
+      TRC_DEBUG("None of the %zu rows exist in %s", _keys.size(), _table.c_str());
+    }
+
+    return true;
+  }
+
+private:
+  std::string _table;
+  std::vector<std::string> _keys;
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > _columns;
+};
+
+/// Operation that writes the data column in several rows of a column family
+/// in a single batch_mutate.  A request with an expiry of zero deletes the
+/// data, as the Store interface requires it to expire immediately.
+///
+/// Each write is checked against the request's CAS: the current timestamp of
+/// the data column is read first (with a single multiget_slice), and only the
+/// rows whose timestamp matches the CAS (or that don't exist, for a CAS of
+/// zero) are written.  The others fail with DATA_CONTENTION.  Each write is
+/// given a timestamp later than the one it was checked against, so that it
+/// supersedes that version even if the clocks of the writers differ.
+class MultiSetDataOperation : public HAOperation
+{
+public:
+  MultiSetDataOperation(const std::string& table,
+                        const std::vector< ::Store::SetRequest>& requests) :
+    HAOperation(),
+    _table(table),
+    _requests(requests),
+    _statuses(requests.size(), ::Store::ERROR)
+  {
+  }
+
+  /// Gets the result of each write, in the same order as the requests.
+  const std::vector< ::Store::Status>& get_statuses() { return _statuses; }
+
+protected:
+  bool perform(Client* client, SAS::TrailId trail)
+  {
+    std::vector<std::string> keys;
+    for (const ::Store::SetRequest& request : _requests)
+    {
+      keys.push_back(request.key);
+    }
+
+    // Read the current timestamp of each row's data column.
+    std::map<std::string, std::vector<ColumnOrSuperColumn> > columns;
+
+    try
+    {
+      ha_multiget_columns(client,
+                          _table,
+                          keys,
+                          std::vector<std::string>(1, KeyValueStore::DATA_COLUMN),
+                          columns,
+                          trail);
+    }
+    catch (RowNotFoundException& rnfe)
+    {
+      // None of the rows exist.
+    }
+
+    std::map<std::string, int64_t> current;
+    for (const std::pair<const std::string, std::vector<ColumnOrSuperColumn> >& row : columns)
+    {
+      for (const ColumnOrSuperColumn& column : row.second)
+      {
+        if (column.column.name == KeyValueStore::DATA_COLUMN)
+        {
+          current[row.first] = column.column.timestamp;
+        }
+      }
+    }
+
+    int64_t timestamp = Store::generate_timestamp();
+
+    // The mutation map is of the form {"key": {"column_family": [mutations] } }
+    std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutmap;
+
+    for (size_t ii = 0; ii < _requests.size(); ++ii)
+    {
+      const ::Store::SetRequest& request = _requests[ii];
+      std::map<std::string, int64_t>::const_iterator row = current.find(request.key);
+      uint64_t current_cas = (row != current.end()) ? row->second : 0;
+
+      // A key that is written more than once in the batch fails all but the
+      // first write, as the CAS of the later writes is out of date.
+      if ((current_cas != request.cas) || (mutmap.count(request.key) != 0))
+      {
+        TRC_DEBUG("Contention writing %s in %s: CAS %lu, current %lu",
+                  request.key.c_str(), _table.c_str(), request.cas, current_cas);
+        _statuses[ii] = ::Store::DATA_CONTENTION;
+        continue;
+      }
+
+      int64_t write_timestamp = std::max(timestamp, (int64_t)request.cas + 1);
+      Mutation mutation;
+
+      if (request.expiry > 0)
+      {
+        Column* column = &mutation.column_or_supercolumn.column;
+        column->name = KeyValueStore::DATA_COLUMN;
+        column->value = request.data;
+        column->__isset.value = true;
+        column->timestamp = write_timestamp;
+        column->__isset.timestamp = true;
+        column->ttl = request.expiry;
+        column->__isset.ttl = true;
+        mutation.column_or_supercolumn.__isset.column = true;
+        mutation.__isset.column_or_supercolumn = true;
+      }
+      else
+      {
+        SlicePredicate what;
+        Deletion deletion;
+        what.__set_column_names(std::vector<std::string>(1, KeyValueStore::DATA_COLUMN));
+        deletion.__set_predicate(what);
+        deletion.__set_timestamp(write_timestamp);
+        mutation.__set_deletion(deletion);
+      }
+
+      mutmap[request.key][_table].push_back(mutation);
+      _statuses[ii] = ::Store::OK;
+    }
+
+    if (!mutmap.empty())
+    {
+      TRC_DEBUG("Writing %zu rows to %s", mutmap.size(), _table.c_str());
+      client->batch_mutate(mutmap, ConsistencyLevel::ONE);
+    }
+
+    return true;
+  }
+
+private:
+  std::string _table;
+  std::vector< ::Store::SetRequest> _requests;
+  std::vector< ::Store::Status> _statuses;
+};
+
+/// Operation that deletes a row.
+///
+/// The adapter runs all its operations synchronously, and write batching only
+/// applies to asynchronous operations, so this isn't marked as batchable.
+class DeleteDataOperation : public Operation
+{
+public:
+  DeleteDataOperation(const std::string& table, const std::string& key) :
+    Operation(),
+    _table(table),
+    _key(key)
+  {
+  }
+
+protected:
+  bool perform(Client* client, SAS::TrailId trail)
+  {
+    client->delete_row(_table, _key, Store::generate_timestamp());
+    return true;
+  }
+
+private:
+  std::string _table;
+  std::string _key;
+};
+
+KeyValueStore::KeyValueStore(CassandraStore::Store* store) :
+  _store(store)
+{
+}
+
+KeyValueStore::~KeyValueStore()
+{
+}
+
+::Store::Status KeyValueStore::get_data(const std::string& table,
+                                        const std::string& key,
+                                        std::string& data,
+                                        uint64_t& cas,
+                                        SAS::TrailId trail)
+{
+  std::vector< ::Store::GetRequest> requests(1, ::Store::GetRequest(key));
+  get_data_multi(table, requests, trail);
+
+  data = requests[0].data;
+  cas = requests[0].cas;
+  return requests[0].status;
+}
+
+::Store::Status KeyValueStore::set_data(const std::string& table,
+                                        const std::string& key,
+                                        const std::string& data,
+                                        uint64_t cas,
+                                        int expiry,
+                                        SAS::TrailId trail)
+{
+  std::vector< ::Store::SetRequest> requests(1, ::Store::SetRequest(key, data, cas, expiry));
+  set_data_multi(table, requests, trail);
+
+  return requests[0].status;
+}
+
+::Store::Status KeyValueStore::delete_data(const std::string& table,
+                                           const std::string& key,
+                                           SAS::TrailId trail)
+{
+  DeleteDataOperation op(table, key);
+  return _store->do_sync(&op, trail) ? ::Store::OK : ::Store::ERROR;
+}
+
+void KeyValueStore::get_data_multi(const std::string& table,
+                                   std::vector< ::Store::GetRequest>& requests,
+                                   SAS::TrailId trail)
+{
+  if (requests.empty())
+  {
+    return;
+  }
+
+  std::vector<std::string> keys;
+  for (const ::Store::GetRequest& request : requests)
+  {
+    keys.push_back(request.key);
+  }
+
+  MultiGetDataOperation op(table, keys);
+  bool success = _store->do_sync(&op, trail);
+
+  for (::Store::GetRequest& request : requests)
+  {
+    if (!success)
+    {
+      request.status = ::Store::ERROR;
+    }
+    else if (op.get_data(request.key, request.data, request.cas))
+    {
+      request.status = ::Store::OK;
+    }
+    else
+    {
+      request.cas = 0;
+      request.status = ::Store::NOT_FOUND;
+    }
+  }
+}
+
+void KeyValueStore::set_data_multi(const std::string& table,
+                                   std::vector< ::Store::SetRequest>& requests,
+                                   SAS::TrailId trail)
+{
+  if (requests.empty())
+  {
+    return;
+  }
+
+  MultiSetDataOperation op(table, requests);
+  bool success = _store->do_sync(&op, trail);
+
+  for (size_t ii = 0; ii < requests.size(); ++ii)
+  {
+    requests[ii].status = success ? op.get_statuses()[ii] : ::Store::ERROR;
+  }
+}
+
+} // namespace CassandraStore
@@ -11,6 +11,8 @@
  */
 
 #include <boost/format.hpp>
+#include <errno.h>
+#include <exception>
 #include <time.h>
 
 #include "cassandra_store.h"
@@ -29,6 +31,11 @@ namespace CassandraStore
 // set the limit very high instead.
 const int32_t GET_SLICE_MAX_COLUMNS = 1000000;
 
+// How long a coalesced read waits for the identical read that is already in
+// flight before giving up on it and making its own read.  A healthy read
+// completes, or fails with a transport error, well within this time.
+const int MAX_COALESCED_WAIT_MS = 500;
+
 // No-op operation class
 class NoOperation : public Operation
 {
@@ -127,6 +134,17 @@ ha_get_columns_with_prefix(Client* client,
 }
 
 
+void HAOperation::
+ha_multiget_columns(Client* client,
+                    const std::string& column_family,
+                    const std::vector<std::string>& keys,
+                    const std::vector<std::string>& names,
+                    std::map<std::string, std::vector<ColumnOrSuperColumn> >& columns,
+                    SAS::TrailId trail)
+{
+  HA(client, multiget_columns, trail, column_family, keys, names, columns);
+}
+
 void HAOperation::
 ha_multiget_columns_with_prefix(Client* client,
                                 const std::string& column_family,
@@ -254,8 +272,30 @@ Store::Store(const std::string& keyspace) :
   _max_queue(0),
   _thread_pool(NULL),
   _comm_monitor(NULL),
-  _conn_pool(new CassandraConnectionPool())
+  _conn_pool(new CassandraConnectionPool()),
+  _batch_interval_ms(0),
+  _max_batch_ops(0),
+  _batch_thread_running(false),
+  _batch_terminated(false),
+  _batch_op(NULL),
+  _batch_trx(NULL),
+  _read_coalescing(false),
+  _coalesced_reads_tbl(NULL)
 {
+  pthread_mutex_init(&_batch_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_batch_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_mutex_init(&_in_flight_lock, NULL);
+
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_in_flight_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
 }
 
 void Store::configure_connection(std::string cass_hostname,
@@ -302,6 +342,27 @@ void Store::configure_workers(ExceptionHandler* exception_handler,
 }
 
 
+void Store::configure_write_batching(unsigned int flush_interval_ms,
+                                     unsigned int max_batch_ops)
+{
+  TRC_STATUS("Configuring store write batching");
+  TRC_STATUS("  Flush interval: %u ms", flush_interval_ms);
+  TRC_STATUS("  Max batch ops:  %u", max_batch_ops);
+  _batch_interval_ms = flush_interval_ms;
+  _max_batch_ops = (max_batch_ops > 0) ? max_batch_ops : 1;
+}
+
+
+void Store::configure_read_coalescing(bool enabled,
+                                      SNMP::CounterTable* coalesced_reads_tbl)
+{
+  TRC_STATUS("Configuring store read coalescing");
+  TRC_STATUS("  Enabled: %s", enabled ? "true" : "false");
+  _read_coalescing = enabled;
+  _coalesced_reads_tbl = coalesced_reads_tbl;
+}
+
+
 ResultCode Store::start()
 {
   ResultCode rc = OK;
@@ -324,6 +385,21 @@ ResultCode Store::start()
     {
       rc = RESOURCE_ERROR; // LCOV_EXCL_LINE
     }
+    else if (_batch_interval_ms > 0)
+    {
+      // Start the thread that flushes batched writes.
+      if (pthread_create(&_batch_thread, NULL, batch_thread_func, this) == 0)
+      {
+        _batch_thread_running = true;
+      }
+      else
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("Failed to start cassandra batch thread");
+        rc = RESOURCE_ERROR;
+        // LCOV_EXCL_STOP
+      }
+    }
   }
 
   return rc;
@@ -333,6 +409,22 @@ ResultCode Store::start()
 void Store::stop()
 {
   TRC_STATUS("Stopping store");
+
+  // Stop batching writes, and pass any pending batch to the thread pool so
+  // that it is processed before the pool stops.
+  pthread_mutex_lock(&_batch_lock);
+  _batch_terminated = true;
+  pthread_cond_signal(&_batch_cond);
+  pthread_mutex_unlock(&_batch_lock);
+
+  if (_batch_thread_running)
+  {
+    pthread_join(_batch_thread, NULL);
+    _batch_thread_running = false;
+  }
+
+  flush_batch();
+
   if (_thread_pool != NULL)
   {
     _thread_pool->stop();
@@ -363,9 +455,424 @@ Store::~Store()
   }
 
   delete _conn_pool; _conn_pool = NULL;
+
+  pthread_cond_destroy(&_batch_cond);
+  pthread_mutex_destroy(&_batch_lock);
+  pthread_cond_destroy(&_in_flight_cond);
+  pthread_mutex_destroy(&_in_flight_lock);
 }
 
 
+//
+// Read coalescing
+//
+
+/// The state of a read that other threads may be waiting on.  The thread that
+/// makes the read (the leader) removes it from the store's map of in-flight
+/// reads when the read completes, so no new waiters can join, and then fills
+/// in the result.  The last waiter to copy the result frees it, or the leader
+/// does if all the waiters have given up waiting.
+///
+/// If the read fails, the type and text of the exception are stored rather
+/// than the exception itself, and each waiter throws its own copy.
+struct Store::InFlightRead
+{
+  typedef enum {NONE,
+                TIMED_OUT,
+                INVALID_REQUEST,
+                NOT_FOUND,
+                UNAVAILABLE,
+                OTHER} ExceptionType;
+
+  InFlightRead() :
+    complete(false),
+    transport_failed(false),
+    waiters(0),
+    exception_type(NONE),
+    exception_text()
+  {}
+
+  bool complete;
+  bool transport_failed;
+  unsigned int waiters;
+  ExceptionType exception_type;
+  std::string exception_text;
+  std::vector<ColumnOrSuperColumn> columns;
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > multi_columns;
+};
+
+/// Client that shares identical reads between threads.  Writes, and reads
+/// that aren't worth sharing (range slices), go straight to the real client.
+class Store::CoalescingClient : public Client
+{
+public:
+  CoalescingClient(Store* store, Client* client) :
+    _store(store),
+    _client(client)
+  {
+  }
+
+  bool is_connected() { return _client->is_connected(); }
+  void connect() { _client->connect(); }
+  void set_keyspace(const std::string& keyspace) { _client->set_keyspace(keyspace); }
+
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+                    const ConsistencyLevel::type consistency_level)
+  {
+    _client->batch_mutate(mutation_map, consistency_level);
+  }
+
+  void remove(const std::string& key,
+              const ColumnPath& column_path,
+              const int64_t timestamp,
+              const ConsistencyLevel::type consistency_level)
+  {
+    _client->remove(key, column_path, timestamp, consistency_level);
+  }
+
+  void get_range_slices(std::vector<KeySlice> & _return,
+                        const ColumnParent& column_parent,
+                        const SlicePredicate& predicate,
+                        const KeyRange& range,
+                        const ConsistencyLevel::type consistency_level)
+  {
+    _client->get_range_slices(_return, column_parent, predicate, range, consistency_level);
+  }
+
+  void get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const ColumnParent& column_parent,
+                 const SlicePredicate& predicate,
+                 const ConsistencyLevel::type consistency_level)
+  {
+    std::string read_key = describe_read('G',
+                                         std::vector<std::string>(1, key),
+                                         column_parent,
+                                         predicate,
+                                         consistency_level);
+    coalesce(read_key, &InFlightRead::columns, _return, [&]()
+    {
+      _client->get_slice(_return, key, column_parent, predicate, consistency_level);
+    });
+  }
+
+  void multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const ColumnParent& column_parent,
+                      const SlicePredicate& predicate,
+                      const ConsistencyLevel::type consistency_level)
+  {
+    std::string read_key = describe_read('M',
+                                         keys,
+                                         column_parent,
+                                         predicate,
+                                         consistency_level);
+    coalesce(read_key, &InFlightRead::multi_columns, _return, [&]()
+    {
+      _client->multiget_slice(_return, keys, column_parent, predicate, consistency_level);
+    });
+  }
+
+private:
+  // Build a string that uniquely identifies a read.  Each variable length
+  // field is prefixed with its length so that different reads can't produce
+  // the same string.
+  static std::string describe_read(char type,
+                                   const std::vector<std::string>& keys,
+                                   const ColumnParent& column_parent,
+                                   const SlicePredicate& predicate,
+                                   const ConsistencyLevel::type consistency_level)
+  {
+    std::string read_key(1, type);
+    read_key += std::to_string(consistency_level);
+
+    add_field(read_key, column_parent.column_family);
+    if (column_parent.__isset.super_column)
+    {
+      add_field(read_key, column_parent.super_column);
+    }
+
+    read_key += 'K';
+    for (size_t ii = 0; ii < keys.size(); ++ii)
+    {
+      add_field(read_key, keys[ii]);
+    }
+
+    if (predicate.__isset.column_names)
+    {
+      read_key += 'N';
+      for (size_t ii = 0; ii < predicate.column_names.size(); ++ii)
+      {
+        add_field(read_key, predicate.column_names[ii]);
+      }
+    }
+
+    if (predicate.__isset.slice_range)
+    {
+      read_key += 'R';
+      add_field(read_key, predicate.slice_range.start);
+      add_field(read_key, predicate.slice_range.finish);
+      read_key += predicate.slice_range.reversed ? 'r' : 'f';
+      read_key += std::to_string(predicate.slice_range.count);
+    }
+
+    return read_key;
+  }
+
+  static void add_field(std::string& read_key, const std::string& field)
+  {
+    read_key += std::to_string(field.size());
+    read_key += ':';
+    read_key += field;
+  }
+
+  // Make a read, or wait for an identical read that is already in flight.
+  //
+  // If the read in flight fails because of its connection, or doesn't
+  // complete within MAX_COALESCED_WAIT_MS, we make our own read on our own
+  // connection instead.
+  //
+  // @param read_key - The description of the read.
+  // @param field    - The field of the InFlightRead that holds the result.
+  // @param result   - Filled in with the result of the read.
+  // @param do_read  - Function that makes the read using the real client.
+  template <typename T, typename F>
+  void coalesce(const std::string& read_key,
+                T InFlightRead::* field,
+                T& result,
+                F do_read)
+  {
+    bool leader = false;
+    InFlightRead* read;
+
+    pthread_mutex_lock(&_store->_in_flight_lock);
+    std::map<std::string, InFlightRead*>::iterator it =
+                                      _store->_in_flight_reads.find(read_key);
+    if (it != _store->_in_flight_reads.end())
+    {
+      read = it->second;
+      read->waiters++;
+    }
+    else
+    {
+      read = new InFlightRead();
+      _store->_in_flight_reads[read_key] = read;
+      leader = true;
+    }
+    pthread_mutex_unlock(&_store->_in_flight_lock);
+
+    if (leader)
+    {
+      try
+      {
+        do_read();
+      }
+      catch(TTransportException& te)
+      {
+        // The failure is specific to our connection, so the waiters make
+        // their own reads rather than failing too.
+        if (detach(read_key, read))
+        {
+          read->transport_failed = true;
+          complete(read);
+        }
+        throw;
+      }
+      catch(TimedOutException& toe)
+      {
+        fail(read_key, read, InFlightRead::TIMED_OUT, "");
+        throw;
+      }
+      catch(InvalidRequestException& ire)
+      {
+        fail(read_key, read, InFlightRead::INVALID_REQUEST, ire.why);
+        throw;
+      }
+      catch(NotFoundException& nfe)
+      {
+        fail(read_key, read, InFlightRead::NOT_FOUND, "");
+        throw;
+      }
+      catch(UnavailableException& ue)
+      {
+        fail(read_key, read, InFlightRead::UNAVAILABLE, "");
+        throw;
+      }
+      catch(std::exception& e)
+      {
+        fail(read_key, read, InFlightRead::OTHER, e.what());
+        throw;
+      }
+      catch(...)
+      {
+        fail(read_key, read, InFlightRead::OTHER, "Unknown error");
+        throw;
+      }
+
+      if (detach(read_key, read))
+      {
+        read->*field = result;
+        complete(read);
+      }
+    }
+    else
+    {
+      timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += MAX_COALESCED_WAIT_MS / 1000;
+      deadline.tv_nsec += (MAX_COALESCED_WAIT_MS % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+
+      pthread_mutex_lock(&_store->_in_flight_lock);
+      int rc = 0;
+      while ((!read->complete) && (rc != ETIMEDOUT))
+      {
+        rc = pthread_cond_timedwait(&_store->_in_flight_cond,
+                                    &_store->_in_flight_lock,
+                                    &deadline);
+      }
+
+      if (!read->complete)
+      {
+        // Give up on the read.  The leader frees it when it completes if
+        // we were the last waiter.
+        read->waiters--;
+        pthread_mutex_unlock(&_store->_in_flight_lock);
+
+        TRC_DEBUG("Timed out waiting for in-flight cassandra read");
+        do_read();
+        return;
+      }
+      pthread_mutex_unlock(&_store->_in_flight_lock);
+
+      // The result isn't modified once the read is complete, so it's safe to
+      // copy without the lock.
+      bool transport_failed = read->transport_failed;
+      InFlightRead::ExceptionType exception_type = read->exception_type;
+      std::string exception_text = read->exception_text;
+      if ((!transport_failed) && (exception_type == InFlightRead::NONE))
+      {
+        result = read->*field;
+      }
+
+      pthread_mutex_lock(&_store->_in_flight_lock);
+      bool last_waiter = (--read->waiters == 0);
+      pthread_mutex_unlock(&_store->_in_flight_lock);
+
+      if (last_waiter)
+      {
+        delete read; read = NULL;
+      }
+
+      if (transport_failed)
+      {
+        // Make our own read.  This isn't shared, so that a read can't be
+        // retried indefinitely by a succession of failing leaders.
+        do_read();
+      }
+      else
+      {
+        TRC_DEBUG("Shared result of in-flight cassandra read");
+
+        if (_store->_coalesced_reads_tbl != NULL)
+        {
+          _store->_coalesced_reads_tbl->increment();
+        }
+
+        throw_exception(exception_type, exception_text);
+      }
+    }
+  }
+
+  // Complete a read that failed with an exception, recording the exception
+  // for the waiters.
+  void fail(const std::string& read_key,
+            InFlightRead*& read,
+            InFlightRead::ExceptionType exception_type,
+            const std::string& exception_text)
+  {
+    if (detach(read_key, read))
+    {
+      read->exception_type = exception_type;
+      read->exception_text = exception_text;
+      complete(read);
+    }
+  }
+
+  // Throw a new exception of the given type, if there is one.  Each waiter
+  // throws its own exception, rather than sharing the leader's between
+  // threads.
+  static void throw_exception(InFlightRead::ExceptionType exception_type,
+                              const std::string& exception_text)
+  {
+    switch (exception_type)
+    {
+    case InFlightRead::TIMED_OUT:
+      throw TimedOutException();
+
+    case InFlightRead::INVALID_REQUEST:
+    {
+      InvalidRequestException ire;
+      ire.why = exception_text;
+      throw ire;
+    }
+
+    case InFlightRead::NOT_FOUND:
+      throw NotFoundException();
+
+    case InFlightRead::UNAVAILABLE:
+      throw UnavailableException();
+
+    case InFlightRead::OTHER:
+      throw TException(exception_text);
+
+    case InFlightRead::NONE:
+      break;
+    }
+  }
+
+  // Remove a read from the map of in-flight reads, so that no more waiters
+  // can join it.  Frees the read and returns false if there are no waiters.
+  bool detach(const std::string& read_key, InFlightRead*& read)
+  {
+    pthread_mutex_lock(&_store->_in_flight_lock);
+    _store->_in_flight_reads.erase(read_key);
+    bool has_waiters = (read->waiters > 0);
+    pthread_mutex_unlock(&_store->_in_flight_lock);
+
+    if (!has_waiters)
+    {
+      delete read; read = NULL;
+    }
+
+    return has_waiters;
+  }
+
+  // Mark a read as complete and wake up the waiters.  Frees the read if all
+  // the waiters have given up waiting for it.
+  void complete(InFlightRead* read)
+  {
+    pthread_mutex_lock(&_store->_in_flight_lock);
+    read->complete = true;
+    bool has_waiters = (read->waiters > 0);
+    pthread_cond_broadcast(&_store->_in_flight_cond);
+    pthread_mutex_unlock(&_store->_in_flight_lock);
+
+    if (!has_waiters)
+    {
+      delete read; read = NULL;
+    }
+  }
+
+  Store* _store;
+  Client* _client;
+};
+
+
 bool Store::perform_op(Operation* op,
                        SAS::TrailId trail,
                        ResultCode& cass_result,
@@ -411,7 +918,15 @@ bool Store::perform_op(Operation* op,
         client->set_keyspace(_keyspace);
       }
 
-      success = op->perform(client, trail);
+      if (_read_coalescing)
+      {
+        CoalescingClient coalescing_client(this, client);
+        success = op->perform(&coalescing_client, trail);
+      }
+      else
+      {
+        success = op->perform(client, trail);
+      }
     }
     catch(TTransportException& te)
     {
@@ -423,9 +938,12 @@ bool Store::perform_op(Operation* op,
                          % te.what() % te.getType()).str();
 
       // SAS log the connection error.
-      SAS::Event event(trail, SASEvent::CASS_CONNECT_FAIL, 0);
-      event.add_var_param(cass_error_text);
-      SAS::report_event(event);
+      for (SAS::TrailId sas_trail : sas_trails(op, trail))
+      {
+        SAS::Event event(sas_trail, SASEvent::CASS_CONNECT_FAIL, 0);
+        event.add_var_param(cass_error_text);
+        SAS::report_event(event);
+      }
 
       // Tell the pool not to reuse this connection
       conn_handle.set_return_to_pool(false);
@@ -448,8 +966,11 @@ bool Store::perform_op(Operation* op,
                          % te.what()).str();
 
       // SAS log the timeout.
-      SAS::Event event(trail, SASEvent::CASS_TIMEOUT, 0);
-      SAS::report_event(event);
+      for (SAS::TrailId sas_trail : sas_trails(op, trail))
+      {
+        SAS::Event event(sas_trail, SASEvent::CASS_TIMEOUT, 0);
+        SAS::report_event(event);
+      }
 
       TRC_DEBUG("Cassandra timeout - retrying if possible");
       retry = true;
@@ -557,8 +1078,13 @@ void Store::do_async(Operation*& op, Transaction*& trx)
     assert(!"Can't process async operation as no thread pool has been configured");
   }
 
-  std::pair<Operation*, Transaction*> params(op, trx);
-  _thread_pool->add_work(params);
+  if ((!_batch_thread_running) ||
+      (!op->is_batchable()) ||
+      (!add_to_batch(op, trx)))
+  {
+    std::pair<Operation*, Transaction*> params(op, trx);
+    _thread_pool->add_work(params);
+  }
 
   // The caller no longer owns the operation or transaction, so null them out.
   op = NULL;
@@ -566,6 +1092,459 @@ void Store::do_async(Operation*& op, Transaction*& trx)
 }
 
 
+//
+// Write batching
+//
+
+// Exception thrown by the RecordingClient if an operation tries to read from
+// cassandra.  Operations that do this can't be batched.
+class NotBatchableException
+{
+};
+
+/// Client that records the writes made by an operation, rather than sending
+/// them to cassandra.
+class Store::RecordingClient : public Client
+{
+public:
+  typedef std::map<std::string, std::map<std::string, std::vector<Mutation> > > MutationMap;
+
+  struct Remove
+  {
+    std::string key;
+    ColumnPath column_path;
+    int64_t timestamp;
+    ConsistencyLevel::type consistency_level;
+  };
+
+  /// The writes made by an operation.
+  struct Writes
+  {
+    std::vector<std::pair<ConsistencyLevel::type, MutationMap> > mutations;
+    std::vector<Remove> removes;
+  };
+
+  RecordingClient() : writes() {}
+
+  bool is_connected() { return true; }
+  void connect() {}
+  void set_keyspace(const std::string& keyspace) {}
+
+  void batch_mutate(const MutationMap& mutation_map,
+                    const ConsistencyLevel::type consistency_level)
+  {
+    writes.mutations.push_back(std::make_pair(consistency_level, mutation_map));
+  }
+
+  void remove(const std::string& key,
+              const ColumnPath& column_path,
+              const int64_t timestamp,
+              const ConsistencyLevel::type consistency_level)
+  {
+    Remove record = {key, column_path, timestamp, consistency_level};
+    writes.removes.push_back(record);
+  }
+
+  void get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const ColumnParent& column_parent,
+                 const SlicePredicate& predicate,
+                 const ConsistencyLevel::type consistency_level)
+  {
+    throw NotBatchableException();
+  }
+
+  void multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const ColumnParent& column_parent,
+                      const SlicePredicate& predicate,
+                      const ConsistencyLevel::type consistency_level)
+  {
+    throw NotBatchableException();
+  }
+
+  void get_range_slices(std::vector<KeySlice> & _return,
+                        const ColumnParent& column_parent,
+                        const SlicePredicate& predicate,
+                        const KeyRange& range,
+                        const ConsistencyLevel::type consistency_level)
+  {
+    throw NotBatchableException();
+  }
+
+  Writes writes;
+};
+
+/// Operation that makes all the writes recorded for a batch.  Mutations are
+/// merged into a single batch_mutate for each consistency level.  Removes
+/// can't be expressed as mutations in every version of cassandra, so are
+/// made individually after the mutations.
+///
+/// Each write carries the timestamp that was generated when the original
+/// operation ran, so the batch can safely be retried, or its writes replayed
+/// individually.
+class Store::BatchOperation : public Operation
+{
+public:
+  BatchOperation() : Operation(), _writes(), _trails() {}
+
+  /// Add the writes made by an operation to the batch.
+  ///
+  /// @param writes - The writes.
+  /// @param trail  - The SAS trail of the operation.
+  void add(const RecordingClient::Writes& writes, SAS::TrailId trail)
+  {
+    _writes.push_back(writes);
+    _trails.push_back(trail);
+  }
+
+  unsigned int num_ops() { return _writes.size(); }
+
+  const RecordingClient::Writes& get_writes(unsigned int index)
+  {
+    return _writes[index];
+  }
+
+  const std::vector<SAS::TrailId>& get_trails() { return _trails; }
+
+protected:
+  bool perform(Client* client, SAS::TrailId trail)
+  {
+    TRC_DEBUG("Writing batch of %zu operations to cassandra", _writes.size());
+
+    std::map<ConsistencyLevel::type, RecordingClient::MutationMap> merged_mutations;
+
+    for (const RecordingClient::Writes& writes : _writes)
+    {
+      for (size_t ii = 0; ii < writes.mutations.size(); ++ii)
+      {
+        RecordingClient::MutationMap& merged =
+                                   merged_mutations[writes.mutations[ii].first];
+        const RecordingClient::MutationMap& mutmap =
+                                   writes.mutations[ii].second;
+
+        for (RecordingClient::MutationMap::const_iterator key = mutmap.begin();
+             key != mutmap.end();
+             ++key)
+        {
+          for (std::map<std::string, std::vector<Mutation> >::const_iterator cf =
+                 key->second.begin();
+               cf != key->second.end();
+               ++cf)
+          {
+            std::vector<Mutation>& mutations = merged[key->first][cf->first];
+            mutations.insert(mutations.end(), cf->second.begin(), cf->second.end());
+          }
+        }
+      }
+    }
+
+    for (std::map<ConsistencyLevel::type, RecordingClient::MutationMap>::iterator it =
+           merged_mutations.begin();
+         it != merged_mutations.end();
+         ++it)
+    {
+      client->batch_mutate(it->second, it->first);
+    }
+
+    for (const RecordingClient::Writes& writes : _writes)
+    {
+      for (const RecordingClient::Remove& remove : writes.removes)
+      {
+        client->remove(remove.key,
+                       remove.column_path,
+                       remove.timestamp,
+                       remove.consistency_level);
+      }
+    }
+
+    return true;
+  }
+
+private:
+  std::vector<RecordingClient::Writes> _writes;
+  std::vector<SAS::TrailId> _trails;
+};
+
+/// Transaction that calls back the transactions of all the operations in a
+/// batch with the result of the batch.  It takes ownership of the operations
+/// and transactions, and deletes them once they've been called back.
+///
+/// If the batch is rejected as invalid, one operation's writes may be at
+/// fault, so the writes of each operation are retried on their own and each
+/// transaction is called back with its own result.
+class Store::BatchTransaction : public Transaction
+{
+public:
+  BatchTransaction(Store* store, SAS::TrailId trail) :
+    Transaction(trail),
+    _store(store),
+    _ops()
+  {
+  }
+
+  virtual ~BatchTransaction()
+  {
+    // The operations and transactions are normally freed when the batch
+    // completes, so this only has anything to do if the batch was never
+    // processed.
+    for (size_t ii = 0; ii < _ops.size(); ++ii)
+    {
+      delete _ops[ii].trx; _ops[ii].trx = NULL;
+      delete _ops[ii].op; _ops[ii].op = NULL;
+    }
+  }
+
+  /// Add an operation to the batch.  This must be called in the same order as
+  /// BatchOperation::add.
+  ///
+  /// @param op      - The operation.
+  /// @param trx     - The operation's transaction.
+  /// @param success - The value that the operation's perform() returned.
+  ///                  If this is false, the transaction is called back with
+  ///                  a failure however the batch completes.
+  void add(Operation* op, Transaction* trx, bool success)
+  {
+    BatchedOp batched_op = {op, trx, success};
+    _ops.push_back(batched_op);
+  }
+
+  void on_success(Operation* batch_op)
+  {
+    for (size_t ii = 0; ii < _ops.size(); ++ii)
+    {
+      complete(_ops[ii], _ops[ii].success);
+    }
+
+    _ops.clear();
+  }
+
+  void on_failure(Operation* batch_op)
+  {
+    BatchOperation* batch = (BatchOperation*)batch_op;
+    ResultCode rc = batch->get_result_code();
+    std::string error_text = batch->get_error_text();
+
+    if ((rc == INVALID_REQUEST) && (_ops.size() > 1))
+    {
+      TRC_DEBUG("Batch of %zu operations is invalid - retrying individually",
+                _ops.size());
+    }
+
+    for (size_t ii = 0; ii < _ops.size(); ++ii)
+    {
+      if (!_ops[ii].success)
+      {
+        complete(_ops[ii], false);
+      }
+      else if ((rc == INVALID_REQUEST) && (_ops.size() > 1))
+      {
+        // Replay just this operation's writes, rather than performing the
+        // operation again.
+        BatchOperation single;
+        single.add(batch->get_writes(ii), _ops[ii].trx->trail);
+
+        if (_store->do_sync(&single, _ops[ii].trx->trail))
+        {
+          complete(_ops[ii], true);
+        }
+        else
+        {
+          std::string single_error_text = single.get_error_text();
+          _ops[ii].op->unhandled_exception(single.get_result_code(),
+                                           single_error_text,
+                                           _ops[ii].trx->trail);
+          complete(_ops[ii], false);
+        }
+      }
+      else
+      {
+        // Pass the result of the batch to the operation, as if it had hit
+        // the error itself.
+        _ops[ii].op->unhandled_exception(rc, error_text, _ops[ii].trx->trail);
+        complete(_ops[ii], false);
+      }
+    }
+
+    _ops.clear();
+  }
+
+private:
+  struct BatchedOp
+  {
+    Operation* op;
+    Transaction* trx;
+    bool success;
+  };
+
+  // Call back an operation's transaction, and free them both.
+  static void complete(BatchedOp& batched_op, bool success)
+  {
+    batched_op.trx->stop_timer();
+
+    if (success)
+    {
+      batched_op.trx->on_success(batched_op.op);
+    }
+    else
+    {
+      batched_op.trx->on_failure(batched_op.op);
+    }
+
+    delete batched_op.trx; batched_op.trx = NULL;
+    delete batched_op.op; batched_op.op = NULL;
+  }
+
+  Store* _store;
+  std::vector<BatchedOp> _ops;
+};
+
+
+std::vector<SAS::TrailId> Store::sas_trails(Operation* op, SAS::TrailId trail)
+{
+  BatchOperation* batch = dynamic_cast<BatchOperation*>(op);
+
+  if (batch != NULL)
+  {
+    return batch->get_trails();
+  }
+
+  return std::vector<SAS::TrailId>(1, trail);
+}
+
+
+bool Store::add_to_batch(Operation* op, Transaction* trx)
+{
+  // Run the operation to find out what it writes.  The operation is timed
+  // from now until its batch completes.
+  RecordingClient recorder;
+  bool success = false;
+
+  trx->start_timer();
+
+  try
+  {
+    success = op->perform(&recorder, trx->trail);
+  }
+  catch(NotBatchableException& nbe)
+  {
+    // The operation tried to read from cassandra, so it must be run as
+    // normal.  It hasn't written anything yet.
+    TRC_DEBUG("Operation can't be batched");
+    return false;
+  }
+  catch(...)
+  {
+    // The operation hit an error of its own.  Fail it with the rest of the
+    // batch, rather than performing it again.
+    std::string error_text = "Unknown error";
+    op->unhandled_exception(UNKNOWN_ERROR, error_text, trx->trail);
+    success = false;
+  }
+
+  if (!success)
+  {
+    // Don't make any writes for a failed operation.
+    recorder.writes = RecordingClient::Writes();
+  }
+
+  BatchOperation* full_op = NULL;
+  BatchTransaction* full_trx = NULL;
+
+  pthread_mutex_lock(&_batch_lock);
+
+  if (_batch_terminated)
+  {
+    // LCOV_EXCL_START - only hit during shutdown
+    pthread_mutex_unlock(&_batch_lock);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  if (_batch_op == NULL)
+  {
+    _batch_op = new BatchOperation();
+    _batch_trx = new BatchTransaction(this, trx->trail);
+  }
+
+  _batch_op->add(recorder.writes, trx->trail);
+  _batch_trx->add(op, trx, success);
+
+  if (_batch_op->num_ops() >= _max_batch_ops)
+  {
+    // The batch is full so send it now.
+    full_op = _batch_op;
+    full_trx = _batch_trx;
+    _batch_op = NULL;
+    _batch_trx = NULL;
+  }
+
+  pthread_mutex_unlock(&_batch_lock);
+
+  if (full_op != NULL)
+  {
+    std::pair<Operation*, Transaction*> params(full_op, full_trx);
+    _thread_pool->add_work(params);
+  }
+
+  return true;
+}
+
+
+void Store::flush_batch()
+{
+  pthread_mutex_lock(&_batch_lock);
+  BatchOperation* op = _batch_op;
+  BatchTransaction* trx = _batch_trx;
+  _batch_op = NULL;
+  _batch_trx = NULL;
+  pthread_mutex_unlock(&_batch_lock);
+
+  if (op != NULL)
+  {
+    std::pair<Operation*, Transaction*> params(op, trx);
+    _thread_pool->add_work(params);
+  }
+}
+
+
+void* Store::batch_thread_func(void* store)
+{
+  ((Store*)store)->batch_thread_loop();
+  return NULL;
+}
+
+
+void Store::batch_thread_loop()
+{
+  pthread_mutex_lock(&_batch_lock);
+
+  while (!_batch_terminated)
+  {
+    struct timespec wake;
+    clock_gettime(CLOCK_MONOTONIC, &wake);
+    wake.tv_sec += _batch_interval_ms / 1000;
+    wake.tv_nsec += (_batch_interval_ms % 1000) * 1000000;
+    if (wake.tv_nsec >= 1000000000)
+    {
+      wake.tv_sec++;
+      wake.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&_batch_cond, &_batch_lock, &wake);
+
+    if ((!_batch_terminated) && (_batch_op != NULL))
+    {
+      pthread_mutex_unlock(&_batch_lock);
+      flush_batch();
+      pthread_mutex_lock(&_batch_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_batch_lock);
+}
+
+
 //
 // Pool methods
 //
@@ -807,6 +1786,22 @@ get_columns_with_prefix(const std::string& column_family,
 }
 
 
+void Client::
+multiget_columns(const std::string& column_family,
+                 const std::vector<std::string>& keys,
+                 const std::vector<std::string>& names,
+                 std::map<std::string, std::vector<ColumnOrSuperColumn> >& columns,
+                 ConsistencyLevel::type consistency_level)
+{
+  // Get only the specified column names.
+  SlicePredicate sp;
+  sp.column_names = names;
+  sp.__isset.column_names = true;
+
+  issue_multiget_for_key(column_family, keys, sp, columns, consistency_level);
+}
+
+
 void Client::
 multiget_columns_with_prefix(const std::string& column_family,
                              const std::vector<std::string>& keys,
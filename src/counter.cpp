@@ -16,7 +16,7 @@
 void Counter::increment(void)
 {
   // Update the basic counters and samples.
-  _current._count++;
+  _current._count.increment();
   // Refresh the statistics, if required.
   refresh();
 }
@@ -47,7 +47,7 @@ void Counter::reset()
   // Get the timestamp now.
   _current._timestamp_us.store(get_timestamp_us());
   // Reset everything else to 0.
-  _current._count.store(0);
+  _current._count.reset();
   _last._count = 0;
 }
 
@@ -56,7 +56,7 @@ void Counter::reset()
 void Counter::read(uint_fast64_t period_us)
 {
   // Read the basic statistics, and replace them with 0.
-  uint_fast64_t count = _current._count.exchange(0);
+  uint_fast64_t count = _current._count.read_and_reset();
   _last._count = count ;
 }
 
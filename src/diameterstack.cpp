@@ -28,6 +28,7 @@ Stack::Stack() : _initialized(false),
                  _comm_monitor(NULL),
                  _realm_counter(NULL),
                  _host_counter(NULL),
+                 _latency_histogram(NULL),
                  _peer_count(-1),
                  _connected_peer_count(-1)
 {
@@ -384,7 +385,8 @@ void Stack::configure(std::string filename,
                       ExceptionHandler* exception_handler,
                       BaseCommunicationMonitor* comm_monitor,
                       SNMP::CounterTable* realm_counter,
-                      SNMP::CounterTable* host_counter)
+                      SNMP::CounterTable* host_counter,
+                      SNMP::EventHistogramTable* latency_histogram)
 {
   initialize();
   TRC_STATUS("Configuring Diameter stack from file %s", filename.c_str());
@@ -418,6 +420,7 @@ void Stack::configure(std::string filename,
   _comm_monitor = comm_monitor;
   _realm_counter = realm_counter;
   _host_counter = host_counter;
+  _latency_histogram = latency_histogram;
 }
 
 void Stack::advertize_application(const Dictionary::Application::Type type,
@@ -744,6 +747,17 @@ void Stack::report_tsx_timeout()
   }
 }
 
+void Stack::report_tsx_latency(Transaction* tsx)
+{
+  unsigned long latency_us = 0;
+
+  if ((_latency_histogram != NULL) &&
+      (tsx->get_duration(latency_us)))
+  {
+    _latency_histogram->accumulate(latency_us);
+  }
+}
+
 bool Stack::add(Peer* peer)
 {
   // Set up the peer information structure.
@@ -1109,6 +1123,7 @@ void Transaction::on_response(void* data, struct msg** rsp)
   stack->report_tsx_result(rc);
 
   tsx->stop_timer();
+  stack->report_tsx_latency(tsx);
   tsx->on_response(msg);
   delete tsx;
   // Null out the message so that freeDiameter doesn't try to send it on.
@@ -1146,6 +1161,7 @@ void Transaction::on_timeout(void* data, DiamId_t to, size_t to_len, struct msg*
   stack->report_tsx_timeout();
 
   tsx->stop_timer();
+  stack->report_tsx_latency(tsx);
   tsx->on_timeout();
   delete tsx;
   // Null out the message so that freeDiameter doesn't try to send it on.
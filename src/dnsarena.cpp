@@ -0,0 +1,417 @@
+/**
+ * @file dnsarena.cpp Compact, arena-backed store of DNS resource records.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#include "dnsarena.h"
+
+DnsArena::DnsArena(size_t max_records, size_t max_names, size_t max_text) :
+  _block(NULL),
+  _records(NULL),
+  _names(NULL),
+  _text(NULL),
+  _num_records(0),
+  _num_names(0),
+  _text_used(0),
+  _num_answers(0),
+  _num_authorities(0)
+{
+  // The records and names only need 4 byte alignment, so they can be packed
+  // one after the other, with the text at the end.
+  size_t records_size = max_records * sizeof(Record);
+  size_t names_size = max_names * sizeof(Name);
+
+  _block = malloc(records_size + names_size + max_text + 1);
+
+  if (_block == NULL)
+  {
+    throw std::bad_alloc(); // LCOV_EXCL_LINE
+  }
+
+  _records = (Record*)_block;
+  _names = (Name*)((char*)_block + records_size);
+  _text = (char*)_block + records_size + names_size;
+}
+
+DnsArena::~DnsArena()
+{
+  free(_block); _block = NULL;
+}
+
+DnsArena::Record& DnsArena::add_record()
+{
+  Record& record = _records[_num_records++];
+  memset(&record, 0, sizeof(Record));
+  return record;
+}
+
+uint32_t DnsArena::add_name(const char* name, size_t length, uint32_t wire_offset)
+{
+  Name& entry = _names[_num_names];
+  entry.offset = _text_used;
+  entry.length = length;
+  entry.wire_offset = wire_offset;
+
+  Text text;
+  memcpy(add_text(length, text), name, length);
+
+  return _num_names++;
+}
+
+uint32_t DnsArena::find_name(uint32_t wire_offset) const
+{
+  // Names from a DNS message are added in the order they appear in the
+  // message, so the table is sorted by wire offset.
+  size_t low = 0;
+  size_t high = _num_names;
+
+  while (low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+
+    if (_names[mid].wire_offset < wire_offset)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+char* DnsArena::add_text(size_t length, Text& text)
+{
+  text.offset = _text_used;
+  text.length = length;
+  char* p = _text + _text_used;
+  p[length] = '\0';
+  _text_used += length + 1;
+  return p;
+}
+
+DnsRRecord* DnsArena::to_rrecord(const Record& record) const
+{
+  DnsRRecord* rr;
+  std::string rrname(name(record.name), name_length(record.name));
+
+  if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_a))
+  {
+    rr = new DnsARecord(rrname, record.ttl, record.rdata.a);
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_aaaa))
+  {
+    rr = new DnsAAAARecord(rrname, record.ttl, record.rdata.aaaa);
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_srv))
+  {
+    rr = new DnsSrvRecord(rrname,
+                          record.ttl,
+                          record.rdata.srv.priority,
+                          record.rdata.srv.weight,
+                          record.rdata.srv.port,
+                          std::string(name(record.rdata.srv.target),
+                                      name_length(record.rdata.srv.target)));
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_naptr))
+  {
+    const Text& flags = record.rdata.naptr.flags;
+    const Text& service = record.rdata.naptr.service;
+    const Text& regexp = record.rdata.naptr.regexp;
+    uint32_t replacement = record.rdata.naptr.replacement;
+    rr = new DnsNaptrRecord(rrname,
+                            record.ttl,
+                            record.rdata.naptr.order,
+                            record.rdata.naptr.preference,
+                            std::string(text(flags), flags.length),
+                            std::string(text(service), service.length),
+                            std::string(text(regexp), regexp.length),
+                            std::string(name(replacement),
+                                        name_length(replacement)));
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_cname))
+  {
+    rr = new DnsCNAMERecord(rrname,
+                            record.ttl,
+                            std::string(name(record.rdata.cname.target),
+                                        name_length(record.rdata.cname.target)));
+  }
+  else
+  {
+    rr = new DnsRRecord(rrname, record.rrtype, record.rrclass, record.ttl);
+  }
+
+  // Keep the expiry time of the original record, rather than recalculating it
+  // from the TTL.
+  rr->set_expires(record.expires);
+
+  return rr;
+}
+
+void DnsArena::to_rrecords(const std::vector<const Record*>& records,
+                           std::vector<DnsRRecord*>& rrecords) const
+{
+  rrecords.reserve(rrecords.size() + records.size());
+
+  for (const Record* record : records)
+  {
+    rrecords.push_back(to_rrecord(*record));
+  }
+}
+
+std::string DnsArena::to_string(const Record& record) const
+{
+  DnsRRecord* rr = to_rrecord(record);
+  std::string str = rr->to_string();
+  delete rr; rr = NULL;
+  return str;
+}
+
+std::shared_ptr<DnsArena> DnsArena::from_records(const std::vector<DnsRRecord*>& records)
+{
+  // Work out how much space is needed.  Consecutive records with the same
+  // name (the common case) share a single copy of it.
+  size_t num_names = 0;
+  size_t text_size = 0;
+  const std::string* last_name = NULL;
+
+  for (const DnsRRecord* rr : records)
+  {
+    if ((last_name == NULL) || (*last_name != rr->rrname()))
+    {
+      last_name = &rr->rrname();
+      num_names++;
+      text_size += last_name->length() + 1;
+    }
+
+    if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_srv))
+    {
+      num_names++;
+      text_size += ((const DnsSrvRecord*)rr)->target().length() + 1;
+    }
+    else if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_naptr))
+    {
+      const DnsNaptrRecord* naptr = (const DnsNaptrRecord*)rr;
+      num_names++;
+      text_size += naptr->flags().length() + 1 +
+                   naptr->service().length() + 1 +
+                   naptr->regexp().length() + 1 +
+                   naptr->replacement().length() + 1;
+    }
+    else if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_cname))
+    {
+      num_names++;
+      text_size += ((const DnsCNAMERecord*)rr)->target().length() + 1;
+    }
+  }
+
+  std::shared_ptr<DnsArena> arena =
+    std::make_shared<DnsArena>(records.size(), num_names, text_size);
+  last_name = NULL;
+  uint32_t name = 0;
+
+  for (const DnsRRecord* rr : records)
+  {
+    if ((last_name == NULL) || (*last_name != rr->rrname()))
+    {
+      last_name = &rr->rrname();
+      name = arena->add_name(last_name->data(), last_name->length(), 0);
+    }
+
+    Record& record = arena->add_record();
+    record.rrtype = rr->rrtype();
+    record.rrclass = rr->rrclass();
+    record.ttl = rr->ttl();
+    record.expires = rr->expires();
+    record.name = name;
+
+    if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_a))
+    {
+      record.rdata.a = ((const DnsARecord*)rr)->address();
+    }
+    else if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_aaaa))
+    {
+      record.rdata.aaaa = ((const DnsAAAARecord*)rr)->address();
+    }
+    else if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_srv))
+    {
+      const DnsSrvRecord* srv = (const DnsSrvRecord*)rr;
+      record.rdata.srv.priority = srv->priority();
+      record.rdata.srv.weight = srv->weight();
+      record.rdata.srv.port = srv->port();
+      record.rdata.srv.target = arena->add_name(srv->target().data(),
+                                                srv->target().length(),
+                                                0);
+    }
+    else if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_naptr))
+    {
+      const DnsNaptrRecord* naptr = (const DnsNaptrRecord*)rr;
+      record.rdata.naptr.order = naptr->order();
+      record.rdata.naptr.preference = naptr->preference();
+      memcpy(arena->add_text(naptr->flags().length(), record.rdata.naptr.flags),
+             naptr->flags().data(),
+             naptr->flags().length());
+      memcpy(arena->add_text(naptr->service().length(), record.rdata.naptr.service),
+             naptr->service().data(),
+             naptr->service().length());
+      memcpy(arena->add_text(naptr->regexp().length(), record.rdata.naptr.regexp),
+             naptr->regexp().data(),
+             naptr->regexp().length());
+      record.rdata.naptr.replacement = arena->add_name(naptr->replacement().data(),
+                                                       naptr->replacement().length(),
+                                                       0);
+    }
+    else if ((rr->rrclass() == ns_c_in) && (rr->rrtype() == ns_t_cname))
+    {
+      const DnsCNAMERecord* cname = (const DnsCNAMERecord*)rr;
+      record.rdata.cname.target = arena->add_name(cname->target().data(),
+                                                  cname->target().length(),
+                                                  0);
+    }
+  }
+
+  arena->set_sections(records.size(), 0);
+
+  return arena;
+}
+
+size_t DnsArena::image_size() const
+{
+  size_t size = sizeof(ImageHeader) + block_size();
+  return (size + 7) & ~(size_t)7;
+}
+
+void DnsArena::write_image(char* buf) const
+{
+  ImageHeader header;
+  header.num_records = _num_records;
+  header.num_names = _num_names;
+  header.text_size = _text_used;
+  header.num_answers = _num_answers;
+  header.num_authorities = _num_authorities;
+  header.reserved = 0;
+
+  char* p = buf;
+  memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+  memcpy(p, _records, _num_records * sizeof(Record));
+  p += _num_records * sizeof(Record);
+  memcpy(p, _names, _num_names * sizeof(Name));
+  p += _num_names * sizeof(Name);
+  memcpy(p, _text, _text_used);
+  p += _text_used;
+
+  // Zero the padding.
+  memset(p, 0, buf + image_size() - p);
+}
+
+std::shared_ptr<DnsArena> DnsArena::read_image(const char* buf,
+                                               size_t length,
+                                               size_t& used)
+{
+  std::shared_ptr<DnsArena> arena;
+  ImageHeader header;
+
+  if (length < sizeof(header))
+  {
+    return arena;
+  }
+
+  memcpy(&header, buf, sizeof(header));
+
+  // Check the image fits in the buffer (using 64-bit arithmetic, so this
+  // can't overflow whatever the counts are).
+  uint64_t records_size = (uint64_t)header.num_records * sizeof(Record);
+  uint64_t names_size = (uint64_t)header.num_names * sizeof(Name);
+  uint64_t size = sizeof(header) + records_size + names_size + header.text_size;
+  size = (size + 7) & ~(uint64_t)7;
+
+  if ((size > length) ||
+      ((uint64_t)header.num_answers + header.num_authorities > header.num_records))
+  {
+    return arena;
+  }
+
+  arena = std::make_shared<DnsArena>(header.num_records,
+                                     header.num_names,
+                                     header.text_size);
+  const char* p = buf + sizeof(header);
+  memcpy(arena->_records, p, records_size);
+  p += records_size;
+  memcpy(arena->_names, p, names_size);
+  p += names_size;
+  memcpy(arena->_text, p, header.text_size);
+  arena->_text[header.text_size] = '\0';
+  arena->_num_records = header.num_records;
+  arena->_num_names = header.num_names;
+  arena->_text_used = header.text_size;
+  arena->_num_answers = header.num_answers;
+  arena->_num_authorities = header.num_authorities;
+
+  // Check all the references in the records.
+  bool valid = true;
+
+  for (size_t ii = 0; (valid) && (ii < arena->_num_names); ++ii)
+  {
+    const Name& name = arena->_names[ii];
+    valid = ((uint64_t)name.offset + name.length < arena->_text_used) &&
+            (arena->_text[name.offset + name.length] == '\0');
+  }
+
+  for (size_t ii = 0; (valid) && (ii < arena->_num_records); ++ii)
+  {
+    const Record& record = arena->_records[ii];
+    valid = arena->valid_name(record.name);
+
+    if ((valid) && (record.rrclass == ns_c_in))
+    {
+      if (record.rrtype == ns_t_srv)
+      {
+        valid = arena->valid_name(record.rdata.srv.target);
+      }
+      else if (record.rrtype == ns_t_naptr)
+      {
+        valid = (arena->valid_text(record.rdata.naptr.flags) &&
+                 arena->valid_text(record.rdata.naptr.service) &&
+                 arena->valid_text(record.rdata.naptr.regexp) &&
+                 arena->valid_name(record.rdata.naptr.replacement));
+      }
+      else if (record.rrtype == ns_t_cname)
+      {
+        valid = arena->valid_name(record.rdata.cname.target);
+      }
+    }
+  }
+
+  if (!valid)
+  {
+    arena.reset();
+    return arena;
+  }
+
+  used = size;
+  return arena;
+}
+
+bool DnsArena::valid_name(uint32_t name) const
+{
+  return (name < _num_names);
+}
+
+bool DnsArena::valid_text(const Text& text) const
+{
+  return ((uint64_t)text.offset + text.length < _text_used) &&
+         (_text[text.offset + text.length] == '\0');
+}
@@ -13,6 +13,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <errno.h>
+#include <cassert>
 
 #include <sstream>
 #include <iomanip>
@@ -24,6 +31,7 @@
 
 #include "log.h"
 #include "dnsparser.h"
+#include "dnsarena.h"
 #include "dnscachedresolver.h"
 #include "sas.h"
 #include "sasevent.h"
@@ -117,6 +125,37 @@ void DnsCachedResolver::init(const std::vector<IP46Address>& dns_servers)
   pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
   pthread_cond_init(&_got_reply_cond, &cond_attr);
   pthread_condattr_destroy(&cond_attr);
+
+  // Each thread keeps a reference to the last snapshot of the cache it used,
+  // so create the thread-local store for that and publish an initial empty
+  // snapshot.
+  pthread_key_create(&_snapshot_key, (void(*)(void*))&destroy_snapshot_ref);
+  pthread_mutex_init(&_snapshot_refs_lock, NULL);
+  _static_cnames.reset(new std::map<std::string, std::string>());
+  _snapshot_version = 0;
+  _snapshot_dirty = true;
+  publish_snapshot();
+
+  // Stale-while-revalidate is disabled until explicitly enabled.
+  _stale_grace_period = 0;
+  _prefetch_time = 0;
+  _refresh_thread_running = false;
+  _refresh_terminated = false;
+  pthread_mutex_init(&_refresh_lock, NULL);
+  pthread_cond_init(&_refresh_cond, NULL);
+  _stale_serves = 0;
+  _refreshes = 0;
+  _prefetches = 0;
+
+  // Cache persistence is disabled until explicitly enabled.
+  _persist_interval = 0;
+  _persist_thread_running = false;
+  _persist_terminated = false;
+  pthread_mutex_init(&_persist_lock, NULL);
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_persist_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
 }
 
 void DnsCachedResolver::init_from_server_ips(const std::vector<std::string>& dns_servers)
@@ -195,6 +234,19 @@ DnsCachedResolver::DnsCachedResolver(const std::string& dns_server,
 
 DnsCachedResolver::~DnsCachedResolver()
 {
+  stop_refresh_thread();
+  pthread_cond_destroy(&_refresh_cond);
+  pthread_mutex_destroy(&_refresh_lock);
+
+  // Save the cache one last time before clearing it.
+  stop_persist_thread();
+  if (!_persist_file.empty())
+  {
+    save_cache(_persist_file);
+  }
+  pthread_cond_destroy(&_persist_cond);
+  pthread_mutex_destroy(&_persist_lock);
+
   DnsChannel* channel = (DnsChannel*)pthread_getspecific(_thread_local);
   if (channel != NULL)
   {
@@ -203,6 +255,27 @@ DnsCachedResolver::~DnsCachedResolver()
   }
   pthread_key_delete(_thread_local);
 
+  DnsCacheSnapshotRef* ref = (DnsCacheSnapshotRef*)pthread_getspecific(_snapshot_key);
+  if (ref != NULL)
+  {
+    pthread_setspecific(_snapshot_key, NULL);
+    destroy_snapshot_ref(ref);
+  }
+  pthread_key_delete(_snapshot_key);
+
+  // Release the references of every other thread.  Their snapshots are freed
+  // now, but pthreads won't call the key destructor for threads that are
+  // still running, so the reference itself is only freed here if its thread
+  // has already exited (otherwise just the small DnsCacheSnapshotRef leaks).
+  pthread_mutex_lock(&_snapshot_refs_lock);
+  for (DnsCacheSnapshotRef* other_ref : _snapshot_refs)
+  {
+    destroy_snapshot_ref(other_ref);
+  }
+  _snapshot_refs.clear();
+  pthread_mutex_unlock(&_snapshot_refs_lock);
+  pthread_mutex_destroy(&_snapshot_refs_lock);
+
   // Clear the cache.
   clear();
 
@@ -363,10 +436,28 @@ void DnsCachedResolver::reload_static_records()
       }
     }
 
+    // Build the map of static CNAME records used by the cache snapshots.
+    std::map<std::string, std::string>* static_cnames =
+                                        new std::map<std::string, std::string>();
+    for (const std::pair<const std::string, std::vector<DnsRRecord*>>& entry : static_records)
+    {
+      for (DnsRRecord* record : entry.second)
+      {
+        if (record->rrtype() == ns_t_cname)
+        {
+          (*static_cnames)[entry.first] = ((DnsCNAMERecord*)record)->target();
+          break;
+        }
+      }
+    }
+
     // Now swap out the old _static_records for the new one. This needs to be
     // done under the cache lock
     pthread_mutex_lock(&_cache_lock);
     std::swap(_static_records, static_records);
+    _static_cnames.reset(static_cnames);
+    _snapshot_dirty = true;
+    publish_snapshot();
     pthread_mutex_unlock(&_cache_lock);
 
     // Finally, clean up the now unused records
@@ -405,6 +496,13 @@ void DnsCachedResolver::dns_query(const std::vector<std::string>& domains,
                                   std::vector<DnsResult>& results,
                                   SAS::TrailId trail)
 {
+  // Most queries are for valid entries already in the cache, so try to
+  // answer from the snapshot first without taking the cache lock.
+  if (query_snapshot(domains, dnstype, results))
+  {
+    return;
+  }
+
   std::vector<std::string> new_domains;
 
   pthread_mutex_lock(&_cache_lock);
@@ -443,9 +541,856 @@ void DnsCachedResolver::dns_query(const std::vector<std::string>& domains,
   // Now do the actual lookup
   inner_dns_query(new_domains, dnstype, results, trail);
 
+  publish_snapshot();
   pthread_mutex_unlock(&_cache_lock);
 }
 
+/// Attempts to answer a query from the current snapshot of the cache.  This
+/// only succeeds if there is a valid (unexpired) entry for every domain.
+///
+/// @returns whether the results were filled in.
+bool DnsCachedResolver::query_snapshot(const std::vector<std::string>& domains,
+                                       int dnstype,
+                                       std::vector<DnsResult>& results)
+{
+  DnsCacheSnapshotPtr snapshot = get_snapshot();
+  std::vector<DnsCacheSnapshotEntryPtr> entries;
+  time_t now = time(NULL);
+
+  for (const std::string& domain : domains)
+  {
+    // Apply any static CNAME record for the domain.
+    std::map<std::string, std::string>::const_iterator cname =
+      snapshot->static_cnames->find(domain);
+    const std::string& new_domain = (cname != snapshot->static_cnames->end()) ?
+                                    cname->second : domain;
+
+    DnsCacheKey key = std::make_pair(dnstype, new_domain);
+    size_t index = snapshot_bucket(key);
+    const DnsCacheSnapshotBucket& bucket =
+      *(*snapshot->groups[index / SNAPSHOT_GROUP_BUCKETS])[index % SNAPSHOT_GROUP_BUCKETS];
+    DnsCacheSnapshotBucket::const_iterator i = bucket.find(key);
+
+    if ((i == bucket.end()) ||
+        ((i->second->expires <= now) &&
+         (!can_serve_stale(i->second->expires, !i->second->records.empty(), now))))
+    {
+      // No usable entry, so this query needs to go through the cache.
+      return false;
+    }
+
+    entries.push_back(i->second);
+  }
+
+  for (const DnsCacheSnapshotEntryPtr& entry : entries)
+  {
+    TRC_DEBUG("Pulling %d records from cache snapshot for %s %s",
+              entry->records.size(),
+              entry->domain.c_str(),
+              DnsRRecord::rrtype_to_string(entry->dnstype).c_str());
+
+    int expiry = entry->expires - now;
+
+    if (expiry <= 0)
+    {
+      // The entry has expired, but is within the grace period so return it
+      // and refresh it in the background.
+      TRC_DEBUG("Serving expired entry for %s while it is refreshed",
+                entry->domain.c_str());
+      ++_stale_serves;
+      request_refresh(entry->domain, entry->dnstype);
+      expiry = STALE_TTL;
+    }
+    else if ((expiry <= _prefetch_time) &&
+             (++entry->prefetch_hits == PREFETCH_MIN_HITS))
+    {
+      // The entry is popular and about to expire, so refresh it now.
+      TRC_DEBUG("Prefetching entry for %s which expires in %d seconds",
+                entry->domain.c_str(), expiry);
+      ++_prefetches;
+      request_refresh(entry->domain, entry->dnstype);
+    }
+
+    results.push_back(DnsResult(entry->domain, entry->dnstype, expiry));
+
+    if (entry->arena != NULL)
+    {
+      entry->arena->to_rrecords(entry->records, results.back().records());
+    }
+  }
+
+  return true;
+}
+
+void DnsCachedResolver::enable_stale_while_revalidate(int grace_period,
+                                                      int prefetch_time)
+{
+  if (grace_period > EXTRA_INVALID_TIME)
+  {
+    // Entries are removed from the cache EXTRA_INVALID_TIME after they
+    // expire, so we can't serve them for any longer than that.
+    TRC_WARNING("Stale DNS grace period of %d seconds is too long - using %d",
+                grace_period, EXTRA_INVALID_TIME);
+    grace_period = EXTRA_INVALID_TIME;
+  }
+
+  TRC_STATUS("Enabling stale-while-revalidate DNS cache mode, grace period = %d, prefetch time = %d",
+             grace_period, prefetch_time);
+  _stale_grace_period = grace_period;
+  _prefetch_time = prefetch_time;
+
+  pthread_mutex_lock(&_refresh_lock);
+  if (!_refresh_thread_running)
+  {
+    _refresh_terminated = false;
+    _refresh_thread_running =
+      (pthread_create(&_refresh_thread, NULL, refresh_thread_func, this) == 0);
+
+    if (!_refresh_thread_running)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start DNS refresh thread");
+      _stale_grace_period = 0;
+      _prefetch_time = 0;
+      // LCOV_EXCL_STOP
+    }
+  }
+  pthread_mutex_unlock(&_refresh_lock);
+}
+
+DnsCachedResolver::Stats DnsCachedResolver::stats() const
+{
+  Stats stats;
+  stats.stale_serves = _stale_serves.load();
+  stats.refreshes = _refreshes.load();
+  stats.prefetches = _prefetches.load();
+  return stats;
+}
+
+/// Returns true if an expired entry can be returned to the caller while it
+/// is refreshed in the background.
+bool DnsCachedResolver::can_serve_stale(int expires,
+                                        bool has_records,
+                                        time_t now)
+{
+  // Don't serve negative entries past their expiry, as the records may have
+  // been added since.
+  return ((_stale_grace_period > 0) &&
+          (has_records) &&
+          (expires != 0) &&
+          (now < expires + _stale_grace_period));
+}
+
+/// Queues a background refresh of a cache entry, unless one is already
+/// queued or in progress.
+void DnsCachedResolver::request_refresh(const std::string& domain, int dnstype)
+{
+  DnsCacheKey key = std::make_pair(dnstype, domain);
+
+  pthread_mutex_lock(&_refresh_lock);
+  if ((_refresh_thread_running) &&
+      (_refresh_keys.insert(key).second))
+  {
+    _refresh_queue.push_back(key);
+    pthread_cond_signal(&_refresh_cond);
+  }
+  pthread_mutex_unlock(&_refresh_lock);
+}
+
+void DnsCachedResolver::stop_refresh_thread()
+{
+  pthread_mutex_lock(&_refresh_lock);
+  bool running = _refresh_thread_running;
+  _refresh_terminated = true;
+  pthread_cond_signal(&_refresh_cond);
+  pthread_mutex_unlock(&_refresh_lock);
+
+  if (running)
+  {
+    pthread_join(_refresh_thread, NULL);
+    _refresh_thread_running = false;
+  }
+}
+
+void* DnsCachedResolver::refresh_thread_func(void* resolver)
+{
+  ((DnsCachedResolver*)resolver)->refresh_thread_loop();
+  return NULL;
+}
+
+void DnsCachedResolver::refresh_thread_loop()
+{
+  pthread_mutex_lock(&_refresh_lock);
+
+  while (!_refresh_terminated)
+  {
+    if (_refresh_queue.empty())
+    {
+      pthread_cond_wait(&_refresh_cond, &_refresh_lock);
+      continue;
+    }
+
+    DnsCacheKey key = _refresh_queue.front();
+    _refresh_queue.pop_front();
+    pthread_mutex_unlock(&_refresh_lock);
+
+    refresh(key);
+
+    pthread_mutex_lock(&_refresh_lock);
+    _refresh_keys.erase(key);
+  }
+
+  pthread_mutex_unlock(&_refresh_lock);
+}
+
+/// Refreshes a cache entry by querying the DNS server, and waits for the
+/// response.  Runs on the refresh thread.
+void DnsCachedResolver::refresh(const DnsCacheKey& key)
+{
+  DnsChannel* channel = get_dns_channel();
+
+  if (channel == NULL)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_cache_lock);
+
+  // Only refresh the entry if it's still in the cache and no other thread is
+  // already querying it.  If it has been removed the next query will
+  // repopulate it.
+  DnsCacheEntryPtr ce = get_cache_entry(key.second, key.first);
+  bool do_query = ((ce != NULL) && (!ce->pending_query));
+
+  if ((ce != NULL) && (ce->pending_query))
+  {
+    // Let the pending query re-arm the prefetch trigger when it completes,
+    // in case it doesn't refresh the entry.
+    TRC_DEBUG("Skipping refresh of cache entry for %s type %d - query already pending",
+              key.second.c_str(), key.first);
+    ce->refresh_skipped = true;
+  }
+
+  if (do_query)
+  {
+    TRC_DEBUG("Refreshing cache entry for %s type %d",
+              key.second.c_str(), key.first);
+    ++_refreshes;
+    ce->pending_query = true;
+    DnsTsx* tsx = new DnsTsx(channel, key.second, key.first, 0);
+    tsx->execute();
+  }
+
+  pthread_mutex_unlock(&_cache_lock);
+
+  if (do_query)
+  {
+    wait_for_replies(channel);
+  }
+}
+
+const char DnsCachedResolver::CACHE_FILE_MAGIC[8] = {'D', 'N', 'S', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t DnsCachedResolver::CACHE_FILE_BYTE_ORDER;
+const uint32_t DnsCachedResolver::CACHE_FILE_VERSION;
+const uint32_t DnsCachedResolver::CACHE_FILE_NO_ARENA;
+
+/// Rounds a length in a cache file up to the 8 byte alignment.
+static size_t cache_file_align(size_t length)
+{
+  return (length + 7) & ~(size_t)7;
+}
+
+bool DnsCachedResolver::save_cache(const std::string& filename)
+{
+  // Save from the published snapshot, so the cache lock isn't held while the
+  // file is written.  The snapshot keeps the arenas alive.
+  DnsCacheSnapshotPtr snapshot = std::atomic_load(&_snapshot);
+  time_t now = time(NULL);
+
+  // Work out which entries and arenas to save, and how big the file is.
+  // Each arena is saved once, however many entries share it.
+  std::vector<const DnsCacheSnapshotEntry*> entries;
+  std::vector<const DnsArena*> arenas;
+  std::map<const DnsArena*, uint32_t> arena_indexes;
+  size_t size = sizeof(CacheFileHeader);
+
+  for (const std::shared_ptr<const DnsCacheSnapshotBucketGroup>& group :
+         snapshot->groups)
+  {
+    for (const std::shared_ptr<const DnsCacheSnapshotBucket>& bucket : *group)
+    {
+      for (const std::pair<const DnsCacheKey, DnsCacheSnapshotEntryPtr>& i :
+             *bucket)
+      {
+        const DnsCacheSnapshotEntry* entry = i.second.get();
+
+        if ((entry->expires == 0) ||
+            ((entry->expires <= now) &&
+             (!can_serve_stale(entry->expires, !entry->records.empty(), now))))
+        {
+          // Either still pending its first query, or no longer usable.
+          continue;
+        }
+
+        if ((entry->arena != NULL) &&
+            (arena_indexes.insert(std::make_pair(entry->arena.get(),
+                                                 (uint32_t)arenas.size())).second))
+        {
+          arenas.push_back(entry->arena.get());
+          size += entry->arena->image_size();
+        }
+
+        entries.push_back(entry);
+        size += cache_file_align(sizeof(CacheFileEntry) +
+                                 entry->records.size() * sizeof(uint32_t) +
+                                 entry->domain.length());
+      }
+    }
+  }
+
+  std::string buf(size, '\0');
+  char* p = &buf[0];
+
+  CacheFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+  header.byte_order = CACHE_FILE_BYTE_ORDER;
+  header.version = CACHE_FILE_VERSION;
+  header.record_size = sizeof(DnsArena::Record);
+  header.num_arenas = arenas.size();
+  header.num_entries = entries.size();
+  header.saved_at = now;
+  memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+
+  for (const DnsArena* arena : arenas)
+  {
+    arena->write_image(p);
+    p += arena->image_size();
+  }
+
+  for (const DnsCacheSnapshotEntry* entry : entries)
+  {
+    CacheFileEntry file_entry;
+    memset(&file_entry, 0, sizeof(file_entry));
+    file_entry.dnstype = entry->dnstype;
+    file_entry.expires = entry->expires;
+    file_entry.arena = (entry->arena != NULL) ?
+                       arena_indexes[entry->arena.get()] : CACHE_FILE_NO_ARENA;
+    file_entry.num_records = entry->records.size();
+    file_entry.domain_length = entry->domain.length();
+
+    char* start = p;
+    memcpy(p, &file_entry, sizeof(file_entry));
+    p += sizeof(file_entry);
+
+    for (const DnsArena::Record* record : entry->records)
+    {
+      uint32_t index = record - &entry->arena->record(0);
+      memcpy(p, &index, sizeof(index));
+      p += sizeof(index);
+    }
+
+    memcpy(p, entry->domain.data(), entry->domain.length());
+    p = start + cache_file_align(p + entry->domain.length() - start);
+  }
+
+  // Write to a temporary file and rename it, so the file is replaced
+  // atomically.
+  std::string tmp_filename = filename + ".tmp";
+  FILE* f = fopen(tmp_filename.c_str(), "wb");
+
+  if (f == NULL)
+  {
+    TRC_ERROR("Failed to open DNS cache file %s for writing: %s",
+              tmp_filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Flush the data to disk before renaming, so a crash can't leave the
+  // file renamed but empty.
+  bool written = (fwrite(buf.data(), 1, buf.length(), f) == buf.length());
+  written = written && (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+  written = (fclose(f) == 0) && written;
+
+  if ((!written) ||
+      (rename(tmp_filename.c_str(), filename.c_str()) != 0))
+  {
+    TRC_ERROR("Failed to write DNS cache file %s: %s",
+              filename.c_str(), strerror(errno));
+    unlink(tmp_filename.c_str());
+    return false;
+  }
+
+  TRC_DEBUG("Saved %zu DNS cache entries (%zu bytes) to %s",
+            entries.size(), buf.length(), filename.c_str());
+  return true;
+}
+
+bool DnsCachedResolver::load_cache(const std::string& filename)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    TRC_STATUS("No DNS cache file %s to load: %s",
+               filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  void* map = MAP_FAILED;
+
+  if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+  {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  close(fd);
+
+  if (map == MAP_FAILED)
+  {
+    TRC_ERROR("Failed to map DNS cache file %s", filename.c_str());
+    return false;
+  }
+
+  bool rc = load_cache_file((const char*)map, st.st_size);
+  munmap(map, st.st_size);
+
+  if (!rc)
+  {
+    TRC_ERROR("DNS cache file %s is invalid", filename.c_str());
+  }
+
+  return rc;
+}
+
+/// Loads the entries from a mapped cache file.  The whole file is checked
+/// before any entries are added to the cache.
+bool DnsCachedResolver::load_cache_file(const char* buf, size_t length)
+{
+  CacheFileHeader header;
+
+  if (length < sizeof(header))
+  {
+    return false;
+  }
+
+  memcpy(&header, buf, sizeof(header));
+
+  if ((memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) != 0) ||
+      (header.byte_order != CACHE_FILE_BYTE_ORDER) ||
+      (header.version != CACHE_FILE_VERSION) ||
+      (header.record_size != sizeof(DnsArena::Record)))
+  {
+    return false;
+  }
+
+  size_t offset = sizeof(header);
+  std::vector<DnsArenaPtr> arenas;
+  arenas.reserve(std::min((size_t)header.num_arenas, length / 8));
+
+  for (uint32_t ii = 0; ii < header.num_arenas; ++ii)
+  {
+    size_t used = 0;
+    DnsArenaPtr arena = DnsArena::read_image(buf + offset, length - offset, used);
+
+    if (arena == NULL)
+    {
+      return false;
+    }
+
+    arenas.push_back(arena);
+    offset += used;
+  }
+
+  struct LoadedEntry
+  {
+    std::string domain;
+    int dnstype;
+    int expires;
+    DnsArenaPtr arena;
+    std::vector<const DnsArena::Record*> records;
+  };
+
+  std::vector<LoadedEntry> loaded;
+  loaded.reserve(std::min((size_t)header.num_entries, length / 8));
+
+  for (uint32_t ii = 0; ii < header.num_entries; ++ii)
+  {
+    CacheFileEntry file_entry;
+
+    if (length - offset < sizeof(file_entry))
+    {
+      return false;
+    }
+
+    memcpy(&file_entry, buf + offset, sizeof(file_entry));
+    uint64_t entry_length = sizeof(file_entry) +
+                            (uint64_t)file_entry.num_records * sizeof(uint32_t) +
+                            file_entry.domain_length;
+
+    if ((entry_length > length - offset) ||
+        ((file_entry.arena == CACHE_FILE_NO_ARENA) &&
+         (file_entry.num_records != 0)) ||
+        ((file_entry.arena != CACHE_FILE_NO_ARENA) &&
+         (file_entry.arena >= arenas.size())))
+    {
+      return false;
+    }
+
+    LoadedEntry entry;
+    entry.dnstype = file_entry.dnstype;
+    entry.expires = file_entry.expires;
+
+    if (file_entry.arena != CACHE_FILE_NO_ARENA)
+    {
+      entry.arena = arenas[file_entry.arena];
+    }
+
+    const char* p = buf + offset + sizeof(file_entry);
+
+    for (uint32_t jj = 0; jj < file_entry.num_records; ++jj)
+    {
+      uint32_t index;
+      memcpy(&index, p, sizeof(index));
+      p += sizeof(index);
+
+      if (index >= entry.arena->num_records())
+      {
+        return false;
+      }
+
+      entry.records.push_back(&entry.arena->record(index));
+    }
+
+    entry.domain.assign(p, file_entry.domain_length);
+    loaded.push_back(entry);
+    offset += std::min((size_t)cache_file_align(entry_length), length - offset);
+  }
+
+  // The file is valid, so add the entries that are still usable and not
+  // already in the cache.
+  time_t now = time(NULL);
+  int added = 0;
+
+  pthread_mutex_lock(&_cache_lock);
+
+  for (const LoadedEntry& entry : loaded)
+  {
+    if (((entry.expires <= now) &&
+         (!can_serve_stale(entry.expires, !entry.records.empty(), now))) ||
+        (get_cache_entry(entry.domain, entry.dnstype) != NULL))
+    {
+      continue;
+    }
+
+    DnsCacheEntryPtr ce = create_cache_entry(entry.domain, entry.dnstype);
+
+    for (const DnsArena::Record* record : entry.records)
+    {
+      add_record_to_cache(ce, entry.arena, record);
+    }
+
+    // The entry's expiry time isn't always that of its records (for
+    // example, negative entries), so restore it.
+    ce->expires = entry.expires;
+    add_to_expiry_list(ce);
+    added++;
+  }
+
+  publish_snapshot();
+  pthread_mutex_unlock(&_cache_lock);
+
+  TRC_STATUS("Loaded %d DNS cache entries saved %d seconds ago",
+             added, (int)(now - header.saved_at));
+  return true;
+}
+
+void DnsCachedResolver::enable_cache_persistence(const std::string& filename,
+                                                 int interval)
+{
+  if (interval < MIN_PERSIST_INTERVAL)
+  {
+    // The persist thread would save the cache continuously.
+    TRC_WARNING("DNS cache persistence interval of %d seconds is too short - using %d",
+                interval, MIN_PERSIST_INTERVAL);
+    interval = MIN_PERSIST_INTERVAL;
+  }
+
+  TRC_STATUS("Enabling DNS cache persistence to %s every %d seconds",
+             filename.c_str(), interval);
+  load_cache(filename);
+
+  pthread_mutex_lock(&_persist_lock);
+  _persist_file = filename;
+  _persist_interval = interval;
+
+  if (!_persist_thread_running)
+  {
+    _persist_terminated = false;
+    _persist_thread_running =
+      (pthread_create(&_persist_thread, NULL, persist_thread_func, this) == 0);
+
+    if (!_persist_thread_running)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start DNS cache persistence thread - the cache will only be saved on shutdown");
+      // LCOV_EXCL_STOP
+    }
+  }
+  pthread_mutex_unlock(&_persist_lock);
+}
+
+void DnsCachedResolver::stop_persist_thread()
+{
+  pthread_mutex_lock(&_persist_lock);
+  bool running = _persist_thread_running;
+  _persist_terminated = true;
+  pthread_cond_signal(&_persist_cond);
+  pthread_mutex_unlock(&_persist_lock);
+
+  if (running)
+  {
+    pthread_join(_persist_thread, NULL);
+    _persist_thread_running = false;
+  }
+}
+
+void* DnsCachedResolver::persist_thread_func(void* resolver)
+{
+  ((DnsCachedResolver*)resolver)->persist_thread_loop();
+  return NULL;
+}
+
+void DnsCachedResolver::persist_thread_loop()
+{
+  pthread_mutex_lock(&_persist_lock);
+
+  while (!_persist_terminated)
+  {
+    struct timespec wake_time;
+    clock_gettime(CLOCK_MONOTONIC, &wake_time);
+    wake_time.tv_sec += _persist_interval;
+
+    pthread_cond_timedwait(&_persist_cond, &_persist_lock, &wake_time);
+
+    if (!_persist_terminated)
+    {
+      std::string filename = _persist_file;
+      pthread_mutex_unlock(&_persist_lock);
+      save_cache(filename);
+      pthread_mutex_lock(&_persist_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_persist_lock);
+}
+
+const size_t DnsCachedResolver::SNAPSHOT_GROUPS;
+const size_t DnsCachedResolver::SNAPSHOT_GROUP_BUCKETS;
+
+/// Gets the current snapshot of the cache.  Each thread caches the snapshot
+/// it last used, so this normally avoids touching any shared state other than
+/// the snapshot version.
+DnsCachedResolver::DnsCacheSnapshotPtr DnsCachedResolver::get_snapshot()
+{
+  DnsCacheSnapshotRef* ref = (DnsCacheSnapshotRef*)pthread_getspecific(_snapshot_key);
+
+  if (ref == NULL)
+  {
+    ref = new DnsCacheSnapshotRef();
+    ref->version = 0;
+    ref->owners = 2;
+    pthread_setspecific(_snapshot_key, ref);
+
+    // Register the reference so the resolver can release it, and free any
+    // references whose threads have exited (which only the resolver still
+    // owns).
+    pthread_mutex_lock(&_snapshot_refs_lock);
+    std::vector<DnsCacheSnapshotRef*>::iterator i = _snapshot_refs.begin();
+    while (i != _snapshot_refs.end())
+    {
+      if ((*i)->owners.load() == 1)
+      {
+        destroy_snapshot_ref(*i);
+        i = _snapshot_refs.erase(i);
+      }
+      else
+      {
+        ++i;
+      }
+    }
+    _snapshot_refs.push_back(ref);
+    pthread_mutex_unlock(&_snapshot_refs_lock);
+  }
+
+  // The snapshot is published before the version is incremented, so if we
+  // see a new version we will fetch at least that snapshot.
+  uint64_t version = _snapshot_version.load();
+
+  if ((ref->snapshot == NULL) || (ref->version != version))
+  {
+    ref->snapshot = std::atomic_load(&_snapshot);
+    ref->version = version;
+  }
+
+  return ref->snapshot;
+}
+
+/// Publishes a new snapshot of the cache if it has changed since the last
+/// one.  Must be called with the cache lock held.  Only the groups and
+/// buckets holding entries that have changed are copied - the rest are shared
+/// with the previous snapshot.
+void DnsCachedResolver::publish_snapshot()
+{
+  if (!_snapshot_dirty)
+  {
+    return;
+  }
+
+  DnsCacheSnapshot* snapshot = new DnsCacheSnapshot();
+  snapshot->static_cnames = _static_cnames;
+
+  // Only publish_snapshot updates the published snapshot (under the cache
+  // lock), so it is safe to build on the previous one.
+  DnsCacheSnapshotPtr previous = std::atomic_load(&_snapshot);
+
+  if (previous != NULL)
+  {
+    snapshot->groups = previous->groups;
+  }
+  else
+  {
+    std::shared_ptr<const DnsCacheSnapshotBucketGroup> empty_group =
+      std::make_shared<const DnsCacheSnapshotBucketGroup>(
+                            SNAPSHOT_GROUP_BUCKETS,
+                            std::make_shared<const DnsCacheSnapshotBucket>());
+    snapshot->groups.assign(SNAPSHOT_GROUPS, empty_group);
+  }
+
+  // Copy each bucket holding a changed entry once, and update the entries in
+  // the copy.
+  std::map<size_t, DnsCacheSnapshotBucket*> buckets;
+
+  for (const DnsCacheKey& key : _snapshot_changed)
+  {
+    size_t index = snapshot_bucket(key);
+    DnsCacheSnapshotBucket*& bucket = buckets[index];
+
+    if (bucket == NULL)
+    {
+      bucket = new DnsCacheSnapshotBucket(
+        *(*snapshot->groups[index / SNAPSHOT_GROUP_BUCKETS])[index % SNAPSHOT_GROUP_BUCKETS]);
+    }
+
+    DnsCache::const_iterator i = _cache.find(key);
+
+    if (i == _cache.end())
+    {
+      // The entry has been removed from the cache.
+      bucket->erase(key);
+      continue;
+    }
+
+    DnsCacheEntryPtr ce = i->second;
+
+    if (ce->snapshot == NULL)
+    {
+      ce->snapshot.reset(new DnsCacheSnapshotEntry(ce->domain,
+                                                   ce->dnstype,
+                                                   ce->expires,
+                                                   ce->arena,
+                                                   ce->records));
+    }
+
+    (*bucket)[i->first] = ce->snapshot;
+  }
+
+  // Then copy each group holding a changed bucket once, and swap the new
+  // buckets into the copy.
+  std::map<size_t, DnsCacheSnapshotBucketGroup*> groups;
+
+  for (std::map<size_t, DnsCacheSnapshotBucket*>::const_iterator i = buckets.begin();
+       i != buckets.end();
+       ++i)
+  {
+    size_t index = i->first / SNAPSHOT_GROUP_BUCKETS;
+    DnsCacheSnapshotBucketGroup*& group = groups[index];
+
+    if (group == NULL)
+    {
+      group = new DnsCacheSnapshotBucketGroup(*snapshot->groups[index]);
+    }
+
+    (*group)[i->first % SNAPSHOT_GROUP_BUCKETS].reset(i->second);
+  }
+
+  for (std::map<size_t, DnsCacheSnapshotBucketGroup*>::const_iterator i = groups.begin();
+       i != groups.end();
+       ++i)
+  {
+    snapshot->groups[i->first].reset(i->second);
+  }
+
+  _snapshot_changed.clear();
+
+  std::atomic_store(&_snapshot, DnsCacheSnapshotPtr(snapshot));
+  _snapshot_version++;
+  _snapshot_dirty = false;
+}
+
+/// Records that the cache entry with the specified key has been added,
+/// changed or removed, so that it is updated in the next snapshot.  Must be
+/// called with the cache lock held.
+void DnsCachedResolver::snapshot_entry_changed(const DnsCacheKey& key)
+{
+  _snapshot_changed.insert(key);
+  _snapshot_dirty = true;
+}
+
+/// Works out which snapshot bucket holds the entry with the specified key.
+/// Domains are compared case-insensitively, so they are hashed that way too.
+size_t DnsCachedResolver::snapshot_bucket(const DnsCacheKey& key)
+{
+  size_t hash = key.first;
+
+  for (char c : key.second)
+  {
+    hash = hash * 31 + tolower((unsigned char)c);
+  }
+
+  return hash % (SNAPSHOT_GROUPS * SNAPSHOT_GROUP_BUCKETS);
+}
+
+/// Releases one owner's hold on a snapshot reference, freeing the reference
+/// once both the thread and the resolver have released it.
+void DnsCachedResolver::destroy_snapshot_ref(DnsCacheSnapshotRef* ref)
+{
+  // Drop the snapshot straight away, rather than when the last owner lets go.
+  std::atomic_store(&ref->snapshot, DnsCacheSnapshotPtr());
+
+  if (--ref->owners == 0)
+  {
+    delete ref;
+  }
+}
+
+DnsCachedResolver::DnsCacheSnapshotEntry::DnsCacheSnapshotEntry(
+                                   const std::string& domain_param,
+                                   int dnstype_param,
+                                   int expires_param,
+                                   const DnsArenaPtr& arena_param,
+                                   const std::vector<const DnsArena::Record*>& records_param) :
+  domain(domain_param),
+  dnstype(dnstype_param),
+  expires(expires_param),
+  arena(arena_param),
+  records(records_param),
+  prefetch_hits(0)
+{
+}
+
 void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
                                         int dnstype,
                                         std::vector<DnsResult>& results,
@@ -485,7 +1430,14 @@ void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
       // asynchronous query to update our DNS cache, unless we have another
       // thread already doing this query for us.
 
-      if (ce->pending_query)
+      if (can_serve_stale(ce->expires, !ce->records.empty(), now))
+      {
+        // Use the old result and refresh it in the background.
+        TRC_DEBUG("Expired entry found in cache - using it while it is refreshed");
+        ++_stale_serves;
+        request_refresh(*domain, dnstype);
+      }
+      else if (ce->pending_query)
       {
         TRC_DEBUG("Expired entry found in cache - asynchronous query to update it already in progress on another thread");
         // To minimise latency, we should only block until that query returns if
@@ -569,18 +1521,27 @@ void DnsCachedResolver::inner_dns_query(const std::vector<std::string>& domains,
                 ce->domain.c_str(),
                 DnsRRecord::rrtype_to_string(ce->dnstype).c_str());
 
-      int expiry = ce->expires - time(NULL);
-      if (expiry < 0)
+      time_t now = time(NULL);
+      int expiry = ce->expires - now;
+      if ((expiry <= 0) &&
+          (can_serve_stale(ce->expires, !ce->records.empty(), now)))
+      {
+        // We are serving an expired DNS record while it is refreshed in the
+        // background - report a short TTL rather than one that makes the
+        // records look unusable.
+        expiry = STALE_TTL;
+      }
+      else if (expiry < 0)
       {
-        // We might have used an expired DNS record to avoid the latency of
-        // waiting for a response - if so, don't report a negative TTL.
         expiry = 0;
       }
 
-      results.push_back(DnsResult(ce->domain,
-                                  ce->dnstype,
-                                  ce->records,
-                                  expiry));
+      results.push_back(DnsResult(ce->domain, ce->dnstype, expiry));
+
+      if (ce->arena != NULL)
+      {
+        ce->arena->to_rrecords(ce->records, results.back().records());
+      }
     }
     else
     {
@@ -615,10 +1576,17 @@ void DnsCachedResolver::add_to_cache(const std::string& domain,
     clear_cache_entry(ce);
   }
 
-  // Copy all the records across to the cache entry.
+  // Copy all the records into an arena for the cache entry, then free them.
+  DnsArenaPtr arena = DnsArena::from_records(records);
+
+  for (size_t ii = 0; ii < arena->num_records(); ++ii)
+  {
+    add_record_to_cache(ce, arena, &arena->record(ii));
+  }
+
   for (size_t ii = 0; ii < records.size(); ++ii)
   {
-    add_record_to_cache(ce, records[ii]);
+    delete records[ii];
   }
 
   records.clear();
@@ -626,6 +1594,7 @@ void DnsCachedResolver::add_to_cache(const std::string& domain,
   // Finally make sure the record is in the expiry list.
   add_to_expiry_list(ce);
 
+  publish_snapshot();
   pthread_mutex_unlock(&_cache_lock);
 }
 
@@ -645,11 +1614,11 @@ std::string DnsCachedResolver::display_cache()
         << " type=" << DnsRRecord::rrtype_to_string(ce->dnstype)
         << " expires=" << ce->expires-now << std::endl;
 
-    for (std::vector<DnsRRecord*>::const_iterator j = ce->records.begin();
+    for (std::vector<const DnsArena::Record*>::const_iterator j = ce->records.begin();
          j != ce->records.end();
          ++j)
     {
-      oss << (*j)->to_string() << std::endl;
+      oss << ce->arena->to_string(**j) << std::endl;
     }
   }
   pthread_mutex_unlock(&_cache_lock);
@@ -670,6 +1639,9 @@ void DnsCachedResolver::clear()
     clear_cache_entry(ce);
     _cache.erase(i);
   }
+
+  _snapshot_dirty = true;
+  publish_snapshot();
 }
 
 /// Handles a DNS response from the server.
@@ -706,44 +1678,46 @@ void DnsCachedResolver::dns_response(const std::string& domain,
       SAS::report_event(event);
     }
 
-    // Create a message parser and parse the message.
+    // Create a message parser and parse the message into an arena, which is
+    // then shared by the cache entries that hold its records.
     DnsParser parser(abuf, alen);
+    DnsArenaPtr arena = parser.parse_to_arena();
 
-    if (parser.parse())
+    if (arena != NULL)
     {
       // Parsing was successful, so clear out any old records, then process
       // the answers and additional data.
       clear_cache_entry(ce);
 
-      while (!parser.answers().empty())
+      for (size_t ii = 0; ii < arena->num_answers(); ++ii)
       {
-        DnsRRecord* rr = parser.answers().front();
-        parser.answers().pop_front();
-        if ((rr->rrtype() == ns_t_a) ||
-            (rr->rrtype() == ns_t_aaaa))
+        const DnsArena::Record* record = &arena->record(ii);
+        const char* rrname = arena->name(record->name);
+
+        if ((record->rrtype == ns_t_a) ||
+            (record->rrtype == ns_t_aaaa))
         {
           // A/AAAA record, so check that RRNAME matches the question
           // (or a CNAME).
-          if ((strcasecmp(rr->rrname().c_str(), domain.c_str()) == 0) ||
-              (strcasecmp(rr->rrname().c_str(), canonical_domain.c_str()) == 0))
+          if ((strcasecmp(rrname, domain.c_str()) == 0) ||
+              (strcasecmp(rrname, canonical_domain.c_str()) == 0))
           {
             // RRNAME matches, so add this record to the cache entry.
-            add_record_to_cache(ce, rr);
+            add_record_to_cache(ce, arena, record);
           }
           else
           {
             TRC_DEBUG("Ignoring A/AAAA record for %s (expecting domain %s)",
-                      rr->rrname().c_str(), domain.c_str());
-            delete rr;
+                      rrname, domain.c_str());
           }
         }
-        else if ((rr->rrtype() == ns_t_srv) ||
-                 (rr->rrtype() == ns_t_naptr))
+        else if ((record->rrtype == ns_t_srv) ||
+                 (record->rrtype == ns_t_naptr))
         {
           // SRV or NAPTR record, so add it to the cache entry.
-          add_record_to_cache(ce, rr);
+          add_record_to_cache(ce, arena, record);
         }
-        else if (rr->rrtype() == ns_t_cname)
+        else if (record->rrtype == ns_t_cname)
         {
           // Store off the CNAME value, so that if we see subsequent A
           // records for the pointed-to name, we'll recognise them.
@@ -755,7 +1729,7 @@ void DnsCachedResolver::dns_response(const std::string& domain,
           //
           // RFC 1034 mandates this format, so this should be fine.
 
-          canonical_domain = ((DnsCNAMERecord*)rr)->target();
+          canonical_domain = arena->name(record->rdata.cname.target);
           TRC_DEBUG("CNAME record pointing at %s - treating this as equivalent to %s",
                     canonical_domain.c_str(),
                     domain.c_str());
@@ -763,33 +1737,30 @@ void DnsCachedResolver::dns_response(const std::string& domain,
         else
         {
           TRC_WARNING("Ignoring %s record in DNS answer - only CNAME, A, AAAA, NAPTR and SRV are supported",
-                      DnsRRecord::rrtype_to_string(rr->rrtype()).c_str());
-          delete rr;
+                      DnsRRecord::rrtype_to_string(record->rrtype).c_str());
         }
       }
 
       // Process any additional records returned in the response, creating
       // or updating cache entries.  First we sort the records by cache key.
-      std::map<DnsCacheKey, std::list<DnsRRecord*> > sorted;
-      while (!parser.additional().empty())
+      std::map<DnsCacheKey, std::list<const DnsArena::Record*> > sorted;
+      for (size_t ii = arena->num_records() - arena->num_additional();
+           ii < arena->num_records();
+           ++ii)
       {
-        DnsRRecord* rr = parser.additional().front();
-        parser.additional().pop_front();
-        if (caching_enabled(rr->rrtype()))
+        const DnsArena::Record* record = &arena->record(ii);
+        if (caching_enabled(record->rrtype))
         {
           // Caching is enabled for this record type, so add it to sorted
           // structure.
-          sorted[std::make_pair(rr->rrtype(), rr->rrname())].push_back(rr);
-        }
-        else
-        {
-          // Caching not enabled for this record, so delete it.
-          delete rr;
+          sorted[std::make_pair((int)record->rrtype,
+                                std::string(arena->name(record->name),
+                                            arena->name_length(record->name)))].push_back(record);
         }
       }
 
       // Now update each cache record in turn.
-      for (std::map<DnsCacheKey, std::list<DnsRRecord*> >::const_iterator i = sorted.begin();
+      for (std::map<DnsCacheKey, std::list<const DnsArena::Record*> >::const_iterator i = sorted.begin();
            i != sorted.end();
            ++i)
       {
@@ -804,11 +1775,11 @@ void DnsCachedResolver::dns_response(const std::string& domain,
           // Existing cache entry so clear out any existing records.
           clear_cache_entry(ace);
         }
-        for (std::list<DnsRRecord*>::const_iterator j = i->second.begin();
+        for (std::list<const DnsArena::Record*>::const_iterator j = i->second.begin();
              j != i->second.end();
              ++j)
         {
-          add_record_to_cache(ace, *j);
+          add_record_to_cache(ace, arena, *j);
         }
 
         // Finally make sure the record is in the expiry list.
@@ -854,6 +1825,7 @@ void DnsCachedResolver::dns_response(const std::string& domain,
       }
 
       ce->expires = 30 + time(NULL);
+      cache_entry_changed(ce);
     }
   }
 
@@ -864,6 +1836,7 @@ void DnsCachedResolver::dns_response(const std::string& domain,
   {
     // We didn't get an SOA record, so use a default negative cache timeout.
     ce->expires = DEFAULT_NEGATIVE_CACHE_TTL + time(NULL);
+    cache_entry_changed(ce);
   }
 
   // Add the record to the expiry list.
@@ -873,10 +1846,20 @@ void DnsCachedResolver::dns_response(const std::string& domain,
   // the lock on the cache entry.
   ce->pending_query = false;
 
+  if (ce->refresh_skipped)
+  {
+    // A prefetch was skipped while this query was pending, and won't be
+    // triggered again by the same snapshot entry, so republish the entry
+    // with its hit count reset.
+    ce->refresh_skipped = false;
+    cache_entry_changed(ce);
+  }
+
   // Another thread may be waiting for our query to finish, so
   // broadcast a signal to wake it up.
   pthread_cond_broadcast(&_got_reply_cond);
 
+  publish_snapshot();
   pthread_mutex_unlock(&_cache_lock);
 }
 
@@ -907,7 +1890,9 @@ DnsCachedResolver::DnsCacheEntryPtr DnsCachedResolver::create_cache_entry(const
   ce->dnstype = dnstype;
   ce->expires = 0;
   ce->pending_query = false;
+  ce->refresh_skipped = false;
   _cache[std::make_pair(dnstype, domain)] = ce;
+  snapshot_entry_changed(std::make_pair(dnstype, domain));
 
   return ce;
 }
@@ -968,25 +1953,44 @@ void DnsCachedResolver::expire_cache()
 /// Clears all the records from a cache entry.
 void DnsCachedResolver::clear_cache_entry(DnsCacheEntryPtr ce)
 {
-  while (!ce->records.empty())
-  {
-    delete ce->records.back();
-    ce->records.pop_back();
-  }
+  ce->records.clear();
+  ce->arena.reset();
   ce->expires = 0;
+  cache_entry_changed(ce);
+}
+
+/// Marks a cache entry as changed, so that it is copied into the next
+/// snapshot of the cache.
+void DnsCachedResolver::cache_entry_changed(DnsCacheEntryPtr ce)
+{
+  ce->snapshot.reset();
+  snapshot_entry_changed(std::make_pair(ce->dnstype, ce->domain));
 }
 
-/// Adds a DNS RR to a cache entry.
-void DnsCachedResolver::add_record_to_cache(DnsCacheEntryPtr ce, DnsRRecord* rr)
+/// Adds a DNS RR to a cache entry.  All the records in a cache entry must be
+/// in the same arena.
+void DnsCachedResolver::add_record_to_cache(DnsCacheEntryPtr ce,
+                                            const DnsArenaPtr& arena,
+                                            const DnsArena::Record* record)
 {
-  TRC_DEBUG("Adding record to cache entry, TTL=%d, expiry=%ld", rr->ttl(), rr->expires());
+  TRC_DEBUG("Adding record to cache entry, TTL=%d, expiry=%d", record->ttl, record->expires);
+
+  // An entry only holds a reference to one arena, so all its records must
+  // come from the same one (the entry is cleared before it is refilled from a
+  // new response).
+  assert((ce->records.empty()) || (ce->arena == arena));
+  assert((record >= &arena->record(0)) &&
+         (record < &arena->record(0) + arena->num_records()));
+
   if ((ce->expires == 0) ||
-      (ce->expires > rr->expires()))
+      (ce->expires > record->expires))
   {
-    TRC_DEBUG("Update cache entry expiry to %ld", rr->expires());
-    ce->expires = rr->expires();
+    TRC_DEBUG("Update cache entry expiry to %d", record->expires);
+    ce->expires = record->expires;
   }
-  ce->records.push_back(rr);
+  ce->arena = arena;
+  ce->records.push_back(record);
+  cache_entry_changed(ce);
 }
 
 /// Waits for replies to outstanding DNS queries on the specified channel.
@@ -15,6 +15,7 @@
 
 #include <memory.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <ares.h>
 
@@ -336,6 +337,339 @@ int DnsParser::parse_rr(unsigned char* rptr, DnsRRecord*& rr)
   return nlength + RR_HDR_FIXED_SIZE + rdlength;
 }
 
+/// State for one pass over the message in parse_to_arena.
+struct DnsParser::ArenaPass
+{
+  // The arena being filled in, or NULL if this pass is just checking the
+  // message and measuring the arena.
+  DnsArena* arena;
+  int now;
+
+  size_t num_records;
+  size_t num_names;
+  size_t text_size;
+
+  // Bitmap of the offsets in the message at which names have been decoded,
+  // so that compression pointers to them can reuse the decoded name.
+  uint64_t decoded_names[(MAX_MESSAGE_LENGTH / 64) + 1];
+
+  bool decoded(size_t offset) const
+  {
+    return (decoded_names[offset / 64] & (1ull << (offset % 64))) != 0;
+  }
+
+  void set_decoded(size_t offset)
+  {
+    decoded_names[offset / 64] |= (1ull << (offset % 64));
+  }
+};
+
+std::shared_ptr<DnsArena> DnsParser::parse_to_arena()
+{
+  std::shared_ptr<DnsArena> arena;
+
+  TRC_DEBUG("Parsing DNS message\n%s", display_message().c_str());
+
+  if ((_length < HDR_SIZE) || (_length > MAX_MESSAGE_LENGTH))
+  {
+    TRC_ERROR("Failed to parse DNS message - invalid length %d", _length);
+    return arena;
+  }
+
+  ArenaPass pass;
+  pass.arena = NULL;
+  pass.now = time(NULL);
+
+  try
+  {
+    // The first pass checks that the message is valid and works out how big
+    // the arena needs to be, and the second fills it in.
+    arena_pass(pass);
+    arena = std::make_shared<DnsArena>(pass.num_records,
+                                       pass.num_names,
+                                       pass.text_size);
+    pass.arena = arena.get();
+    arena_pass(pass);
+  }
+  catch (std::exception& e)
+  {
+    TRC_ERROR("Failed to parse DNS message - %s", e.what());
+    arena.reset();
+    return arena;
+  }
+
+  TRC_DEBUG("Parsed %zu records with %zu distinct names",
+            arena->num_records(), arena->names_used());
+  TRC_DEBUG("Records\n%s", display_records(*arena).c_str());
+
+  return arena;
+}
+
+void DnsParser::arena_pass(ArenaPass& pass)
+{
+  pass.num_records = 0;
+  pass.num_names = 0;
+  pass.text_size = 0;
+  memset(pass.decoded_names, 0, ((_length / 64) + 1) * sizeof(uint64_t));
+
+  _qd_count = read_int16(_data + QDCOUNT_OFFSET);
+  _an_count = read_int16(_data + ANCOUNT_OFFSET);
+  _ns_count = read_int16(_data + NSCOUNT_OFFSET);
+  _ar_count = read_int16(_data + ARCOUNT_OFFSET);
+
+  size_t offset = HDR_SIZE;
+
+  // The question names aren't stored in any records, but are decoded anyway
+  // because the names in the answers are usually pointers to them.
+  for (int ii = 0; ii < _qd_count; ++ii)
+  {
+    arena_domain_name(pass, offset);
+    check_bounds(offset, Q_FIXED_SIZE);
+    offset += Q_FIXED_SIZE;
+  }
+
+  for (int ii = 0; ii < _an_count + _ns_count + _ar_count; ++ii)
+  {
+    arena_rr(pass, offset);
+  }
+
+  if (pass.arena != NULL)
+  {
+    pass.arena->set_sections(_an_count, _ns_count);
+  }
+}
+
+uint32_t DnsParser::arena_domain_name(ArenaPass& pass, size_t& offset)
+{
+  size_t start = offset;
+  check_bounds(start, 1);
+
+  if ((_data[start] & 0xc0) == 0xc0)
+  {
+    // The whole name is compressed, so if it points at a name we've already
+    // decoded, just reuse that.
+    check_bounds(start, 2);
+    size_t target = ((_data[start] & 0x3f) << 8) + _data[start + 1];
+
+    if ((target < start) && (pass.decoded(target)))
+    {
+      offset += 2;
+      return (pass.arena != NULL) ? pass.arena->find_name(target) : 0;
+    }
+  }
+
+  char name[MAX_NAME_LENGTH + 1];
+  size_t length = 0;
+  size_t encoded_length = 0;
+
+  if (_data[start] == 0)
+  {
+    // The root domain.
+    name[length++] = '.';
+    encoded_length = 1;
+  }
+  else
+  {
+    // Each pointer must point before the previous one (or the start of the
+    // name), so decoding always terminates.
+    size_t pos = start;
+    size_t limit = start;
+
+    while (true)
+    {
+      check_bounds(pos, 1);
+      int label = _data[pos];
+
+      if (label == 0)
+      {
+        if (encoded_length == 0)
+        {
+          encoded_length = pos + 1 - start;
+        }
+        break;
+      }
+      else if ((label & 0xc0) == 0)
+      {
+        check_bounds(pos + 1, label);
+        size_t separator = (length > 0) ? 1 : 0;
+
+        if (length + separator + label > (size_t)MAX_NAME_LENGTH)
+        {
+          throw std::exception();
+        }
+
+        if (separator)
+        {
+          name[length++] = '.';
+        }
+        memcpy(name + length, _data + pos + 1, label);
+        length += label;
+        pos += label + 1;
+      }
+      else if ((label & 0xc0) == 0xc0)
+      {
+        check_bounds(pos, 2);
+        size_t target = ((label & 0x3f) << 8) + _data[pos + 1];
+
+        if (target >= limit)
+        {
+          throw std::exception();
+        }
+
+        if (encoded_length == 0)
+        {
+          encoded_length = pos + 2 - start;
+        }
+        limit = target;
+        pos = target;
+      }
+      else
+      {
+        TRC_DEBUG("Unexpected label length/offset field %x at offset %x",
+                  label, pos);
+        throw std::exception();
+      }
+    }
+  }
+
+  pass.set_decoded(start);
+  pass.num_names++;
+  pass.text_size += length + 1;
+  offset += encoded_length;
+
+  return (pass.arena != NULL) ? pass.arena->add_name(name, length, start) : 0;
+}
+
+void DnsParser::arena_character_string(ArenaPass& pass,
+                                       size_t& offset,
+                                       size_t end,
+                                       DnsArena::Text& text)
+{
+  if (offset >= end)
+  {
+    throw std::exception();
+  }
+
+  size_t length = _data[offset];
+
+  if (offset + 1 + length > end)
+  {
+    throw std::exception();
+  }
+
+  if (pass.arena != NULL)
+  {
+    memcpy(pass.arena->add_text(length, text), _data + offset + 1, length);
+  }
+
+  pass.text_size += length + 1;
+  offset += length + 1;
+}
+
+void DnsParser::arena_rr(ArenaPass& pass, size_t& offset)
+{
+  // Parse the common RR fields.
+  DnsArena::Record record;
+  memset(&record, 0, sizeof(record));
+  record.name = arena_domain_name(pass, offset);
+
+  check_bounds(offset, RR_HDR_FIXED_SIZE);
+  record.rrtype = read_int16(_data + offset + RRTYPE_OFFSET);
+  record.rrclass = read_int16(_data + offset + RRCLASS_OFFSET);
+  record.ttl = read_int32(_data + offset + TTL_OFFSET);
+  if (record.ttl < 0)
+  {
+    // RFC 2181 says to treat TTLs with the top bit set as zero.
+    record.ttl = 0;
+  }
+  record.expires = ((int64_t)pass.now + record.ttl > INT32_MAX) ?
+                   INT32_MAX : pass.now + record.ttl;
+  size_t rdlength = read_int16(_data + offset + RDLENGTH_OFFSET);
+  size_t rdata = offset + RR_HDR_FIXED_SIZE;
+
+  // Check the length of the variable part of the record doesn't overflow
+  // the buffer.
+  check_bounds(rdata, rdlength);
+  size_t end = rdata + rdlength;
+
+  // Process the variant parts of the record.
+  if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_a))
+  {
+    if (rdlength < sizeof(struct in_addr))
+    {
+      throw std::exception();
+    }
+    memcpy(&record.rdata.a, _data + rdata, sizeof(struct in_addr));
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_aaaa))
+  {
+    if (rdlength < sizeof(struct in6_addr))
+    {
+      throw std::exception();
+    }
+    memcpy(&record.rdata.aaaa, _data + rdata, sizeof(struct in6_addr));
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_srv))
+  {
+    if (rdlength < SRV_FIXED_SIZE)
+    {
+      throw std::exception();
+    }
+    record.rdata.srv.priority = read_int16(_data + rdata + SRV_PRIORITY_OFFSET);
+    record.rdata.srv.weight = read_int16(_data + rdata + SRV_WEIGHT_OFFSET);
+    record.rdata.srv.port = read_int16(_data + rdata + SRV_PORT_OFFSET);
+    size_t pos = rdata + SRV_TARGET_OFFSET;
+    record.rdata.srv.target = arena_domain_name(pass, pos);
+    if (pos > end)
+    {
+      throw std::exception();
+    }
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_naptr))
+  {
+    if (rdlength < NAPTR_FIXED_SIZE)
+    {
+      throw std::exception();
+    }
+    record.rdata.naptr.order = read_int16(_data + rdata + NAPTR_ORDER_OFFSET);
+    record.rdata.naptr.preference = read_int16(_data + rdata + NAPTR_PREFERENCE_OFFSET);
+    size_t pos = rdata + NAPTR_FLAGS_OFFSET;
+    arena_character_string(pass, pos, end, record.rdata.naptr.flags);
+    arena_character_string(pass, pos, end, record.rdata.naptr.service);
+    arena_character_string(pass, pos, end, record.rdata.naptr.regexp);
+    record.rdata.naptr.replacement = arena_domain_name(pass, pos);
+    if (pos > end)
+    {
+      throw std::exception();
+    }
+  }
+  else if ((record.rrclass == ns_c_in) && (record.rrtype == ns_t_cname))
+  {
+    size_t pos = rdata;
+    record.rdata.cname.target = arena_domain_name(pass, pos);
+    if (pos > end)
+    {
+      throw std::exception();
+    }
+  }
+
+  if (pass.arena != NULL)
+  {
+    pass.arena->add_record() = record;
+  }
+
+  pass.num_records++;
+  offset = end;
+}
+
+void DnsParser::check_bounds(size_t offset, size_t length)
+{
+  if (offset + length > (size_t)_length)
+  {
+    throw std::exception();
+  }
+}
+
 int DnsParser::read_int16(unsigned char* p)
 {
   return (((int)(*p)) << 8) + ((int)(*(p+1)));
@@ -414,3 +748,12 @@ std::string DnsParser::display_records(const std::list<DnsRRecord*>& records)
   return oss.str();
 }
 
+std::string DnsParser::display_records(const DnsArena& arena)
+{
+  std::ostringstream oss;
+  for (size_t ii = 0; ii < arena.num_records(); ++ii)
+  {
+    oss << arena.to_string(arena.record(ii)) << std::endl;
+  }
+  return oss.str();
+}
@@ -0,0 +1,90 @@
+/**
+ * @file histogram.cpp Lock-free log-linear histogram.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <math.h>
+
+#include "histogram.h"
+
+const unsigned int Histogram::SUB_BUCKET_BITS;
+const unsigned int Histogram::NUM_BUCKETS;
+
+uint_fast64_t Histogram::count() const
+{
+  uint_fast64_t total = 0;
+
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    total += _buckets[ii].load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+uint_fast64_t Histogram::percentiles(const std::vector<double>& percentiles,
+                                     std::vector<uint_fast64_t>& values) const
+{
+  // Take a copy of the buckets, so that the count and the percentiles are
+  // consistent with each other even if samples are being recorded.
+  uint_fast64_t counts[NUM_BUCKETS];
+  uint_fast64_t total = 0;
+
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    counts[ii] = _buckets[ii].load(std::memory_order_relaxed);
+    total += counts[ii];
+  }
+
+  values.assign(percentiles.size(), 0);
+
+  if (total == 0)
+  {
+    return total;
+  }
+
+  // Walk the buckets once, filling in each percentile when the running count
+  // reaches the number of samples at or below it.
+  unsigned int bucket = 0;
+  uint_fast64_t running_count = counts[0];
+
+  for (size_t jj = 0; jj < percentiles.size(); ++jj)
+  {
+    double fraction = percentiles[jj] / 100.0;
+    fraction = (fraction < 0.0) ? 0.0 : (fraction > 1.0) ? 1.0 : fraction;
+
+    uint_fast64_t target = (uint_fast64_t)ceil(fraction * total);
+    target = (target == 0) ? 1 : target;
+
+    while ((running_count < target) && (bucket < NUM_BUCKETS - 1))
+    {
+      ++bucket;
+      running_count += counts[bucket];
+    }
+
+    values[jj] = bucket_max_value(bucket);
+  }
+
+  return total;
+}
+
+uint_fast64_t Histogram::percentile(double percentile) const
+{
+  std::vector<uint_fast64_t> values;
+  percentiles(std::vector<double>(1, percentile), values);
+  return values[0];
+}
+
+void Histogram::reset()
+{
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii].store(0, std::memory_order_relaxed);
+  }
+}
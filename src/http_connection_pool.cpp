@@ -10,14 +10,21 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include "http_connection_pool.h"
 #include "httpconnection.h"
 
 HttpConnectionPool::HttpConnectionPool(LoadMonitor* load_monitor,
                                        SNMP::IPCountTable* stat_table) :
   ConnectionPool<CURL*>(MAX_IDLE_TIME_S),
-  _stat_table(stat_table)
+  _stat_table(stat_table),
+  _http2(false),
+  _sockets()
 {
+  pthread_mutex_init(&_stat_lock, NULL);
+
   _timeout_ms = calc_req_timeout_from_latency((load_monitor != NULL) ?
                                                               load_monitor->get_target_latency_us() :
                                                               DEFAULT_LATENCY_US);
@@ -50,6 +57,11 @@ CURL* HttpConnectionPool::create_connection(AddrInfo target)
   // of DNS entries and we rely on this for load balancing.
   curl_easy_setopt(conn, CURLOPT_DNS_CACHE_TIMEOUT, 0L);
 
+  // Don't reuse a connection that has been idle for longer than a pooled
+  // handle can be.  This matters for connections held in the connection
+  // cache of a multi handle, which outlive the handle that opened them.
+  curl_easy_setopt(conn, CURLOPT_MAXAGE_CONN, (long)MAX_IDLE_TIME_S);
+
   // Nagle is not required. Probably won't bite us, but can't hurt
   // to turn it off.
   curl_easy_setopt(conn, CURLOPT_TCP_NODELAY, 1L);
@@ -67,6 +79,22 @@ CURL* HttpConnectionPool::create_connection(AddrInfo target)
 
   curl_easy_setopt(conn, CURLOPT_VERBOSE, 1L);
 
+  if (_http2)
+  {
+    // Speak HTTP/2 without an upgrade from HTTP/1.1, and wait for an existing
+    // connection to the target to become available for multiplexing rather
+    // than opening a new one.
+    curl_easy_setopt(conn, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    curl_easy_setopt(conn, CURLOPT_PIPEWAIT, 1L);
+
+    // Many handles share each connection, so count the connections
+    // themselves (as they are opened and closed) rather than the handles.
+    curl_easy_setopt(conn, CURLOPT_OPENSOCKETFUNCTION, &HttpConnectionPool::open_socket);
+    curl_easy_setopt(conn, CURLOPT_OPENSOCKETDATA, this);
+    curl_easy_setopt(conn, CURLOPT_CLOSESOCKETFUNCTION, &HttpConnectionPool::close_socket);
+    curl_easy_setopt(conn, CURLOPT_CLOSESOCKETDATA, this);
+  }
+
   increment_statistic(target, conn);
 
   return conn;
@@ -74,7 +102,7 @@ CURL* HttpConnectionPool::create_connection(AddrInfo target)
 
 void HttpConnectionPool::increment_statistic(AddrInfo target, CURL* conn)
 {
-  if (_stat_table)
+  if ((_stat_table) && (!_http2))
   {
     // Increment the statistic
     char buf[100];
@@ -82,15 +110,13 @@ void HttpConnectionPool::increment_statistic(AddrInfo target, CURL* conn)
                                        &target.address.addr,
                                        buf,
                                        sizeof(buf));
-    // The lock is held in the base class when this method is called, so it is
-    // safe to access the table
-    _stat_table->get(ip_address)->increment();
+    update_statistic(ip_address, 1);
   }
 }
 
 void HttpConnectionPool::decrement_statistic(AddrInfo target, CURL* conn)
 {
-  if (_stat_table)
+  if ((_stat_table) && (!_http2))
   {
     // Decrement the statistic
     char buf[100];
@@ -98,27 +124,98 @@ void HttpConnectionPool::decrement_statistic(AddrInfo target, CURL* conn)
                                        &target.address.addr,
                                        buf,
                                        sizeof(buf));
-    // The lock is held in the base class when this method is called, so it is
-    // safe to access the table
-    if (_stat_table->get(ip_address)->decrement() == 0)
+    update_statistic(ip_address, -1);
+  }
+}
+
+void HttpConnectionPool::update_statistic(const std::string& ip_address,
+                                          int delta)
+{
+  // Connections are counted both by the pool (which holds its own lock) and
+  // by curl as it opens and closes sockets (which doesn't), so take our own
+  // lock to access the table.
+  pthread_mutex_lock(&_stat_lock);
+
+  if (delta > 0)
+  {
+    _stat_table->get(ip_address)->increment();
+  }
+  else if (_stat_table->get(ip_address)->decrement() == 0)
+  {
+    // If the statistic is now zero, remove from the table
+    _stat_table->remove(ip_address);
+  }
+
+  pthread_mutex_unlock(&_stat_lock);
+}
+
+curl_socket_t HttpConnectionPool::open_socket(void* pool_ptr,
+                                              curlsocktype purpose,
+                                              struct curl_sockaddr* address)
+{
+  HttpConnectionPool* pool = (HttpConnectionPool*)pool_ptr;
+  curl_socket_t fd = socket(address->family, address->socktype, address->protocol);
+
+  if ((fd != CURL_SOCKET_BAD) &&
+      (pool->_stat_table) &&
+      (purpose == CURLSOCKTYPE_IPCXN))
+  {
+    char buf[100];
+    const char* ip_address = NULL;
+
+    if (address->family == AF_INET)
     {
-      // If the statistic is now zero, remove from the table
-      _stat_table->remove(ip_address);
+      ip_address = inet_ntop(AF_INET,
+                             &((struct sockaddr_in*)&address->addr)->sin_addr,
+                             buf,
+                             sizeof(buf));
+    }
+    else if (address->family == AF_INET6)
+    {
+      ip_address = inet_ntop(AF_INET6,
+                             &((struct sockaddr_in6*)&address->addr)->sin6_addr,
+                             buf,
+                             sizeof(buf));
+    }
+
+    if (ip_address != NULL)
+    {
+      pool->update_statistic(ip_address, 1);
+
+      pthread_mutex_lock(&pool->_stat_lock);
+      pool->_sockets[fd] = ip_address;
+      pthread_mutex_unlock(&pool->_stat_lock);
     }
   }
+
+  return fd;
 }
 
-void HttpConnectionPool::destroy_connection(AddrInfo target, CURL* conn)
+int HttpConnectionPool::close_socket(void* pool_ptr, curl_socket_t fd)
 {
-  decrement_statistic(target, conn);
-  curl_slist *host_resolve = NULL;
-  curl_easy_getinfo(conn, CURLINFO_PRIVATE, &host_resolve);
-  if (host_resolve != NULL)
+  HttpConnectionPool* pool = (HttpConnectionPool*)pool_ptr;
+  std::string ip_address;
+
+  pthread_mutex_lock(&pool->_stat_lock);
+  std::map<curl_socket_t, std::string>::iterator it = pool->_sockets.find(fd);
+  if (it != pool->_sockets.end())
+  {
+    ip_address = it->second;
+    pool->_sockets.erase(it);
+  }
+  pthread_mutex_unlock(&pool->_stat_lock);
+
+  if (!ip_address.empty())
   {
-    curl_easy_setopt(conn, CURLOPT_PRIVATE, NULL);
-    curl_slist_free_all(host_resolve);
+    pool->update_statistic(ip_address, -1);
   }
 
+  return close(fd);
+}
+
+void HttpConnectionPool::destroy_connection(AddrInfo target, CURL* conn)
+{
+  decrement_statistic(target, conn);
   curl_easy_cleanup(conn);
 }
 
@@ -10,7 +10,12 @@
  */
 
 #include <curl/curl.h>
+#include <algorithm>
 #include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <deque>
 #include <iostream>
 #include <map>
 
@@ -25,6 +30,17 @@
 /// Maximum number of targets to try connecting to.
 static const int MAX_TARGETS = 5;
 
+/// Length of the periods over which response times are collected to
+/// calculate the hedge delay.
+static const int HEDGE_LATENCY_PERIOD_MS = 10000;
+
+/// Number of response times needed in a period before the hedge delay is
+/// calculated from them.
+static const uint_fast64_t MIN_HEDGE_LATENCY_SAMPLES = 20;
+
+/// Whether the current thread is running an AsyncLoop.
+static thread_local bool on_async_loop_thread = false;
+
 /// Create an HTTP client object.
 ///
 /// @param assert_user Assert user in header?
@@ -46,10 +62,17 @@ HttpClient::HttpClient(bool assert_user,
   _comm_monitor(comm_monitor),
   _stat_table(stat_table),
   _conn_pool(load_monitor, stat_table),
-  _should_omit_body(should_omit_body)
+  _should_omit_body(should_omit_body),
+  _async_loops(),
+  _next_async_loop(0),
+  _hedge_percentile(0),
+  _min_hedge_delay_ms(0),
+  _hedge_latencies(HEDGE_LATENCY_PERIOD_MS),
+  _hedge_multis()
 {
   pthread_key_create(&_uuid_thread_local, cleanup_uuid);
   pthread_mutex_init(&_lock, NULL);
+  pthread_rwlock_init(&_async_loops_lock, NULL);
   curl_global_init(CURL_GLOBAL_DEFAULT);
 }
 
@@ -73,6 +96,8 @@ HttpClient::HttpClient(bool assert_user,
 
 HttpClient::~HttpClient()
 {
+  stop_async();
+
   RandomUUIDGenerator* uuid_gen =
     (RandomUUIDGenerator*)pthread_getspecific(_uuid_thread_local);
 
@@ -83,6 +108,15 @@ HttpClient::~HttpClient()
   }
 
   pthread_key_delete(_uuid_thread_local);
+
+  for (CURLM* multi : _hedge_multis)
+  {
+    curl_multi_cleanup(multi);
+  }
+
+  _hedge_multis.clear();
+
+  pthread_rwlock_destroy(&_async_loops_lock);
 }
 
 // Map the CURLcode into a sensible HTTP return code.
@@ -324,6 +358,99 @@ std::string HttpClient::request_type_to_string(RequestType request_type)
   }
 }
 
+/// State for a single HTTP request as it is retried across targets.  This is
+/// shared by the synchronous path (where it lives on the stack for the
+/// duration of send_request) and the asynchronous path (where it is owned by
+/// an AsyncLoop while the request is in flight).
+struct HttpClient::RequestContext
+{
+  RequestContext(RequestType request_type_param,
+                 const std::string& url_param,
+                 const std::string& body_param,
+                 std::string* doc_param,
+                 const std::string& username_param,
+                 SAS::TrailId trail_param,
+                 const std::vector<std::string>& headers_to_add_param,
+                 std::map<std::string, std::string>* response_headers_param) :
+    request_type(request_type_param),
+    url(url_param),
+    body(body_param),
+    doc(doc_param),
+    username(username_param),
+    trail(trail_param),
+    headers_to_add(headers_to_add_param),
+    response_headers(response_headers_param),
+    port(0),
+    target_it(NULL),
+    host_is_ip(false),
+    num_http_503_responses(0),
+    num_http_504_responses(0),
+    num_timeouts_or_io_errors(0),
+    attempts(0),
+    remote_ip(NULL),
+    rc(CURLE_COULDNT_RESOLVE_HOST),
+    http_code(HTTP_NOT_FOUND),
+    conn_handle(NULL),
+    curl(NULL),
+    extra_headers(NULL),
+    connect_to(NULL),
+    host_context(NULL),
+    req_timestamp(0)
+  {
+    // We always want to catch the headers, even if the caller isn't
+    // interested.
+    if (response_headers == NULL)
+    {
+      response_headers = &internal_rsp_hdrs;
+    }
+  }
+
+  RequestType request_type;
+  std::string url;
+  std::string body;
+  std::string* doc;
+  std::string username;
+  SAS::TrailId trail;
+  std::vector<std::string> headers_to_add;
+  std::map<std::string, std::string>* response_headers;
+  std::map<std::string, std::string> internal_rsp_hdrs;
+
+  std::string uuid_str;
+  std::string scheme;
+  std::string host;
+  std::string path;
+  int port;
+
+  BaseAddrIterator* target_it;
+  bool host_is_ip;
+
+  // Track the number of HTTP 503 and 504 responses and the number of timeouts
+  // or I/O errors.
+  int num_http_503_responses;
+  int num_http_504_responses;
+  int num_timeouts_or_io_errors;
+  int attempts;
+
+  // State for the current attempt.
+  AddrInfo target;
+  char remote_ip_buf[100];
+  const char* remote_ip;
+  CURLcode rc;
+  HTTPCode http_code;
+  ConnectionHandle<CURL*>* conn_handle;
+  CURL* curl;
+  struct curl_slist* extra_headers;
+  curl_slist* connect_to;
+  std::string curl_target;
+  Recorder recorder;
+  void* host_context;
+  SAS::Timestamp req_timestamp;
+
+  // Used only for asynchronous requests.
+  std::string async_doc;
+  ResponseCallback callback;
+};
+
 /// Get data; return a HTTP return code
 HTTPCode HttpClient::send_request(RequestType request_type,
                                   const std::string& url,
@@ -334,310 +461,666 @@ HTTPCode HttpClient::send_request(RequestType request_type,
                                   std::vector<std::string> headers_to_add,
                                   std::map<std::string, std::string>* response_headers)
 {
-  HTTPCode http_code;
-  CURLcode rc;
+  bool async_running;
 
-  // Create a UUID to use for SAS correlation.
-  boost::uuids::uuid uuid = get_random_uuid();
-  std::string uuid_str = boost::uuids::to_string(uuid);
+  pthread_rwlock_rdlock(&_async_loops_lock);
+  async_running = !_async_loops.empty();
+  pthread_rwlock_unlock(&_async_loops_lock);
 
-  // Now log the marker to SAS. Flag that SAS should not reactivate the trail
-  // group as a result of associations on this marker (doing so after the call
-  // ends means it will take a long time to be searchable in SAS).
-  SAS::Marker corr_marker(trail, MARKER_ID_VIA_BRANCH_PARAM, 0);
-  corr_marker.add_var_param(uuid_str);
-  SAS::report_marker(corr_marker, SAS::Marker::Scope::Trace, false);
+  if ((_conn_pool.http2_enabled()) &&
+      (async_running) &&
+      (!on_async_loop_thread))
+  {
+    // Send the request via one of the event loops, so that it is multiplexed
+    // with requests from other threads onto a single connection to the
+    // target.  Requests from callbacks on the event loop threads can't wait
+    // for the loop, so those are sent directly below.  If the loops are
+    // stopped in the meantime, send_request_async sends the request
+    // directly instead.
+    return send_request_multiplexed(request_type,
+                                    url,
+                                    body,
+                                    doc,
+                                    username,
+                                    trail,
+                                    headers_to_add,
+                                    response_headers);
+  }
 
-  std::string scheme;
-  std::string server;
-  std::string path;
-  if (!Utils::parse_http_url(url, scheme, server, path))
+  RequestContext ctx(request_type,
+                     url,
+                     body,
+                     &doc,
+                     username,
+                     trail,
+                     headers_to_add,
+                     response_headers);
+
+  if (!init_request(ctx))
   {
-    TRC_ERROR("%s could not be parsed as a URL : fatal",
-              url.c_str());
     return HTTP_BAD_REQUEST;
   }
 
-  std::string host = host_from_server(scheme, server);
-  int port = port_from_server(scheme, server);
+  if ((_hedge_percentile > 0) && (request_type == RequestType::GET))
+  {
+    perform_hedged_request(ctx);
+  }
+  else
+  {
+    // Iterate over the targets until a successful connection is made, a
+    // specified number of failures is reached, or the targets are exhausted.
+    while (start_attempt(ctx))
+    {
+      CURLcode rc = curl_easy_perform(ctx.curl);
 
-  // Resolve the host, and check whether it was an IP address all along.
-  BaseAddrIterator* target_it = _resolver->resolve_iter(host, port, trail);
-  IP46Address dummy_address;
-  bool host_is_ip = BaseResolver::parse_ip_target(host, dummy_address);
+      if (!complete_attempt(ctx, rc))
+      {
+        break;
+      }
+    }
+  }
 
-  // Track the number of HTTP 503 and 504 responses and the number of timeouts
-  // or I/O errors.
-  int num_http_503_responses = 0;
-  int num_http_504_responses = 0;
-  int num_timeouts_or_io_errors = 0;
+  return finish_request(ctx);
+}
 
-  // Track the IP addresses we're connecting to.  If we fail, we failed to
-  // resolve the host, so default to that.
-  const char *remote_ip = NULL;
-  rc = CURLE_COULDNT_RESOLVE_HOST;
-  http_code = HTTP_NOT_FOUND;
+HTTPCode HttpClient::send_request_multiplexed(RequestType request_type,
+                                              const std::string& url,
+                                              const std::string& body,
+                                              std::string& doc,
+                                              const std::string& username,
+                                              SAS::TrailId trail,
+                                              const std::vector<std::string>& headers_to_add,
+                                              std::map<std::string, std::string>* response_headers)
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool complete = false;
+  HTTPCode http_code = HTTP_SERVER_UNAVAILABLE;
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+
+  // We wait for the callback before returning, so it can safely refer to our
+  // variables.
+  send_request_async(request_type,
+                     url,
+                     body,
+                     username,
+                     trail,
+                     headers_to_add,
+                     [&](HTTPCode rsp_code,
+                         const std::string& response,
+                         const std::map<std::string, std::string>& headers)
+  {
+    pthread_mutex_lock(&lock);
+    http_code = rsp_code;
+    doc = response;
+    if (response_headers != NULL)
+    {
+      *response_headers = headers;
+    }
+    complete = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  });
 
-  AddrInfo target;
+  pthread_mutex_lock(&lock);
+  while (!complete)
+  {
+    pthread_cond_wait(&cond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+
+  return http_code;
+}
+
+void HttpClient::enable_http2()
+{
+  _conn_pool.enable_http2();
+}
 
-  // Iterate over the targets returned by target_it until a successful
-  // connection is made, a specified number of failures is reached, or the
-  // targets are exhausted. If only one target is available, it should be tried
-  // twice.
-  for (int attempts = 0;
-       target_it->next(target) || attempts == 1;
-       ++attempts)
+void HttpClient::enable_hedging(double percentile, long min_delay_ms)
+{
+  TRC_STATUS("Hedging GET requests after %.1f percentile response time (minimum %ldms)",
+             percentile, min_delay_ms);
+  _hedge_percentile = percentile;
+  _min_hedge_delay_ms = min_delay_ms;
+}
+
+long HttpClient::hedge_delay_ms()
+{
+  // Use the response times from the previous period if there are enough of
+  // them, as the current period may have only just started.
+  Histogram* latencies = _hedge_latencies.get_previous();
+
+  if (latencies->count() < MIN_HEDGE_LATENCY_SAMPLES)
   {
-    // Get a curl handle and the associated pool entry
-    ConnectionHandle<CURL*> conn_handle = _conn_pool.get_connection(target);
-    CURL* curl = conn_handle.get_connection();
+    latencies = _hedge_latencies.get_current();
+  }
 
-    // Construct and add extra headers
-    struct curl_slist* extra_headers = build_headers(headers_to_add,
-                                                     _assert_user,
-                                                     username,
-                                                     uuid_str);
+  long delay_ms = _min_hedge_delay_ms;
 
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, extra_headers);
+  if (latencies->count() >= MIN_HEDGE_LATENCY_SAMPLES)
+  {
+    delay_ms = std::max(delay_ms,
+                        (long)(latencies->percentile(_hedge_percentile) / 1000));
+  }
 
-    // Set general curl options
-    set_curl_options_general(curl, body, doc);
+  return delay_ms;
+}
 
-    // Set response header curl options. We always want to catch the headers,
-    // even if the caller isn't interested.
-    std::map<std::string, std::string> internal_rsp_hdrs;
+void HttpClient::perform_hedged_request(RequestContext& ctx)
+{
+  // The request is sent to at most two targets at once.  The first attempt
+  // always uses ctx.  A hedged attempt uses a second context, which shares
+  // the request and the target iterator with ctx but has its own curl handle
+  // and response buffers.
+  std::string hedge_doc;
+  std::map<std::string, std::string> hedge_rsp_hdrs;
+  RequestContext hedge(ctx.request_type,
+                       ctx.url,
+                       ctx.body,
+                       &hedge_doc,
+                       ctx.username,
+                       ctx.trail,
+                       ctx.headers_to_add,
+                       &hedge_rsp_hdrs);
+  hedge.uuid_str = ctx.uuid_str;
+  hedge.scheme = ctx.scheme;
+  hedge.host = ctx.host;
+  hedge.path = ctx.path;
+  hedge.port = ctx.port;
+  hedge.target_it = ctx.target_it;
+  hedge.host_is_ip = ctx.host_is_ip;
+
+  RequestContext* attempts[2] = {&ctx, &hedge};
+  bool in_flight[2] = {false, false};
+  int num_in_flight = 0;
+  int num_completed = 0;
+  bool targets_exhausted = false;
+  bool done = false;
+
+  // The attempt whose result is used for the request.
+  RequestContext* result = &ctx;
+
+  long delay_ms = hedge_delay_ms();
+  unsigned long hedge_time_ms = 0;
+
+  // A transfer can't move onto a multi handle once curl_easy_perform has
+  // started it, so both attempts are driven by a multi handle from the
+  // start.  The connections are then held in the multi handle's connection
+  // cache (rather than the curl handles'), so we keep the multi handles for
+  // later requests rather than closing the connections.
+  CURLM* multi = get_hedge_multi();
+
+  while (!done)
+  {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    unsigned long now_ms = tp.tv_sec * 1000 + (tp.tv_nsec / 1000000);
 
-    if (!response_headers)
+    if ((num_in_flight == 0) ||
+        ((num_in_flight == 1) && (!targets_exhausted) && (now_ms >= hedge_time_ms)))
     {
-      response_headers = &internal_rsp_hdrs;
-    }
+      // Start an attempt, either because nothing is in flight or because the
+      // attempt in flight has taken longer than the hedge delay.
+      int slot = in_flight[0] ? 1 : 0;
+      RequestContext* attempt = attempts[slot];
 
-    set_curl_options_response(curl, response_headers);
-
-    // Set request-type specific curl options
-    set_curl_options_request(curl, request_type);
-
-    // Convert the target IP address into a string and tell curl to resolve to that.
-    char buf[100];
-    remote_ip = inet_ntop(target.address.af,
-                          &target.address.addr,
-                          buf,
-                          sizeof(buf));
-
-    // We want curl's DNS cache to contain exactly one entry: for the host and
-    // IP that we're currently processing.
-    //
-    // It's easy to add an entry with the CURLOPT_RESOLVE flag, but removing it
-    // again in anticipation of the next query is trickier - because options
-    // that we set are not processed until we actually make a query, and we can
-    // only set this option once per request.
-    //
-    // So each time we add an entry we also store a curl_slist which will
-    // remove that entry, and then _next_ time round we use that as well as
-    // adding the entry that we do want.
-    //
-    // At this point then, we retrieve the value previously stored - if any.
-    // (We may be here for the very first time, or the previous query may have
-    // been direct to an IP address, so we may not find anything).
-    curl_slist *host_resolve = NULL;
-    curl_easy_getinfo(curl, CURLINFO_PRIVATE, &host_resolve);
-    curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
-
-    // Add the new entry - except in the case where the host is already an IP
-    // address.
-    if (!host_is_ip)
-    {
-      std::string resolve_addr =
-        host + ":" + std::to_string(port) + ":" + remote_ip;
-      host_resolve = curl_slist_append(host_resolve, resolve_addr.c_str());
-      TRC_DEBUG("Set CURLOPT_RESOLVE: %s", resolve_addr.c_str());
+      // Only retry the same target (when it is the only one) if nothing else
+      // is in flight, as in the unhedged case.
+      attempt->attempts = (num_in_flight == 0) ? num_completed : 0;
+
+      if (!start_attempt(*attempt))
+      {
+        if (num_in_flight == 0)
+        {
+          done = true;
+        }
+
+        targets_exhausted = true;
+        continue;
+      }
+
+      if (num_in_flight > 0)
+      {
+        TRC_DEBUG("No response after %ldms, hedging request to %s",
+                  delay_ms, attempt->remote_ip);
+      }
+
+      curl_multi_add_handle(multi, attempt->curl);
+      in_flight[slot] = true;
+      num_in_flight++;
+      hedge_time_ms = now_ms + delay_ms;
+      continue;
     }
-    if (host_resolve != NULL)
+
+    // Drive the transfers, and handle any that have finished.
+    int running = 0;
+    curl_multi_perform(multi, &running);
+
+    CURLMsg* msg;
+    int msgs_left = 0;
+    while ((!done) && ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL))
     {
-      curl_easy_setopt(curl, CURLOPT_RESOLVE, host_resolve);
-    }
+      if (msg->msg != CURLMSG_DONE)
+      {
+        continue; // LCOV_EXCL_LINE
+      }
 
-    // Set the curl target URL
-    std::string curl_target = scheme + "://" + host + ":" + std::to_string(port) + path;
-    curl_easy_setopt(curl, CURLOPT_URL, curl_target.c_str());
+      CURL* curl = msg->easy_handle;
+      CURLcode rc = msg->data.result;
+      curl_multi_remove_handle(multi, curl);
 
-    // Create and register an object to record the HTTP transaction.
-    Recorder recorder;
-    curl_easy_setopt(curl, CURLOPT_DEBUGDATA, &recorder);
+      int slot = (in_flight[0] && (attempts[0]->curl == curl)) ? 0 : 1;
+      RequestContext* attempt = attempts[slot];
+      in_flight[slot] = false;
+      num_in_flight--;
 
+      // Both attempts count towards the same retry limits.
+      attempt->num_http_503_responses = ctx.num_http_503_responses;
+      attempt->num_http_504_responses = ctx.num_http_504_responses;
+      attempt->num_timeouts_or_io_errors = ctx.num_timeouts_or_io_errors;
 
-    // Set host-specific curl options
-    void* host_context = set_curl_options_host(curl, host, port);
+      bool keep_trying = complete_attempt(*attempt, rc);
 
-    // Get the current timestamp before calling into curl.  This is because we
-    // can't log the request to SAS until after curl_easy_perform has returned.
-    // This could be a long time if the server is being slow, and we want to log
-    // the request with the right timestamp.
-    SAS::Timestamp req_timestamp = SAS::get_current_timestamp();
+      ctx.num_http_503_responses = attempt->num_http_503_responses;
+      ctx.num_http_504_responses = attempt->num_http_504_responses;
+      ctx.num_timeouts_or_io_errors = attempt->num_timeouts_or_io_errors;
 
-    // Send the request.
-    doc.clear();
-    TRC_DEBUG("Sending HTTP request : %s (trying %s)", url.c_str(), remote_ip);
-    rc = curl_easy_perform(curl);
+      num_completed++;
+      result = attempt;
 
-    // If a request was sent, log it to SAS.
-    std::string method_str = request_type_to_string(request_type);
-    if (recorder.request.length() > 0)
-    {
-      sas_log_http_req(trail, curl, method_str, url, recorder.request, req_timestamp, 0);
+      if (!keep_trying)
+      {
+        done = true;
+      }
     }
 
-    // Clean up from setting up the DNS cache this time round.
-    if (host_resolve != NULL)
+    if ((!done) && (num_in_flight > 0))
     {
-      curl_slist_free_all(host_resolve);
-      host_resolve = NULL;
-    }
+      // Wait for activity on the transfers, or until it's time to hedge.
+      // curl may return sooner to handle its own timeouts.
+      int timeout_ms = 1000;
 
-    // Prepare to remove the DNS entry from curl's cache next time round, if
-    // necessary
-    if (!host_is_ip)
-    {
-      std::string resolve_remove_addr =
-        std::string("-") + host + ":" + std::to_string(port);
-      host_resolve = curl_slist_append(NULL, resolve_remove_addr.c_str());
-      curl_easy_setopt(curl, CURLOPT_PRIVATE, host_resolve);
-    }
+      if ((num_in_flight == 1) && (!targets_exhausted))
+      {
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        now_ms = tp.tv_sec * 1000 + (tp.tv_nsec / 1000000);
+        timeout_ms = (hedge_time_ms > now_ms) ?
+                       std::min(timeout_ms, (int)(hedge_time_ms - now_ms)) : 0;
+      }
 
-    // Log the result of the request.
-    long http_rc = 0;
-    if (rc == CURLE_OK)
-    {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
-      sas_log_http_rsp(trail, curl, http_rc, method_str, url, recorder.response, 0);
-      TRC_DEBUG("Received HTTP response: status=%d, doc=%s", http_rc, doc.c_str());
+      int numfds = 0;
+      curl_multi_wait(multi, NULL, 0, timeout_ms, &numfds);
     }
-    else
+  }
+
+  // Cancel the attempt that lost, if it's still in flight.  It hasn't failed,
+  // so rather than blacklisting its target, tell the resolver that it went
+  // untested.
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    if (in_flight[ii])
     {
-      TRC_WARNING("%s failed at server %s : %s (%d) : fatal",
-                  url.c_str(), remote_ip, curl_easy_strerror(rc), rc);
-      sas_log_curl_error(trail, remote_ip, target.port, method_str, url, rc, 0);
+      TRC_DEBUG("Cancelling hedged request to %s", attempts[ii]->remote_ip);
+      curl_multi_remove_handle(multi, attempts[ii]->curl);
+      _resolver->untested(attempts[ii]->target);
+      abort_attempt(*attempts[ii]);
     }
+  }
+
+  release_hedge_multi(multi);
+
+  if (result != &ctx)
+  {
+    // The hedged attempt won, so copy its result into ctx.
+    ctx.target = result->target;
+    ctx.rc = result->rc;
+    ctx.http_code = result->http_code;
+    ctx.doc->swap(hedge_doc);
+    ctx.response_headers->swap(hedge_rsp_hdrs);
+  }
+
+  // The target iterator belongs to ctx.
+  hedge.target_it = NULL;
+}
+
+CURLM* HttpClient::get_hedge_multi()
+{
+  CURLM* multi = NULL;
 
-    http_code = curl_code_to_http_code(curl, rc);
+  pthread_mutex_lock(&_lock);
+  if (!_hedge_multis.empty())
+  {
+    multi = _hedge_multis.back();
+    _hedge_multis.pop_back();
+  }
+  pthread_mutex_unlock(&_lock);
 
-    // At this point, we are finished with the curl object, so it is safe to
-    // free the headers
-    curl_slist_free_all(extra_headers);
+  if (multi == NULL)
+  {
+    multi = curl_multi_init();
+  }
+
+  return multi;
+}
 
-    // Clean up any memory allocated by set_curl_options_host
-    cleanup_host_context(host_context);
+void HttpClient::release_hedge_multi(CURLM* multi)
+{
+  pthread_mutex_lock(&_lock);
+  _hedge_multis.push_back(multi);
+  pthread_mutex_unlock(&_lock);
+}
+
+bool HttpClient::init_request(RequestContext& ctx)
+{
+  // Create a UUID to use for SAS correlation.
+  boost::uuids::uuid uuid = get_random_uuid();
+  ctx.uuid_str = boost::uuids::to_string(uuid);
 
-    // Update the connection recycling and retry algorithms.
-    if ((rc == CURLE_OK) && !(http_rc >= 400))
+  // Now log the marker to SAS. Flag that SAS should not reactivate the trail
+  // group as a result of associations on this marker (doing so after the call
+  // ends means it will take a long time to be searchable in SAS).
+  SAS::Marker corr_marker(ctx.trail, MARKER_ID_VIA_BRANCH_PARAM, 0);
+  corr_marker.add_var_param(ctx.uuid_str);
+  SAS::report_marker(corr_marker, SAS::Marker::Scope::Trace, false);
+
+  std::string server;
+  if (!Utils::parse_http_url(ctx.url, ctx.scheme, server, ctx.path))
+  {
+    TRC_ERROR("%s could not be parsed as a URL : fatal",
+              ctx.url.c_str());
+    return false;
+  }
+
+  ctx.host = host_from_server(ctx.scheme, server);
+  ctx.port = port_from_server(ctx.scheme, server);
+
+  // Resolve the host, and check whether it was an IP address all along.
+  ctx.target_it = _resolver->resolve_iter(ctx.host, ctx.port, ctx.trail);
+  IP46Address dummy_address;
+  ctx.host_is_ip = BaseResolver::parse_ip_target(ctx.host, dummy_address);
+
+  // Track the IP addresses we're connecting to.  If we fail, we failed to
+  // resolve the host, so default to that.
+  ctx.remote_ip = NULL;
+  ctx.rc = CURLE_COULDNT_RESOLVE_HOST;
+  ctx.http_code = HTTP_NOT_FOUND;
+
+  return true;
+}
+
+bool HttpClient::start_attempt(RequestContext& ctx)
+{
+  // Move on to the next target returned by target_it. If only one target is
+  // available, it should be tried twice.
+  if (!(ctx.target_it->next(ctx.target) || (ctx.attempts == 1)))
+  {
+    return false;
+  }
+
+  // Get a curl handle and the associated pool entry
+  ctx.conn_handle =
+    new ConnectionHandle<CURL*>(_conn_pool.get_connection(ctx.target));
+  CURL* curl = ctx.conn_handle->get_connection();
+  ctx.curl = curl;
+
+  // Construct and add extra headers
+  ctx.extra_headers = build_headers(ctx.headers_to_add,
+                                    _assert_user,
+                                    ctx.username,
+                                    ctx.uuid_str);
+
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, ctx.extra_headers);
+
+  // Set general curl options
+  set_curl_options_general(curl, ctx.body, *ctx.doc);
+
+  // Set response header curl options.
+  set_curl_options_response(curl, ctx.response_headers);
+
+  // Set request-type specific curl options
+  set_curl_options_request(curl, ctx.request_type);
+
+  // Convert the target IP address into a string and tell curl to resolve to that.
+  ctx.remote_ip = inet_ntop(ctx.target.address.af,
+                            &ctx.target.address.addr,
+                            ctx.remote_ip_buf,
+                            sizeof(ctx.remote_ip_buf));
+
+  // Tell curl to connect to the target's IP address rather than resolving the
+  // host itself (unless the host is already an IP address).
+  //
+  // We use CURLOPT_CONNECT_TO rather than CURLOPT_RESOLVE because curl only
+  // reuses a cached connection for a transfer with the same connect-to
+  // address.  With CURLOPT_RESOLVE it would reuse any connection to the same
+  // host and port, so when transfers share a connection cache (as they do on
+  // an AsyncLoop's multi handle) a request for one target could be sent to
+  // another.
+  ctx.connect_to = NULL;
+
+  if (!ctx.host_is_ip)
+  {
+    std::string connect_addr = (ctx.target.address.af == AF_INET6) ?
+                                 ("[" + std::string(ctx.remote_ip) + "]") :
+                                 std::string(ctx.remote_ip);
+    std::string connect_to = ctx.host + ":" + std::to_string(ctx.port) + ":" +
+                             connect_addr + ":" + std::to_string(ctx.port);
+    ctx.connect_to = curl_slist_append(NULL, connect_to.c_str());
+    TRC_DEBUG("Set CURLOPT_CONNECT_TO: %s", connect_to.c_str());
+  }
+
+  curl_easy_setopt(curl, CURLOPT_CONNECT_TO, ctx.connect_to);
+
+  // Set the curl target URL
+  ctx.curl_target = ctx.scheme + "://" + ctx.host + ":" +
+                    std::to_string(ctx.port) + ctx.path;
+  curl_easy_setopt(curl, CURLOPT_URL, ctx.curl_target.c_str());
+
+  // Register an object to record the HTTP transaction.
+  ctx.recorder.request.clear();
+  ctx.recorder.response.clear();
+  curl_easy_setopt(curl, CURLOPT_DEBUGDATA, &ctx.recorder);
+
+  // Set host-specific curl options
+  ctx.host_context = set_curl_options_host(curl, ctx.host, ctx.port);
+
+  // Get the current timestamp before calling into curl.  This is because we
+  // can't log the request to SAS until after curl has completed the transfer.
+  // This could be a long time if the server is being slow, and we want to log
+  // the request with the right timestamp.
+  ctx.req_timestamp = SAS::get_current_timestamp();
+
+  // The request is ready to send.
+  ctx.doc->clear();
+  TRC_DEBUG("Sending HTTP request : %s (trying %s)", ctx.url.c_str(), ctx.remote_ip);
+
+  return true;
+}
+
+bool HttpClient::complete_attempt(RequestContext& ctx, CURLcode rc)
+{
+  bool keep_trying = true;
+  CURL* curl = ctx.curl;
+  ctx.rc = rc;
+
+  // If a request was sent, log it to SAS.
+  std::string method_str = request_type_to_string(ctx.request_type);
+  if (ctx.recorder.request.length() > 0)
+  {
+    sas_log_http_req(ctx.trail,
+                     curl,
+                     method_str,
+                     ctx.url,
+                     ctx.recorder.request,
+                     ctx.req_timestamp,
+                     0);
+  }
+
+  // Clean up the connect-to address.
+  curl_easy_setopt(curl, CURLOPT_CONNECT_TO, NULL);
+  curl_slist_free_all(ctx.connect_to);
+  ctx.connect_to = NULL;
+
+  // Log the result of the request.
+  long http_rc = 0;
+  if (rc == CURLE_OK)
+  {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    sas_log_http_rsp(ctx.trail, curl, http_rc, method_str, ctx.url, ctx.recorder.response, 0);
+    TRC_DEBUG("Received HTTP response: status=%d, doc=%s", http_rc, ctx.doc->c_str());
+  }
+  else
+  {
+    TRC_WARNING("%s failed at server %s : %s (%d) : fatal",
+                ctx.url.c_str(), ctx.remote_ip, curl_easy_strerror(rc), rc);
+    sas_log_curl_error(ctx.trail, ctx.remote_ip, ctx.target.port, method_str, ctx.url, rc, 0);
+  }
+
+  ctx.http_code = curl_code_to_http_code(curl, rc);
+
+  // At this point, we are finished with the curl object, so it is safe to
+  // free the headers
+  curl_slist_free_all(ctx.extra_headers);
+  ctx.extra_headers = NULL;
+
+  // Clean up any memory allocated by set_curl_options_host
+  cleanup_host_context(ctx.host_context);
+  ctx.host_context = NULL;
+
+  // Update the connection recycling and retry algorithms.
+  if ((rc == CURLE_OK) && !(http_rc >= 400))
+  {
+    // Success!
+    _resolver->success(ctx.target);
+    keep_trying = false;
+
+    if ((_hedge_percentile > 0) && (ctx.request_type == RequestType::GET))
     {
-      // Success!
-      _resolver->success(target);
-      break;
+      // Record the response time for calculating the hedge delay.
+      double total_time_s = 0;
+      curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time_s);
+      _hedge_latencies.get_current()->record(
+                                        (uint_fast64_t)(total_time_s * 1000000));
     }
-    else
+  }
+  else
+  {
+    // If we failed to even to establish an HTTP connection or recieved a 503
+    // with a Retry-After header, blacklist this IP address.
+    if ((!(http_rc >= 400)) &&
+        (rc != CURLE_REMOTE_FILE_NOT_FOUND) &&
+        (rc != CURLE_REMOTE_ACCESS_DENIED))
     {
-      // If we failed to even to establish an HTTP connection or recieved a 503
-      // with a Retry-After header, blacklist this IP address.
-      if ((!(http_rc >= 400)) &&
-          (rc != CURLE_REMOTE_FILE_NOT_FOUND) &&
-          (rc != CURLE_REMOTE_ACCESS_DENIED))
-      {
-        // The CURL connection should not be returned to the pool
-        TRC_DEBUG("Blacklist on connection failure");
-        conn_handle.set_return_to_pool(false);
-        _resolver->blacklist(target);
-      }
-      else if (http_rc == 503)
+      // The CURL connection should not be returned to the pool
+      TRC_DEBUG("Blacklist on connection failure");
+      ctx.conn_handle->set_return_to_pool(false);
+      _resolver->blacklist(ctx.target);
+    }
+    else if (http_rc == 503)
+    {
+      // Check for a Retry-After header on 503 responses and if present with
+      // a valid value (i.e. an integer) blacklist the host for the given
+      // number of seconds.
+      TRC_DEBUG("Have 503 failure");
+      std::map<std::string, std::string>::iterator retry_after_header =
+                                   ctx.response_headers->find("retry-after");
+      int retry_after = 0;
+
+      if (retry_after_header != ctx.response_headers->end())
       {
-        // Check for a Retry-After header on 503 responses and if present with
-        // a valid value (i.e. an integer) blacklist the host for the given
-        // number of seconds.
-        TRC_DEBUG("Have 503 failure");
-        std::map<std::string, std::string>::iterator retry_after_header =
-                                          response_headers->find("retry-after");
-        int retry_after = 0;
-
-        if (retry_after_header != response_headers->end())
-        {
-          TRC_DEBUG("Try to parse retry after value");
-          std::string retry_after_val = retry_after_header->second;
-          retry_after = atoi(retry_after_val.c_str());
+        TRC_DEBUG("Try to parse retry after value");
+        std::string retry_after_val = retry_after_header->second;
+        retry_after = atoi(retry_after_val.c_str());
 
-          // Log if we failed to parse the Retry-After header here
-          if (retry_after == 0)
-          {
-            TRC_WARNING("Failed to parse Retry-After value: %s", retry_after_val.c_str());
-            sas_log_bad_retry_after_value(trail, retry_after_val, 0);
-          }
-        }
-
-        if (retry_after > 0)
+        // Log if we failed to parse the Retry-After header here
+        if (retry_after == 0)
         {
-          // The CURL connection should not be returned to the pool
-          TRC_DEBUG("Have retry after value %d", retry_after);
-          conn_handle.set_return_to_pool(false);
-          _resolver->blacklist(target, retry_after);
-        }
-        else
-        {
-          _resolver->success(target);
+          TRC_WARNING("Failed to parse Retry-After value: %s", retry_after_val.c_str());
+          sas_log_bad_retry_after_value(ctx.trail, retry_after_val, 0);
         }
       }
+
+      if (retry_after > 0)
+      {
+        // The CURL connection should not be returned to the pool
+        TRC_DEBUG("Have retry after value %d", retry_after);
+        ctx.conn_handle->set_return_to_pool(false);
+        _resolver->blacklist(ctx.target, retry_after);
+      }
       else
       {
-        _resolver->success(target);
+        _resolver->success(ctx.target);
       }
+    }
+    else
+    {
+      _resolver->success(ctx.target);
+    }
 
-      // Determine the failure mode and update the correct counter.
-      bool fatal_http_error = false;
+    // Determine the failure mode and update the correct counter.
+    bool fatal_http_error = false;
 
-      if (http_rc >= 400)
+    if (http_rc >= 400)
+    {
+      if (http_rc == 503)
       {
-        if (http_rc == 503)
-        {
-          num_http_503_responses++;
-        }
-        // LCOV_EXCL_START fakecurl doesn't let us return custom return codes.
-        else if (http_rc == 504)
-        {
-          num_http_504_responses++;
-        }
-        else
-        {
-          fatal_http_error = true;
-        }
-        // LCOV_EXCL_STOP
+        ctx.num_http_503_responses++;
       }
-      else if ((rc == CURLE_REMOTE_FILE_NOT_FOUND) ||
-               (rc == CURLE_REMOTE_ACCESS_DENIED))
+      // LCOV_EXCL_START fakecurl doesn't let us return custom return codes.
+      else if (http_rc == 504)
       {
-        fatal_http_error = true;
+        ctx.num_http_504_responses++;
       }
-      else if ((rc == CURLE_OPERATION_TIMEDOUT) ||
-               (rc == CURLE_SEND_ERROR) ||
-               (rc == CURLE_RECV_ERROR))
+      else
       {
-        num_timeouts_or_io_errors++;
+        fatal_http_error = true;
       }
+      // LCOV_EXCL_STOP
+    }
+    else if ((rc == CURLE_REMOTE_FILE_NOT_FOUND) ||
+             (rc == CURLE_REMOTE_ACCESS_DENIED))
+    {
+      fatal_http_error = true;
+    }
+    else if ((rc == CURLE_OPERATION_TIMEDOUT) ||
+             (rc == CURLE_SEND_ERROR) ||
+             (rc == CURLE_RECV_ERROR))
+    {
+      ctx.num_timeouts_or_io_errors++;
+    }
 
-      // Decide whether to keep trying.
-      if ((num_http_503_responses + num_timeouts_or_io_errors >= 2) ||
-          (num_http_504_responses >= 1) ||
-          fatal_http_error)
-      {
-        // Make a SAS log so that its clear that we have stopped retrying
-        // deliberately.
-        HttpErrorResponseTypes reason = fatal_http_error ?
-                                        HttpErrorResponseTypes::Permanent :
-                                        HttpErrorResponseTypes::Temporary;
-        sas_log_http_abort(trail, reason, 0);
-        break;
-      }
+    // Decide whether to keep trying.
+    if ((ctx.num_http_503_responses + ctx.num_timeouts_or_io_errors >= 2) ||
+        (ctx.num_http_504_responses >= 1) ||
+        fatal_http_error)
+    {
+      // Make a SAS log so that its clear that we have stopped retrying
+      // deliberately.
+      HttpErrorResponseTypes reason = fatal_http_error ?
+                                      HttpErrorResponseTypes::Permanent :
+                                      HttpErrorResponseTypes::Temporary;
+      sas_log_http_abort(ctx.trail, reason, 0);
+      keep_trying = false;
     }
   }
 
-  delete target_it;
+  // Return the connection to the pool (or destroy it).
+  delete ctx.conn_handle; ctx.conn_handle = NULL;
+  ctx.curl = NULL;
+
+  ++ctx.attempts;
+
+  return keep_trying;
+}
+
+HTTPCode HttpClient::finish_request(RequestContext& ctx)
+{
+  delete ctx.target_it; ctx.target_it = NULL;
 
   // Check whether we should apply a penalty. We do this when:
   //  - both attempts return 503 errors, which means the downstream node is
@@ -645,8 +1128,8 @@ HTTPCode HttpClient::send_request(RequestType request_type,
   //  - the error is a 504, which means that the node downsteam of the node
   //    we're connecting to currently has reported that it is overloaded/was
   //    unresponsive.
-  if (((num_http_503_responses >= 2) ||
-       (num_http_504_responses >= 1)) &&
+  if (((ctx.num_http_503_responses >= 2) ||
+       (ctx.num_http_504_responses >= 1)) &&
       (_load_monitor != NULL))
   {
     _load_monitor->incr_penalties();
@@ -658,13 +1141,13 @@ HTTPCode HttpClient::send_request(RequestType request_type,
   assert(rv == 0);
   unsigned long now_ms = tp.tv_sec * 1000 + (tp.tv_nsec / 1000000);
 
-  if (rc == CURLE_OK)
+  if (ctx.rc == CURLE_OK)
   {
     if (_comm_monitor)
     {
       // If both attempts fail due to overloaded downstream nodes, consider
       // it a communication failure.
-      if (num_http_503_responses >= 2)
+      if (ctx.num_http_503_responses >= 2)
       {
         _comm_monitor->inform_failure(now_ms); // LCOV_EXCL_LINE - No UT for 503 fails
       }
@@ -682,12 +1165,450 @@ HTTPCode HttpClient::send_request(RequestType request_type,
     }
   }
 
-  if (((rc != CURLE_OK) && (rc != CURLE_REMOTE_FILE_NOT_FOUND)) || (http_code >= 400))
+  if (((ctx.rc != CURLE_OK) && (ctx.rc != CURLE_REMOTE_FILE_NOT_FOUND)) ||
+      (ctx.http_code >= 400))
   {
-    TRC_ERROR("cURL failure with cURL error code %d (see man 3 libcurl-errors) and HTTP error code %ld", (int)rc, http_code);  // LCOV_EXCL_LINE
+    TRC_ERROR("cURL failure with cURL error code %d (see man 3 libcurl-errors) and HTTP error code %ld", (int)ctx.rc, ctx.http_code);  // LCOV_EXCL_LINE
   }
 
-  return http_code;
+  return ctx.http_code;
+}
+
+/// An event loop that drives asynchronous requests using a curl multi handle
+/// on a dedicated thread.  Each request is run through the same
+/// start_attempt/complete_attempt/finish_request steps as the synchronous
+/// path, but rather than blocking in curl_easy_perform the loop waits for
+/// activity on all its in-flight transfers at once.
+class HttpClient::AsyncLoop
+{
+public:
+  AsyncLoop(HttpClient* client) :
+    _client(client),
+    _multi(curl_multi_init()),
+    _terminated(false)
+  {
+    pthread_mutex_init(&_lock, NULL);
+
+    // Allow HTTP/2 transfers to the same target to share a connection.
+    // Each attempt pins its target IP with CURLOPT_CONNECT_TO (see
+    // start_attempt), which curl takes into account when matching
+    // connections, so transfers are only multiplexed onto a connection to
+    // the same IP, not just to the same host and port.
+    curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    if (pipe2(_wakeup_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to create wakeup pipe for HTTP event loop: %d", errno);
+      _wakeup_fds[0] = -1;
+      _wakeup_fds[1] = -1;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  ~AsyncLoop()
+  {
+    curl_multi_cleanup(_multi);
+
+    if (_wakeup_fds[0] != -1)
+    {
+      ::close(_wakeup_fds[0]);
+      ::close(_wakeup_fds[1]);
+    }
+
+    pthread_mutex_destroy(&_lock);
+  }
+
+  bool start()
+  {
+    if (_wakeup_fds[0] == -1)
+    {
+      return false; // LCOV_EXCL_LINE
+    }
+
+    return (pthread_create(&_thread, NULL, loop_thread_func, this) == 0);
+  }
+
+  /// Stop the loop and wait for the thread to exit.  Any requests still in
+  /// flight are failed with a 503.
+  void stop()
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_mutex_unlock(&_lock);
+    wakeup();
+
+    pthread_join(_thread, NULL);
+  }
+
+  /// Queue a request on this loop.  The loop takes ownership of the context.
+  void add_request(RequestContext* ctx)
+  {
+    bool terminated;
+
+    pthread_mutex_lock(&_lock);
+    terminated = _terminated;
+    if (!terminated)
+    {
+      _new_requests.push_back(ctx);
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (terminated)
+    {
+      // LCOV_EXCL_START - only hit during shutdown
+      ctx->http_code = HTTP_SERVER_UNAVAILABLE;
+      _client->complete_async_request(ctx);
+      // LCOV_EXCL_STOP
+    }
+    else
+    {
+      wakeup();
+    }
+  }
+
+private:
+  static void* loop_thread_func(void* loop)
+  {
+    ((AsyncLoop*)loop)->run();
+    return NULL;
+  }
+
+  void wakeup()
+  {
+    char c = 0;
+    ssize_t rc = write(_wakeup_fds[1], &c, 1);
+    (void)rc;
+  }
+
+  // Start the next attempt for a request, or finish it if there are no more
+  // targets to try.
+  void start_next_attempt(RequestContext* ctx)
+  {
+    if (_client->start_attempt(*ctx))
+    {
+      curl_multi_add_handle(_multi, ctx->curl);
+
+      pthread_mutex_lock(&_lock);
+      _in_flight[ctx->curl] = ctx;
+      pthread_mutex_unlock(&_lock);
+    }
+    else
+    {
+      _client->complete_async_request(ctx);
+    }
+  }
+
+  void run()
+  {
+    bool terminated = false;
+    on_async_loop_thread = true;
+
+    while (!terminated)
+    {
+      // Pick up any new requests.
+      std::deque<RequestContext*> new_requests;
+
+      pthread_mutex_lock(&_lock);
+      new_requests.swap(_new_requests);
+      terminated = _terminated;
+      pthread_mutex_unlock(&_lock);
+
+      for (RequestContext* ctx : new_requests)
+      {
+        start_next_attempt(ctx);
+      }
+
+      if (terminated)
+      {
+        break;
+      }
+
+      // Drive all the transfers.
+      int running = 0;
+      curl_multi_perform(_multi, &running);
+
+      // Handle any transfers that have finished.
+      CURLMsg* msg;
+      int msgs_left = 0;
+      while ((msg = curl_multi_info_read(_multi, &msgs_left)) != NULL)
+      {
+        if (msg->msg == CURLMSG_DONE)
+        {
+          CURL* curl = msg->easy_handle;
+          CURLcode rc = msg->data.result;
+          curl_multi_remove_handle(_multi, curl);
+
+          pthread_mutex_lock(&_lock);
+          RequestContext* ctx = _in_flight[curl];
+          _in_flight.erase(curl);
+          pthread_mutex_unlock(&_lock);
+
+          if (_client->complete_attempt(*ctx, rc))
+          {
+            start_next_attempt(ctx);
+          }
+          else
+          {
+            _client->complete_async_request(ctx);
+          }
+        }
+      }
+
+      // Wait for activity on any transfer, or for a wakeup.
+      struct curl_waitfd wakeup_fd;
+      wakeup_fd.fd = _wakeup_fds[0];
+      wakeup_fd.events = CURL_WAIT_POLLIN;
+      wakeup_fd.revents = 0;
+      int numfds = 0;
+      curl_multi_wait(_multi, &wakeup_fd, 1, MAX_WAIT_MS, &numfds);
+
+      if (wakeup_fd.revents != 0)
+      {
+        char buf[64];
+        while (read(_wakeup_fds[0], buf, sizeof(buf)) > 0)
+        {
+        }
+      }
+    }
+
+    // Fail anything that is still in flight.
+    std::map<CURL*, RequestContext*> in_flight;
+    pthread_mutex_lock(&_lock);
+    in_flight.swap(_in_flight);
+    pthread_mutex_unlock(&_lock);
+
+    for (std::map<CURL*, RequestContext*>::iterator it = in_flight.begin();
+         it != in_flight.end();
+         ++it)
+    {
+      curl_multi_remove_handle(_multi, it->first);
+      _client->abort_attempt(*(it->second));
+      it->second->http_code = HTTP_SERVER_UNAVAILABLE;
+      _client->complete_async_request(it->second);
+    }
+  }
+
+  // The maximum time to block in curl_multi_wait.  curl may ask for a shorter
+  // wait to handle its own timeouts.
+  static const int MAX_WAIT_MS = 1000;
+
+  HttpClient* _client;
+  CURLM* _multi;
+  pthread_t _thread;
+  int _wakeup_fds[2];
+
+  pthread_mutex_t _lock;
+  bool _terminated;  // must access under _lock
+  std::deque<RequestContext*> _new_requests;  // must access under _lock
+  std::map<CURL*, RequestContext*> _in_flight;  // must access under _lock
+};
+
+bool HttpClient::start_async(int num_threads)
+{
+  bool success = true;
+  std::vector<AsyncLoop*> loops;
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    AsyncLoop* loop = new AsyncLoop(this);
+
+    if (loop->start())
+    {
+      loops.push_back(loop);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start HTTP event loop thread");
+      delete loop; loop = NULL;
+      success = false;
+      break;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  pthread_rwlock_wrlock(&_async_loops_lock);
+  _async_loops.insert(_async_loops.end(), loops.begin(), loops.end());
+  pthread_rwlock_unlock(&_async_loops_lock);
+
+  return success;
+}
+
+void HttpClient::stop_async()
+{
+  // Take the loops out of the list first, so that no new requests are added
+  // to them.  We can't stop them under the lock, as stopping a loop invokes
+  // the callbacks of its outstanding requests, which may send new requests.
+  std::vector<AsyncLoop*> loops;
+
+  pthread_rwlock_wrlock(&_async_loops_lock);
+  loops.swap(_async_loops);
+  pthread_rwlock_unlock(&_async_loops_lock);
+
+  for (AsyncLoop* loop : loops)
+  {
+    loop->stop();
+    delete loop;
+  }
+}
+
+void HttpClient::send_request_async(RequestType request_type,
+                                    const std::string& url,
+                                    const std::string& body,
+                                    const std::string& username,
+                                    SAS::TrailId trail,
+                                    const std::vector<std::string>& headers_to_add,
+                                    ResponseCallback callback)
+{
+  bool async_running;
+
+  pthread_rwlock_rdlock(&_async_loops_lock);
+  async_running = !_async_loops.empty();
+  pthread_rwlock_unlock(&_async_loops_lock);
+
+  if (!async_running)
+  {
+    // There are no event loops running, so fall back to a synchronous
+    // request on this thread.
+    std::string response;
+    std::map<std::string, std::string> response_headers;
+    HTTPCode http_code = send_request(request_type,
+                                      url,
+                                      body,
+                                      response,
+                                      username,
+                                      trail,
+                                      headers_to_add,
+                                      &response_headers);
+    callback(http_code, response, response_headers);
+    return;
+  }
+
+  RequestContext* ctx = new RequestContext(request_type,
+                                           url,
+                                           body,
+                                           NULL,
+                                           username,
+                                           trail,
+                                           headers_to_add,
+                                           NULL);
+  ctx->doc = &ctx->async_doc;
+  ctx->callback = callback;
+
+  if (!init_request(*ctx))
+  {
+    callback(HTTP_BAD_REQUEST, ctx->async_doc, ctx->internal_rsp_hdrs);
+    delete ctx; ctx = NULL;
+    return;
+  }
+
+  // Spread requests across the loops.  The loops are only stopped once they
+  // have been removed from the list, so holding the lock stops the loop from
+  // being deleted under us, and means that add_request won't invoke the
+  // callback on this thread.
+  pthread_rwlock_rdlock(&_async_loops_lock);
+
+  if (!_async_loops.empty())
+  {
+    unsigned int index = _next_async_loop.fetch_add(1) % _async_loops.size();
+    _async_loops[index]->add_request(ctx);
+    ctx = NULL;
+  }
+
+  pthread_rwlock_unlock(&_async_loops_lock);
+
+  if (ctx != NULL)
+  {
+    // The loops were stopped after we checked for them above.
+    ctx->http_code = HTTP_SERVER_UNAVAILABLE;
+    complete_async_request(ctx);
+  }
+}
+
+void HttpClient::abort_attempt(RequestContext& ctx)
+{
+  curl_easy_setopt(ctx.curl, CURLOPT_CONNECT_TO, NULL);
+  curl_slist_free_all(ctx.connect_to);
+  ctx.connect_to = NULL;
+
+  curl_slist_free_all(ctx.extra_headers);
+  ctx.extra_headers = NULL;
+
+  cleanup_host_context(ctx.host_context);
+  ctx.host_context = NULL;
+
+  // We don't know what state the connection is in, so don't reuse it.
+  ctx.conn_handle->set_return_to_pool(false);
+  delete ctx.conn_handle; ctx.conn_handle = NULL;
+  ctx.curl = NULL;
+}
+
+void HttpClient::complete_async_request(RequestContext* ctx)
+{
+  HTTPCode http_code = finish_request(*ctx);
+  ctx->callback(http_code, ctx->async_doc, *(ctx->response_headers));
+  delete ctx; ctx = NULL;
+}
+
+void HttpClient::send_get_async(const std::string& url,
+                                const std::vector<std::string>& headers_to_add,
+                                const std::string& username,
+                                SAS::TrailId trail,
+                                ResponseCallback callback)
+{
+  send_request_async(RequestType::GET,
+                     url,
+                     "",
+                     username,
+                     trail,
+                     headers_to_add,
+                     callback);
+}
+
+void HttpClient::send_delete_async(const std::string& url,
+                                   const std::string& body,
+                                   SAS::TrailId trail,
+                                   ResponseCallback callback)
+{
+  send_request_async(RequestType::DELETE,
+                     url,
+                     body,
+                     "",
+                     trail,
+                     std::vector<std::string>(),
+                     callback);
+}
+
+void HttpClient::send_put_async(const std::string& url,
+                                const std::string& body,
+                                const std::vector<std::string>& extra_req_headers,
+                                SAS::TrailId trail,
+                                ResponseCallback callback,
+                                const std::string& username)
+{
+  send_request_async(RequestType::PUT,
+                     url,
+                     body,
+                     username,
+                     trail,
+                     extra_req_headers,
+                     callback);
+}
+
+void HttpClient::send_post_async(const std::string& url,
+                                 const std::string& body,
+                                 SAS::TrailId trail,
+                                 ResponseCallback callback,
+                                 const std::string& username)
+{
+  send_request_async(RequestType::POST,
+                     url,
+                     body,
+                     username,
+                     trail,
+                     std::vector<std::string>(),
+                     callback);
 }
 
 struct curl_slist* HttpClient::build_headers(std::vector<std::string> headers_to_add,
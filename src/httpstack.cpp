@@ -11,7 +11,11 @@
 
 #include "httpstack.h"
 #include <cstring>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #include <climits>
 #include <algorithm>
 #include "log.h"
@@ -35,7 +39,9 @@ HttpStack::HttpStack(int num_threads,
   _load_monitor(load_monitor),
   _stats(stats),
   _evbase(nullptr),
-  _evhtp(nullptr)
+  _evhtp(nullptr),
+  _reuseport(false),
+  _init_cb(NULL)
 {
   TRC_STATUS("Constructing HTTP stack with %d threads", _num_threads);
 }
@@ -101,6 +107,12 @@ void HttpStack::send_reply(Request& req,
   }
 }
 
+void HttpStack::use_reuseport_listeners()
+{
+  TRC_STATUS("HTTP stack using a listening socket per thread");
+  _reuseport = true;
+}
+
 void HttpStack::initialize()
 {
   // Initialize if we haven't already done so.  We don't do this in the
@@ -122,6 +134,39 @@ void HttpStack::initialize()
   {
     _evhtp = evhtp_new(_evbase, NULL);
   }
+
+  if ((_reuseport) && (_listeners.empty()))
+  {
+    // Each thread gets its own event base and evhtp instance.  The first
+    // thread uses the main ones.
+    for (int ii = 0; ii < _num_threads; ++ii)
+    {
+      Listener listener;
+      listener.stack = this;
+      listener.evbase = (ii == 0) ? _evbase : event_base_new();
+      listener.evhtp = (ii == 0) ? _evhtp : evhtp_new(listener.evbase, NULL);
+      _listeners.push_back(listener);
+    }
+  }
+}
+
+std::vector<evhtp_t*> HttpStack::evhtp_instances()
+{
+  std::vector<evhtp_t*> instances;
+
+  if (_listeners.empty())
+  {
+    instances.push_back(_evhtp);
+  }
+  else
+  {
+    for (const Listener& listener : _listeners)
+    {
+      instances.push_back(listener.evhtp);
+    }
+  }
+
+  return instances;
 }
 
 void HttpStack::register_handler(const char* path,
@@ -130,13 +175,16 @@ void HttpStack::register_handler(const char* path,
   HandlerRegistration* reg = new HandlerRegistration(this, handler);
   _handler_registrations.insert(reg);
 
-  evhtp_callback_t* cb = evhtp_set_regex_cb(_evhtp,
-                                            path,
-                                            handler_callback_fn,
-                                            (void*)reg);
-  if (cb == NULL)
+  for (evhtp_t* evhtp : evhtp_instances())
   {
-    throw Exception("evhtp_set_cb", 0); // LCOV_EXCL_LINE
+    evhtp_callback_t* cb = evhtp_set_regex_cb(evhtp,
+                                              path,
+                                              handler_callback_fn,
+                                              (void*)reg);
+    if (cb == NULL)
+    {
+      throw Exception("evhtp_set_cb", 0); // LCOV_EXCL_LINE
+    }
   }
 }
 
@@ -145,9 +193,12 @@ void HttpStack::register_default_handler(HttpStack::HandlerInterface* handler)
   HandlerRegistration* reg = new HandlerRegistration(this, handler);
   _handler_registrations.insert(reg);
 
-  evhtp_set_gencb(_evhtp,
-                  handler_callback_fn,
-                  (void*)reg);
+  for (evhtp_t* evhtp : evhtp_instances())
+  {
+    evhtp_set_gencb(evhtp,
+                    handler_callback_fn,
+                    (void*)reg);
+  }
 }
 
 void HttpStack::bind_tcp_socket(const std::string& bind_address,
@@ -192,16 +243,7 @@ void HttpStack::bind_tcp_socket(const std::string& bind_address,
 
   freeaddrinfo(servinfo);
 
-  int rc = evhtp_bind_socket(_evhtp, full_bind_address.c_str(), port, 1024);
-  if (rc != 0)
-  {
-    // LCOV_EXCL_START
-    TRC_ERROR("evhtp_bind_socket failed with address %s and port %d",
-              full_bind_address.c_str(),
-              port);
-    throw Exception("evhtp_bind_socket (tcp)", rc);
-    // LCOV_EXCL_STOP
-  }
+  bind_all(full_bind_address, port, "evhtp_bind_socket (tcp)");
 
   if ((local_bind_address != full_bind_address) &&
       (full_bind_address != "0.0.0.0")          &&
@@ -209,17 +251,105 @@ void HttpStack::bind_tcp_socket(const std::string& bind_address,
   {
     // Listen on the local address as well as the main address (so long as the
     // main address isn't all)
-    rc = evhtp_bind_socket(_evhtp, local_bind_address.c_str(), port, 1024);
+    bind_all(local_bind_address, port, "evhtp_bind_socket (tcp) - localhost");
+  }
+}
+
+void HttpStack::bind_all(const std::string& address,
+                         unsigned short port,
+                         const char* description)
+{
+  if (_listeners.empty())
+  {
+    int rc = evhtp_bind_socket(_evhtp, address.c_str(), port, 1024);
     if (rc != 0)
     {
       // LCOV_EXCL_START
       TRC_ERROR("evhtp_bind_socket failed with address %s and port %d",
-                local_bind_address.c_str(),
+                address.c_str(),
                 port);
-      throw Exception("evhtp_bind_socket (tcp) - localhost", rc);
+      throw Exception(description, rc);
       // LCOV_EXCL_STOP
     }
   }
+  else
+  {
+    for (const Listener& listener : _listeners)
+    {
+      int rc = bind_reuseport_socket(listener.evhtp, address, port);
+      if (rc != 0)
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("Failed to bind SO_REUSEPORT socket with address %s and port %d",
+                  address.c_str(),
+                  port);
+        throw Exception(description, rc);
+        // LCOV_EXCL_STOP
+      }
+    }
+  }
+}
+
+int HttpStack::bind_reuseport_socket(evhtp_t* evhtp,
+                                     const std::string& address,
+                                     unsigned short port)
+{
+  // Convert the address from the format used by evhtp_bind_socket.
+  sockaddr_storage sa;
+  socklen_t sa_len;
+  memset(&sa, 0, sizeof(sa));
+
+  if (address.compare(0, 5, "ipv6:") == 0)
+  {
+    sockaddr_in6* sin6 = (sockaddr_in6*)&sa;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    sa_len = sizeof(sockaddr_in6);
+
+    if (inet_pton(AF_INET6, address.c_str() + 5, &sin6->sin6_addr) != 1)
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    sockaddr_in* sin = (sockaddr_in*)&sa;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sa_len = sizeof(sockaddr_in);
+
+    if (inet_pton(AF_INET, address.c_str(), &sin->sin_addr) != 1)
+    {
+      return -1;
+    }
+  }
+
+  int fd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return errno; // LCOV_EXCL_LINE
+  }
+
+  int on = 1;
+  int rc = 0;
+
+  if ((setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) ||
+      (bind(fd, (sockaddr*)&sa, sa_len) != 0))
+  {
+    rc = errno;
+    ::close(fd);
+    return rc;
+  }
+
+  // evhtp listens on the socket and takes ownership of it.
+  rc = evhtp_accept_socket(evhtp, fd, 1024);
+  if (rc != 0)
+  {
+    ::close(fd); // LCOV_EXCL_LINE
+  }
+
+  return rc;
 }
 
 void HttpStack::bind_unix_socket(const std::string& bind_path)
@@ -250,6 +380,28 @@ void HttpStack::bind_unix_socket(const std::string& bind_path)
 // has been called
 void HttpStack::start(evhtp_thread_init_cb init_cb)
 {
+  if (!_listeners.empty())
+  {
+    // Run each listener's event base on its own thread.  There's no need for
+    // evhtp's own threads as each listener accepts and processes its own
+    // connections.
+    _init_cb = init_cb;
+
+    for (Listener& listener : _listeners)
+    {
+      int rc = pthread_create(&listener.thread, NULL, listener_thread_fn, &listener);
+      if (rc != 0)
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("pthread_create failed in HTTPStack creation");
+        throw Exception("pthread_create", rc);
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    return;
+  }
+
   int rc = evhtp_use_threads(_evhtp, init_cb, _num_threads, this);
   if (rc != 0)
   {
@@ -269,6 +421,16 @@ void HttpStack::start(evhtp_thread_init_cb init_cb)
 void HttpStack::stop()
 {
   TRC_STATUS("Stopping HTTP stack");
+  if (!_listeners.empty())
+  {
+    for (Listener& listener : _listeners)
+    {
+      event_base_loopbreak(listener.evbase);
+      evhtp_unbind_socket(listener.evhtp);
+    }
+    return;
+  }
+
   event_base_loopbreak(_evbase);
   evhtp_unbind_socket(_evhtp);
 }
@@ -276,7 +438,27 @@ void HttpStack::stop()
 void HttpStack::wait_stopped()
 {
   TRC_STATUS("Waiting for HTTP stack to stop");
-  pthread_join(_event_base_thread, NULL);
+  if (!_listeners.empty())
+  {
+    // The first listener's event base and evhtp instance are the main ones,
+    // which are freed below.
+    for (size_t ii = 0; ii < _listeners.size(); ++ii)
+    {
+      pthread_join(_listeners[ii].thread, NULL);
+
+      if (ii > 0)
+      {
+        evhtp_free(_listeners[ii].evhtp);
+        event_base_free(_listeners[ii].evbase);
+      }
+    }
+    _listeners.clear();
+  }
+  else
+  {
+    pthread_join(_event_base_thread, NULL);
+  }
+
   evhtp_free(_evhtp);
   _evhtp = NULL;
   event_base_free(_evbase);
@@ -365,6 +547,19 @@ void HttpStack::event_base_thread_fn()
   event_base_loop(_evbase, 0);
 }
 
+void* HttpStack::listener_thread_fn(void* listener_ptr)
+{
+  Listener* listener = (Listener*)listener_ptr;
+
+  if (listener->stack->_init_cb != NULL)
+  {
+    listener->stack->_init_cb(listener->evhtp, NULL, listener->stack);
+  }
+
+  event_base_loop(listener->evbase, 0);
+  return NULL;
+}
+
 void HttpStack::record_penalty()
 {
   if (_load_monitor != NULL)
@@ -378,15 +573,123 @@ std::string HttpStack::Request::get_rx_body()
   if (!_rx_body_set)
   {
     _rx_body = evbuffer_to_string(_req->buffer_in);
+    _rx_body_set = true;
   }
   return _rx_body;
 }
 
+HttpStack::BodyView HttpStack::Request::get_rx_body_view()
+{
+  if (_rx_body_set)
+  {
+    return BodyView(_rx_body.data(), _rx_body.length());
+  }
+
+  size_t len = evbuffer_get_length(_req->buffer_in);
+  const char* buf = (const char*)evbuffer_pullup(_req->buffer_in, len);
+  return BodyView(buf, (buf != NULL) ? len : 0);
+}
+
+std::vector<HttpStack::BodyView> HttpStack::Request::get_rx_body_segments()
+{
+  std::vector<BodyView> segments;
+
+  if (_rx_body_set)
+  {
+    if (!_rx_body.empty())
+    {
+      segments.push_back(BodyView(_rx_body.data(), _rx_body.length()));
+    }
+    return segments;
+  }
+
+  // Find out how many segments there are, then fetch them.
+  int num_segments = evbuffer_peek(_req->buffer_in, -1, NULL, NULL, 0);
+
+  if (num_segments > 0)
+  {
+    std::vector<evbuffer_iovec> iovecs(num_segments);
+    num_segments = evbuffer_peek(_req->buffer_in,
+                                 -1,
+                                 NULL,
+                                 iovecs.data(),
+                                 num_segments);
+
+    segments.reserve(num_segments);
+    for (int ii = 0; ii < num_segments; ++ii)
+    {
+      if (iovecs[ii].iov_len > 0)
+      {
+        segments.push_back(BodyView((const char*)iovecs[ii].iov_base,
+                                    iovecs[ii].iov_len));
+      }
+    }
+  }
+
+  return segments;
+}
+
+size_t HttpStack::Request::get_rx_body_length()
+{
+  return _rx_body_set ? _rx_body.length() :
+                        evbuffer_get_length(_req->buffer_in);
+}
+
 std::string HttpStack::Request::get_tx_body()
 {
   return evbuffer_to_string(_req->buffer_out);
 }
 
+size_t HttpStack::Request::get_tx_body_length()
+{
+  return evbuffer_get_length(_req->buffer_out);
+}
+
+// Bodies smaller than this are copied into the response buffer even if the
+// caller hands over ownership, as that is cheaper than allocating a string to
+// hold them until the response has been sent.
+static const size_t MIN_REFERENCE_CONTENT_LENGTH = 4096;
+
+static void free_content_string(const void* data, size_t len, void* arg)
+{
+  delete (std::string*)arg;
+}
+
+void HttpStack::Request::add_content(std::string&& content)
+{
+  if (content.length() < MIN_REFERENCE_CONTENT_LENGTH)
+  {
+    evbuffer_add(_req->buffer_out, content.c_str(), content.length());
+  }
+  else
+  {
+    // Move the content into a string that lives until the buffer has
+    // finished with it.  Moving a long string doesn't copy its data.
+    std::string* owned = new std::string(std::move(content));
+    add_content_reference(owned->data(),
+                          owned->length(),
+                          free_content_string,
+                          owned);
+  }
+}
+
+void HttpStack::Request::add_content_reference(const char* data,
+                                               size_t len,
+                                               evbuffer_ref_cleanup_cb cleanup,
+                                               void* arg)
+{
+  if (evbuffer_add_reference(_req->buffer_out, data, len, cleanup, arg) != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to add %lu bytes of content to response", len);
+    if (cleanup != NULL)
+    {
+      cleanup(data, len, arg);
+    }
+    // LCOV_EXCL_STOP
+  }
+}
+
 std::string HttpStack::Request::get_rx_header()
 {
   return evbuffer_to_string(_req->header_buffer_in);
@@ -540,7 +843,7 @@ void HttpStack::SasLogger::log_req_event(SAS::TrailId trail,
   }
   else
   {
-    if (req.get_rx_body().empty())
+    if (req.get_rx_body_length() == 0)
     {
       // We are omitting the body but there wasn't one in the messaage. Just log
       // the headers.
@@ -580,7 +883,7 @@ void HttpStack::SasLogger::log_rsp_event(SAS::TrailId trail,
   }
   else
   {
-    if (req.get_tx_body().empty())
+    if (req.get_tx_body_length() == 0)
     {
       // We are omitting the body but there wasn't one in the messaage. Just log
       // the headers.
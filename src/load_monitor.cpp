@@ -9,52 +9,113 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <math.h>
+#include <algorithm>
+
 #include "load_monitor.h"
 #include "log.h"
 #include "snmp_continuous_accumulator_table.h"
 #include "snmp_scalar.h"
 #include "sasevent.h"
 
-TokenBucket::TokenBucket(int s, float r)
+TokenBucket::TokenBucket(int s, float r) :
+  max_size(s),
+  _rate(r),
+  _empty_time_ns(0)
 {
-  max_size = s;
-  tokens = max_size;
-  rate = r;
-  clock_gettime(CLOCK_MONOTONIC, &replenish_time);
+  // Start with a full bucket.
+  _empty_time_ns = get_time_ns() - (max_size * get_token_interval_ns(r));
 }
 
-bool TokenBucket::get_token()
+bool TokenBucket::get_token(float* tokens_remaining)
 {
-  replenish_bucket();
-  bool rc = (tokens >= 1);
+  int64_t interval_ns = get_token_interval_ns(_rate.load());
+  int64_t capacity_ns = max_size * interval_ns;
+  int64_t now_ns = get_time_ns();
+  int64_t empty_time_ns = _empty_time_ns.load();
+  int64_t new_empty_time_ns;
 
-  if (rc)
+  do
   {
-    tokens -= 1;
+    // The bucket can't hold more than max_size tokens, so if it filled up a
+    // while ago, act as if it was empty more recently.  Note that
+    // compare_exchange_weak loads the current value into empty_time_ns if the
+    // compare fails.
+    int64_t effective_empty_time_ns = std::max(empty_time_ns,
+                                               now_ns - capacity_ns);
+
+    if (now_ns - effective_empty_time_ns < interval_ns)
+    {
+      // There isn't a whole token in the bucket.
+      if (tokens_remaining != NULL)
+      {
+        *tokens_remaining = (float)(now_ns - effective_empty_time_ns) /
+                            interval_ns;
+      }
+
+      return false;
+    }
+
+    new_empty_time_ns = effective_empty_time_ns + interval_ns;
   }
+  while (!_empty_time_ns.compare_exchange_weak(empty_time_ns,
+                                               new_empty_time_ns));
 
-  return rc;
+  if (tokens_remaining != NULL)
+  {
+    *tokens_remaining = (float)(now_ns - new_empty_time_ns) / interval_ns;
+  }
+
+  return true;
 }
 
 void TokenBucket::update_rate(float new_rate)
 {
-  rate = new_rate;
+  int64_t old_interval_ns = get_token_interval_ns(_rate.load());
+  int64_t new_interval_ns = get_token_interval_ns(new_rate);
+  int64_t capacity_ns = max_size * old_interval_ns;
+  int64_t now_ns = get_time_ns();
+  int64_t empty_time_ns = _empty_time_ns.load();
+  int64_t new_empty_time_ns;
+
+  // Keep the same number of tokens in the bucket at the new rate.
+  do
+  {
+    double tokens = (double)(now_ns - std::max(empty_time_ns,
+                                               now_ns - capacity_ns)) /
+                    old_interval_ns;
+    new_empty_time_ns = now_ns - (int64_t)(tokens * new_interval_ns);
+  }
+  while (!_empty_time_ns.compare_exchange_weak(empty_time_ns,
+                                               new_empty_time_ns));
+
+  _rate.store(new_rate);
 }
 
-void TokenBucket::replenish_bucket()
+float TokenBucket::token_count()
 {
-  timespec new_replenish_time;
-  clock_gettime(CLOCK_MONOTONIC, &new_replenish_time);
-  float timediff = (new_replenish_time.tv_nsec - replenish_time.tv_nsec) / 1000.0 +
-                   (new_replenish_time.tv_sec - replenish_time.tv_sec) * 1000000.0;
-  // The rate is in tokens/sec, and the timediff is in usec.
-  tokens += ((rate * timediff) / 1000000.0);
-  replenish_time = new_replenish_time;
-
-  if (tokens >= max_size)
-  {
-    tokens = max_size;
-  }
+  int64_t interval_ns = get_token_interval_ns(_rate.load());
+  int64_t now_ns = get_time_ns();
+  int64_t elapsed_ns = now_ns - _empty_time_ns.load();
+  float tokens = (float)elapsed_ns / interval_ns;
+  return std::min(tokens, (float)max_size);
+}
+
+int64_t TokenBucket::get_time_ns()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((int64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+int64_t TokenBucket::get_token_interval_ns(float rate)
+{
+  // The rate is in tokens/sec.  Limit the interval to between 1ns and
+  // 1000s, so that it (and the capacity of the bucket) can't overflow.
+  static const int64_t MAX_INTERVAL_NS = 1000LL * 1000000000;
+  double interval_ns = (rate > 0) ? 1000000000.0 / rate : MAX_INTERVAL_NS;
+  interval_ns = std::min(interval_ns, (double)MAX_INTERVAL_NS);
+  return std::max((int64_t)1, (int64_t)interval_ns);
 }
 
 LoadMonitor::LoadMonitor(int init_target_latency, int max_bucket_size,
@@ -71,11 +132,7 @@ LoadMonitor::LoadMonitor(int init_target_latency, int max_bucket_size,
                            _penalties_scalar(penalties_scalar),
                            _token_rate_scalar(token_rate_scalar)
 {
-  pthread_mutexattr_t attrs;
-  pthread_mutexattr_init(&attrs);
-  pthread_mutexattr_settype(&attrs, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init(&_lock, &attrs);
-  pthread_mutexattr_destroy(&attrs);
+  pthread_mutex_init(&_adjust_lock, NULL);
 
   TRC_STATUS("Constructing LoadMonitor");
   TRC_STATUS("   Target latency (usecs)   : %d", init_target_latency);
@@ -92,18 +149,10 @@ LoadMonitor::LoadMonitor(int init_target_latency, int max_bucket_size,
   INCREASE_THRESHOLD = -0.005;
   INCREASE_FACTOR = 0.5;
 
-  accepted = 0;
-  rejected = 0;
-  penalties = 0;
-  pending_count = 0;
-  max_pending_count = 0;
+  last_penalties = 0;
   target_latency = init_target_latency;
   smoothed_latency = init_target_latency;
-  adjust_count = 0;
-
-  timespec current_time;
-  clock_gettime(CLOCK_MONOTONIC_COARSE, &current_time);
-  last_adjustment_time_ms = (current_time.tv_sec * 1000) + (current_time.tv_nsec / 1000000);
+  last_adjustment_time_ms = get_time_ms();
   min_token_rate = init_min_token_rate;
 
   // As this statistics reporting is continuous, we should
@@ -114,60 +163,50 @@ LoadMonitor::LoadMonitor(int init_target_latency, int max_bucket_size,
 LoadMonitor::~LoadMonitor()
 {
   // Destroy the lock
-  pthread_mutex_destroy(&_lock);
+  pthread_mutex_destroy(&_adjust_lock);
 }
 
 bool LoadMonitor::admit_request(SAS::TrailId trail)
 {
-  pthread_mutex_lock(&_lock);
+  float tokens_remaining = 0;
 
-  if (bucket.get_token())
+  if (bucket.get_token(&tokens_remaining))
   {
-    SAS::Event event(trail, SASEvent::LOAD_MONITOR_ACCEPTED_REQUEST, trail);
-    event.add_static_param(bucket.rate);
-    event.add_static_param(bucket.token_count());
-    SAS::report_event(event);
-
     // Got a token from the bucket, so admit the request
-    accepted += 1;
-    pending_count += 1;
+    accepted.increment();
 
-    if (pending_count > max_pending_count)
-    {
-      max_pending_count = pending_count;
-    }
+    SAS::Event event(trail, SASEvent::LOAD_MONITOR_ACCEPTED_REQUEST, trail);
+    event.add_static_param(bucket.get_rate());
+    event.add_static_param(tokens_remaining);
+    SAS::report_event(event);
 
-    pthread_mutex_unlock(&_lock);
     return true;
   }
   else
   {
-    float accepted_percent = (accepted + rejected == 0) ?
+    uint_fast64_t accepted_count = accepted.load();
+    uint_fast64_t rejected_count = rejected.load();
+    float accepted_percent = (accepted_count + rejected_count == 0) ?
                              100.0 :
-                             100 * (((float) accepted) / (accepted + rejected));
-    timespec current_time;
-    clock_gettime(CLOCK_MONOTONIC_COARSE, &current_time);
-    unsigned long time_passed_ms = ((current_time.tv_sec * 1000) +
-                                    (current_time.tv_nsec / 1000000)) -
-                                   last_adjustment_time_ms;
+                             100 * (((float) accepted_count) /
+                                    (accepted_count + rejected_count));
+    unsigned long time_passed_ms = get_time_ms() - last_adjustment_time_ms;
+
+    rejected.increment();
 
     SAS::Event event(trail, SASEvent::LOAD_MONITOR_REJECTED_REQUEST, trail);
-    event.add_static_param(bucket.rate);
+    event.add_static_param(bucket.get_rate());
     event.add_static_param(accepted_percent);
     event.add_static_param(time_passed_ms);
     SAS::report_event(event);
 
-    rejected += 1;
-    pthread_mutex_unlock(&_lock);
     return false;
   }
 }
 
 void LoadMonitor::incr_penalties()
 {
-  pthread_mutex_lock(&_lock);
-  penalties += 1;
-  pthread_mutex_unlock(&_lock);
+  penalties.increment();
 }
 
 
@@ -178,106 +217,136 @@ int LoadMonitor::get_target_latency_us()
 
 void LoadMonitor::request_complete(int latency)
 {
-  pthread_mutex_lock(&_lock);
-  pending_count -= 1;
-  smoothed_latency = (7 * smoothed_latency + latency) / 8;
-  adjust_count += 1;
-
-  if (adjust_count >= REQUESTS_BEFORE_ADJUSTMENT)
+  latency_count.increment();
+  latency_sum.increment((latency > 0) ? latency : 0);
+
+  // Check whether it's time to adjust the token rate.  Only one thread needs
+  // to do this, so any thread that finds another already doing it just
+  // carries on.
+  unsigned long current_time_ms = get_time_ms();
+  unsigned long adjustment_due_ms = last_adjustment_time_ms +
+                                    (SECONDS_BEFORE_ADJUSTMENT * 1000);
+
+  if ((current_time_ms >= adjustment_due_ms) &&
+      (pthread_mutex_trylock(&_adjust_lock) == 0))
   {
-    // We've seen the right number of requests, but ensure
-    // that an appropriate amount of time has passed, so the rate doesn't
-    // fluctuate wildly if latency spikes for a few milliseconds
-    timespec current_time;
-    clock_gettime(CLOCK_MONOTONIC_COARSE, &current_time);
-    unsigned long current_time_ms = (current_time.tv_sec * 1000) + (current_time.tv_nsec / 1000000);
-    if (current_time_ms >= (last_adjustment_time_ms + (SECONDS_BEFORE_ADJUSTMENT * 1000)))
+    // Check again now we hold the lock, in case another thread has just
+    // made the adjustment.  We also need to have seen the right number of
+    // requests - ensuring enough time has passed as well means the rate
+    // doesn't fluctuate wildly if latency spikes for a few milliseconds.
+    if ((current_time_ms >= last_adjustment_time_ms +
+                            (SECONDS_BEFORE_ADJUSTMENT * 1000)) &&
+        (latency_count.load() >= (uint_fast64_t)REQUESTS_BEFORE_ADJUSTMENT))
     {
-      // This algorithm is based on the Welsh and Culler "Adaptive Overload
-      // Control for Busy Internet Servers" paper, although based on a smoothed
-      // mean latency, rather than the 90th percentile as per the paper.
-      // Also, the additive increase is scaled as a proportion of the maximum
-      // bucket size, rather than an absolute number as per the paper.
-      float err = ((float) (smoothed_latency - target_latency)) / target_latency;
+      adjust_rate(current_time_ms);
+    }
 
-      // Work out the percentage of accepted requests (for logs)
-      float accepted_percent = (accepted + rejected == 0) ? 100.0 : 100 * (((float) accepted) / (accepted + rejected));
+    pthread_mutex_unlock(&_adjust_lock);
+  }
+}
 
-      TRC_INFO("Accepted %f%% of requests, latency error = %f, overload responses = %d",
-          accepted_percent, err, penalties);
+void LoadMonitor::adjust_rate(unsigned long current_time_ms)
+{
+  // Collect the counts for this period, resetting them for the next one.
+  uint_fast64_t latency_count_period = latency_count.read_and_reset();
+  uint_fast64_t latency_sum_period = latency_sum.read_and_reset();
+  uint_fast64_t accepted_count = accepted.read_and_reset();
+  uint_fast64_t rejected_count = rejected.read_and_reset();
+  last_penalties = penalties.read_and_reset();
+
+  // Fold the latencies from this period into the smoothed latency.  The
+  // smoothed latency is an exponentially weighted moving average, with each
+  // request having a weight of 1/8.  We don't track the individual latencies,
+  // so apply the mean latency of this period once for each request.
+  if (latency_count_period > 0)
+  {
+    float mean_latency = (float)latency_sum_period / latency_count_period;
+    float decay = pow(7.0 / 8.0, (double)latency_count_period);
+    smoothed_latency = (int)(mean_latency +
+                             (smoothed_latency - mean_latency) * decay);
+  }
 
-      // latency is above where we want it to be, or we are getting overload responses from
-      // Homer/Homestead, so adjust the rate downwards by a multiplicative factor
+  float rate = bucket.get_rate();
 
-      if (err > DECREASE_THRESHOLD || penalties > 0)
-      {
-        float new_rate = bucket.rate / DECREASE_FACTOR;
-        if (new_rate < min_token_rate)
-        {
-          new_rate = min_token_rate;
-        }
-        bucket.update_rate(new_rate);
-        TRC_STATUS("Maximum incoming request rate/second decreased to %f "
-                   "(based on a smoothed mean latency of %d and %d upstream overload responses)",
-                   bucket.rate,
-                   smoothed_latency,
-                   penalties);
-      }
-      else if (err < INCREASE_THRESHOLD)
-      {
-        // Our latency is below the threshold, so increasing our permitted request rate would be
-        // sensible. Before doing that, we check that we're using a significant proportion of our
-        // current rate - if we're allowing 100 requests/sec, and we get 1 request/sec because it's
-        // a quiet period, then it's going to be handled quickly, but that's not sufficient evidence
-        // to increase our rate.
-        int ms_passed = (current_time_ms - last_adjustment_time_ms);
-        float maximum_permitted_requests = bucket.rate * ms_passed / 1000;
-
-        // Arbitrary threshold - require 50% of our current permitted rate to be used
-        float minimum_threshold = maximum_permitted_requests * 0.5;
-
-        if (accepted > minimum_threshold)
-        {
-          float new_rate = bucket.rate + (-1 * err * bucket.max_size * INCREASE_FACTOR);
-          bucket.update_rate(new_rate);
-          TRC_STATUS("Maximum incoming request rate/second increased to %f "
-                     "(based on a smoothed mean latency of %d, %d upstream "
-                     "overload responses, %dms time passing, %d accepted "
-                     "requests, and %d rejected requests).",
-                     bucket.rate,
-                     smoothed_latency,
-                     penalties,
-                     ms_passed,
-                     accepted,
-                     rejected);
-        }
-        else
-        {
-          TRC_STATUS("Maximum incoming request rate/second unchanged - only handled %d requests"
-                     " in last %dms, minimum threshold for a change is %f",
-                     accepted,
-                     ms_passed,
-                     minimum_threshold);
-        }
-      }
-      else
-      {
-        TRC_DEBUG("Maximum incoming request rate/second is unchanged at %f",
-                  bucket.rate);
-      }
+  // This algorithm is based on the Welsh and Culler "Adaptive Overload
+  // Control for Busy Internet Servers" paper, although based on a smoothed
+  // mean latency, rather than the 90th percentile as per the paper.
+  // Also, the additive increase is scaled as a proportion of the maximum
+  // bucket size, rather than an absolute number as per the paper.
+  float err = ((float) (smoothed_latency - target_latency)) / target_latency;
 
-      update_statistics();
+  // Work out the percentage of accepted requests (for logs)
+  float accepted_percent = (accepted_count + rejected_count == 0) ?
+                           100.0 :
+                           100 * (((float) accepted_count) /
+                                  (accepted_count + rejected_count));
 
-      // Reset counts
-      last_adjustment_time_ms = current_time_ms;
-      adjust_count = 0;
-      accepted = 0;
-      rejected = 0;
-      penalties = 0;
+  TRC_INFO("Accepted %f%% of requests, latency error = %f, overload responses = %d",
+      accepted_percent, err, last_penalties);
+
+  // latency is above where we want it to be, or we are getting overload responses from
+  // Homer/Homestead, so adjust the rate downwards by a multiplicative factor
+
+  if (err > DECREASE_THRESHOLD || last_penalties > 0)
+  {
+    float new_rate = rate / DECREASE_FACTOR;
+    if (new_rate < min_token_rate)
+    {
+      new_rate = min_token_rate;
     }
+    bucket.update_rate(new_rate);
+    TRC_STATUS("Maximum incoming request rate/second decreased to %f "
+               "(based on a smoothed mean latency of %d and %d upstream overload responses)",
+               new_rate,
+               smoothed_latency.load(),
+               last_penalties);
   }
+  else if (err < INCREASE_THRESHOLD)
+  {
+    // Our latency is below the threshold, so increasing our permitted request rate would be
+    // sensible. Before doing that, we check that we're using a significant proportion of our
+    // current rate - if we're allowing 100 requests/sec, and we get 1 request/sec because it's
+    // a quiet period, then it's going to be handled quickly, but that's not sufficient evidence
+    // to increase our rate.
+    int ms_passed = (current_time_ms - last_adjustment_time_ms);
+    float maximum_permitted_requests = rate * ms_passed / 1000;
+
+    // Arbitrary threshold - require 50% of our current permitted rate to be used
+    float minimum_threshold = maximum_permitted_requests * 0.5;
+
+    if (accepted_count > minimum_threshold)
+    {
+      float new_rate = rate + (-1 * err * bucket.max_size * INCREASE_FACTOR);
+      bucket.update_rate(new_rate);
+      TRC_STATUS("Maximum incoming request rate/second increased to %f "
+                 "(based on a smoothed mean latency of %d, %d upstream "
+                 "overload responses, %dms time passing, %d accepted "
+                 "requests, and %d rejected requests).",
+                 new_rate,
+                 smoothed_latency.load(),
+                 last_penalties,
+                 ms_passed,
+                 (int)accepted_count,
+                 (int)rejected_count);
+    }
+    else
+    {
+      TRC_STATUS("Maximum incoming request rate/second unchanged - only handled %d requests"
+                 " in last %dms, minimum threshold for a change is %f",
+                 (int)accepted_count,
+                 ms_passed,
+                 minimum_threshold);
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Maximum incoming request rate/second is unchanged at %f",
+              rate);
+  }
+
+  update_statistics();
 
-  pthread_mutex_unlock(&_lock);
+  last_adjustment_time_ms = current_time_ms;
 }
 
 void LoadMonitor::update_statistics()
@@ -292,14 +361,21 @@ void LoadMonitor::update_statistics()
   }
   if (_penalties_scalar != NULL)
   {
-    _penalties_scalar->set_value(penalties);
+    _penalties_scalar->set_value(last_penalties);
   }
   if (_token_rate_table != NULL)
   {
-    _token_rate_table->accumulate(bucket.rate);
+    _token_rate_table->accumulate(bucket.get_rate());
   }
   if (_token_rate_scalar != NULL)
   {
-    _token_rate_scalar->set_value(bucket.rate);
+    _token_rate_scalar->set_value(bucket.get_rate());
   }
 }
+
+unsigned long LoadMonitor::get_time_ms()
+{
+  timespec current_time;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &current_time);
+  return (current_time.tv_sec * 1000) + (current_time.tv_nsec / 1000000);
+}
@@ -79,7 +79,6 @@ Store::Status LocalStore::get_data(const std::string& table,
                                    SAS::TrailId trail)
 {
   TRC_DEBUG("get_data table=%s key=%s", table.c_str(), key.c_str());
-  Store::Status status = Store::Status::NOT_FOUND;
 
   // This is for the purpose of testing data GETs failing.  If the flag is set
   // to true, then we'll just return an error.
@@ -104,12 +103,68 @@ Store::Status LocalStore::get_data(const std::string& table,
     _data_contention_flag = false;
   }
 
+  Store::Status status = get_record(_db_in_use, fqkey, data, cas, time(NULL));
+
+  pthread_mutex_unlock(&_db_lock);
+
+  TRC_DEBUG("get_data status = %d", status);
+
+  return status;
+}
+
+void LocalStore::get_data_multi(const std::string& table,
+                                std::vector<Store::GetRequest>& requests,
+                                SAS::TrailId trail)
+{
+  TRC_DEBUG("get_data_multi table=%s keys=%zu", table.c_str(), requests.size());
+
+  // As for get_data, a forced error fails the whole batch.
+  if (_force_error_on_get_flag)
+  {
+    TRC_DEBUG("Force an error on the GET");
+    _force_error_on_get_flag = false;
+
+    for (Store::GetRequest& request : requests)
+    {
+      request.status = Store::Status::ERROR;
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&_db_lock);
+
+  std::map<std::string, Record>& _db_in_use = _data_contention_flag ? _old_db : _db;
+  if (_data_contention_flag)
+  {
+    _data_contention_flag = false;
+  }
+
   uint32_t now = time(NULL);
 
+  for (Store::GetRequest& request : requests)
+  {
+    request.status = get_record(_db_in_use,
+                                table + "\\\\" + request.key,
+                                request.data,
+                                request.cas,
+                                now);
+  }
+
+  pthread_mutex_unlock(&_db_lock);
+}
+
+Store::Status LocalStore::get_record(std::map<std::string, Record>& db,
+                                     const std::string& fqkey,
+                                     std::string& data,
+                                     uint64_t& cas,
+                                     uint32_t now)
+{
+  Store::Status status = Store::Status::NOT_FOUND;
+
   TRC_DEBUG("Search store for key %s", fqkey.c_str());
 
-  std::map<std::string, Record>::iterator i = _db_in_use.find(fqkey);
-  if (i != _db_in_use.end())
+  std::map<std::string, Record>::iterator i = db.find(fqkey);
+  if (i != db.end())
   {
     // Found an existing record, so check the expiry.
     Record& r = i->second;
@@ -118,7 +173,7 @@ Store::Status LocalStore::get_data(const std::string& table,
     {
       // Record has expired, so remove it from the map and return not found.
       TRC_DEBUG("Record has expired, remove it from store");
-      _db_in_use.erase(i);
+      db.erase(i);
     }
     else
     {
@@ -131,10 +186,6 @@ Store::Status LocalStore::get_data(const std::string& table,
     }
   }
 
-  pthread_mutex_unlock(&_db_lock);
-
-  TRC_DEBUG("get_data status = %d", status);
-
   return status;
 }
 
@@ -149,8 +200,6 @@ Store::Status LocalStore::set_data(const std::string& table,
   TRC_DEBUG("set_data table=%s key=%s CAS=%ld expiry=%d",
             table.c_str(), key.c_str(), cas, expiry);
 
-  Store::Status status = Store::Status::DATA_CONTENTION;
-
   // This is for the purpose of testing data SETs failing.  If the flag is set
   // to true, then we'll just return an error.
   if (_force_error_on_set_flag)
@@ -164,10 +213,56 @@ Store::Status LocalStore::set_data(const std::string& table,
   // Calculate the fully qualified key.
   std::string fqkey = table + "\\\\" + key;
 
+  pthread_mutex_lock(&_db_lock);
+  Store::Status status = set_record(fqkey, data, cas, expiry, time(NULL));
+  pthread_mutex_unlock(&_db_lock);
+
+  return status;
+}
+
+void LocalStore::set_data_multi(const std::string& table,
+                                std::vector<Store::SetRequest>& requests,
+                                SAS::TrailId trail)
+{
+  TRC_DEBUG("set_data_multi table=%s keys=%zu", table.c_str(), requests.size());
+
+  // As for set_data, a forced error fails the whole batch.
+  if (_force_error_on_set_flag)
+  {
+    TRC_DEBUG("Force an error on the SET");
+    _force_error_on_set_flag = false;
+
+    for (Store::SetRequest& request : requests)
+    {
+      request.status = Store::Status::ERROR;
+    }
+    return;
+  }
+
   pthread_mutex_lock(&_db_lock);
 
   uint32_t now = time(NULL);
 
+  for (Store::SetRequest& request : requests)
+  {
+    request.status = set_record(table + "\\\\" + request.key,
+                                request.data,
+                                request.cas,
+                                request.expiry,
+                                now);
+  }
+
+  pthread_mutex_unlock(&_db_lock);
+}
+
+Store::Status LocalStore::set_record(const std::string& fqkey,
+                                     const std::string& data,
+                                     uint64_t cas,
+                                     int expiry,
+                                     uint32_t now)
+{
+  Store::Status status = Store::Status::DATA_CONTENTION;
+
   TRC_DEBUG("Search store for key %s", fqkey.c_str());
 
   std::map<std::string, Record>::iterator i = _db.find(fqkey);
@@ -210,7 +305,6 @@ Store::Status LocalStore::set_data(const std::string& table,
               r.cas, r.expiry, now);
   }
 
-  pthread_mutex_unlock(&_db_lock);
   return status;
 }
 
@@ -14,19 +14,120 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <algorithm>
+#include <atomic>
 #include "log.h"
 
 const char* log_level[] = {"Error", "Warning", "Status", "Info", "Verbose", "Debug"};
 
 #define MAX_LOGLINE 8192
 
+// Size of the batches the asynchronous log writer passes to the Logger, and
+// how long it sleeps for when there is nothing to write.
+#define ASYNC_LOG_BATCH_SIZE (256 * 1024)
+#define ASYNC_LOG_IDLE_INTERVAL_MS 10
+
 namespace Log
 {
   static Logger logger_static;
   static Logger *logger = &logger_static;
   static pthread_mutex_t serialization_lock = PTHREAD_MUTEX_INITIALIZER;
   int loggingLevel = 4;
+
+  // A single-producer/single-consumer ring of log records, owned by one
+  // logging thread and drained by the asynchronous writer thread.  Each
+  // record is a RecordHeader followed by the (unterminated) log line.
+  //
+  // Buffers are never freed, so that the crash path can always walk the list
+  // of buffers without taking any locks.  Instead, when the owning thread
+  // exits and the buffer has been drained, it is reused by the next thread
+  // that starts logging.
+  struct AsyncBuffer
+  {
+    AsyncBuffer(size_t size_param) :
+      data(new char[size_param]),
+      size(size_param),
+      head(0),
+      tail(0),
+      writing(false),
+      orphaned(false),
+      next(NULL)
+    {
+    }
+
+    char* data;
+    size_t size;
+
+    // Total bytes ever written by the owning thread and read by the writer
+    // thread.  Only the owner updates head and only the writer updates tail.
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+
+    // Set while the owning thread is copying a line into the buffer, so that
+    // stopAsyncLogging can wait for it to finish.
+    std::atomic<bool> writing;
+
+    // Set when the owning thread exits, so the buffer can be reused once it
+    // is empty.
+    std::atomic<bool> orphaned;
+
+    // The next buffer in the list of all buffers.  This doesn't change once
+    // the buffer is on the list.
+    AsyncBuffer* next;
+  };
+
+  struct RecordHeader
+  {
+    struct timespec time;
+    uint32_t length;
+  };
+
+  // Marks the calling thread's buffer as orphaned when the thread exits.
+  struct AsyncBufferOwner
+  {
+    AsyncBuffer* buffer;
+    ~AsyncBufferOwner()
+    {
+      if (buffer != NULL)
+      {
+        buffer->orphaned.store(true);
+      }
+    }
+  };
+
+  static std::atomic<bool> async_enabled(false);
+  static size_t async_buffer_size = 0;
+  static std::atomic<uint64_t> async_drops(0);
+  static thread_local AsyncBufferOwner async_buffer_owner = {NULL};
+
+  // The list of all the per-thread buffers.  Buffers are added to the front
+  // of the list under async_buffers_lock, but the list can be walked without
+  // the lock.
+  static pthread_mutex_t async_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+  static std::atomic<AsyncBuffer*> async_buffers(NULL);
+
+  // The writer thread.
+  static pthread_t async_writer_thread;
+  static std::atomic<bool> async_writer_running(false);
+
+  // Batch used to drain the buffers on the crash path, where we can't
+  // allocate memory.
+  static char async_crash_batch[ASYNC_LOG_BATCH_SIZE];
+
+  static int format_line(char* logline,
+                         int level,
+                         const char* module,
+                         int line_number,
+                         const char* fmt,
+                         va_list args,
+                         int& truncated);
+  static void write_sync(const char* logline, int truncated);
+  static AsyncBuffer* async_get_buffer();
+  static bool async_write(const char* line, size_t length);
+  static bool async_drain(char* batch, bool unlocked);
+  static void* async_writer_func(void* notused);
 }
 
 void Log::setLoggingLevel(int level)
@@ -76,6 +177,35 @@ void Log::_write(int level, const char *module, int line_number, const char *fmt
     return;
   }
 
+  char logline[MAX_LOGLINE];
+  int truncated = 0;
+  int written = format_line(logline, level, module, line_number, fmt, args, truncated);
+
+  if (Log::async_enabled.load(std::memory_order_relaxed))
+  {
+    // Hand the line to the writer thread without taking any locks.
+    if (async_write(logline, written + 1))
+    {
+      if (truncated > 0)
+      {
+        char buf[128];
+        int len = snprintf(buf, 128, "Previous log was truncated by %d characters\n", truncated);
+        async_write(buf, std::min(len, 127));
+      }
+
+      return;
+    }
+
+    // Asynchronous logging has just been stopped, so write the line
+    // synchronously instead.
+  }
+
+  write_sync(logline, truncated);
+}
+
+/// Writes a formatted log line directly to the logger.
+void Log::write_sync(const char* logline, int truncated)
+{
   pthread_mutex_lock(&Log::serialization_lock);
   if (!Log::logger)
   {
@@ -87,10 +217,31 @@ void Log::_write(int level, const char *module, int line_number, const char *fmt
 
   pthread_cleanup_push(release_lock, 0);
 
-  char logline[MAX_LOGLINE];
+  Log::logger->write(logline);
+  if (truncated > 0)
+  {
+    char buf[128];
+    snprintf(buf, 128, "Previous log was truncated by %d characters\n", truncated);
+    Log::logger->write(buf);
+  }
+  pthread_cleanup_pop(0);
+  pthread_mutex_unlock(&Log::serialization_lock);
+}
 
+/// Formats a log line (including the trailing newline) into the supplied
+/// buffer, which must be MAX_LOGLINE bytes long.
+///
+/// @returns the length of the line excluding the newline.
+int Log::format_line(char* logline,
+                     int level,
+                     const char* module,
+                     int line_number,
+                     const char* fmt,
+                     va_list args,
+                     int& truncated)
+{
   int written = 0;
-  int truncated = 0;
+  truncated = 0;
 
   const char* mod = strrchr(module, '/');
   module = (mod != NULL) ? mod + 1 : module;
@@ -122,16 +273,301 @@ void Log::_write(int level, const char *module, int line_number, const char *fmt
   logline[written] = '\n';
   logline[written+1] = '\0';
 
-  Log::logger->write(logline);
-  if (truncated > 0)
+  return written;
+}
+
+void Log::startAsyncLogging(size_t buffer_size)
+{
+  if (Log::async_writer_running.load())
+  {
+    return;
+  }
+
+  Log::async_buffer_size = std::max(buffer_size,
+                                    (size_t)(2 * (sizeof(RecordHeader) + MAX_LOGLINE)));
+  Log::async_writer_running.store(true);
+
+  if (pthread_create(&Log::async_writer_thread, NULL, async_writer_func, NULL) != 0)
+  {
+    // LCOV_EXCL_START
+    Log::async_writer_running.store(false);
+    TRC_ERROR("Failed to start asynchronous log writer - logging synchronously");
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  Log::async_enabled.store(true);
+}
+
+void Log::stopAsyncLogging()
+{
+  if (!Log::async_writer_running.load())
+  {
+    return;
+  }
+
+  // Stop new lines going to the buffers, and wait for any threads that are
+  // part way through copying a line into their buffer.  Then let the writer
+  // drain what's left and exit.
+  Log::async_enabled.store(false);
+
+  for (AsyncBuffer* buffer = Log::async_buffers.load();
+       buffer != NULL;
+       buffer = buffer->next)
+  {
+    while (buffer->writing.load())
+    {
+      sched_yield();
+    }
+  }
+
+  Log::async_writer_running.store(false);
+  pthread_join(Log::async_writer_thread, NULL);
+}
+
+uint64_t Log::asyncLogDrops()
+{
+  return Log::async_drops.load();
+}
+
+/// Returns the calling thread's buffer, reusing the buffer of a thread that
+/// has exited or creating a new one if this is the first log from this
+/// thread.
+Log::AsyncBuffer* Log::async_get_buffer()
+{
+  AsyncBuffer* buffer = Log::async_buffer_owner.buffer;
+
+  if (buffer == NULL)
+  {
+    pthread_mutex_lock(&Log::async_buffers_lock);
+
+    for (AsyncBuffer* b = Log::async_buffers.load();
+         b != NULL;
+         b = b->next)
+    {
+      // The buffer's owner has exited, so its head won't change.  Check it
+      // has been completely drained before reusing it.
+      if ((b->orphaned.load()) &&
+          (b->head.load(std::memory_order_acquire) ==
+           b->tail.load(std::memory_order_acquire)))
+      {
+        b->orphaned.store(false);
+        buffer = b;
+        break;
+      }
+    }
+
+    if (buffer == NULL)
+    {
+      buffer = new AsyncBuffer(Log::async_buffer_size);
+      buffer->next = Log::async_buffers.load(std::memory_order_relaxed);
+      Log::async_buffers.store(buffer, std::memory_order_release);
+    }
+
+    pthread_mutex_unlock(&Log::async_buffers_lock);
+    Log::async_buffer_owner.buffer = buffer;
+  }
+
+  return buffer;
+}
+
+/// Copies a log line into the calling thread's buffer, dropping it if the
+/// buffer is full.
+///
+/// @returns false if asynchronous logging has been stopped, in which case
+///          the caller should write the line synchronously.
+bool Log::async_write(const char* line, size_t length)
+{
+  AsyncBuffer* buffer = async_get_buffer();
+
+  // Flag that we're writing to the buffer before checking that asynchronous
+  // logging is still enabled.  stopAsyncLogging disables it before waiting
+  // for the flag to clear, so either it waits for us or we see that it has
+  // been disabled.
+  buffer->writing.store(true);
+
+  if (!Log::async_enabled.load())
+  {
+    buffer->writing.store(false);
+    return false;
+  }
+
+  RecordHeader header;
+  clock_gettime(CLOCK_REALTIME, &header.time);
+  header.length = length;
+
+  size_t record_length = sizeof(header) + length;
+  size_t head = buffer->head.load(std::memory_order_relaxed);
+  size_t tail = buffer->tail.load(std::memory_order_acquire);
+
+  if (buffer->size - (head - tail) < record_length)
+  {
+    // The writer thread isn't keeping up - drop the line rather than block.
+    Log::async_drops.fetch_add(1, std::memory_order_relaxed);
+    buffer->writing.store(false, std::memory_order_release);
+    return true;
+  }
+
+  // Copy the header and line into the ring, wrapping as required.
+  const char* parts[2] = {(const char*)&header, line};
+  size_t lengths[2] = {sizeof(header), length};
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    size_t offset = head % buffer->size;
+    size_t first = std::min(lengths[ii], buffer->size - offset);
+    memcpy(buffer->data + offset, parts[ii], first);
+    memcpy(buffer->data, parts[ii] + first, lengths[ii] - first);
+    head += lengths[ii];
+  }
+
+  buffer->head.store(head, std::memory_order_release);
+  buffer->writing.store(false, std::memory_order_release);
+
+  return true;
+}
+
+/// Copies bytes out of a buffer's ring, wrapping as required.
+static void copy_from_ring(Log::AsyncBuffer* buffer,
+                           size_t pos,
+                           char* dest,
+                           size_t length)
+{
+  size_t offset = pos % buffer->size;
+  size_t first = std::min(length, buffer->size - offset);
+  memcpy(dest, buffer->data + offset, first);
+  memcpy(dest + first, buffer->data, length - first);
+}
+
+/// Writes a batch of lines to the logger.
+static void flush_batch(const char* batch, size_t& length, bool unlocked)
+{
+  if (length == 0)
+  {
+    return;
+  }
+
+  if (unlocked)
+  {
+    // LCOV_EXCL_START - crash path only
+    if (Log::logger != NULL)
+    {
+      Log::logger->write_batch_unlocked(batch, length);
+    }
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    pthread_mutex_lock(&Log::serialization_lock);
+    if (Log::logger != NULL)
+    {
+      Log::logger->write_batch(batch, length);
+    }
+    pthread_mutex_unlock(&Log::serialization_lock);
+  }
+
+  length = 0;
+}
+
+/// Drains all the per-thread buffers into the logger, in batches.
+///
+/// The buffers are drained one after another, so lines logged by different
+/// threads at around the same time may be written out of order (although
+/// each line has the time it was logged).
+///
+/// @param batch    Buffer of ASYNC_LOG_BATCH_SIZE bytes to build the batches
+///                 in.
+/// @param unlocked true on the crash path, where no locks may be taken.
+/// @returns whether anything was written.
+bool Log::async_drain(char* batch, bool unlocked)
+{
+  bool wrote = false;
+  size_t length = 0;
+
+  bool add_timestamps = ((Log::logger != NULL) &&
+                         (Log::logger->get_flags() & Logger::ADD_TIMESTAMPS));
+
+  for (AsyncBuffer* buffer = Log::async_buffers.load(std::memory_order_acquire);
+       buffer != NULL;
+       buffer = buffer->next)
+  {
+    size_t tail = buffer->tail.load(std::memory_order_relaxed);
+    size_t head = buffer->head.load(std::memory_order_acquire);
+
+    while (tail != head)
+    {
+      RecordHeader header;
+      copy_from_ring(buffer, tail, (char*)&header, sizeof(header));
+
+      if (length + Logger::MAX_TIMESTAMP_LENGTH + header.length > ASYNC_LOG_BATCH_SIZE)
+      {
+        flush_batch(batch, length, unlocked);
+      }
+
+      if (add_timestamps)
+      {
+        length += Logger::format_timestamp(header.time, batch + length);
+      }
+
+      copy_from_ring(buffer, tail + sizeof(header), batch + length, header.length);
+      length += header.length;
+
+      tail += sizeof(header) + header.length;
+      wrote = true;
+    }
+
+    buffer->tail.store(tail, std::memory_order_release);
+  }
+
+  flush_batch(batch, length, unlocked);
+
+  return wrote;
+}
+
+/// Logs the number of lines that have been dropped since the last report.
+static void report_async_drops(uint64_t& reported_drops)
+{
+  uint64_t drops = Log::async_drops.load();
+
+  if (drops != reported_drops)
   {
     char buf[128];
-    snprintf(buf, 128, "Previous log was truncated by %d characters\n", truncated);
-    Log::logger->write(buf);
+    snprintf(buf, 128, "Asynchronous logging dropped %lu log lines\n",
+             (unsigned long)(drops - reported_drops));
+    pthread_mutex_lock(&Log::serialization_lock);
+    if (Log::logger != NULL)
+    {
+      Log::logger->write(buf);
+    }
+    pthread_mutex_unlock(&Log::serialization_lock);
+    reported_drops = drops;
   }
-  pthread_cleanup_pop(0);
-  pthread_mutex_unlock(&Log::serialization_lock);
+}
 
+void* Log::async_writer_func(void* notused)
+{
+  uint64_t reported_drops = 0;
+  char* batch = new char[ASYNC_LOG_BATCH_SIZE];
+
+  while (Log::async_writer_running.load())
+  {
+    bool wrote = async_drain(batch, false);
+    report_async_drops(reported_drops);
+
+    if (!wrote)
+    {
+      struct timespec idle = {0, ASYNC_LOG_IDLE_INTERVAL_MS * 1000000};
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  // Write out anything logged before asynchronous logging was disabled.
+  async_drain(batch, false);
+  report_async_drops(reported_drops);
+
+  delete[] batch; batch = NULL;
+
+  return NULL;
 }
 
 // LCOV_EXCL_START Only used in exceptional signal handlers - not hit in UT
@@ -157,6 +593,14 @@ void Log::backtrace(const char *fmt, ...)
   logline[written] = '\n';
   logline[written+1] = '\0';
 
+  if (Log::async_writer_running.load())
+  {
+    // Write out any logs that the writer thread hasn't got to yet, so they
+    // appear before the backtrace.  We can't take any locks or allocate
+    // memory here.
+    Log::async_drain(Log::async_crash_batch, true);
+  }
+
   Log::logger->backtrace(logline);
 }
 
@@ -167,6 +611,11 @@ void Log::commit()
     return;
   }
 
+  if (Log::async_writer_running.load())
+  {
+    Log::async_drain(Log::async_crash_batch, true);
+  }
+
   Log::logger->commit();
 }
 
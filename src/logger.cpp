@@ -29,6 +29,7 @@
 #include <list>
 #include <queue>
 #include <string>
+#include <algorithm>
 
 #include "logger.h"
 
@@ -102,6 +103,67 @@ void Logger::write(const char* data)
   pthread_mutex_lock(&_lock);
   pthread_cleanup_push(Logger::release_lock, this);
 
+  if (check_log_file(ts))
+  {
+    // We have a valid log file open, so write the log.
+    write_log_file(data, ts);
+  }
+  else
+  {
+    // No valid log file, so count this as a discard.
+    ++_discards;
+  }
+
+  pthread_cleanup_pop(0);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Writes a block of log lines to the logfile, cycling or opening the log file
+/// when necessary.
+void Logger::write_batch(const char* data, size_t length)
+{
+  timestamp_t ts;
+  get_timestamp(ts);
+
+  pthread_mutex_lock(&_lock);
+  pthread_cleanup_push(Logger::release_lock, this);
+
+  if (check_log_file(ts))
+  {
+    write_log_file(data, length);
+  }
+  else
+  {
+    // No valid log file, so count each line in the block as a discard.
+    _discards += std::count(data, data + length, '\n');
+  }
+
+  pthread_cleanup_pop(0);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+// LCOV_EXCL_START Only used on the crash path - not hit in UT
+
+/// Writes a block of log lines to the current logfile without locking.
+void Logger::write_batch_unlocked(const char* data, size_t length)
+{
+  if (_fd != NULL)
+  {
+    write_log_file(data, length);
+  }
+}
+
+// LCOV_EXCL_STOP
+
+
+/// Cycles or opens the log file if necessary.  Must be called with the lock
+/// held.
+///
+/// @returns whether there is a valid log file to write to.
+bool Logger::check_log_file(const timestamp_t& ts)
+{
   bool cycle_log_file_required = false;
 
   if (_fd == NULL)
@@ -152,19 +214,7 @@ void Logger::write(const char* data)
     }
   }
 
-  if (_fd != NULL)
-  {
-    // We have a valid log file open, so write the log.
-    write_log_file(data, ts);
-  }
-  else
-  {
-    // No valid log file, so count this as a discard.
-    ++_discards;
-  }
-
-  pthread_cleanup_pop(0);
-  pthread_mutex_unlock(&_lock);
+  return (_fd != NULL);
 }
 
 
@@ -172,29 +222,49 @@ void Logger::write(const char* data)
 void Logger::get_timestamp(timestamp_t& ts)
 {
   struct timespec timespec;
-  struct tm dt;
   gettime(&timespec);
-  gmtime_r(&timespec.tv_sec, &dt);
+  timespec_to_timestamp(timespec, ts);
+}
+
+
+void Logger::timespec_to_timestamp(const struct timespec& time, timestamp_t& ts)
+{
+  struct tm dt;
+  gmtime_r(&time.tv_sec, &dt);
   ts.year = dt.tm_year;
   ts.mon = dt.tm_mon;
   ts.mday = dt.tm_mday;
   ts.hour = dt.tm_hour;
   ts.min = dt.tm_min;
   ts.sec = dt.tm_sec;
-  ts.msec = (int)(timespec.tv_nsec / 1000000);
+  ts.msec = (int)(time.tv_nsec / 1000000);
   ts.yday = dt.tm_yday;
 }
 
 
+int Logger::format_timestamp(const timestamp_t& ts, char* buf)
+{
+  return sprintf(buf, "%2.2d-%2.2d-%4.4d %2.2d:%2.2d:%2.2d.%3.3d UTC ",
+                 ts.mday, (ts.mon+1), (ts.year + 1900),
+                 ts.hour, ts.min, ts.sec, ts.msec);
+}
+
+
+int Logger::format_timestamp(const struct timespec& time, char* buf)
+{
+  timestamp_t ts;
+  timespec_to_timestamp(time, ts);
+  return format_timestamp(ts, buf);
+}
+
+
 /// Writes a log to the file with timestamp if configured.
 void Logger::write_log_file(const char *data, const timestamp_t& ts)
 {
   if (_flags & ADD_TIMESTAMPS)
   {
-    char timestamp[100];
-    sprintf(timestamp, "%2.2d-%2.2d-%4.4d %2.2d:%2.2d:%2.2d.%3.3d UTC ",
-            ts.mday, (ts.mon+1), (ts.year + 1900),
-            ts.hour, ts.min, ts.sec, ts.msec);
+    char timestamp[MAX_TIMESTAMP_LENGTH];
+    format_timestamp(ts, timestamp);
     fputs(timestamp, _fd);
   }
 
@@ -216,6 +286,38 @@ void Logger::write_log_file(const char *data, const timestamp_t& ts)
 }
 
 
+/// Writes a block of log lines to the file.  Anything buffered in the FILE is
+/// flushed first, and the block itself is then written directly to the file
+/// descriptor so that a whole batch costs a single write.
+void Logger::write_log_file(const char* data, size_t length)
+{
+  fflush(_fd);
+
+  int fd = fileno(_fd);
+  while (length > 0)
+  {
+    ssize_t written = ::write(fd, data, length);
+
+    if (written < 0)
+    {
+      // LCOV_EXCL_START
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      fclose(_fd);
+      _fd = NULL;
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    data += written;
+    length -= written;
+  }
+}
+
+
 void Logger::cycle_log_file(const timestamp_t& ts)
 {
   if (_fd != NULL)
@@ -23,6 +23,7 @@
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
+#include <memory>
 #include <time.h>
 
 #include "log.h"
@@ -104,6 +105,63 @@ memcached_return_t BaseMemcachedStore::get_from_replica(memcached_st* replica,
 }
 
 
+memcached_return_t BaseMemcachedStore::get_multi_from_replica(memcached_st* replica,
+                                                              const std::vector<std::string>& keys,
+                                                              std::map<std::string, std::pair<std::string, uint64_t> >& found)
+{
+  memcached_return_t rc = MEMCACHED_ERROR;
+  found.clear();
+
+  std::vector<const char*> key_ptrs;
+  std::vector<size_t> key_lens;
+  for (const std::string& key : keys)
+  {
+    key_ptrs.push_back(key.data());
+    key_lens.push_back(key.length());
+  }
+
+  rc = memcached_mget(replica, key_ptrs.data(), key_lens.data(), keys.size());
+
+  if (memcached_success(rc))
+  {
+    // memcached_mget command was successful, so retrieve the results.  There
+    // is one result for each key that was found.
+    TRC_DEBUG("Fetch results for %zu keys", keys.size());
+    memcached_result_st result;
+    memcached_result_create(replica, &result);
+
+    while (true)
+    {
+      memcached_fetch_result(replica, &result, &rc);
+
+      if (!memcached_success(rc))
+      {
+        break;
+      }
+
+      std::string key(memcached_result_key_value(&result),
+                      memcached_result_key_length(&result));
+      TRC_DEBUG("Found record for %s on replica", key.c_str());
+      found[key] = std::make_pair(std::string(memcached_result_value(&result),
+                                              memcached_result_length(&result)),
+                                  memcached_result_cas(&result));
+    }
+
+    memcached_result_free(&result);
+
+    // The fetch loop ends with MEMCACHED_END once all the results have been
+    // retrieved (some versions of libmemcached return MEMCACHED_NOTFOUND
+    // instead).  Anything else means the replica failed.
+    if ((rc == MEMCACHED_END) || (rc == MEMCACHED_NOTFOUND))
+    {
+      rc = MEMCACHED_SUCCESS;
+    }
+  }
+
+  return rc;
+}
+
+
 memcached_return_t BaseMemcachedStore::add_overwriting_tombstone(memcached_st* replica,
                                                                  const char* key_ptr,
                                                                  const size_t key_len,
@@ -238,9 +296,68 @@ TopologyNeutralMemcachedStore(const std::string& target_domain,
   _target_domain(target_domain),
   _resolver(resolver),
   _attempts(2),
-  _conn_pool(60, _options)
+  _conn_pool(60, _options),
+  _hedge_pool(NULL),
+  _hedge_delay_ms(0),
+  _max_parallel_reads(1)
 {}
 
+TopologyNeutralMemcachedStore::~TopologyNeutralMemcachedStore()
+{
+  if (_hedge_pool != NULL)
+  {
+    _hedge_pool->stop();
+    _hedge_pool->join();
+    delete _hedge_pool; _hedge_pool = NULL;
+  }
+}
+
+/// A piece of work for the hedging threads.  The caller that queued the work
+/// waits for it to complete, so if it hits an exception, fail() is called to
+/// complete it with an error instead.
+struct HedgeWork
+{
+  std::function<void()> run;
+  std::function<void()> fail;
+
+  void operator()() { run(); }
+};
+
+static void exception_callback(std::function<void()> work)
+{
+  HedgeWork* hedge_work = work.target<HedgeWork>();
+
+  if (hedge_work != NULL)
+  {
+    hedge_work->fail();
+  }
+}
+
+void TopologyNeutralMemcachedStore::configure_hedging(ExceptionHandler* exception_handler,
+                                                      unsigned int num_threads,
+                                                      unsigned int hedge_delay_ms,
+                                                      unsigned int max_parallel)
+{
+  TRC_STATUS("Configuring memcached hedging");
+  TRC_STATUS("  Threads:      %u", num_threads);
+  TRC_STATUS("  Hedge delay:  %u ms", hedge_delay_ms);
+  TRC_STATUS("  Max parallel: %u", max_parallel);
+
+  _hedge_delay_ms = hedge_delay_ms;
+  _max_parallel_reads = (max_parallel > 0) ? max_parallel : 1;
+  _hedge_pool = new FunctorThreadPool(num_threads,
+                                      exception_handler,
+                                      exception_callback);
+
+  if (!_hedge_pool->start())
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start memcached hedging threads");
+    delete _hedge_pool; _hedge_pool = NULL;
+    // LCOV_EXCL_STOP
+  }
+}
+
 memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
     std::vector<AddrInfo>& targets,
     SAS::TrailId trail,
@@ -290,6 +407,182 @@ memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
   return rc;
 }
 
+/// State shared between a hedged read and the attempts it makes.  This is
+/// reference counted, as attempts may complete after the read has returned.
+template <class R>
+struct HedgedRead
+{
+  HedgedRead(size_t num_targets,
+             std::function<memcached_return_t(memcached_st*, R&)> fn_param) :
+    fn(fn_param),
+    results(num_targets),
+    num_complete(0),
+    winner(-1),
+    winner_rc(MEMCACHED_ERROR),
+    last_rc(MEMCACHED_ERROR)
+  {
+    pthread_mutex_init(&lock, NULL);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+  }
+
+  ~HedgedRead()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  const std::function<memcached_return_t(memcached_st*, R&)> fn;
+
+  // The following fields must only be accessed with the lock held.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  std::vector<R> results;
+  size_t num_complete;
+  int winner;
+  memcached_return_t winner_rc;
+  memcached_return_t last_rc;
+};
+
+template <class R>
+memcached_return_t TopologyNeutralMemcachedStore::hedge_through_targets(
+    std::vector<AddrInfo>& targets,
+    SAS::TrailId trail,
+    std::function<memcached_return_t(memcached_st*, R&)> fn,
+    R& result)
+{
+  std::shared_ptr<HedgedRead<R> > read(new HedgedRead<R>(targets.size(), fn));
+  memcached_return_t rc;
+  size_t num_started = 0;
+  timespec next_hedge_time = {0, 0};
+
+  pthread_mutex_lock(&read->lock);
+
+  while (true)
+  {
+    if (read->winner >= 0)
+    {
+      // An attempt got a definitive result.
+      rc = read->winner_rc;
+      result = read->results[read->winner];
+      break;
+    }
+
+    size_t outstanding = num_started - read->num_complete;
+
+    if ((num_started == targets.size()) && (outstanding == 0))
+    {
+      // Every target has failed.
+      rc = read->last_rc;
+      break;
+    }
+
+    bool can_start = ((num_started < targets.size()) &&
+                      (outstanding < _max_parallel_reads));
+
+    if (can_start)
+    {
+      // Start another attempt if nothing is outstanding (because the
+      // previous attempts failed), or if the outstanding attempts have taken
+      // longer than the hedge delay.
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      if ((outstanding == 0) ||
+          (now.tv_sec > next_hedge_time.tv_sec) ||
+          ((now.tv_sec == next_hedge_time.tv_sec) &&
+           (now.tv_nsec >= next_hedge_time.tv_nsec)))
+      {
+        AddrInfo target = targets[num_started];
+        const size_t index = num_started;
+
+        TRC_DEBUG("Try server IP %s, port %d (attempt %zu, %zu outstanding)",
+                  target.address.to_string().c_str(),
+                  target.port,
+                  index + 1,
+                  outstanding);
+        SAS::Event attempt(trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+        attempt.add_var_param(target.address.to_string());
+        attempt.add_static_param(target.port);
+        SAS::report_event(attempt);
+
+        HedgeWork work;
+        work.run = [this, read, target, index]()
+        {
+          ConnectionHandle<memcached_st*> conn = _conn_pool.get_connection(target);
+
+          R attempt_result;
+          memcached_return_t attempt_rc = read->fn(conn.get_connection(),
+                                                   attempt_result);
+          TRC_DEBUG("libmemcached returned %d", attempt_rc);
+
+          bool retry = can_retry_memcached_rc(attempt_rc);
+          if (retry)
+          {
+            TRC_DEBUG("Blacklisting target");
+            _resolver->blacklist(target);
+          }
+
+          pthread_mutex_lock(&read->lock);
+          read->num_complete++;
+          if (retry)
+          {
+            read->last_rc = attempt_rc;
+          }
+          else if (read->winner < 0)
+          {
+            read->winner = index;
+            read->winner_rc = attempt_rc;
+            read->results[index] = attempt_result;
+          }
+          pthread_cond_signal(&read->cond);
+          pthread_mutex_unlock(&read->lock);
+        };
+        work.fail = [read]()
+        {
+          // Treat the attempt as having failed in a way that means the next
+          // target should be tried.
+          pthread_mutex_lock(&read->lock);
+          read->num_complete++;
+          read->last_rc = MEMCACHED_ERROR;
+          pthread_cond_signal(&read->cond);
+          pthread_mutex_unlock(&read->lock);
+        };
+        _hedge_pool->add_work(work);
+
+        num_started++;
+
+        next_hedge_time = now;
+        next_hedge_time.tv_sec += _hedge_delay_ms / 1000;
+        next_hedge_time.tv_nsec += (_hedge_delay_ms % 1000) * 1000000;
+        if (next_hedge_time.tv_nsec >= 1000000000)
+        {
+          next_hedge_time.tv_sec++;
+          next_hedge_time.tv_nsec -= 1000000000;
+        }
+
+        continue;
+      }
+
+      // Wait for an attempt to complete, or until it's time to hedge.
+      pthread_cond_timedwait(&read->cond, &read->lock, &next_hedge_time);
+    }
+    else
+    {
+      // Wait for an attempt to complete.
+      pthread_cond_wait(&read->cond, &read->lock);
+    }
+  }
+
+  pthread_mutex_unlock(&read->lock);
+
+  return rc;
+}
+
 Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
                                                       const std::string& key,
                                                       std::string& data,
@@ -321,14 +614,36 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
   //
   // The code that does the GET operation is passed as a lambda that captures
   // all necessary variables by reference.
-  rc = iterate_through_targets(targets, trail,
-                               [&](ConnectionHandle<memcached_st*>& conn_handle) {
-     return get_from_replica(conn_handle.get_connection(),
-                             fqkey.data(),
-                             fqkey.length(),
-                             data,
-                             cas);
-  });
+  if (_hedge_pool != NULL)
+  {
+    std::pair<std::string, uint64_t> record;
+    rc = hedge_through_targets<std::pair<std::string, uint64_t> >(targets, trail,
+                               [this, fqkey](memcached_st* replica,
+                                             std::pair<std::string, uint64_t>& record) {
+       return get_from_replica(replica,
+                               fqkey.data(),
+                               fqkey.length(),
+                               record.first,
+                               record.second);
+    }, record);
+
+    if (memcached_success(rc))
+    {
+      data.swap(record.first);
+      cas = record.second;
+    }
+  }
+  else
+  {
+    rc = iterate_through_targets(targets, trail,
+                                 [&](ConnectionHandle<memcached_st*>& conn_handle) {
+       return get_from_replica(conn_handle.get_connection(),
+                               fqkey.data(),
+                               fqkey.length(),
+                               data,
+                               cas);
+    });
+  }
 
   if (memcached_success(rc))
   {
@@ -411,6 +726,146 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
 }
 
 
+void TopologyNeutralMemcachedStore::get_data_multi(const std::string& table,
+                                                   std::vector<Store::GetRequest>& requests,
+                                                   SAS::TrailId trail)
+{
+  std::vector<AddrInfo> targets;
+  std::vector<std::string> fqkeys;
+  std::map<std::string, std::pair<std::string, uint64_t> > found;
+  memcached_return_t rc;
+
+  TRC_DEBUG("Start GET from table %s for %zu keys", table.c_str(), requests.size());
+
+  for (Store::GetRequest& request : requests)
+  {
+    fqkeys.push_back(get_fq_key(table, request.key));
+    request.status = Store::Status::ERROR;
+    request.cas = 0;
+
+    if (trail != 0)
+    {
+      SAS::Event start(trail, SASEvent::MEMCACHED_GET_START, 0);
+      start.add_var_param(fqkeys.back());
+      SAS::report_event(start);
+    }
+  }
+
+  if ((requests.empty()) || (!get_targets(targets, trail)))
+  {
+    return;
+  }
+
+  // Do a single multi-key GET to each target, stopping if we get a
+  // definitive success/failure response.
+  if (_hedge_pool != NULL)
+  {
+    typedef std::map<std::string, std::pair<std::string, uint64_t> > Records;
+    rc = hedge_through_targets<Records>(targets, trail,
+                                        [this, fqkeys](memcached_st* replica,
+                                                       Records& records) {
+       return get_multi_from_replica(replica, fqkeys, records);
+    }, found);
+  }
+  else
+  {
+    rc = iterate_through_targets(targets, trail,
+                                 [&](ConnectionHandle<memcached_st*>& conn_handle) {
+       return get_multi_from_replica(conn_handle.get_connection(),
+                                     fqkeys,
+                                     found);
+    });
+  }
+
+  for (size_t ii = 0; ii < requests.size(); ++ii)
+  {
+    Store::GetRequest& request = requests[ii];
+    const std::string& fqkey = fqkeys[ii];
+
+    if (!memcached_success(rc))
+    {
+      if (trail != 0)
+      {
+        SAS::Event err(trail, SASEvent::MEMCACHED_GET_ERROR, 0);
+        err.add_var_param(fqkey);
+        err.add_var_param(memcached_strerror(NULL, rc));
+        SAS::report_event(err);
+      }
+
+      continue;
+    }
+
+    std::map<std::string, std::pair<std::string, uint64_t> >::iterator record =
+      found.find(fqkey);
+
+    if (record == found.end())
+    {
+      TRC_DEBUG("Key %s not found", fqkey.c_str());
+
+      if (trail != 0)
+      {
+        SAS::Event not_found(trail, SASEvent::MEMCACHED_GET_NOT_FOUND, 0);
+        not_found.add_var_param(fqkey);
+        SAS::report_event(not_found);
+      }
+
+      request.status = Store::Status::NOT_FOUND;
+    }
+    else if (record->second.first != TOMBSTONE)
+    {
+      request.data = record->second.first;
+      request.cas = record->second.second;
+
+      if (trail != 0)
+      {
+        SAS::Event got_data(trail, SASEvent::MEMCACHED_GET_SUCCESS, 0);
+        got_data.add_var_param(fqkey);
+        got_data.add_var_param(request.data);
+        got_data.add_static_param(request.cas);
+        SAS::report_event(got_data);
+      }
+
+      TRC_DEBUG("Read %zu bytes from table %s key %s, CAS = %ld",
+                request.data.length(), table.c_str(), request.key.c_str(), request.cas);
+      request.status = Store::OK;
+    }
+    else
+    {
+      if (trail != 0)
+      {
+        SAS::Event got_tombstone(trail, SASEvent::MEMCACHED_GET_TOMBSTONE, 0);
+        got_tombstone.add_var_param(fqkey);
+        got_tombstone.add_static_param(record->second.second);
+        SAS::report_event(got_tombstone);
+      }
+
+      // We have read a tombstone, which is reported as NOT_FOUND with a zero
+      // CAS (as for get_data).
+      TRC_DEBUG("Read tombstone from table %s key %s",
+                table.c_str(), request.key.c_str());
+      request.status = Store::NOT_FOUND;
+    }
+  }
+
+  if (memcached_success(rc))
+  {
+    if (_comm_monitor)
+    {
+      _comm_monitor->inform_success();
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Failed to read data with error %s", memcached_strerror(NULL, rc));
+
+    if (_comm_monitor)
+    {
+      _comm_monitor->inform_failure();
+    }
+  }
+}
+
+
 Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
                                                       const std::string& key,
                                                       const std::string& data,
@@ -418,24 +873,153 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
                                                       int expiry,
                                                       SAS::TrailId trail)
 {
-  Store::Status status = Store::Status::OK;
   std::vector<AddrInfo> targets;
-  memcached_return_t rc;
 
+  log_set_start(table, key, data, cas, expiry, trail);
+
+  if (!get_targets(targets, trail))
+  {
+    return ERROR;
+  }
+
+  return set_data_to_targets(targets, table, key, data, cas, expiry, trail);
+}
+
+
+void TopologyNeutralMemcachedStore::set_data_multi(const std::string& table,
+                                                   std::vector<Store::SetRequest>& requests,
+                                                   SAS::TrailId trail)
+{
+  std::vector<AddrInfo> targets;
+
+  for (Store::SetRequest& request : requests)
+  {
+    log_set_start(table,
+                  request.key,
+                  request.data,
+                  request.cas,
+                  request.expiry,
+                  trail);
+  }
+
+  if ((requests.empty()) || (!get_targets(targets, trail)))
+  {
+    for (Store::SetRequest& request : requests)
+    {
+      request.status = ERROR;
+    }
+    return;
+  }
+
+  if ((_hedge_pool != NULL) && (requests.size() > 1))
+  {
+    // Write the keys in parallel.  The first key is written on this thread,
+    // and the rest on the hedging threads.  We wait for all the writes to
+    // complete, so the work items can safely refer to our variables.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t remaining = requests.size() - 1;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    for (size_t ii = 1; ii < requests.size(); ++ii)
+    {
+      HedgeWork work;
+      work.run = [&, ii]()
+      {
+        Store::SetRequest& request = requests[ii];
+        request.status = set_data_to_targets(targets,
+                                             table,
+                                             request.key,
+                                             request.data,
+                                             request.cas,
+                                             request.expiry,
+                                             trail);
+
+        pthread_mutex_lock(&lock);
+        remaining--;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+      };
+      work.fail = [&, ii]()
+      {
+        pthread_mutex_lock(&lock);
+        requests[ii].status = Store::Status::ERROR;
+        remaining--;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+      };
+      _hedge_pool->add_work(work);
+    }
+
+    requests[0].status = set_data_to_targets(targets,
+                                             table,
+                                             requests[0].key,
+                                             requests[0].data,
+                                             requests[0].cas,
+                                             requests[0].expiry,
+                                             trail);
+
+    pthread_mutex_lock(&lock);
+    while (remaining > 0)
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+    return;
+  }
+
+  for (Store::SetRequest& request : requests)
+  {
+    request.status = set_data_to_targets(targets,
+                                         table,
+                                         request.key,
+                                         request.data,
+                                         request.cas,
+                                         request.expiry,
+                                         trail);
+  }
+}
+
+
+void TopologyNeutralMemcachedStore::log_set_start(const std::string& table,
+                                                  const std::string& key,
+                                                  const std::string& data,
+                                                  uint64_t cas,
+                                                  int expiry,
+                                                  SAS::TrailId trail)
+{
   TRC_DEBUG("Writing %d bytes to table %s key %s, CAS = %ld, expiry = %d",
             data.length(), table.c_str(), key.c_str(), cas, expiry);
 
-  std::string fqkey = get_fq_key(table, key);
-
   if (trail != 0)
   {
     SAS::Event start(trail, SASEvent::MEMCACHED_SET_START, 0);
-    start.add_var_param(fqkey);
+    start.add_var_param(get_fq_key(table, key));
     start.add_var_param(data);
     start.add_static_param(cas);
     start.add_static_param(expiry);
     SAS::report_event(start);
   }
+}
+
+
+Store::Status TopologyNeutralMemcachedStore::set_data_to_targets(std::vector<AddrInfo>& targets,
+                                                                 const std::string& table,
+                                                                 const std::string& key,
+                                                                 const std::string& data,
+                                                                 uint64_t cas,
+                                                                 int expiry,
+                                                                 SAS::TrailId trail)
+{
+  Store::Status status = Store::Status::OK;
+  memcached_return_t rc;
+
+  std::string fqkey = get_fq_key(table, key);
 
   // Memcached uses a flexible mechanism for specifying expiration.
   // - 0 indicates never expire.
@@ -448,11 +1032,6 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
   time_t memcached_expiration =
     (time_t)((expiry > 0) ? expiry : MEMCACHED_EXPIRATION_MAXDELTA + 1);
 
-  if (!get_targets(targets, trail))
-  {
-    return ERROR;
-  }
-
   // Do a ADD/CAS to each replica (depending on the cas value), stopping if we
   // get a definitive success/failure response.
   //
@@ -0,0 +1,445 @@
+/**
+ * @file sharded_localstore.cpp Sharded in-memory implementation of the Store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+
+#include <functional>
+
+#include "log.h"
+#include "sharded_localstore.h"
+
+ShardedLocalStore::Shard::Shard() :
+  slots(),
+  full(0),
+  deleted(0)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+ShardedLocalStore::Shard::~Shard()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+ShardedLocalStore::ShardedLocalStore(unsigned int num_shards,
+                                     unsigned int expiry_interval) :
+  _shards(),
+  _expiry_interval(expiry_interval),
+  _expiry_thread_running(false),
+  _terminated(false)
+{
+  num_shards = (num_shards > 0) ? num_shards : 1;
+
+  for (unsigned int ii = 0; ii < num_shards; ++ii)
+  {
+    _shards.push_back(new Shard());
+  }
+
+  pthread_mutex_init(&_expiry_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_expiry_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (_expiry_interval > 0)
+  {
+    _expiry_thread_running =
+      (pthread_create(&_expiry_thread, NULL, expiry_thread_func, this) == 0);
+
+    if (!_expiry_thread_running)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start expiry thread - records will only be expired lazily");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  TRC_DEBUG("Created sharded local store with %d shards", num_shards);
+}
+
+ShardedLocalStore::~ShardedLocalStore()
+{
+  if (_expiry_thread_running)
+  {
+    pthread_mutex_lock(&_expiry_lock);
+    _terminated = true;
+    pthread_cond_signal(&_expiry_cond);
+    pthread_mutex_unlock(&_expiry_lock);
+
+    pthread_join(_expiry_thread, NULL);
+  }
+
+  pthread_cond_destroy(&_expiry_cond);
+  pthread_mutex_destroy(&_expiry_lock);
+
+  for (Shard* shard : _shards)
+  {
+    delete shard;
+  }
+  _shards.clear();
+}
+
+Store::Status ShardedLocalStore::get_data(const std::string& table,
+                                          const std::string& key,
+                                          std::string& data,
+                                          uint64_t& cas,
+                                          SAS::TrailId trail)
+{
+  TRC_DEBUG("get_data table=%s key=%s", table.c_str(), key.c_str());
+  Store::Status status = Store::Status::NOT_FOUND;
+
+  // Calculate the fully qualified key.
+  std::string fqkey = table + "\\\\" + key;
+  size_t hash = std::hash<std::string>()(fqkey);
+  Shard& shard = shard_for(hash);
+
+  pthread_mutex_lock(&shard.lock);
+
+  uint32_t now = time(NULL);
+  size_t index = find_slot(shard, hash, fqkey);
+
+  if (index != NOT_FOUND_INDEX)
+  {
+    // Found an existing record, so check the expiry.
+    Slot& r = shard.slots[index];
+    TRC_DEBUG("Found record, expiry = %ld (now = %ld)", r.expiry, now);
+    if (r.expiry < now)
+    {
+      // Record has expired, so remove it from the table and return not found.
+      TRC_DEBUG("Record has expired, remove it from store");
+      remove_slot(shard, index);
+    }
+    else
+    {
+      // Record has not expired, so return the data and the cas value.
+      TRC_DEBUG("Record has not expired, return %d bytes of data with CAS = %ld",
+                r.data.length(), r.cas);
+      data = r.data;
+      cas = r.cas;
+      status = Store::Status::OK;
+    }
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  TRC_DEBUG("get_data status = %d", status);
+
+  return status;
+}
+
+Store::Status ShardedLocalStore::set_data(const std::string& table,
+                                          const std::string& key,
+                                          const std::string& data,
+                                          uint64_t cas,
+                                          int expiry,
+                                          SAS::TrailId trail)
+{
+  TRC_DEBUG("set_data table=%s key=%s CAS=%ld expiry=%d",
+            table.c_str(), key.c_str(), cas, expiry);
+
+  Store::Status status = Store::Status::DATA_CONTENTION;
+
+  // Calculate the fully qualified key.
+  std::string fqkey = table + "\\\\" + key;
+  size_t hash = std::hash<std::string>()(fqkey);
+  Shard& shard = shard_for(hash);
+
+  pthread_mutex_lock(&shard.lock);
+
+  uint32_t now = time(NULL);
+  size_t index = find_slot(shard, hash, fqkey);
+
+  if (index != NOT_FOUND_INDEX)
+  {
+    // Found an existing record, so check the expiry and CAS value.
+    Slot& r = shard.slots[index];
+    TRC_DEBUG("Found existing record, CAS = %ld, expiry = %ld (now = %ld)",
+              r.cas, r.expiry, now);
+
+    if (((r.expiry >= now) && (cas == r.cas)) ||
+        ((r.expiry < now) && (cas == 0)))
+    {
+      // Supplied CAS is consistent (either because record hasn't expired and
+      // CAS matches, or record has expired and CAS is zero) so update the
+      // record.
+      r.data = data;
+      r.cas = ++cas;
+      r.expiry = (expiry == 0) ? 0 : (uint32_t)expiry + now;
+      status = Store::Status::OK;
+      TRC_DEBUG("CAS is consistent, updated record, CAS = %ld, expiry = %ld (now = %ld)",
+                r.cas, r.expiry, now);
+    }
+  }
+  else if (cas == 0)
+  {
+    // No existing record and supplied CAS is zero, so add a new record.
+    Slot& r = insert_slot(shard, hash, fqkey);
+    r.data = data;
+    r.cas = 1;
+    r.expiry = (expiry == 0) ? 0 : (uint32_t)expiry + now;
+    status = Store::Status::OK;
+    TRC_DEBUG("No existing record so inserted new record, CAS = %ld, expiry = %ld (now = %ld)",
+              r.cas, r.expiry, now);
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return status;
+}
+
+Store::Status ShardedLocalStore::delete_data(const std::string& table,
+                                             const std::string& key,
+                                             SAS::TrailId trail)
+{
+  TRC_DEBUG("delete_data table=%s key=%s",
+            table.c_str(), key.c_str());
+
+  // Calculate the fully qualified key.
+  std::string fqkey = table + "\\\\" + key;
+  size_t hash = std::hash<std::string>()(fqkey);
+  Shard& shard = shard_for(hash);
+
+  pthread_mutex_lock(&shard.lock);
+
+  size_t index = find_slot(shard, hash, fqkey);
+  if (index != NOT_FOUND_INDEX)
+  {
+    remove_slot(shard, index);
+  }
+
+  pthread_mutex_unlock(&shard.lock);
+
+  return Store::Status::OK;
+}
+
+void ShardedLocalStore::flush_all()
+{
+  TRC_DEBUG("Flushing sharded local store");
+
+  for (Shard* shard : _shards)
+  {
+    pthread_mutex_lock(&shard->lock);
+    std::vector<Slot>().swap(shard->slots);
+    shard->full = 0;
+    shard->deleted = 0;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void ShardedLocalStore::expire_all()
+{
+  for (Shard* shard : _shards)
+  {
+    // Take the time for each shard, so we don't hold a stale time if
+    // sweeping takes a while.
+    pthread_mutex_lock(&shard->lock);
+    expire_shard(*shard, time(NULL));
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+size_t ShardedLocalStore::size()
+{
+  size_t size = 0;
+
+  for (Shard* shard : _shards)
+  {
+    pthread_mutex_lock(&shard->lock);
+    size += shard->full;
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return size;
+}
+
+ShardedLocalStore::Shard& ShardedLocalStore::shard_for(size_t hash)
+{
+  return *_shards[hash % _shards.size()];
+}
+
+/// Finds the slot holding the specified key.
+///
+/// @returns the index of the slot, or NOT_FOUND_INDEX.
+size_t ShardedLocalStore::find_slot(Shard& shard,
+                                    size_t hash,
+                                    const std::string& key)
+{
+  size_t capacity = shard.slots.size();
+
+  if (capacity == 0)
+  {
+    return NOT_FOUND_INDEX;
+  }
+
+  // The low bits of the hash select the shard, so use the remaining bits to
+  // select the slot.  The capacity is always a power of two.
+  size_t mask = capacity - 1;
+  size_t index = (hash / _shards.size()) & mask;
+
+  for (size_t probes = 0; probes < capacity; ++probes)
+  {
+    Slot& slot = shard.slots[index];
+
+    if (slot.state == EMPTY)
+    {
+      break;
+    }
+    else if ((slot.state == FULL) &&
+             (slot.hash == hash) &&
+             (slot.key == key))
+    {
+      return index;
+    }
+
+    index = (index + 1) & mask;
+  }
+
+  return NOT_FOUND_INDEX;
+}
+
+/// Claims a slot for a key that isn't already in the shard, growing the table
+/// if necessary.
+ShardedLocalStore::Slot& ShardedLocalStore::insert_slot(Shard& shard,
+                                                        size_t hash,
+                                                        const std::string& key)
+{
+  // Keep the table no more than 3/4 used (counting deleted slots, as they
+  // lengthen probe sequences just as much as full ones).
+  if ((shard.full + shard.deleted + 1) * 4 > shard.slots.size() * 3)
+  {
+    size_t capacity = INITIAL_CAPACITY;
+    while ((shard.full + 1) * 2 > capacity)
+    {
+      capacity *= 2;
+    }
+    rebuild_shard(shard, capacity);
+  }
+
+  size_t mask = shard.slots.size() - 1;
+  size_t index = (hash / _shards.size()) & mask;
+
+  while (shard.slots[index].state == FULL)
+  {
+    index = (index + 1) & mask;
+  }
+
+  Slot& slot = shard.slots[index];
+
+  if (slot.state == DELETED)
+  {
+    --shard.deleted;
+  }
+  ++shard.full;
+
+  slot.state = FULL;
+  slot.hash = hash;
+  slot.key = key;
+
+  return slot;
+}
+
+void ShardedLocalStore::remove_slot(Shard& shard, size_t index)
+{
+  Slot& slot = shard.slots[index];
+  slot.state = DELETED;
+  std::string().swap(slot.key);
+  std::string().swap(slot.data);
+  --shard.full;
+  ++shard.deleted;
+}
+
+/// Removes all the expired records from a shard, and shrinks the table if it
+/// is now mostly unused.
+void ShardedLocalStore::expire_shard(Shard& shard, uint32_t now)
+{
+  for (size_t ii = 0; ii < shard.slots.size(); ++ii)
+  {
+    if ((shard.slots[ii].state == FULL) &&
+        (shard.slots[ii].expiry < now))
+    {
+      remove_slot(shard, ii);
+    }
+  }
+
+  if ((shard.deleted > 0) &&
+      (shard.deleted >= shard.full))
+  {
+    size_t capacity = INITIAL_CAPACITY;
+    while (shard.full * 2 > capacity)
+    {
+      capacity *= 2;
+    }
+    rebuild_shard(shard, capacity);
+  }
+}
+
+/// Rebuilds a shard's table with the specified capacity, dropping any
+/// deleted slots.
+void ShardedLocalStore::rebuild_shard(Shard& shard, size_t capacity)
+{
+  std::vector<Slot> old_slots(capacity);
+  old_slots.swap(shard.slots);
+  shard.deleted = 0;
+
+  size_t mask = capacity - 1;
+
+  for (Slot& old_slot : old_slots)
+  {
+    if (old_slot.state == FULL)
+    {
+      size_t index = (old_slot.hash / _shards.size()) & mask;
+
+      while (shard.slots[index].state == FULL)
+      {
+        index = (index + 1) & mask;
+      }
+
+      Slot& slot = shard.slots[index];
+      slot.state = FULL;
+      slot.hash = old_slot.hash;
+      slot.key.swap(old_slot.key);
+      slot.data.swap(old_slot.data);
+      slot.expiry = old_slot.expiry;
+      slot.cas = old_slot.cas;
+    }
+  }
+}
+
+void* ShardedLocalStore::expiry_thread_func(void* store)
+{
+  ((ShardedLocalStore*)store)->expiry_thread_loop();
+  return NULL;
+}
+
+void ShardedLocalStore::expiry_thread_loop()
+{
+  pthread_mutex_lock(&_expiry_lock);
+
+  while (!_terminated)
+  {
+    struct timespec wake_time;
+    clock_gettime(CLOCK_MONOTONIC, &wake_time);
+    wake_time.tv_sec += _expiry_interval;
+
+    pthread_cond_timedwait(&_expiry_cond, &_expiry_lock, &wake_time);
+
+    if (!_terminated)
+    {
+      pthread_mutex_unlock(&_expiry_lock);
+      expire_all();
+      pthread_mutex_lock(&_expiry_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_expiry_lock);
+}
@@ -85,7 +85,7 @@ private:
 
     TRC_DEBUG("Accumulating sample %uui into continuous accumulator statistic", sample);
 
-    current_data->count++;
+    current_data->count.increment();
 
     // Compute the updated sum and sqsum based on the previous values, dependent on
     // how long since an update happened. Additionally update the sum of squares as a
@@ -101,23 +101,9 @@ private:
     current_data->sqsum += current_value * current_value * time_since_last_update;
     current_data->current_value = sample;
 
-    // Update the low- and high-water marks.  In each case, we get the current
-    // value, decide whether a change is required and then atomically swap it
-    // if so, repeating if it was changed in the meantime.  Note that
-    // compare_exchange_weak loads the current value into the expected value
-    // parameter (lwm or hwm below) if the compare fails.
-    uint_fast64_t lwm = current_data->lwm.load();
-    while ((sample < lwm) &&
-           (!current_data->lwm.compare_exchange_weak(lwm, sample)))
-    {
-      // Do nothing.
-    }
-    uint_fast64_t hwm = current_data->hwm.load();
-    while ((sample > hwm) &&
-           (!current_data->hwm.compare_exchange_weak(hwm, sample)))
-    {
-      // Do nothing.
-    }
+    // Update the low- and high-water marks.
+    current_data->lwm.update(sample);
+    current_data->hwm.update(sample);
   };
 
   int n;
@@ -14,18 +14,20 @@
 #include "snmp_event_accumulator_table.h"
 #include "snmp_event_accumulator_by_scope_table.h"
 #include "limits.h"
+#include "sharded_statistics.h"
 
 namespace SNMP
 {
 
-// Storage for the underlying data
+// Storage for the underlying data.  This is updated for every sample, so is
+// sharded to avoid contention between threads.
 struct EventStatistics
 {
-  std::atomic_uint_fast64_t count;
-  std::atomic_uint_fast64_t sum;
-  std::atomic_uint_fast64_t sqsum;
-  std::atomic_uint_fast64_t hwm;
-  std::atomic_uint_fast64_t lwm;
+  ShardedCounter count;
+  ShardedCounter sum;
+  ShardedCounter sqsum;
+  ShardedHighWaterMark hwm;
+  ShardedLowWaterMark lwm;
 
   void reset(uint64_t periodstart, EventStatistics* previous = NULL);
 };
@@ -95,30 +97,16 @@ private:
 
     EventStatistics* current = data.get_current(now);
 
-    current->count++;
+    current->count.increment();
 
     // Just keep a running total as we go along, so we can calculate the average and variance on
     // request
-    current->sum += sample;
-    current->sqsum += (sample * sample);
-
-    // Update the low- and high-water marks.  In each case, we get the current
-    // value, decide whether a change is required and then atomically swap it
-    // if so, repeating if it was changed in the meantime.  Note that
-    // compare_exchange_weak loads the current value into the expected value
-    // parameter (lwm or hwm below) if the compare fails.
-    uint_fast64_t lwm = current->lwm.load();
-    while ((sample < lwm) &&
-           (!current->lwm.compare_exchange_weak(lwm, sample)))
-    {
-      // Do nothing.
-    }
-    uint_fast64_t hwm = current->hwm.load();
-    while ((sample > hwm) &&
-           (!current->hwm.compare_exchange_weak(hwm, sample)))
-    {
-      // Do nothing.
-    }
+    current->sum.increment(sample);
+    current->sqsum.increment(sample * sample);
+
+    // Update the low- and high-water marks.
+    current->lwm.update(sample);
+    current->hwm.update(sample);
   };
 
   int n;
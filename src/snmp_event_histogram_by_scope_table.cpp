@@ -0,0 +1,130 @@
+/**
+ * @file snmp_event_histogram_by_scope_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "snmp_internal/snmp_time_period_table.h"
+#include "snmp_internal/snmp_time_period_and_scope_table.h"
+#include "snmp_event_histogram_by_scope_table.h"
+#include "histogram.h"
+
+namespace SNMP
+{
+
+// A TimeAndScopeBasedRow that maps the data from a Histogram into a count
+// column followed by a column for each percentile.
+class EventHistogramByScopeRow: public TimeAndScopeBasedRow<Histogram>
+{
+public:
+  EventHistogramByScopeRow(int time_index,
+                           std::string scope_index,
+                           View* view,
+                           const std::vector<double>& percentiles) :
+    TimeAndScopeBasedRow<Histogram>(time_index, scope_index, view),
+    _percentiles(percentiles)
+  {};
+  ColumnData get_columns();
+
+private:
+  const std::vector<double>& _percentiles;
+};
+
+class EventHistogramByScopeTableImpl: public ManagedTable<EventHistogramByScopeRow, int>, public EventHistogramByScopeTable
+{
+public:
+  EventHistogramByScopeTableImpl(std::string name,
+                                 std::string tbl_oid,
+                                 const std::vector<double>& percentiles):
+    ManagedTable<EventHistogramByScopeRow, int>(name,
+                                                tbl_oid,
+                                                3,
+                                                3 + percentiles.size(), // Count and percentile columns should be visible
+                                                { ASN_INTEGER , ASN_OCTET_STR }), // Type of the index column
+    _percentiles(percentiles),
+    five_second(5000),
+    five_minute(300000)
+  {
+    // The percentiles are calculated in a single pass over the histogram, so
+    // must be in ascending order.
+    std::sort(_percentiles.begin(), _percentiles.end());
+
+    // We have a fixed number of rows, so create them in the constructor.
+    n = 0;
+
+    this->add(n++, new_row(scopePrevious5SecondPeriod));
+    this->add(n++, new_row(scopeCurrent5MinutePeriod));
+    this->add(n++, new_row(scopePrevious5MinutePeriod));
+  }
+
+  // Accumulate a sample into the underlying statistics.
+  void accumulate(uint32_t sample)
+  {
+    // Pass samples through to the underlying data structures
+    five_second.get_current()->record(sample);
+    five_minute.get_current()->record(sample);
+  }
+
+private:
+  // Map row indexes to the view of the underlying data they should expose
+  EventHistogramByScopeRow* new_row(int index)
+  {
+    EventHistogramByScopeRow::View* view = NULL;
+    switch (index)
+    {
+      case TimePeriodIndexes::scopePrevious5SecondPeriod:
+        view = new EventHistogramByScopeRow::PreviousView(&five_second);
+        break;
+      case TimePeriodIndexes::scopeCurrent5MinutePeriod:
+        view = new EventHistogramByScopeRow::CurrentView(&five_minute);
+        break;
+      case TimePeriodIndexes::scopePrevious5MinutePeriod:
+        view = new EventHistogramByScopeRow::PreviousView(&five_minute);
+        break;
+    }
+
+    return new EventHistogramByScopeRow(index, "node", view, _percentiles);
+  }
+
+  int n;
+
+  std::vector<double> _percentiles;
+
+  CurrentAndPrevious<Histogram> five_second;
+  CurrentAndPrevious<Histogram> five_minute;
+};
+
+ColumnData EventHistogramByScopeRow::get_columns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+  Histogram* histogram = _view->get_data(now);
+  std::vector<uint_fast64_t> values;
+  uint_fast64_t count = histogram->percentiles(_percentiles, values);
+
+  // Construct and return a ColumnData with the appropriate values
+  ColumnData ret;
+  ret[3] = Value::uint(count);
+  for (size_t ii = 0; ii < values.size(); ++ii)
+  {
+    ret[4 + ii] = Value::uint(values[ii]);
+  }
+  return ret;
+}
+
+EventHistogramByScopeTable* EventHistogramByScopeTable::create(std::string name,
+                                                               std::string oid,
+                                                               const std::vector<double>& percentiles)
+{
+  return new EventHistogramByScopeTableImpl(name, oid, percentiles);
+}
+
+}
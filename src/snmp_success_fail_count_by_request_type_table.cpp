@@ -94,20 +94,20 @@ public:
 
   void increment_attempts(SIPRequestTypes type)
   {
-    five_second[type]->get_current()->attempts++;
-    five_minute[type]->get_current()->attempts++;
+    five_second[type]->get_current()->attempts.increment();
+    five_minute[type]->get_current()->attempts.increment();
   }
 
   void increment_successes(SIPRequestTypes type)
   {
-    five_second[type]->get_current()->successes++;
-    five_minute[type]->get_current()->successes++;
+    five_second[type]->get_current()->successes.increment();
+    five_minute[type]->get_current()->successes.increment();
   }
 
   void increment_failures(SIPRequestTypes type)
   {
-    five_second[type]->get_current()->failures++;
-    five_minute[type]->get_current()->failures++;
+    five_second[type]->get_current()->failures.increment();
+    five_minute[type]->get_current()->failures.increment();
   }
 };
 
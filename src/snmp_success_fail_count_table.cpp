@@ -80,22 +80,22 @@ public:
   void increment_attempts()
   {
     // Increment each underlying set of data.
-    five_second.get_current()->attempts++;
-    five_minute.get_current()->attempts++;
+    five_second.get_current()->attempts.increment();
+    five_minute.get_current()->attempts.increment();
   }
 
   void increment_successes()
   {
     // Increment each underlying set of data.
-    five_second.get_current()->successes++;
-    five_minute.get_current()->successes++;
+    five_second.get_current()->successes.increment();
+    five_minute.get_current()->successes.increment();
   }
 
   void increment_failures()
   {
     // Increment each underlying set of data.
-    five_second.get_current()->failures++;
-    five_minute.get_current()->failures++;
+    five_second.get_current()->failures.increment();
+    five_minute.get_current()->failures.increment();
   }
 
 private:
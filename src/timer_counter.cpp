@@ -122,25 +122,9 @@ void TimerCounter::write_statistics(SNMP::ContinuousStatistics* data, int value_
     }
   } while (!data->current_value.compare_exchange_weak(current_value, new_value));
 
-  // Update the low- and high-water marks.  In each case, we get the current
-  // value, decide whether a change is required and then atomically swap it
-  // if so, repeating if it was changed in the meantime.  Note that
-  // compare_exchange_weak loads the current value into the expected value
-  // parameter (lwm or hwm below) if the compare fails.
-
-  uint_fast64_t lwm = data->lwm.load();
-  while ((new_value < lwm) &&
-         (!data->lwm.compare_exchange_weak(lwm, new_value)))
-  {
-    // Do nothing.
-  }
-
-  uint_fast64_t hwm = data->hwm.load();
-  while ((new_value > hwm) &&
-         (!data->hwm.compare_exchange_weak(hwm, new_value)))
-  {
-    // Do nothing.
-  }
+  // Update the low- and high-water marks.
+  data->lwm.update(new_value);
+  data->hwm.update(new_value);
 }
 
 void TimerCounter::read_statistics(SNMP::ContinuousStatistics* data,
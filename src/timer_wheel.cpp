@@ -0,0 +1,295 @@
+/**
+ * @file timer_wheel.cpp Hierarchical timing wheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+const unsigned int TimerWheel::SLOT_BITS;
+const unsigned int TimerWheel::SLOTS_PER_LEVEL;
+const unsigned int TimerWheel::NUM_LEVELS;
+const uint32_t TimerWheel::OVERDUE_SLOT;
+const unsigned int TimerWheel::BITMAP_WORDS;
+
+TimerWheel::TimerWheel(uint64_t current_time) :
+  _current_time(current_time),
+  _size(0),
+  _next_timer(nullptr)
+{
+  memset(_slots, 0, sizeof(_slots));
+  memset(_occupied, 0, sizeof(_occupied));
+}
+
+void TimerWheel::insert(WheelableTimer* t)
+{
+  if (t->_wheel != this)
+  {
+    link(t);
+    t->_wheel = this;
+    _size++;
+
+    if ((_next_timer != nullptr) &&
+        (t->get_pop_time() < _next_timer->get_pop_time()))
+    {
+      _next_timer = t;
+    }
+  }
+}
+
+bool TimerWheel::remove(WheelableTimer* t)
+{
+  if (t->_wheel == this)
+  {
+    unlink(t);
+    t->_wheel = nullptr;
+    _size--;
+
+    if (t == _next_timer)
+    {
+      _next_timer = nullptr;
+    }
+
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+void TimerWheel::rebalance(WheelableTimer* t)
+{
+  if (t->_wheel == this)
+  {
+    unlink(t);
+    link(t);
+
+    if (t == _next_timer)
+    {
+      // The timer may now pop after other timers.
+      _next_timer = nullptr;
+    }
+    else if ((_next_timer != nullptr) &&
+             (t->get_pop_time() < _next_timer->get_pop_time()))
+    {
+      _next_timer = t;
+    }
+  }
+}
+
+WheelableTimer* TimerWheel::get_next_timer()
+{
+  if ((_next_timer != nullptr) || (_size == 0))
+  {
+    return _next_timer;
+  }
+
+  // Overdue timers pop before any others.  Otherwise the next timer is in the
+  // earliest occupied slot.  All the timers in a level 0 slot have the same
+  // pop time, but in higher levels we need to search the slot.
+  WheelableTimer* t = _slots[OVERDUE_SLOT];
+  unsigned int level = 0;
+  unsigned int index;
+
+  if (t == nullptr)
+  {
+    find_next_slot(level, index);
+    t = _slots[level * SLOTS_PER_LEVEL + index];
+  }
+
+  _next_timer = t;
+
+  if ((_slots[OVERDUE_SLOT] != nullptr) || (level > 0))
+  {
+    for (t = t->_wheel_next; t != nullptr; t = t->_wheel_next)
+    {
+      if (t->get_pop_time() < _next_timer->get_pop_time())
+      {
+        _next_timer = t;
+      }
+    }
+  }
+
+  return _next_timer;
+}
+
+void TimerWheel::pop_expired(uint64_t now, std::vector<WheelableTimer*>& expired)
+{
+  _next_timer = nullptr;
+
+  // Start with the overdue timers.  These are in the order they were
+  // inserted, so need sorting.
+  size_t first_overdue = expired.size();
+
+  while (_slots[OVERDUE_SLOT] != nullptr)
+  {
+    WheelableTimer* t = _slots[OVERDUE_SLOT];
+    unlink(t);
+    t->_wheel = nullptr;
+    _size--;
+    expired.push_back(t);
+  }
+
+  std::sort(expired.begin() + first_overdue,
+            expired.end(),
+            [](WheelableTimer* t1, WheelableTimer* t2)
+            {
+              return (t1->get_pop_time() < t2->get_pop_time());
+            });
+
+  // Now advance through the occupied slots in order.  Advancing to the start
+  // of a slot expires the timers in it that pop at that time, and moves the
+  // rest down to a lower level.
+  unsigned int level;
+  unsigned int index;
+
+  while (find_next_slot(level, index))
+  {
+    uint64_t start_time = slot_start_time(level, index);
+
+    if (start_time > now)
+    {
+      break;
+    }
+
+    _current_time = start_time;
+
+    uint32_t slot = level * SLOTS_PER_LEVEL + index;
+    WheelableTimer* t = _slots[slot];
+    _slots[slot] = nullptr;
+    _occupied[level][index / 64] &= ~(1ull << (index % 64));
+
+    while (t != nullptr)
+    {
+      WheelableTimer* next = t->_wheel_next;
+
+      if (t->get_pop_time() <= _current_time)
+      {
+        t->_wheel = nullptr;
+        t->_wheel_prev = nullptr;
+        t->_wheel_next = nullptr;
+        _size--;
+        expired.push_back(t);
+      }
+      else
+      {
+        link(t);
+      }
+
+      t = next;
+    }
+  }
+
+  // No occupied slot starts at or before now, so the timers stay in the same
+  // slots relative to the new time.
+  if (now > _current_time)
+  {
+    _current_time = now;
+  }
+}
+
+void TimerWheel::link(WheelableTimer* t)
+{
+  uint64_t pop_time = t->get_pop_time();
+  uint32_t slot;
+
+  if (pop_time <= _current_time)
+  {
+    slot = OVERDUE_SLOT;
+  }
+  else
+  {
+    unsigned int level =
+      (63 - __builtin_clzll(pop_time ^ _current_time)) / SLOT_BITS;
+    unsigned int index = digit(pop_time, level);
+    slot = level * SLOTS_PER_LEVEL + index;
+    _occupied[level][index / 64] |= (1ull << (index % 64));
+  }
+
+  t->_wheel_slot = slot;
+  t->_wheel_prev = nullptr;
+  t->_wheel_next = _slots[slot];
+
+  if (_slots[slot] != nullptr)
+  {
+    _slots[slot]->_wheel_prev = t;
+  }
+
+  _slots[slot] = t;
+}
+
+void TimerWheel::unlink(WheelableTimer* t)
+{
+  uint32_t slot = t->_wheel_slot;
+
+  if (t->_wheel_prev != nullptr)
+  {
+    t->_wheel_prev->_wheel_next = t->_wheel_next;
+  }
+  else
+  {
+    _slots[slot] = t->_wheel_next;
+  }
+
+  if (t->_wheel_next != nullptr)
+  {
+    t->_wheel_next->_wheel_prev = t->_wheel_prev;
+  }
+
+  t->_wheel_prev = nullptr;
+  t->_wheel_next = nullptr;
+
+  if ((slot != OVERDUE_SLOT) && (_slots[slot] == nullptr))
+  {
+    unsigned int index = slot % SLOTS_PER_LEVEL;
+    _occupied[slot / SLOTS_PER_LEVEL][index / 64] &= ~(1ull << (index % 64));
+  }
+}
+
+bool TimerWheel::find_next_slot(unsigned int& level, unsigned int& index) const
+{
+  // Timers are always in a slot after the current time's digit at their
+  // level, and every occupied slot in a level comes before any occupied slot
+  // in a higher level.
+  for (level = 0; level < NUM_LEVELS; ++level)
+  {
+    unsigned int current = digit(_current_time, level);
+
+    for (unsigned int word = current / 64; word < BITMAP_WORDS; ++word)
+    {
+      uint64_t bits = _occupied[level][word];
+
+      if (word == current / 64)
+      {
+        // Ignore the slots up to and including the current one.
+        unsigned int shift = (current % 64) + 1;
+        bits = (shift < 64) ? (bits & (~0ull << shift)) : 0;
+      }
+
+      if (bits != 0)
+      {
+        index = word * 64 + __builtin_ctzll(bits);
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+uint64_t TimerWheel::slot_start_time(unsigned int level, unsigned int index) const
+{
+  // Keep the current time's digits above the slot's level.
+  unsigned int shift = (level + 1) * SLOT_BITS;
+  uint64_t prefix = (shift < 64) ? ((_current_time >> shift) << shift) : 0;
+  return prefix | ((uint64_t)index << (level * SLOT_BITS));
+}
@@ -0,0 +1,148 @@
+/**
+ * @file connection_pool_bench.cpp Microbenchmark for ConnectionPool checkout
+ * and release, with and without per-thread caches.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Each thread repeatedly gets a connection from a shared pool and releases
+// it, cycling over 4 of the pool's targets.  The connections are stub
+// integers, so this measures the pool's own overhead.  Prints the elapsed time
+// per checkout and release (across all threads) for the default pool and for
+// a pool with thread caches, for each number of targets.
+//
+// Usage: connection_pool_bench [threads] [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <vector>
+
+#include "connection_pool.h"
+
+static const int TARGETS_PER_THREAD = 4;
+
+static std::atomic<bool> stop;
+
+class BenchPool : public ConnectionPool<int>
+{
+public:
+  BenchPool() : ConnectionPool<int>(60) {}
+  ~BenchPool() { destroy_connection_pool(); }
+
+protected:
+  int create_connection(AddrInfo target) { return 0; }
+  void destroy_connection(AddrInfo target, int conn) {}
+};
+
+struct ThreadArgs
+{
+  BenchPool* pool;
+  std::vector<AddrInfo> targets;
+  uint64_t ops;
+};
+
+static AddrInfo target(int index)
+{
+  AddrInfo ai;
+  ai.address.af = AF_INET;
+  ai.address.addr.ipv4.s_addr = htonl(0x0a000000 + index);
+  ai.port = 80;
+  ai.transport = IPPROTO_TCP;
+  return ai;
+}
+
+static void* bench_thread(void* p)
+{
+  ThreadArgs* args = (ThreadArgs*)p;
+  uint64_t ops = 0;
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      ConnectionHandle<int> conn_handle =
+        args->pool->get_connection(args->targets[ii % TARGETS_PER_THREAD]);
+      (void)conn_handle.get_connection();
+    }
+    ops += 1000;
+  }
+
+  args->ops = ops;
+  return NULL;
+}
+
+static double run(BenchPool* pool, int num_threads, int num_targets, int seconds)
+{
+  stop = false;
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<ThreadArgs> args(num_threads);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    args[ii].pool = pool;
+    args[ii].ops = 0;
+
+    for (int jj = 0; jj < TARGETS_PER_THREAD; ++jj)
+    {
+      args[ii].targets.push_back(target((ii * 7 + jj) % num_targets));
+    }
+
+    pthread_create(&threads[ii], NULL, bench_thread, &args[ii]);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct timespec delay = {seconds, 0};
+  nanosleep(&delay, NULL);
+  stop = true;
+
+  uint64_t ops = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    ops += args[ii].ops;
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed_ns = (end.tv_sec - start.tv_sec) * 1e9 +
+                      (end.tv_nsec - start.tv_nsec);
+  return elapsed_ns / ops;
+}
+
+int main(int argc, char** argv)
+{
+  int num_threads = (argc > 1) ? atoi(argv[1]) : 8;
+  int seconds = (argc > 2) ? atoi(argv[2]) : 2;
+
+  // Don't include the cost of debug logging.
+  Log::setLoggingLevel(Log::ERROR_LEVEL);
+
+  printf("%8s %16s %16s\n", "targets", "default ns/op", "cached ns/op");
+
+  for (int num_targets = 4; num_targets <= 1000; num_targets *= 250)
+  {
+    BenchPool pool;
+    double before = run(&pool, num_threads, num_targets, seconds);
+
+    BenchPool cached_pool;
+    cached_pool.enable_thread_caches(TARGETS_PER_THREAD);
+    double after = run(&cached_pool, num_threads, num_targets, seconds);
+
+    printf("%8d %16.0f %16.0f\n", num_targets, before, after);
+  }
+
+  return 0;
+}
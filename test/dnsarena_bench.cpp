@@ -0,0 +1,291 @@
+/**
+ * @file dnsarena_bench.cpp Microbenchmark comparing DnsParser::parse with
+ * DnsParser::parse_to_arena.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Repeatedly parses typical NAPTR, SRV and A responses (with additional
+// records, compressed names and a CNAME) into DnsRRecord objects and into a
+// DnsArena.  Prints the time and number of allocations per parse for each.
+//
+// Usage: dnsarena_bench [parses per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "dnsparser.h"
+
+static long allocations = 0;
+
+void* operator new(size_t size)
+{
+  allocations++;
+  void* p = malloc(size);
+
+  if (p == NULL)
+  {
+    throw std::bad_alloc();
+  }
+
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+/// Builds a DNS response, compressing names against any suffix already
+/// written.
+class ResponseBuilder
+{
+public:
+  ResponseBuilder(int answers, int additional)
+  {
+    unsigned char header[] = {0x12, 0x34, 0x81, 0x80, 0, 1, 0, 0, 0, 0, 0, 0};
+    header[7] = answers;
+    header[11] = additional;
+    _msg.assign(header, header + sizeof(header));
+  }
+
+  void question(const std::string& domain, int rrtype)
+  {
+    name(domain);
+    u16(rrtype);
+    u16(ns_c_in);
+  }
+
+  void a(const std::string& domain, const char* address)
+  {
+    size_t rdlength = rr_header(domain, ns_t_a);
+    struct in_addr addr;
+    inet_pton(AF_INET, address, &addr);
+    _msg.insert(_msg.end(), (unsigned char*)&addr, (unsigned char*)&addr + 4);
+    rr_end(rdlength);
+  }
+
+  void cname(const std::string& domain, const std::string& target)
+  {
+    size_t rdlength = rr_header(domain, ns_t_cname);
+    name(target);
+    rr_end(rdlength);
+  }
+
+  void srv(const std::string& domain, int port, const std::string& target)
+  {
+    size_t rdlength = rr_header(domain, ns_t_srv);
+    u16(10);
+    u16(50);
+    u16(port);
+    name(target);
+    rr_end(rdlength);
+  }
+
+  void naptr(const std::string& domain,
+             int order,
+             const std::string& service,
+             const std::string& replacement)
+  {
+    size_t rdlength = rr_header(domain, ns_t_naptr);
+    u16(order);
+    u16(50);
+    text("s");
+    text(service);
+    text("");
+    name(replacement);
+    rr_end(rdlength);
+  }
+
+  const std::vector<unsigned char>& msg() const { return _msg; }
+
+private:
+  void u16(int value)
+  {
+    _msg.push_back(value >> 8);
+    _msg.push_back(value);
+  }
+
+  void text(const std::string& value)
+  {
+    _msg.push_back(value.length());
+    _msg.insert(_msg.end(), value.begin(), value.end());
+  }
+
+  void name(std::string domain)
+  {
+    while (!domain.empty())
+    {
+      std::map<std::string, size_t>::iterator i = _suffixes.find(domain);
+
+      if (i != _suffixes.end())
+      {
+        u16(0xc000 | i->second);
+        return;
+      }
+
+      _suffixes[domain] = _msg.size();
+      size_t dot = domain.find('.');
+      text(domain.substr(0, dot));
+      domain = (dot == std::string::npos) ? "" : domain.substr(dot + 1);
+    }
+
+    _msg.push_back(0);
+  }
+
+  size_t rr_header(const std::string& domain, int rrtype)
+  {
+    name(domain);
+    u16(rrtype);
+    u16(ns_c_in);
+    u16(0);
+    u16(300);
+    u16(0);
+    return _msg.size();
+  }
+
+  void rr_end(size_t rdata_start)
+  {
+    size_t length = _msg.size() - rdata_start;
+    _msg[rdata_start - 2] = length >> 8;
+    _msg[rdata_start - 1] = length;
+  }
+
+  std::vector<unsigned char> _msg;
+  std::map<std::string, size_t> _suffixes;
+};
+
+static std::vector<unsigned char> naptr_response()
+{
+  ResponseBuilder rsp(2, 6);
+  rsp.question("example.com", ns_t_naptr);
+  rsp.naptr("example.com", 10, "SIP+D2T", "_sip._tcp.example.com");
+  rsp.naptr("example.com", 20, "SIPS+D2T", "_sips._tcp.example.com");
+  rsp.srv("_sip._tcp.example.com", 5060, "sprout-0.example.com");
+  rsp.srv("_sip._tcp.example.com", 5060, "sprout-1.example.com");
+  rsp.srv("_sips._tcp.example.com", 5061, "sprout-0.example.com");
+  rsp.a("sprout-0.example.com", "10.0.0.1");
+  rsp.a("sprout-1.example.com", "10.0.0.2");
+  rsp.a("sprout-1.example.com", "10.0.0.3");
+  return rsp.msg();
+}
+
+static std::vector<unsigned char> srv_response()
+{
+  ResponseBuilder rsp(4, 4);
+  rsp.question("_sip._udp.sprout.example.com", ns_t_srv);
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    rsp.srv("_sip._udp.sprout.example.com",
+            5060,
+            "sprout-" + std::to_string(ii) + ".example.com");
+  }
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    rsp.a("sprout-" + std::to_string(ii) + ".example.com",
+          ("10.0.1." + std::to_string(ii)).c_str());
+  }
+
+  return rsp.msg();
+}
+
+static std::vector<unsigned char> a_response()
+{
+  ResponseBuilder rsp(4, 0);
+  rsp.question("host.example.com", ns_t_a);
+  rsp.cname("host.example.com", "real.example.com");
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    rsp.a("real.example.com", ("10.0.2." + std::to_string(ii)).c_str());
+  }
+
+  return rsp.msg();
+}
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char* name,
+                std::vector<unsigned char> msg,
+                int num_parses)
+{
+  long parse_allocations;
+  long arena_allocations;
+
+  {
+    long start = allocations;
+    DnsParser parser(msg.data(), msg.size());
+    parser.parse();
+    parse_allocations = allocations - start;
+  }
+
+  {
+    long start = allocations;
+    DnsParser parser(msg.data(), msg.size());
+    DnsArenaPtr arena = parser.parse_to_arena();
+    arena_allocations = allocations - start;
+  }
+
+  double start = now_ns();
+
+  for (int ii = 0; ii < num_parses; ++ii)
+  {
+    DnsParser parser(msg.data(), msg.size());
+    parser.parse();
+  }
+
+  double parsed = now_ns();
+
+  for (int ii = 0; ii < num_parses; ++ii)
+  {
+    DnsParser parser(msg.data(), msg.size());
+    DnsArenaPtr arena = parser.parse_to_arena();
+  }
+
+  double parsed_to_arena = now_ns();
+
+  printf("%-6s %6zu %10.0f %8ld %10.0f %8ld\n",
+         name,
+         msg.size(),
+         (parsed - start) / num_parses,
+         parse_allocations,
+         (parsed_to_arena - parsed) / num_parses,
+         arena_allocations);
+}
+
+int main(int argc, char** argv)
+{
+  int num_parses = (argc > 1) ? atoi(argv[1]) : 200000;
+
+  // Don't include the cost of debug logging.
+  Log::setLoggingLevel(Log::ERROR_LEVEL);
+
+  printf("%-6s %6s %10s %8s %10s %8s\n",
+         "type", "bytes", "parse ns", "allocs", "arena ns", "allocs");
+
+  run("NAPTR", naptr_response(), num_parses);
+  run("SRV", srv_response(), num_parses);
+  run("A", a_response(), num_parses);
+
+  return 0;
+}
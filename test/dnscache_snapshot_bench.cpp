@@ -0,0 +1,136 @@
+/**
+ * @file dnscache_snapshot_bench.cpp Microbenchmark for publishing
+ * DnsCachedResolver cache snapshots.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Fills the cache with a number of entries, then repeatedly updates one entry
+// (which publishes a new snapshot each time) while reader threads query
+// random entries, which are all served from the snapshot.  Prints the time
+// per update and the reader query rate for each cache size, so the cost of
+// publishing can be seen to be independent of the number of entries.
+//
+// Usage: dnscache_snapshot_bench [readers] [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "dnscachedresolver.h"
+
+static std::atomic<bool> stop;
+static DnsCachedResolver* resolver;
+static int num_entries;
+
+struct ReaderArgs
+{
+  unsigned int seed;
+  uint64_t queries;
+};
+
+static std::string domain(int index)
+{
+  return "host" + std::to_string(index) + ".example.com";
+}
+
+static void add_entry(int index, uint32_t address)
+{
+  std::vector<DnsRRecord*> records;
+  struct in_addr addr;
+  addr.s_addr = htonl(address);
+  records.push_back(new DnsARecord(domain(index), 3600, addr));
+  resolver->add_to_cache(domain(index), ns_t_a, records);
+}
+
+static void* reader_thread(void* p)
+{
+  ReaderArgs* args = (ReaderArgs*)p;
+  uint64_t queries = 0;
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    resolver->dns_query(domain(rand_r(&args->seed) % num_entries), ns_t_a, 0);
+    queries++;
+  }
+
+  args->queries = queries;
+  return NULL;
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+  int num_readers = (argc > 1) ? atoi(argv[1]) : 4;
+  int seconds = (argc > 2) ? atoi(argv[2]) : 2;
+
+  printf("%8s %16s %16s\n", "entries", "us/update", "reader query/s");
+
+  for (num_entries = 1000; num_entries <= 64000; num_entries *= 4)
+  {
+    // The resolver never sends a query, as every entry is in the cache.
+    resolver = new DnsCachedResolver("127.0.0.1", 53);
+
+    for (int ii = 0; ii < num_entries; ++ii)
+    {
+      add_entry(ii, 0x0a000000 + ii);
+    }
+
+    stop = false;
+    std::vector<pthread_t> threads(num_readers);
+    std::vector<ReaderArgs> args(num_readers);
+
+    for (int ii = 0; ii < num_readers; ++ii)
+    {
+      args[ii].seed = ii;
+      args[ii].queries = 0;
+      pthread_create(&threads[ii], NULL, reader_thread, &args[ii]);
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + seconds * 1000000000ULL;
+    uint64_t updates = 0;
+
+    while (now_ns() < end)
+    {
+      add_entry(updates % num_entries, 0x0b000000 + updates);
+      updates++;
+    }
+
+    double elapsed_ns = now_ns() - start;
+    stop = true;
+
+    uint64_t queries = 0;
+    for (int ii = 0; ii < num_readers; ++ii)
+    {
+      pthread_join(threads[ii], NULL);
+      queries += args[ii].queries;
+    }
+
+    printf("%8d %16.2f %16.0f\n",
+           num_entries,
+           elapsed_ns / updates / 1000.0,
+           queries * 1e9 / elapsed_ns);
+
+    delete resolver; resolver = NULL;
+  }
+
+  return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file dnscachedresolver_test.cpp UT for DnsCachedResolver TTLs.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "gtest/gtest.h"
+
+#include "dnscachedresolver.h"
+#include "test_interposer.hpp"
+
+/// Fixture for a resolver with no DNS servers, so it only ever returns what
+/// has been added to its cache.
+class DnsCachedResolverTest : public ::testing::Test
+{
+public:
+  DnsCachedResolverTest() :
+    _resolver(std::vector<IP46Address>())
+  {
+    cwtest_completely_control_time();
+  }
+
+  virtual ~DnsCachedResolverTest()
+  {
+    cwtest_reset_time();
+  }
+
+  void add_a_record(const std::string& domain, int ttl)
+  {
+    struct in_addr address;
+    inet_pton(AF_INET, "10.0.0.1", &address);
+    std::vector<DnsRRecord*> records;
+    records.push_back(new DnsARecord(domain, ttl, address));
+    _resolver.add_to_cache(domain, ns_t_a, records);
+  }
+
+  DnsCachedResolver _resolver;
+};
+
+// An unexpired entry is returned with its remaining TTL.
+TEST_F(DnsCachedResolverTest, RemainingTTL)
+{
+  add_a_record("sprout.example.com", 60);
+  cwtest_advance_time_ms(10000);
+
+  DnsResult result = _resolver.dns_query("sprout.example.com", ns_t_a, 0);
+  EXPECT_EQ(1u, result.records().size());
+  EXPECT_EQ(50, result.ttl());
+}
+
+// Without stale-while-revalidate, an expired entry whose records are still
+// returned has a TTL of zero, so callers don't cache them.
+TEST_F(DnsCachedResolverTest, ExpiredEntryTTLZero)
+{
+  add_a_record("sprout.example.com", 60);
+  cwtest_advance_time_ms(70000);
+
+  DnsResult result = _resolver.dns_query("sprout.example.com", ns_t_a, 0);
+  EXPECT_EQ(1u, result.records().size());
+  EXPECT_EQ(0, result.ttl());
+}
+
+// With stale-while-revalidate, an expired entry within the grace period is
+// returned with a short TTL while it is refreshed.
+TEST_F(DnsCachedResolverTest, StaleEntryShortTTL)
+{
+  _resolver.enable_stale_while_revalidate(60, 0);
+  add_a_record("sprout.example.com", 60);
+  cwtest_advance_time_ms(70000);
+
+  DnsResult result = _resolver.dns_query("sprout.example.com", ns_t_a, 0);
+  EXPECT_EQ(1u, result.records().size());
+  EXPECT_EQ(30, result.ttl());
+}
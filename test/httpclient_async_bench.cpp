@@ -0,0 +1,186 @@
+/**
+ * @file httpclient_async_bench.cpp Benchmark comparing the threads needed for
+ * synchronous and asynchronous HttpClient requests.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Keeps a fixed number of GET requests in flight to a server (which should
+// add some latency to each response, so that requests overlap), first with
+// one thread blocked in send_get per request, then with send_get_async on a
+// number of event loop threads.  For each, prints the number of threads used
+// (as configured), the average number of requests actually in flight
+// (sampled every 10ms), the rate of successful requests and the number of
+// requests that failed.
+//
+// Usage: httpclient_async_bench <server IP> <port> [in-flight] [loops] [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "httpclient.h"
+#include "fakehttpresolver.hpp"
+
+static std::atomic<bool> stop;
+static std::atomic<uint64_t> succeeded;
+static std::atomic<uint64_t> failed;
+static std::atomic<int> outstanding;
+
+static HttpClient* client;
+static std::string url;
+
+static void count(HTTPCode rc)
+{
+  if (rc == 200)
+  {
+    succeeded++;
+  }
+  else
+  {
+    failed++;
+  }
+}
+
+static void* sync_thread(void* arg)
+{
+  while (!stop.load())
+  {
+    std::string response;
+    outstanding++;
+    HTTPCode rc = client->send_get(url, response, "", 0);
+    outstanding--;
+    count(rc);
+  }
+
+  return NULL;
+}
+
+static void send_async()
+{
+  std::vector<std::string> headers;
+  outstanding++;
+  client->send_get_async(url,
+                         headers,
+                         "",
+                         0,
+                         [](HTTPCode rc,
+                            const std::string& response,
+                            const std::map<std::string, std::string>& rsp_headers)
+  {
+    outstanding--;
+    count(rc);
+
+    // Keep the same number of requests in flight.
+    if (!stop.load())
+    {
+      send_async();
+    }
+  });
+}
+
+static void reset()
+{
+  stop = false;
+  succeeded = 0;
+  failed = 0;
+  outstanding = 0;
+}
+
+/// Runs for the given time, then stops sending requests.
+///
+/// @returns the average number of requests in flight.
+static double run(int seconds)
+{
+  struct timespec interval = {0, 10000000};
+  int samples = seconds * 100;
+  double total = 0;
+
+  for (int ii = 0; ii < samples; ++ii)
+  {
+    nanosleep(&interval, NULL);
+    total += outstanding.load();
+  }
+
+  stop = true;
+  return total / samples;
+}
+
+static void report(const char* mode,
+                   int threads,
+                   double in_flight,
+                   int seconds)
+{
+  printf("%-6s %8d %12.1f %10.0f %10lu\n",
+         mode,
+         threads,
+         in_flight,
+         (double)succeeded.load() / seconds,
+         (unsigned long)failed.load());
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s <server IP> <port> [in-flight] [loops] [seconds]\n", argv[0]);
+    return 1;
+  }
+
+  std::string ip = argv[1];
+  url = "http://bench.example.com:" + std::string(argv[2]) + "/";
+  int in_flight = (argc > 3) ? atoi(argv[3]) : 1000;
+  int loops = (argc > 4) ? atoi(argv[4]) : 1;
+  int seconds = (argc > 5) ? atoi(argv[5]) : 10;
+
+  FakeHttpResolver resolver(ip);
+  client = new HttpClient(false, &resolver, SASEvent::HttpLogLevel::NONE, NULL);
+
+  printf("%-6s %8s %12s %10s %10s\n",
+         "mode", "threads", "avg in flight", "ok req/s", "errors");
+
+  // Synchronous requests, each blocking a thread.
+  reset();
+  std::vector<pthread_t> threads(in_flight);
+
+  for (int ii = 0; ii < in_flight; ++ii)
+  {
+    pthread_create(&threads[ii], NULL, sync_thread, NULL);
+  }
+
+  double sync_in_flight = run(seconds);
+
+  for (int ii = 0; ii < in_flight; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  report("sync", in_flight, sync_in_flight, seconds);
+
+  // Asynchronous requests, driven by the event loop threads.
+  reset();
+  client->start_async(loops);
+
+  for (int ii = 0; ii < in_flight; ++ii)
+  {
+    send_async();
+  }
+
+  double async_in_flight = run(seconds);
+  report("async", loops, async_in_flight, seconds);
+
+  client->stop_async();
+  delete client; client = NULL;
+
+  return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * @file httpstack_body_bench.cpp Microbenchmark comparing copying and
+ * zero-copy access to HttpStack::Request bodies.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// For each body size, repeatedly:
+//   - fills a request's input buffer in 4KB chunks (as it would be read from
+//     the socket), then reads the body with get_rx_body (a copy),
+//     get_rx_body_view (contiguous, linearized in place) and
+//     get_rx_body_segments (as received)
+//   - adds a response body built in a string, with add_content copying it
+//     and with add_content moving it into the output buffer.
+// Prints the time per body for each, excluding the time to fill and drain
+// the buffers.
+//
+// Usage: httpstack_body_bench [MB per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "httpstack.h"
+
+static const size_t CHUNK_SIZE = 4096;
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void fill(evbuffer* buffer, const std::string& body)
+{
+  for (size_t offset = 0; offset < body.length(); offset += CHUNK_SIZE)
+  {
+    size_t len = std::min(CHUNK_SIZE, body.length() - offset);
+    evbuffer_add(buffer, body.data() + offset, len);
+  }
+}
+
+static void drain(evbuffer* buffer)
+{
+  evbuffer_drain(buffer, evbuffer_get_length(buffer));
+}
+
+enum Operation
+{
+  RX_COPY,
+  RX_VIEW,
+  RX_SEGMENTS,
+  TX_COPY,
+  TX_MOVE
+};
+
+static double run(Operation op, const std::string& body, int iterations)
+{
+  evhtp_request_t req;
+  memset(&req, 0, sizeof(req));
+  req.buffer_in = evbuffer_new();
+  req.buffer_out = evbuffer_new();
+  size_t total = 0;
+  double elapsed_ns = 0;
+
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    // A new request each time, as a request caches its copy of the body.
+    HttpStack::Request request(NULL, &req);
+    fill(req.buffer_in, body);
+    std::string content = body;
+
+    double start = now_ns();
+
+    switch (op)
+    {
+      case RX_COPY:
+        total += request.get_rx_body().length();
+        break;
+
+      case RX_VIEW:
+        total += request.get_rx_body_view().size();
+        break;
+
+      case RX_SEGMENTS:
+        total += request.get_rx_body_segments().size();
+        break;
+
+      case TX_COPY:
+        request.add_content(content);
+        break;
+
+      case TX_MOVE:
+        request.add_content(std::move(content));
+        break;
+    }
+
+    elapsed_ns += now_ns() - start;
+
+    drain(req.buffer_in);
+    drain(req.buffer_out);
+  }
+
+  evbuffer_free(req.buffer_in);
+  evbuffer_free(req.buffer_out);
+
+  // Stop the compiler optimizing the reads away.
+  if (total == 1)
+  {
+    printf("\n");
+  }
+
+  return elapsed_ns / iterations;
+}
+
+int main(int argc, char** argv)
+{
+  size_t run_bytes = ((argc > 1) ? atoi(argv[1]) : 256) * 1048576;
+
+  printf("%8s %12s %12s %12s %12s %12s\n",
+         "bytes", "rx copy ns", "rx view ns", "rx segs ns", "tx copy ns", "tx move ns");
+
+  for (size_t size = 4096; size <= 1048576; size *= 4)
+  {
+    std::string body(size, 'x');
+    int iterations = run_bytes / size;
+
+    printf("%8zu %12.0f %12.0f %12.0f %12.0f %12.0f\n",
+           size,
+           run(RX_COPY, body, iterations),
+           run(RX_VIEW, body, iterations),
+           run(RX_SEGMENTS, body, iterations),
+           run(TX_COPY, body, iterations),
+           run(TX_MOVE, body, iterations));
+  }
+
+  return 0;
+}
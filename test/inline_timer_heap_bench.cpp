@@ -0,0 +1,101 @@
+/**
+ * @file inline_timer_heap_bench.cpp Microbenchmark comparing TimerHeap with
+ * InlineTimerHeap.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Inserts a number of timers with random pop times over the next hour, then
+// moves each of that many random timers to a new random pop time, then pops
+// every timer in order.  Prints the average time per insert, rebalance and
+// pop for TimerHeap and for 4-ary and 8-ary InlineTimerHeaps, for each
+// number of timers.
+//
+// Usage: inline_timer_heap_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include "timer_heap.h"
+#include "inline_timer_heap.h"
+
+static const uint64_t HORIZON_MS = 3600000;
+
+class BenchTimer : public InlineHeapableTimer
+{
+public:
+  uint64_t get_pop_time() const { return _pop_time; }
+
+  uint64_t _pop_time;
+};
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+template <class H>
+static void run(const char* name, size_t num_timers)
+{
+  std::vector<BenchTimer> timers(num_timers);
+  H heap;
+  unsigned int seed = 1;
+
+  double start = now_ns();
+
+  for (size_t ii = 0; ii < num_timers; ++ii)
+  {
+    timers[ii]._pop_time = rand_r(&seed) % HORIZON_MS;
+    heap.insert(&timers[ii]);
+  }
+
+  double inserted = now_ns();
+
+  for (size_t ii = 0; ii < num_timers; ++ii)
+  {
+    BenchTimer& timer = timers[rand_r(&seed) % num_timers];
+    timer._pop_time = rand_r(&seed) % HORIZON_MS;
+    heap.rebalance(&timer);
+  }
+
+  double rebalanced = now_ns();
+
+  while (BenchTimer* timer = (BenchTimer*)heap.get_next_timer())
+  {
+    heap.remove(timer);
+  }
+
+  double popped = now_ns();
+
+  printf("%-10s %10zu %12.0f %12.0f %12.0f\n",
+         name,
+         num_timers,
+         (inserted - start) / num_timers,
+         (rebalanced - inserted) / num_timers,
+         (popped - rebalanced) / num_timers);
+}
+
+int main(int argc, char** argv)
+{
+  printf("%-10s %10s %12s %12s %12s\n",
+         "heap", "timers", "insert ns", "rebalance ns", "pop ns");
+
+  for (size_t num_timers = 10000; num_timers <= 10000000; num_timers *= 10)
+  {
+    run<TimerHeap>("TimerHeap", num_timers);
+    run<InlineTimerHeap<4> >("Inline<4>", num_timers);
+    run<InlineTimerHeap<8> >("Inline<8>", num_timers);
+  }
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file sharded_localstore_bench.cpp Microbenchmark comparing LocalStore with
+ * ShardedLocalStore.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Each thread repeatedly reads a random key out of a fixed set of keys that
+// are all in the store, and writes every tenth one back with the CAS value it
+// read.  Prints the total operations per second for each store and thread
+// count.
+//
+// Usage: sharded_localstore_bench [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "localstore.h"
+#include "sharded_localstore.h"
+
+static const int NUM_KEYS = 10000;
+static const std::string TABLE = "bench";
+
+static std::vector<std::string> keys;
+static std::atomic<bool> stop;
+
+struct ThreadArgs
+{
+  Store* store;
+  unsigned int seed;
+  uint64_t ops;
+};
+
+static void* bench_thread(void* p)
+{
+  ThreadArgs* args = (ThreadArgs*)p;
+  uint64_t ops = 0;
+  std::string data;
+  uint64_t cas;
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      const std::string& key = keys[rand_r(&args->seed) % NUM_KEYS];
+      args->store->get_data(TABLE, key, data, cas, 0);
+
+      if (ii % 10 == 0)
+      {
+        args->store->set_data(TABLE, key, data, cas, 300, 0);
+      }
+    }
+    ops += 1000;
+  }
+
+  args->ops = ops;
+  return NULL;
+}
+
+static double run(Store* store, int num_threads, int seconds)
+{
+  // Load every key into the store.
+  for (int ii = 0; ii < NUM_KEYS; ++ii)
+  {
+    store->set_data(TABLE, keys[ii], "data for " + keys[ii], 0, 300, 0);
+  }
+
+  stop = false;
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<ThreadArgs> args(num_threads);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    args[ii].store = store;
+    args[ii].seed = ii;
+    args[ii].ops = 0;
+    pthread_create(&threads[ii], NULL, bench_thread, &args[ii]);
+  }
+
+  struct timespec delay = {seconds, 0};
+  nanosleep(&delay, NULL);
+  stop = true;
+
+  uint64_t ops = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    ops += args[ii].ops;
+  }
+
+  return (double)ops / seconds;
+}
+
+int main(int argc, char** argv)
+{
+  int seconds = (argc > 1) ? atoi(argv[1]) : 2;
+
+  // Don't include the cost of debug logging.
+  Log::setLoggingLevel(Log::ERROR_LEVEL);
+
+  for (int ii = 0; ii < NUM_KEYS; ++ii)
+  {
+    keys.push_back("sip:user" + std::to_string(ii) + "@example.com");
+  }
+
+  printf("%8s %16s %16s\n", "threads", "LocalStore op/s", "Sharded op/s");
+
+  for (int threads = 1; threads <= 32; threads *= 2)
+  {
+    LocalStore store;
+    double before = run(&store, threads, seconds);
+
+    ShardedLocalStore sharded;
+    double after = run(&sharded, threads, seconds);
+
+    printf("%8d %16.0f %16.0f\n", threads, before, after);
+  }
+
+  return 0;
+}
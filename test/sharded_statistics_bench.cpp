@@ -0,0 +1,153 @@
+/**
+ * @file sharded_statistics_bench.cpp Microbenchmark comparing shared atomic
+ * statistics with ShardedCounter and ShardedHighWaterMark.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Each thread repeatedly records a sample in one statistic shared by all the
+// threads - a counter increment plus a high-water mark update, as the
+// accumulators do for every event.  Prints the total updates per second for
+// shared atomics (with a compare-and-swap loop for the water mark) and for
+// the sharded statistics, for each thread count.
+//
+// Usage: sharded_statistics_bench [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <vector>
+
+#include "sharded_statistics.h"
+
+static std::atomic<bool> stop;
+
+struct AtomicStatistic
+{
+  std::atomic_uint_fast64_t count;
+  std::atomic_uint_fast64_t hwm;
+
+  void update(uint_fast64_t sample)
+  {
+    count.fetch_add(1);
+
+    uint_fast64_t mark = hwm.load();
+    while ((sample > mark) &&
+           (!hwm.compare_exchange_weak(mark, sample)))
+    {
+      // Do nothing.
+    }
+  }
+
+  void reset()
+  {
+    count.store(0);
+    hwm.store(0);
+  }
+};
+
+struct ShardedStatistic
+{
+  ShardedCounter count;
+  ShardedHighWaterMark hwm;
+
+  void update(uint_fast64_t sample)
+  {
+    count.increment();
+    hwm.update(sample);
+  }
+
+  void reset()
+  {
+    count.reset();
+    hwm.reset();
+  }
+};
+
+template <class S>
+struct ThreadArgs
+{
+  S* stat;
+  unsigned int seed;
+  uint64_t ops;
+};
+
+template <class S>
+static void* bench_thread(void* p)
+{
+  ThreadArgs<S>* args = (ThreadArgs<S>*)p;
+  uint64_t ops = 0;
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      args->stat->update(rand_r(&args->seed) % 1000000);
+    }
+    ops += 1000;
+  }
+
+  args->ops = ops;
+  return NULL;
+}
+
+template <class S>
+static double run(S* stat, int num_threads, int seconds)
+{
+  stat->reset();
+  stop = false;
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<ThreadArgs<S> > args(num_threads);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    args[ii].stat = stat;
+    args[ii].seed = ii;
+    args[ii].ops = 0;
+    pthread_create(&threads[ii], NULL, bench_thread<S>, &args[ii]);
+  }
+
+  struct timespec delay = {seconds, 0};
+  nanosleep(&delay, NULL);
+  stop = true;
+
+  uint64_t ops = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    ops += args[ii].ops;
+  }
+
+  return (double)ops / seconds;
+}
+
+int main(int argc, char** argv)
+{
+  int seconds = (argc > 1) ? atoi(argv[1]) : 2;
+
+  printf("%u shards of %zu bytes per statistic\n",
+         ShardedStatistics::num_shards(),
+         ShardedStatistics::CACHE_LINE_SIZE);
+  printf("%8s %16s %16s\n", "threads", "atomic op/s", "sharded op/s");
+
+  for (int threads = 1; threads <= 64; threads *= 2)
+  {
+    AtomicStatistic atomic_stat;
+    double before = run(&atomic_stat, threads, seconds);
+
+    ShardedStatistic sharded_stat;
+    double after = run(&sharded_stat, threads, seconds);
+
+    printf("%8d %16.0f %16.0f\n", threads, before, after);
+  }
+
+  return 0;
+}
@@ -0,0 +1,166 @@
+/**
+ * @file store_multi_bench.cpp Microbenchmark comparing per-key Store reads
+ * and writes with get_data_multi and set_data_multi.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Each thread repeatedly reads a batch of random keys out of a fixed set of
+// keys that are all in a LocalStore, then writes them back with the CAS
+// values it read.  Prints the total keys read and written per second, with
+// one get_data/set_data call per key and with one get_data_multi/
+// set_data_multi call per batch, for each thread count.
+//
+// Usage: store_multi_bench [keys per batch] [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "localstore.h"
+
+static const int NUM_KEYS = 10000;
+static const std::string TABLE = "bench";
+
+static std::vector<std::string> keys;
+static std::atomic<bool> stop;
+static int batch_size;
+
+struct ThreadArgs
+{
+  Store* store;
+  bool multi;
+  unsigned int seed;
+  uint64_t ops;
+};
+
+static void single_batch(Store* store, std::vector<Store::GetRequest>& gets)
+{
+  for (Store::GetRequest& get : gets)
+  {
+    get.status = store->get_data(TABLE, get.key, get.data, get.cas, 0);
+  }
+
+  for (Store::GetRequest& get : gets)
+  {
+    store->set_data(TABLE, get.key, get.data, get.cas, 300, 0);
+  }
+}
+
+static void multi_batch(Store* store, std::vector<Store::GetRequest>& gets)
+{
+  store->get_data_multi(TABLE, gets, 0);
+
+  std::vector<Store::SetRequest> sets;
+  sets.reserve(gets.size());
+
+  for (Store::GetRequest& get : gets)
+  {
+    sets.push_back(Store::SetRequest(get.key, get.data, get.cas, 300));
+  }
+
+  store->set_data_multi(TABLE, sets, 0);
+}
+
+static void* bench_thread(void* p)
+{
+  ThreadArgs* args = (ThreadArgs*)p;
+  uint64_t ops = 0;
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    std::vector<Store::GetRequest> gets;
+    gets.reserve(batch_size);
+
+    for (int ii = 0; ii < batch_size; ++ii)
+    {
+      gets.push_back(Store::GetRequest(keys[rand_r(&args->seed) % NUM_KEYS]));
+    }
+
+    if (args->multi)
+    {
+      multi_batch(args->store, gets);
+    }
+    else
+    {
+      single_batch(args->store, gets);
+    }
+
+    ops += batch_size;
+  }
+
+  args->ops = ops;
+  return NULL;
+}
+
+static double run(bool multi, int num_threads, int seconds)
+{
+  LocalStore store;
+
+  for (int ii = 0; ii < NUM_KEYS; ++ii)
+  {
+    store.set_data(TABLE, keys[ii], "data for " + keys[ii], 0, 300, 0);
+  }
+
+  stop = false;
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<ThreadArgs> args(num_threads);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    args[ii].store = &store;
+    args[ii].multi = multi;
+    args[ii].seed = ii;
+    args[ii].ops = 0;
+    pthread_create(&threads[ii], NULL, bench_thread, &args[ii]);
+  }
+
+  struct timespec delay = {seconds, 0};
+  nanosleep(&delay, NULL);
+  stop = true;
+
+  uint64_t ops = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    ops += args[ii].ops;
+  }
+
+  return (double)ops / seconds;
+}
+
+int main(int argc, char** argv)
+{
+  batch_size = (argc > 1) ? atoi(argv[1]) : 16;
+  int seconds = (argc > 2) ? atoi(argv[2]) : 2;
+
+  // Don't include the cost of debug logging.
+  Log::setLoggingLevel(Log::ERROR_LEVEL);
+
+  for (int ii = 0; ii < NUM_KEYS; ++ii)
+  {
+    keys.push_back("sip:user" + std::to_string(ii) + "@example.com");
+  }
+
+  printf("%8s %16s %16s\n", "threads", "per-key keys/s", "multi keys/s");
+
+  for (int threads = 1; threads <= 16; threads *= 2)
+  {
+    double before = run(false, threads, seconds);
+    double after = run(true, threads, seconds);
+    printf("%8d %16.0f %16.0f\n", threads, before, after);
+  }
+
+  return 0;
+}
@@ -0,0 +1,155 @@
+/**
+ * @file timer_wheel_bench.cpp Microbenchmark comparing TimerHeap with
+ * TimerWheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Inserts a number of timers with random pop times (in ms) over the next
+// hour, then moves each of that many random timers to a new random pop time,
+// then advances time in 1 second steps, popping every timer that has
+// expired.  Prints the average time per insert, rebalance and pop for
+// TimerHeap and TimerWheel, for each number of timers.
+//
+// Usage: timer_wheel_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include "timer_heap.h"
+#include "timer_wheel.h"
+
+static const uint64_t HORIZON_MS = 3600000;
+static const uint64_t STEP_MS = 1000;
+
+// WheelableTimer is also a HeapableTimer, so this can be used in both.
+class BenchTimer : public WheelableTimer
+{
+public:
+  uint64_t get_pop_time() const { return _pop_time; }
+
+  uint64_t _pop_time;
+};
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name,
+                   size_t num_timers,
+                   double start,
+                   double inserted,
+                   double rebalanced,
+                   double popped)
+{
+  printf("%-10s %10zu %12.0f %12.0f %12.0f\n",
+         name,
+         num_timers,
+         (inserted - start) / num_timers,
+         (rebalanced - inserted) / num_timers,
+         (popped - rebalanced) / num_timers);
+}
+
+static void run_heap(size_t num_timers)
+{
+  std::vector<BenchTimer> timers(num_timers);
+  TimerHeap heap;
+  unsigned int seed = 1;
+
+  double start = now_ns();
+
+  for (size_t ii = 0; ii < num_timers; ++ii)
+  {
+    timers[ii]._pop_time = rand_r(&seed) % HORIZON_MS;
+    heap.insert(&timers[ii]);
+  }
+
+  double inserted = now_ns();
+
+  for (size_t ii = 0; ii < num_timers; ++ii)
+  {
+    BenchTimer& timer = timers[rand_r(&seed) % num_timers];
+    timer._pop_time = rand_r(&seed) % HORIZON_MS;
+    heap.rebalance(&timer);
+  }
+
+  double rebalanced = now_ns();
+
+  for (uint64_t now = 0; !heap.empty(); now += STEP_MS)
+  {
+    HeapableTimer* timer;
+
+    while (((timer = heap.get_next_timer()) != NULL) &&
+           (timer->get_pop_time() <= now))
+    {
+      heap.remove(timer);
+    }
+  }
+
+  double popped = now_ns();
+
+  report("TimerHeap", num_timers, start, inserted, rebalanced, popped);
+}
+
+static void run_wheel(size_t num_timers)
+{
+  std::vector<BenchTimer> timers(num_timers);
+  TimerWheel wheel(0);
+  unsigned int seed = 1;
+
+  double start = now_ns();
+
+  for (size_t ii = 0; ii < num_timers; ++ii)
+  {
+    timers[ii]._pop_time = rand_r(&seed) % HORIZON_MS;
+    wheel.insert(&timers[ii]);
+  }
+
+  double inserted = now_ns();
+
+  for (size_t ii = 0; ii < num_timers; ++ii)
+  {
+    BenchTimer& timer = timers[rand_r(&seed) % num_timers];
+    timer._pop_time = rand_r(&seed) % HORIZON_MS;
+    wheel.rebalance(&timer);
+  }
+
+  double rebalanced = now_ns();
+
+  std::vector<WheelableTimer*> expired;
+
+  for (uint64_t now = 0; !wheel.empty(); now += STEP_MS)
+  {
+    expired.clear();
+    wheel.pop_expired(now, expired);
+  }
+
+  double popped = now_ns();
+
+  report("TimerWheel", num_timers, start, inserted, rebalanced, popped);
+}
+
+int main(int argc, char** argv)
+{
+  printf("%-10s %10s %12s %12s %12s\n",
+         "structure", "timers", "insert ns", "rebalance ns", "pop ns");
+
+  for (size_t num_timers = 10000; num_timers <= 10000000; num_timers *= 10)
+  {
+    run_heap(num_timers);
+    run_wheel(num_timers);
+  }
+
+  return 0;
+}
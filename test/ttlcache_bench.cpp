@@ -0,0 +1,139 @@
+/**
+ * @file ttlcache_bench.cpp Microbenchmark comparing TTLCache with
+ * ShardedTTLCache.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// Each thread repeatedly gets (and releases) a random key out of a fixed set
+// of keys that are all in the cache, which is the DNS resolver's hit path.
+// Prints the total operations per second for each cache and thread count.
+//
+// Usage: ttlcache_bench [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "sas.h"
+#include "ttlcache.h"
+
+static const int NUM_KEYS = 10000;
+
+class BenchFactory : public CacheFactory<std::string, int>
+{
+public:
+  int get(std::string key, int& ttl, SAS::TrailId trail)
+  {
+    ttl = 3600;
+    return key.length();
+  }
+
+  void evict(std::string key, int value) {}
+};
+
+static std::vector<std::string> keys;
+static std::atomic<bool> stop;
+
+template <class C>
+struct ThreadArgs
+{
+  C* cache;
+  unsigned int seed;
+  uint64_t ops;
+};
+
+template <class C>
+static void* bench_thread(void* p)
+{
+  ThreadArgs<C>* args = (ThreadArgs<C>*)p;
+  uint64_t ops = 0;
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      const std::string& key = keys[rand_r(&args->seed) % NUM_KEYS];
+      int ttl;
+      args->cache->get(key, ttl, 0);
+      args->cache->dec_ref(key);
+    }
+    ops += 1000;
+  }
+
+  args->ops = ops;
+  return NULL;
+}
+
+template <class C>
+static double run(C* cache, int num_threads, int seconds)
+{
+  // Load every key into the cache.
+  for (int ii = 0; ii < NUM_KEYS; ++ii)
+  {
+    int ttl;
+    cache->get(keys[ii], ttl, 0);
+    cache->dec_ref(keys[ii]);
+  }
+
+  stop = false;
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<ThreadArgs<C> > args(num_threads);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    args[ii].cache = cache;
+    args[ii].seed = ii;
+    args[ii].ops = 0;
+    pthread_create(&threads[ii], NULL, bench_thread<C>, &args[ii]);
+  }
+
+  struct timespec delay = {seconds, 0};
+  nanosleep(&delay, NULL);
+  stop = true;
+
+  uint64_t ops = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    ops += args[ii].ops;
+  }
+
+  return (double)ops / seconds;
+}
+
+int main(int argc, char** argv)
+{
+  int seconds = (argc > 1) ? atoi(argv[1]) : 2;
+
+  for (int ii = 0; ii < NUM_KEYS; ++ii)
+  {
+    keys.push_back("sip:host" + std::to_string(ii) + ".example.com");
+  }
+
+  printf("%8s %16s %16s\n", "threads", "TTLCache op/s", "Sharded op/s");
+
+  for (int threads = 1; threads <= 32; threads *= 2)
+  {
+    BenchFactory factory;
+    TTLCache<std::string, int> cache(&factory);
+    double before = run(&cache, threads, seconds);
+
+    ShardedTTLCache<std::string, int> sharded(&factory);
+    double after = run(&sharded, threads, seconds);
+
+    printf("%8d %16.0f %16.0f\n", threads, before, after);
+  }
+
+  return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file ttlcache_test.cpp UT for ShardedTTLCache.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "sas.h"
+#include "ttlcache.h"
+#include "test_interposer.hpp"
+
+/// Factory that records the entries evicted from the cache.
+class TestFactory : public CacheFactory<std::string, int>
+{
+public:
+  int get(std::string key, int& ttl, SAS::TrailId trail)
+  {
+    ttl = _ttl;
+    return ++_gets;
+  }
+
+  void evict(std::string key, int value)
+  {
+    ++_evicts;
+  }
+
+  int _ttl = 60;
+  int _gets = 0;
+  int _evicts = 0;
+};
+
+class ShardedTTLCacheTest : public ::testing::Test
+{
+public:
+  ShardedTTLCacheTest() :
+    _factory(),
+    _cache(&_factory, 4, 64)
+  {
+    cwtest_completely_control_time();
+  }
+
+  virtual ~ShardedTTLCacheTest()
+  {
+    cwtest_reset_time();
+  }
+
+  TestFactory _factory;
+  ShardedTTLCache<std::string, int> _cache;
+};
+
+// Entries are expired once their TTL has passed.
+TEST_F(ShardedTTLCacheTest, Expiry)
+{
+  _cache.add("key", 1, 10);
+  EXPECT_TRUE(_cache.exists("key"));
+  EXPECT_EQ(10, _cache.ttl("key"));
+
+  cwtest_advance_time_ms(9000);
+  EXPECT_TRUE(_cache.exists("key"));
+
+  cwtest_advance_time_ms(2000);
+  EXPECT_FALSE(_cache.exists("key"));
+  EXPECT_EQ(1, _factory._evicts);
+}
+
+// Entries added with a TTL of zero, or that have already expired, are swept
+// as soon as the wheel next advances, rather than when it next comes round
+// to the slot for their expiry time.
+TEST_F(ShardedTTLCacheTest, AlreadyExpired)
+{
+  // Make sure the wheel has been swept up to the current time.
+  EXPECT_FALSE(_cache.exists("zero"));
+
+  _cache.add("zero", 1, 0);
+  _cache.add("negative", 2, -30);
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_FALSE(_cache.exists("zero"));
+  EXPECT_FALSE(_cache.exists("negative"));
+  EXPECT_EQ(2, _factory._evicts);
+}
+
+// An already expired entry loaded by the factory is swept once the last
+// reference to it is released.
+TEST_F(ShardedTTLCacheTest, AlreadyExpiredFromFactory)
+{
+  _factory._ttl = 0;
+  int ttl;
+  EXPECT_EQ(1, _cache.get("key", ttl, 0));
+  _cache.dec_ref("key");
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_FALSE(_cache.exists("key"));
+  EXPECT_EQ(1, _factory._evicts);
+
+  // The next get loads the entry again.
+  EXPECT_EQ(2, _cache.get("key", ttl, 0));
+  _cache.dec_ref("key");
+}
+
+// Updating an entry's TTL moves its expiry.
+TEST_F(ShardedTTLCacheTest, UpdateTTL)
+{
+  _cache.add("key", 1, 5);
+  _cache.add("key", 2, 20);
+
+  cwtest_advance_time_ms(10000);
+  EXPECT_TRUE(_cache.exists("key"));
+
+  _cache.add("key", 3, 0);
+  cwtest_advance_time_ms(1000);
+  EXPECT_FALSE(_cache.exists("key"));
+}
@@ -357,6 +357,25 @@ CURLcode curl_easy_setopt(CURL* handle, CURLoption option, ...)
     }
   }
   break;
+  case CURLOPT_CONNECT_TO:
+  {
+    // Each entry has the form host:port:connect-to-host:connect-to-port, and
+    // the option replaces any previous entries.
+    curl->_resolves.clear();
+    struct curl_slist* hosts = va_arg(args, struct curl_slist*);
+    if (hosts != NULL)
+    {
+      std::list<std::string>* truelist = (std::list<std::string>*)hosts;
+      for (std::list<std::string>::iterator it = truelist->begin(); it != truelist->end(); ++it)
+      {
+        std::string mapping = *it;
+        size_t first_colon = mapping.find(':');
+        size_t second_colon = mapping.find(':', first_colon + 1);
+        curl->_resolves[mapping.substr(0, second_colon)] = mapping.substr(second_colon + 1);
+      }
+    }
+  }
+  break;
   case CURLOPT_OPENSOCKETFUNCTION:
   {
     curl->_socket_callback = va_arg(args, socket_callback_t*);
@@ -374,6 +393,11 @@ CURLcode curl_easy_setopt(CURL* handle, CURLoption option, ...)
   break;
 
   case CURLOPT_MAXCONNECTS:
+  case CURLOPT_MAXAGE_CONN:
+  case CURLOPT_HTTP_VERSION:
+  case CURLOPT_PIPEWAIT:
+  case CURLOPT_CLOSESOCKETFUNCTION:
+  case CURLOPT_CLOSESOCKETDATA:
   case CURLOPT_TIMEOUT_MS:
   case CURLOPT_CONNECTTIMEOUT_MS:
   case CURLOPT_DNS_CACHE_TIMEOUT: